@@ -0,0 +1,224 @@
+/*
+ * Compares serializing the $NETWORK graph with a cJSON tree (the old
+ * network_graph_update path) against the streaming graph_json writer.
+ *
+ * Needs the cJSON submodule in src/cJSON. Run with:
+ *     make graph_json_bench && ./graph_json_bench
+ */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <cJSON/cJSON.h>
+
+#include "graph_json.h"
+
+#define NAME_LEN        64
+#define PUBS_PER_CLIENT 2
+#define SUBS_PER_TOPIC  2
+#define CLIENTS_PER_IP  8
+
+struct bench_graph {
+    int client_count;
+    int topic_count;
+    int ip_count;
+    char (*clients)[NAME_LEN];
+    char (*topics)[NAME_LEN];
+    char (*ips)[NAME_LEN];
+};
+
+void *graph__realloc(void *ptr, size_t size) {
+    return realloc(ptr, size);
+}
+
+void graph__free(void *mem) {
+    free(mem);
+}
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+/*
+ * Builds a graph with about edge_count pub and sub edges. Every client
+ * publishes to PUBS_PER_CLIENT topics and every topic has SUBS_PER_TOPIC
+ * subscribers.
+ */
+static void bench_graph_init(struct bench_graph *g, int edge_count) {
+    g->client_count = edge_count / (2 * PUBS_PER_CLIENT);
+    g->topic_count = edge_count / (2 * SUBS_PER_TOPIC);
+    g->ip_count = (g->client_count + CLIENTS_PER_IP - 1) / CLIENTS_PER_IP;
+    g->clients = malloc(g->client_count * sizeof(*g->clients));
+    g->topics = malloc(g->topic_count * sizeof(*g->topics));
+    g->ips = malloc(g->ip_count * sizeof(*g->ips));
+    for (int i = 0; i < g->client_count; i++) {
+        snprintf(g->clients[i], NAME_LEN, "camera-%08d", i);
+    }
+    for (int i = 0; i < g->topic_count; i++) {
+        snprintf(g->topics[i], NAME_LEN, "realm/s/scene%d/camera-%08d", i % 16, i);
+    }
+    for (int i = 0; i < g->ip_count; i++) {
+        snprintf(g->ips[i], NAME_LEN, "ip%023d", i);
+    }
+}
+
+static void bench_graph_cleanup(struct bench_graph *g) {
+    free(g->clients);
+    free(g->topics);
+    free(g->ips);
+}
+
+/*
+ * Same calls as the cJSON based network_graph_update()
+ */
+static char *serialize_cjson(struct bench_graph *g) {
+    cJSON *root, *ip_json, *client_json, *topic_json, *item, *arr;
+    char *buf = NULL;
+
+    root = cJSON_CreateObject();
+    cJSON_AddItemToObject(root, "ips", cJSON_CreateArray());
+    cJSON_AddItemToObject(root, "topics", cJSON_CreateArray());
+
+    for (int i = 0; i < g->ip_count; i++) {
+        ip_json = cJSON_CreateObject();
+        cJSON_AddStringToObject(ip_json, "id", g->ips[i]);
+        cJSON_AddItemToObject(ip_json, "clients", cJSON_CreateArray());
+        cJSON_AddItemToArray(cJSON_GetObjectItem(root, "ips"), ip_json);
+
+        for (int c = i * CLIENTS_PER_IP; c < (i + 1) * CLIENTS_PER_IP && c < g->client_count; c++) {
+            client_json = cJSON_CreateObject();
+            cJSON_AddStringToObject(client_json, "name", g->clients[c]);
+            cJSON_AddNumberToObject(client_json, "latency", NAN);
+            cJSON_AddItemToObject(client_json, "published", cJSON_CreateArray());
+            cJSON_AddItemToArray(cJSON_GetObjectItem(ip_json, "clients"), client_json);
+
+            for (int p = 0; p < PUBS_PER_CLIENT; p++) {
+                arr = cJSON_GetObjectItem(client_json, "published");
+                item = cJSON_CreateObject();
+                cJSON_AddStringToObject(item, "topic", g->topics[(c + p) % g->topic_count]);
+                cJSON_AddNumberToObject(item, "bps", 1234.567);
+                cJSON_AddItemToArray(arr, item);
+            }
+        }
+    }
+
+    for (int t = 0; t < g->topic_count; t++) {
+        topic_json = cJSON_CreateObject();
+        cJSON_AddStringToObject(topic_json, "name", g->topics[t]);
+        cJSON_AddItemToObject(topic_json, "subscriptions", cJSON_CreateArray());
+        cJSON_AddItemToArray(cJSON_GetObjectItem(root, "topics"), topic_json);
+
+        for (int s = 0; s < SUBS_PER_TOPIC; s++) {
+            arr = cJSON_GetObjectItem(topic_json, "subscriptions");
+            item = cJSON_CreateObject();
+            cJSON_AddStringToObject(item, "client", g->clients[(t + s) % g->client_count]);
+            cJSON_AddNumberToObject(item, "bps", 9000);
+            cJSON_AddItemToArray(arr, item);
+        }
+    }
+    cJSON_AddNumberToObject(root, "seq", 0);
+
+    buf = cJSON_PrintUnformatted(root);
+    cJSON_Delete(root);
+    return buf;
+}
+
+/*
+ * Same calls as the streaming network_graph_update()
+ */
+static void serialize_stream(struct bench_graph *g, struct graph_json *json) {
+    graph_json_reset(json);
+    graph_json_object_start(json, NULL);
+    graph_json_array_start(json, "ips");
+
+    for (int i = 0; i < g->ip_count; i++) {
+        graph_json_object_start(json, NULL);
+        graph_json_add_string(json, "id", g->ips[i]);
+        graph_json_array_start(json, "clients");
+
+        for (int c = i * CLIENTS_PER_IP; c < (i + 1) * CLIENTS_PER_IP && c < g->client_count; c++) {
+            graph_json_object_start(json, NULL);
+            graph_json_add_string(json, "name", g->clients[c]);
+            graph_json_add_number(json, "latency", NAN);
+            graph_json_array_start(json, "published");
+
+            for (int p = 0; p < PUBS_PER_CLIENT; p++) {
+                graph_json_object_start(json, NULL);
+                graph_json_add_string(json, "topic", g->topics[(c + p) % g->topic_count]);
+                graph_json_add_number(json, "bps", 1234.567);
+                graph_json_object_end(json);
+            }
+            graph_json_array_end(json);
+            graph_json_object_end(json);
+        }
+        graph_json_array_end(json);
+        graph_json_object_end(json);
+    }
+    graph_json_array_end(json);
+    graph_json_array_start(json, "topics");
+
+    for (int t = 0; t < g->topic_count; t++) {
+        graph_json_object_start(json, NULL);
+        graph_json_add_string(json, "name", g->topics[t]);
+        graph_json_array_start(json, "subscriptions");
+
+        for (int s = 0; s < SUBS_PER_TOPIC; s++) {
+            graph_json_object_start(json, NULL);
+            graph_json_add_string(json, "client", g->clients[(t + s) % g->client_count]);
+            graph_json_add_number(json, "bps", 9000);
+            graph_json_object_end(json);
+        }
+        graph_json_array_end(json);
+        graph_json_object_end(json);
+    }
+    graph_json_array_end(json);
+    graph_json_add_number(json, "seq", 0);
+    graph_json_object_end(json);
+}
+
+int main(int argc, char *argv[]) {
+    int edge_counts[] = {1000, 10000, 100000};
+    struct bench_graph g;
+    struct graph_json json;
+    double start, cjson_ms, stream_ms;
+    char *buf = NULL;
+    size_t cjson_len = 0;
+    int iterations;
+    bool match;
+
+    graph_json_init(&json, 4096);
+
+    printf("%10s %12s %14s %14s %10s %6s\n", "edges", "bytes", "cjson ms/op", "stream ms/op", "speedup", "match");
+    for (size_t i = 0; i < sizeof(edge_counts) / sizeof(edge_counts[0]); i++) {
+        bench_graph_init(&g, edge_counts[i]);
+        iterations = 2000000 / edge_counts[i];
+
+        start = now_ms();
+        for (int n = 0; n < iterations; n++) {
+            buf = serialize_cjson(&g);
+            cjson_len = strlen(buf);
+            if (n < iterations - 1) cJSON_free(buf);
+        }
+        cjson_ms = (now_ms() - start) / iterations;
+
+        start = now_ms();
+        for (int n = 0; n < iterations; n++) {
+            serialize_stream(&g, &json);
+        }
+        stream_ms = (now_ms() - start) / iterations;
+
+        match = !json.error && json.len == cjson_len && memcmp(buf, json.data, cjson_len) == 0;
+        printf("%10d %12zu %14.3f %14.3f %9.1fx %6s\n", edge_counts[i], json.len,
+                cjson_ms, stream_ms, cjson_ms / stream_ms, match ? "yes" : "no");
+
+        cJSON_free(buf);
+        bench_graph_cleanup(&g);
+    }
+
+    graph_json_cleanup(&json);
+    return 0;
+}
@@ -0,0 +1,119 @@
+/*
+ * Measures the time network_graph_add_topic() adds to every PUBLISH.
+ *
+ * Links the broker's network_graph.c with stubs for the rest of the broker.
+ * The hook only queues an event for the graph thread, so the CPU time of the
+ * main thread is measured. Every LOOP_PUBLISHES publishes the bench does what
+ * the main loop does, wakes the graph thread and gives up the CPU like poll()
+ * would. Events that did not fit in the queue are reported. Run with:
+ *     make graph_publish_bench && ./graph_publish_bench
+ */
+#include <sched.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mosquitto_broker_internal.h"
+#include "network_graph.h"
+
+#define NAME_LEN        64
+#define CLIENT_COUNT    1000
+#define CLIENTS_PER_IP  8
+#define PUBS_PER_CLIENT 2
+#define PUBLISH_COUNT   10000000
+#define PAYLOAD_LEN     1024
+#define LOOP_PUBLISHES  1000
+
+/*****************************************************************************/
+
+int log__printf(struct mosquitto *mosq, int priority, const char *fmt, ...) {
+    va_list va;
+
+    va_start(va, fmt);
+    vprintf(fmt, va);
+    va_end(va);
+    printf("\n");
+    return 0;
+}
+
+int db__messages_easy_queue(struct mosquitto_db *db, struct mosquitto *context, const char *topic, int qos,
+        uint32_t payloadlen, const void *payload, int retain, uint32_t message_expiry_interval,
+        mosquitto_property **properties) {
+    return 0;
+}
+
+time_t mosquitto_time(void) {
+    return time(NULL);
+}
+
+time_t mosquitto_time_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int mosquitto_topic_matches_sub(const char *sub, const char *topic, bool *result) {
+    *result = !strcmp(sub, topic);
+    return 0;
+}
+
+/*****************************************************************************/
+
+static double thread_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+int main(int argc, char *argv[]) {
+    struct mosquitto_db db;
+    struct mosquitto__config config;
+    struct mosquitto *contexts;
+    char (*topics)[NAME_LEN];
+    double start, elapsed;
+    int c;
+
+    memset(&db, 0, sizeof(db));
+    memset(&config, 0, sizeof(config));
+    config.graph_interval = 1;
+    config.graph_del_mult = 2;
+    db.config = &config;
+    if (network_graph_init(&db)) {
+        fprintf(stderr, "Error: network_graph_init failed\n");
+        return 1;
+    }
+
+    contexts = calloc(CLIENT_COUNT, sizeof(*contexts));
+    topics = malloc(CLIENT_COUNT * PUBS_PER_CLIENT * sizeof(*topics));
+    for (int i = 0; i < CLIENT_COUNT; i++) {
+        contexts[i].id = malloc(NAME_LEN);
+        contexts[i].address = malloc(NAME_LEN);
+        snprintf(contexts[i].id, NAME_LEN, "camera-%08d", i);
+        snprintf(contexts[i].address, NAME_LEN, "10.0.%d.%d", i / CLIENTS_PER_IP / 256, i / CLIENTS_PER_IP % 256);
+        network_graph_add_client(&contexts[i]);
+    }
+    for (int i = 0; i < CLIENT_COUNT * PUBS_PER_CLIENT; i++) {
+        snprintf(topics[i], NAME_LEN, "realm/s/scene%d/camera-%08d/%d", i % 16, i / PUBS_PER_CLIENT, i % PUBS_PER_CLIENT);
+    }
+
+    // every client publishes to each of its topics in turn
+    start = thread_ms();
+    for (int n = 0; n < PUBLISH_COUNT; n++) {
+        c = n % CLIENT_COUNT;
+        network_graph_add_topic(&contexts[c], 0, topics[c * PUBS_PER_CLIENT + (n / CLIENT_COUNT) % PUBS_PER_CLIENT], PAYLOAD_LEN);
+        if (n % LOOP_PUBLISHES == 0) {
+            network_graph_publish(&db);
+            sched_yield();
+        }
+    }
+    elapsed = thread_ms() - start;
+    network_graph_publish(&db);
+
+    printf("%d clients, %d topics, %d publishes: %.1f ns/publish\n", CLIENT_COUNT,
+            CLIENT_COUNT * PUBS_PER_CLIENT, PUBLISH_COUNT, elapsed * 1e6 / PUBLISH_COUNT);
+
+    network_graph_cleanup();
+    return 0;
+}
@@ -0,0 +1,293 @@
+/*
+ * Compares the chained hash dictionaries the network graph used before (a
+ * node list per slot, next/prev pointers in every node, separately allocated
+ * names, starting at one slot) against the open addressing graph_table.
+ * Inserts, looks up and deletes topic-like names at 10k to 1M entries.
+ *
+ * Run with:
+ *     make graph_table_bench && ./graph_table_bench
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "graph_table.h"
+
+#define NAME_LEN        64
+#define ROUNDS          3
+
+void *graph__realloc(void *ptr, size_t size) {
+    return realloc(ptr, size);
+}
+
+void graph__free(void *mem) {
+    free(mem);
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static unsigned long sdbm_hash(const char *str) {
+    unsigned long hash = -1, c;
+    while ((c = *str++)) {
+        hash = c + (hash << 6) + (hash << 16) - hash;
+    }
+    return hash;
+}
+
+/*****************************************************************************/
+
+/*
+ * Same layout and resizing as the old struct topic / struct topic_dict
+ */
+struct chained_node {
+    char *name;
+    struct chained_node *next;
+    struct chained_node *prev;
+    unsigned long hash;
+    double payload[4];
+};
+
+struct chained_dict {
+    size_t used;
+    size_t max_size;
+    struct chained_node **list;
+};
+
+static void chained_init(struct chained_dict *dict) {
+    dict->list = calloc(1, sizeof(struct chained_node *));
+    dict->max_size = 1;
+    dict->used = 0;
+}
+
+static void chained_set_size(struct chained_dict *dict, size_t new_size) {
+    struct chained_node **old = dict->list, *temp;
+    size_t idx;
+
+    dict->list = calloc(new_size, sizeof(struct chained_node *));
+    for (size_t i = 0; i < dict->max_size; ++i) {
+        while (old[i] != NULL) {
+            temp = old[i];
+            old[i] = old[i]->next;
+            idx = temp->hash % new_size;
+            temp->prev = NULL;
+            temp->next = dict->list[idx];
+            if (dict->list[idx] != NULL) {
+                dict->list[idx]->prev = temp;
+            }
+            dict->list[idx] = temp;
+        }
+    }
+    dict->max_size = new_size;
+    free(old);
+}
+
+static struct chained_node *chained_find(struct chained_dict *dict, const char *name) {
+    unsigned long hash = sdbm_hash(name);
+    struct chained_node *node = dict->list[hash % dict->max_size];
+    for (; node != NULL; node = node->next) {
+        if (hash == node->hash) {
+            return node;
+        }
+    }
+    return NULL;
+}
+
+static void chained_add(struct chained_dict *dict, const char *name) {
+    struct chained_node *node = malloc(sizeof(struct chained_node));
+    size_t idx;
+
+    node->name = strdup(name);
+    node->hash = sdbm_hash(name);
+    node->prev = NULL;
+    if (dict->used == dict->max_size) {
+        chained_set_size(dict, dict->max_size * 2);
+    }
+    idx = node->hash % dict->max_size;
+    node->next = dict->list[idx];
+    if (dict->list[idx] != NULL) {
+        dict->list[idx]->prev = node;
+    }
+    dict->list[idx] = node;
+    ++dict->used;
+}
+
+static void chained_delete(struct chained_dict *dict, struct chained_node *node) {
+    size_t idx = node->hash % dict->max_size;
+    if (dict->list[idx] == node) {
+        dict->list[idx] = node->next;
+    }
+    if (node->next != NULL) {
+        node->next->prev = node->prev;
+    }
+    if (node->prev != NULL) {
+        node->prev->next = node->next;
+    }
+    free(node->name);
+    free(node);
+    if (dict->used < dict->max_size / 4) {
+        chained_set_size(dict, dict->max_size / 2);
+    }
+    --dict->used;
+}
+
+/*****************************************************************************/
+
+/*
+ * Same layout as the new struct topic, the name is part of the node
+ */
+struct table_node {
+    unsigned long hash;
+    double payload[4];
+    char name[];
+};
+
+static bool table_match(const void *item, const void *key) {
+    return strcmp(((const struct table_node *)item)->name, (const char *)key) == 0;
+}
+
+static void table_add(struct graph_table *table, const char *name) {
+    size_t len = strlen(name) + 1;
+    struct table_node *node = malloc(sizeof(struct table_node) + len);
+
+    node->hash = sdbm_hash(name);
+    memcpy(node->name, name, len);
+    graph_table_add(table, node->hash, node);
+}
+
+static struct table_node *table_find(struct graph_table *table, const char *name) {
+    return graph_table_find(table, sdbm_hash(name), name, table_match);
+}
+
+static void table_delete(struct graph_table *table, struct table_node *node) {
+    graph_table_remove(table, node->hash, node);
+    free(node);
+    graph_table_shrink(table);
+}
+
+/*****************************************************************************/
+
+struct result {
+    double insert;
+    double lookup;
+    double miss;
+    double delete;
+};
+
+static void shuffle(int *order, int count) {
+    int j, temp;
+    for (int i = count - 1; i > 0; --i) {
+        j = random() % (i + 1);
+        temp = order[i];
+        order[i] = order[j];
+        order[j] = temp;
+    }
+}
+
+static void bench_chained(char (*names)[NAME_LEN], char (*missing)[NAME_LEN], int *order, int count,
+                          struct result *res) {
+    struct chained_dict dict;
+    volatile long found = 0;
+    double start;
+
+    chained_init(&dict);
+    start = now_ns();
+    for (int i = 0; i < count; ++i) {
+        chained_add(&dict, names[i]);
+    }
+    res->insert += (now_ns() - start) / count;
+
+    start = now_ns();
+    for (int i = 0; i < count; ++i) {
+        found += chained_find(&dict, names[order[i]]) != NULL;
+    }
+    res->lookup += (now_ns() - start) / count;
+
+    start = now_ns();
+    for (int i = 0; i < count; ++i) {
+        found += chained_find(&dict, missing[order[i]]) != NULL;
+    }
+    res->miss += (now_ns() - start) / count;
+
+    start = now_ns();
+    for (int i = 0; i < count; ++i) {
+        chained_delete(&dict, chained_find(&dict, names[order[i]]));
+    }
+    res->delete += (now_ns() - start) / count;
+    free(dict.list);
+}
+
+static void bench_table(char (*names)[NAME_LEN], char (*missing)[NAME_LEN], int *order, int count,
+                        struct result *res) {
+    struct graph_table table;
+    volatile long found = 0;
+    double start;
+
+    graph_table_init(&table, 1);
+    start = now_ns();
+    for (int i = 0; i < count; ++i) {
+        table_add(&table, names[i]);
+    }
+    res->insert += (now_ns() - start) / count;
+
+    start = now_ns();
+    for (int i = 0; i < count; ++i) {
+        found += table_find(&table, names[order[i]]) != NULL;
+    }
+    res->lookup += (now_ns() - start) / count;
+
+    start = now_ns();
+    for (int i = 0; i < count; ++i) {
+        found += table_find(&table, missing[order[i]]) != NULL;
+    }
+    res->miss += (now_ns() - start) / count;
+
+    start = now_ns();
+    for (int i = 0; i < count; ++i) {
+        table_delete(&table, table_find(&table, names[order[i]]));
+    }
+    res->delete += (now_ns() - start) / count;
+    graph_table_cleanup(&table);
+}
+
+int main(void) {
+    static const int counts[] = {10000, 100000, 1000000};
+    char (*names)[NAME_LEN], (*missing)[NAME_LEN];
+    struct result chained, table;
+    int *order, count;
+
+    srandom(1);
+    printf("%8s  %-8s %10s %10s %10s %10s   (ns/op)\n", "entries", "dict", "insert", "lookup", "miss", "delete");
+    for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); ++c) {
+        count = counts[c];
+        names = malloc(count * sizeof(*names));
+        missing = malloc(count * sizeof(*missing));
+        order = malloc(count * sizeof(*order));
+        for (int i = 0; i < count; ++i) {
+            snprintf(names[i], NAME_LEN, "realm/s/scene%d/camera-%08d", i % 16, i);
+            snprintf(missing[i], NAME_LEN, "realm/s/scene%d/missing-%08d", i % 16, i);
+            order[i] = i;
+        }
+        shuffle(order, count);
+
+        memset(&chained, 0, sizeof(chained));
+        memset(&table, 0, sizeof(table));
+        for (int r = 0; r < ROUNDS; ++r) {
+            bench_chained(names, missing, order, count, &chained);
+            bench_table(names, missing, order, count, &table);
+        }
+        printf("%8d  %-8s %10.1f %10.1f %10.1f %10.1f\n", count, "chained",
+               chained.insert / ROUNDS, chained.lookup / ROUNDS, chained.miss / ROUNDS, chained.delete / ROUNDS);
+        printf("%8d  %-8s %10.1f %10.1f %10.1f %10.1f\n", count, "table",
+               table.insert / ROUNDS, table.lookup / ROUNDS, table.miss / ROUNDS, table.delete / ROUNDS);
+
+        free(names);
+        free(missing);
+        free(order);
+    }
+    return 0;
+}
@@ -0,0 +1,230 @@
+/*
+ * Cost of reading a stream of back to back PUBLISH packets from one client, as
+ * the broker does for a busy publisher. A child process writes the packets to
+ * a socketpair and they are read once with the loop packet__read() had
+ * before, with a read() for the command, each remaining length byte and the
+ * payload, and once with packet__read(), which reads the socket into a
+ * buffer and handles every complete packet in it.
+ *
+ * Run with:
+ *     make packet_read_bench && ./packet_read_bench
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mosquitto_broker_internal.h"
+#include "memory_mosq.h"
+#include "mqtt_protocol.h"
+#include "net_mosq.h"
+#include "packet_mosq.h"
+
+#define PACKETS         1000000
+
+static long syscalls;
+static long handled;
+
+/* The parts of the broker that packet_mosq.c calls, reduced to what the bench
+ * needs */
+ssize_t net__read(struct mosquitto *mosq, void *buf, size_t count)
+{
+	syscalls++;
+	return read(mosq->sock, buf, count);
+}
+
+ssize_t net__write(struct mosquitto *mosq, void *buf, size_t count)
+{
+	return -1;
+}
+
+ssize_t net__writev(struct mosquitto *mosq, const struct iovec *iov, int iovcnt)
+{
+	return -1;
+}
+
+int handle__packet(struct mosquitto_db *db, struct mosquitto *mosq)
+{
+	handled++;
+	return MOSQ_ERR_SUCCESS;
+}
+
+int send__disconnect(struct mosquitto *mosq, uint8_t reason_code, const mosquitto_property *properties)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+int packet__varint_bytes(int32_t word)
+{
+	return 1;
+}
+
+enum mosquitto_client_state mosquitto__get_state(struct mosquitto *mosq)
+{
+	return mosq_cs_active;
+}
+
+time_t mosquitto_time(void)
+{
+	return 0;
+}
+
+struct mosquitto_db *mosquitto__get_db(void)
+{
+	return NULL;
+}
+
+void db__msg_store_ref_dec(struct mosquitto_db *db, struct mosquitto_msg_store **store)
+{
+}
+
+int log__printf(struct mosquitto *mosq, int priority, const char *fmt, ...)
+{
+	return 0;
+}
+
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+/* Writes PACKETS publishes of packet_len bytes, then closes the socket */
+static void feed(int sock, int packet_len)
+{
+	uint8_t *buf;
+	int remaining_length = packet_len - 2;
+	size_t len;
+
+	if(remaining_length > 127) remaining_length--;
+
+	buf = malloc((size_t)packet_len * 64);
+	for(int i=0; i<64; i++){
+		uint8_t *p = &buf[i*packet_len];
+
+		memset(p, 'x', packet_len);
+		p[0] = CMD_PUBLISH;
+		if(remaining_length > 127){
+			p[1] = (remaining_length & 127) | 128;
+			p[2] = remaining_length / 128;
+		}else{
+			p[1] = remaining_length;
+		}
+	}
+	for(int i=0; i<PACKETS; i+=64){
+		len = (size_t)packet_len * 64;
+		if(write(sock, buf, len) != (ssize_t)len) break;
+	}
+	free(buf);
+	close(sock);
+}
+
+
+/* The read loop packet__read() had before, a read() per header byte and one
+ * for the payload */
+static int read_each(struct mosquitto_db *db, struct mosquitto *mosq)
+{
+	struct mosquitto__packet *packet = &mosq->in_packet;
+	uint8_t byte;
+	ssize_t len;
+
+	if(!packet->command){
+		len = net__read(mosq, &byte, 1);
+		if(len != 1) return len == 0 ? MOSQ_ERR_CONN_LOST : MOSQ_ERR_SUCCESS;
+		packet->command = byte;
+	}
+	if(packet->remaining_count <= 0){
+		do{
+			len = net__read(mosq, &byte, 1);
+			if(len != 1) return len == 0 ? MOSQ_ERR_CONN_LOST : MOSQ_ERR_SUCCESS;
+			packet->remaining_count--;
+			packet->remaining_length += (byte & 127) * packet->remaining_mult;
+			packet->remaining_mult *= 128;
+		}while(byte & 128);
+		packet->remaining_count *= -1;
+		packet->payload = mosquitto__malloc(packet->remaining_length);
+		packet->to_process = packet->remaining_length;
+	}
+	while(packet->to_process > 0){
+		len = net__read(mosq, &packet->payload[packet->pos], packet->to_process);
+		if(len <= 0) return len == 0 ? MOSQ_ERR_CONN_LOST : MOSQ_ERR_SUCCESS;
+		packet->to_process -= len;
+		packet->pos += len;
+	}
+	packet->pos = 0;
+	handle__packet(db, mosq);
+	packet__cleanup(packet);
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static void bench(int packet_len, int (*read_fn)(struct mosquitto_db *, struct mosquitto *), double *ns, double *calls)
+{
+	static struct mosquitto__config config;
+	struct mosquitto_db db;
+	struct mosquitto mosq;
+	struct pollfd pfd;
+	pid_t pid;
+	int sv[2];
+	double start;
+
+	socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+	pid = fork();
+	if(pid == 0){
+		close(sv[0]);
+		feed(sv[1], packet_len);
+		_exit(0);
+	}
+	close(sv[1]);
+	fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL, 0) | O_NONBLOCK);
+
+	memset(&db, 0, sizeof(db));
+	db.config = &config;
+	memset(&mosq, 0, sizeof(mosq));
+	mosq.sock = sv[0];
+	mosq.state = mosq_cs_active;
+	packet__cleanup(&mosq.in_packet);
+	syscalls = 0;
+	handled = 0;
+
+	pfd.fd = sv[0];
+	pfd.events = POLLIN;
+	start = now_ns();
+	while(handled < PACKETS){
+		poll(&pfd, 1, -1);
+		if(read_fn(&db, &mosq) != MOSQ_ERR_SUCCESS) break;
+	}
+	*ns = (now_ns() - start) / handled;
+	*calls = (double)syscalls / handled;
+
+	packet__cleanup(&mosq.in_packet);
+	packet__read_buf_free(&mosq);
+	close(sv[0]);
+	waitpid(pid, NULL, 0);
+}
+
+
+int main(void)
+{
+	static const int sizes[] = {16, 64, 256, 1024, 4096};
+	double each_ns, each_calls, buffered_ns, buffered_calls;
+
+	printf("%6s  %14s %12s  %14s %12s\n", "bytes", "each ns/pkt", "calls/pkt", "buffer ns/pkt", "calls/pkt");
+	for(size_t s=0; s<sizeof(sizes)/sizeof(sizes[0]); s++){
+		bench(sizes[s], read_each, &each_ns, &each_calls);
+		bench(sizes[s], packet__read, &buffered_ns, &buffered_calls);
+		printf("%6d  %14.1f %12.3f  %14.1f %12.3f\n", sizes[s],
+				each_ns, each_calls, buffered_ns, buffered_calls);
+	}
+	return 0;
+}
@@ -0,0 +1,226 @@
+/*
+ * Cost of draining a client's queue of small outgoing packets, as the broker
+ * does for a subscriber on a busy topic once its socket has backed up. Each
+ * round queues a burst of 60 byte packets and writes them to a socketpair
+ * that a child process drains, once with one write() per packet as before and
+ * once with packet__write(), which gathers the queue into writev() calls.
+ *
+ * Run with:
+ *     make packet_write_bench && ./packet_write_bench
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mosquitto_internal.h"
+#include "memory_mosq.h"
+#include "mqtt_protocol.h"
+#include "net_mosq.h"
+#include "packet_mosq.h"
+
+#define PACKET_LEN      60
+#define PACKETS         1000000
+
+static long syscalls;
+
+/* The parts of the library that packet_mosq.c calls, reduced to what the
+ * bench needs */
+ssize_t net__write(struct mosquitto *mosq, void *buf, size_t count)
+{
+	syscalls++;
+	return write(mosq->sock, buf, count);
+}
+
+ssize_t net__writev(struct mosquitto *mosq, const struct iovec *iov, int iovcnt)
+{
+	syscalls++;
+	return writev(mosq->sock, iov, iovcnt);
+}
+
+ssize_t net__read(struct mosquitto *mosq, void *buf, size_t count)
+{
+	return -1;
+}
+
+int handle__packet(struct mosquitto_db *db, struct mosquitto *mosq)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+int send__disconnect(struct mosquitto *mosq, uint8_t reason_code, const mosquitto_property *properties)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+int packet__varint_bytes(int32_t word)
+{
+	return 1;
+}
+
+enum mosquitto_client_state mosquitto__get_state(struct mosquitto *mosq)
+{
+	return mosq_cs_active;
+}
+
+time_t mosquitto_time(void)
+{
+	return 0;
+}
+
+struct mosquitto_db *mosquitto__get_db(void)
+{
+	return NULL;
+}
+
+void db__msg_store_ref_dec(struct mosquitto_db *db, struct mosquitto_msg_store **store)
+{
+}
+
+int log__printf(struct mosquitto *mosq, int priority, const char *fmt, ...)
+{
+	return 0;
+}
+
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+static void drain(int sock)
+{
+	char buf[65536];
+
+	while(read(sock, buf, sizeof(buf)) > 0){
+	}
+}
+
+
+static void wait_writable(int sock)
+{
+	struct pollfd pfd;
+
+	pfd.fd = sock;
+	pfd.events = POLLOUT;
+	poll(&pfd, 1, -1);
+}
+
+
+static void queue_burst(struct mosquitto *mosq, int burst)
+{
+	struct mosquitto__packet *packet;
+
+	for(int i=0; i<burst; i++){
+		packet = packet__new();
+		packet->command = CMD_PUBLISH;
+		packet->remaining_length = PACKET_LEN - 2;
+		packet__alloc(packet);
+		memset(&packet->payload[packet->pos], 'x', packet->remaining_length);
+		packet->pos = 0;
+		packet->to_process = packet->packet_length;
+
+		if(mosq->out_packet){
+			mosq->out_packet_last->next = packet;
+		}else{
+			mosq->out_packet = packet;
+		}
+		mosq->out_packet_last = packet;
+	}
+}
+
+
+/* The write loop packet__write() had before, one write() per packet */
+static void write_each(struct mosquitto *mosq)
+{
+	struct mosquitto__packet *packet;
+	ssize_t len;
+
+	while(mosq->out_packet){
+		packet = mosq->out_packet;
+		while(packet->to_process > 0){
+			len = net__write(mosq, &packet->payload[packet->pos], packet->to_process);
+			if(len > 0){
+				packet->to_process -= len;
+				packet->pos += len;
+			}else if(errno == EAGAIN){
+				wait_writable(mosq->sock);
+			}
+		}
+		mosq->out_packet = packet->next;
+		packet__cleanup(packet);
+		packet__free(packet);
+	}
+	mosq->out_packet_last = NULL;
+}
+
+
+static void write_gathered(struct mosquitto *mosq)
+{
+	while(mosq->out_packet || mosq->current_out_packet){
+		packet__write(mosq);
+		if(mosq->current_out_packet){
+			wait_writable(mosq->sock);
+		}
+	}
+}
+
+
+static void bench(int burst, void (*write_fn)(struct mosquitto *), double *ns, double *calls)
+{
+	struct mosquitto mosq;
+	pid_t pid;
+	int sv[2];
+	double start;
+
+	socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+	pid = fork();
+	if(pid == 0){
+		close(sv[0]);
+		drain(sv[1]);
+		_exit(0);
+	}
+	close(sv[1]);
+	fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL, 0) | O_NONBLOCK);
+
+	memset(&mosq, 0, sizeof(mosq));
+	mosq.sock = sv[0];
+	syscalls = 0;
+
+	start = now_ns();
+	for(int i=0; i<PACKETS; i+=burst){
+		queue_burst(&mosq, burst);
+		write_fn(&mosq);
+	}
+	*ns = (now_ns() - start) / PACKETS;
+	*calls = (double)syscalls / PACKETS;
+
+	close(sv[0]);
+	waitpid(pid, NULL, 0);
+}
+
+
+int main(void)
+{
+	static const int bursts[] = {1, 4, 16, 64, 256};
+	double each_ns, each_calls, gathered_ns, gathered_calls;
+
+	printf("%6s  %14s %12s  %14s %12s\n", "burst", "write ns/pkt", "calls/pkt", "writev ns/pkt", "calls/pkt");
+	for(size_t b=0; b<sizeof(bursts)/sizeof(bursts[0]); b++){
+		bench(bursts[b], write_each, &each_ns, &each_calls);
+		bench(bursts[b], write_gathered, &gathered_ns, &gathered_calls);
+		printf("%6d  %14.1f %12.3f  %14.1f %12.3f\n", bursts[b],
+				each_ns, each_calls, gathered_ns, gathered_calls);
+	}
+	return 0;
+}
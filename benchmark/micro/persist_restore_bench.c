@@ -0,0 +1,241 @@
+/*
+ * Time taken by persist__restore() to load a persistence file of persistent
+ * sessions, reported per million sessions and per million queued messages.
+ * Each session subscribes to its scene and its own topic and has a few
+ * messages queued, shared between the sessions of a scene. The file is
+ * written by the broker's own persist__backup() from a state built here.
+ *
+ * Run with:
+ *     make persist_restore_bench && ./persist_restore_bench [sessions]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <utlist.h>
+
+#include "mosquitto_broker_internal.h"
+#include "memory_mosq.h"
+
+#define SESSIONS        200000
+#define SCENES          1000
+#define QUEUED          4
+#define RETAINED        20000
+#define PAYLOAD_LEN     200
+#define DB_FILE         "persist_restore_bench.db"
+
+/* The parts of the broker that persistence calls, reduced to what the bench
+ * needs */
+struct mosquitto *context__init(struct mosquitto_db *db, mosq_sock_t sock)
+{
+	return mosquitto__calloc(1, sizeof(struct mosquitto));
+}
+
+void context__add_to_disused(struct mosquitto_db *db, struct mosquitto *context)
+{
+}
+
+int log__printf(struct mosquitto *mosq, int priority, const char *fmt, ...)
+{
+	return 0;
+}
+
+struct mosquitto_db *mosquitto__get_db(void)
+{
+	return NULL;
+}
+
+time_t mosquitto_time(void)
+{
+	return time(NULL);
+}
+
+int net__socket_close(struct mosquitto_db *db, struct mosquitto *mosq)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+int send__pingreq(struct mosquitto *mosq)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_acl_check(struct mosquitto_db *db, struct mosquitto *context, const char *topic,
+		long payloadlen, void* payload, int qos, bool retain, int access)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+int acl__find_acls(struct mosquitto_db *db, struct mosquitto *context)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+void acl__patterns_free(struct mosquitto *context)
+{
+}
+
+void packet__buffer_release(struct mosquitto__packet_buffer *buffer)
+{
+}
+
+int send__publish_stored(struct mosquitto *mosq, uint16_t mid, struct mosquitto_msg_store *stored,
+		int qos, bool retain, bool dup, const mosquitto_property *cmsg_props, uint32_t expiry_interval)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+int send__pubcomp(struct mosquitto *mosq, uint16_t mid)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+int send__pubrec(struct mosquitto *mosq, uint16_t mid, uint8_t reason_code)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+int send__pubrel(struct mosquitto *mosq, uint16_t mid)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static double now_s(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static struct mosquitto_msg_store *store_message(struct mosquitto_db *db, const char *topic, int retain)
+{
+	struct mosquitto_msg_store *stored = NULL;
+	mosquitto__payload_uhpa payload;
+
+	if(UHPA_ALLOC(payload, PAYLOAD_LEN) == 0) exit(1);
+	memset(UHPA_ACCESS(payload, PAYLOAD_LEN), 'x', PAYLOAD_LEN);
+	if(db__message_store(db, NULL, 0, mosquitto__strdup(topic), 1, PAYLOAD_LEN, &payload,
+				retain, &stored, 0, NULL, 0, mosq_mo_client)){
+		exit(1);
+	}
+	return stored;
+}
+
+
+/* Build the state to save, in the db that persist__backup() is given */
+static void build(struct mosquitto_db *db, int sessions)
+{
+	static struct mosquitto_msg_store *scene_msgs[SCENES][QUEUED];
+	struct mosquitto *context;
+	struct mosquitto_client_msg *cmsg;
+	struct mosquitto_msg_store *stored;
+	char topic[100];
+	int i, j;
+
+	for(i=0; i<SCENES; i++){
+		for(j=0; j<QUEUED; j++){
+			snprintf(topic, sizeof(topic), "realm/s/scene%d/update%d", i, j);
+			scene_msgs[i][j] = store_message(db, topic, 0);
+		}
+	}
+	for(i=0; i<RETAINED; i++){
+		snprintf(topic, sizeof(topic), "realm/s/scene%d/obj%d", i%SCENES, i);
+		stored = store_message(db, topic, 1);
+		sub__messages_queue(db, NULL, topic, 1, 1, &stored);
+	}
+
+	for(i=0; i<sessions; i++){
+		context = context__init(db, INVALID_SOCKET);
+		snprintf(topic, sizeof(topic), "client%d", i);
+		context->id = mosquitto__strdup(topic);
+		context->clean_start = false;
+		context->session_expiry_interval = UINT32_MAX;
+		HASH_ADD_KEYPTR(hh_id, db->contexts_by_id, context->id, strlen(context->id), context);
+
+		snprintf(topic, sizeof(topic), "realm/s/scene%d/#", i%SCENES);
+		sub__add(db, context, topic, 1, 0, 0, &db->subs);
+		snprintf(topic, sizeof(topic), "realm/c/client%d/+", i);
+		sub__add(db, context, topic, 1, 0, 0, &db->subs);
+
+		for(j=0; j<QUEUED; j++){
+			cmsg = db__client_msg_new();
+			memset(cmsg, 0, sizeof(*cmsg));
+			cmsg->mid = j+1;
+			cmsg->qos = 1;
+			cmsg->direction = mosq_md_out;
+			cmsg->state = mosq_ms_queued;
+			cmsg->store = scene_msgs[i%SCENES][j];
+			db__msg_store_ref_inc(cmsg->store);
+			DL_APPEND(context->msgs_out.queued, cmsg);
+		}
+	}
+}
+
+
+static void count(struct mosquitto_db *db, long *sessions, long *messages)
+{
+	struct mosquitto *context, *ctxt_tmp;
+	struct mosquitto_client_msg *cmsg;
+
+	*sessions = 0;
+	*messages = 0;
+	HASH_ITER(hh_id, db->contexts_by_id, context, ctxt_tmp){
+		(*sessions)++;
+		DL_FOREACH(context->msgs_out.queued, cmsg){
+			(*messages)++;
+		}
+	}
+}
+
+
+static void init_db(struct mosquitto_db *db, struct mosquitto__config *config)
+{
+	memset(db, 0, sizeof(*db));
+	db->config = config;
+	sub__add_hier_entry(NULL, &db->subs, "", 0);
+	sub__add_hier_entry(NULL, &db->subs, "$SYS", 4);
+	retain__add_hier_entry(NULL, &db->retains, "", 0);
+	retain__add_hier_entry(NULL, &db->retains, "$SYS", 4);
+}
+
+
+int main(int argc, char *argv[])
+{
+	static struct mosquitto_db saved, restored;
+	static struct mosquitto__config config;
+	long sessions, messages;
+	double start, elapsed;
+	int n = SESSIONS;
+
+	if(argc > 1) n = atoi(argv[1]);
+
+	config.persistence = true;
+	config.persistence_filepath = DB_FILE;
+
+	init_db(&saved, &config);
+	build(&saved, n);
+	if(persist__backup(&saved, true)){
+		fprintf(stderr, "Unable to write %s\n", DB_FILE);
+		return 1;
+	}
+
+	init_db(&restored, &config);
+	start = now_s();
+	if(persist__restore(&restored)){
+		fprintf(stderr, "Unable to restore %s\n", DB_FILE);
+		unlink(DB_FILE);
+		return 1;
+	}
+	elapsed = now_s() - start;
+	unlink(DB_FILE);
+
+	count(&restored, &sessions, &messages);
+	printf("%ld sessions, %ld queued messages, %d retained messages restored in %.3f s\n",
+			sessions, messages, RETAINED, elapsed);
+	printf("%.3f s per million sessions, %.3f s per million messages\n",
+			elapsed * 1e6 / sessions, elapsed * 1e6 / messages);
+	return 0;
+}
@@ -0,0 +1,74 @@
+/*
+ * Cost of allocating and freeing the per delivery structs when one message
+ * fans out to many subscribers: each round allocates a struct the size of a
+ * mosquitto_client_msg per subscriber and frees them in the order they were
+ * queued. Once with mosquitto__calloc()/mosquitto__free() and memory tracking,
+ * as the broker is built by default, and once from a slab pool.
+ *
+ * Run with:
+ *     make pool_bench && ./pool_bench
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "mosquitto_broker_internal.h"
+#include "memory_mosq.h"
+
+#define DELIVERIES      20000000
+
+static struct mosquitto__pool pool = MEMORY_POOL_INIT("client_msg", sizeof(struct mosquitto_client_msg));
+static void *items[4096];
+
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+static double bench_heap(int fanout)
+{
+	double start = now_ns();
+
+	for(int i=0; i<DELIVERIES; i+=fanout){
+		for(int j=0; j<fanout; j++){
+			items[j] = mosquitto__calloc(1, sizeof(struct mosquitto_client_msg));
+		}
+		for(int j=0; j<fanout; j++){
+			mosquitto__free(items[j]);
+		}
+	}
+	return (now_ns() - start) / DELIVERIES;
+}
+
+
+static double bench_pool(int fanout)
+{
+	double start = now_ns();
+
+	for(int i=0; i<DELIVERIES; i+=fanout){
+		for(int j=0; j<fanout; j++){
+			items[j] = memory__pool_alloc(&pool);
+		}
+		for(int j=0; j<fanout; j++){
+			memory__pool_free(&pool, items[j]);
+		}
+	}
+	return (now_ns() - start) / DELIVERIES;
+}
+
+
+int main(void)
+{
+	static const int fanouts[] = {1, 16, 256, 4096};
+
+	printf("%7s %14s %14s   (ns/delivery)\n", "fanout", "heap", "pool");
+	for(size_t f=0; f<sizeof(fanouts)/sizeof(fanouts[0]); f++){
+		printf("%7d %14.1f %14.1f\n", fanouts[f], bench_heap(fanouts[f]), bench_pool(fanouts[f]));
+	}
+	memory__pool_cleanup();
+	return 0;
+}
@@ -0,0 +1,169 @@
+/*
+ * Cost of sending one stored message to many subscribers, as the broker does
+ * for a point cloud or scene update published to a busy ARENA scene. Each
+ * round sends one message to 200 subscribers, once through send__publish(),
+ * which builds and copies a full packet for every subscriber, and once
+ * through send__publish_stored(), which shares the headers and sends large
+ * payloads straight from the stored message. The sockets are stubbed out, so
+ * only the broker's own work is timed.
+ *
+ * Run with:
+ *     make publish_fanout_bench && ./publish_fanout_bench
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#include "mosquitto_broker_internal.h"
+#include "memory_mosq.h"
+#include "mqtt_protocol.h"
+#include "net_mosq.h"
+#include "packet_mosq.h"
+#include "send_mosq.h"
+
+#define SUBSCRIBERS     200
+#define MESSAGE_BYTES   (200*1000*1000)
+
+static struct mosquitto_db db;
+static long written;
+
+/* The parts of the broker that the send and packet code calls, reduced to
+ * what the bench needs. Writes always succeed in full. */
+ssize_t net__write(struct mosquitto *mosq, void *buf, size_t count)
+{
+	written += count;
+	return count;
+}
+
+ssize_t net__writev(struct mosquitto *mosq, const struct iovec *iov, int iovcnt)
+{
+	size_t count = 0;
+
+	for(int i=0; i<iovcnt; i++){
+		count += iov[i].iov_len;
+	}
+	written += count;
+	return count;
+}
+
+ssize_t net__read(struct mosquitto *mosq, void *buf, size_t count)
+{
+	return -1;
+}
+
+int handle__packet(struct mosquitto_db *db, struct mosquitto *mosq)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+int send__disconnect(struct mosquitto *mosq, uint8_t reason_code, const mosquitto_property *properties)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+enum mosquitto_client_state mosquitto__get_state(struct mosquitto *mosq)
+{
+	return mosq_cs_active;
+}
+
+time_t mosquitto_time(void)
+{
+	return 0;
+}
+
+int log__printf(struct mosquitto *mosq, int priority, const char *fmt, ...)
+{
+	return 0;
+}
+
+struct mosquitto_db *mosquitto__get_db(void)
+{
+	return &db;
+}
+
+void db__msg_store_ref_inc(struct mosquitto_msg_store *store)
+{
+	store->ref_count++;
+}
+
+void db__msg_store_ref_dec(struct mosquitto_db *db, struct mosquitto_msg_store **store)
+{
+	(*store)->ref_count--;
+}
+
+int mosquitto_topic_matches_sub(const char *sub, const char *topic, bool *result)
+{
+	*result = false;
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+static double bench(struct mosquitto *subs, struct mosquitto_msg_store *stored, int qos, bool shared, int rounds)
+{
+	double start = now_ns();
+
+	for(int i=0; i<rounds; i++){
+		for(int j=0; j<SUBSCRIBERS; j++){
+			if(shared){
+				send__publish_stored(&subs[j], 1, stored, qos, false, false, NULL, 0);
+			}else{
+				send__publish(&subs[j], 1, stored->topic, stored->payloadlen,
+						UHPA_ACCESS_PAYLOAD(stored), qos, false, false, NULL, NULL, 0);
+			}
+		}
+	}
+	return (now_ns() - start) / rounds;
+}
+
+
+int main(void)
+{
+	static const uint32_t sizes[] = {100, 1000, 10000, 50000, 200000};
+	static struct mosquitto subs[SUBSCRIBERS];
+	static struct mosquitto__config config;
+	struct mosquitto_msg_store stored;
+	struct mosquitto__packet_buffer *buffer;
+	int rounds;
+
+	db.config = &config;
+	for(int j=0; j<SUBSCRIBERS; j++){
+		subs[j].sock = 1;
+		subs[j].protocol = mosq_p_mqtt311;
+		subs[j].state = mosq_cs_active;
+	}
+
+	printf("%8s %4s %14s %14s   (us/message to %d subscribers)\n", "bytes", "qos", "copy", "shared", SUBSCRIBERS);
+	for(size_t s=0; s<sizeof(sizes)/sizeof(sizes[0]); s++){
+		memset(&stored, 0, sizeof(stored));
+		stored.topic = "realm/s/scene/pointcloud";
+		stored.payloadlen = sizes[s];
+		UHPA_ALLOC_PAYLOAD(&stored);
+		memset(UHPA_ACCESS_PAYLOAD(&stored), 'x', sizes[s]);
+		stored.ref_count = 1;
+
+		rounds = MESSAGE_BYTES / (sizes[s] * SUBSCRIBERS) + 1;
+		for(int qos=0; qos<2; qos++){
+			double copy = bench(subs, &stored, qos, false, rounds);
+			double shared = bench(subs, &stored, qos, true, rounds);
+			printf("%8u %4d %14.1f %14.1f\n", sizes[s], qos, copy/1000, shared/1000);
+		}
+
+		while(stored.packets){
+			buffer = stored.packets;
+			stored.packets = buffer->next;
+			packet__buffer_release(buffer);
+		}
+		UHPA_FREE_PAYLOAD(&stored);
+	}
+	return 0;
+}
@@ -0,0 +1,164 @@
+/*
+ * Publish and subscribe cost of the broker subscription tree at topic depths
+ * 3 to 12. Each publish topic is used once per pass over a set much larger
+ * than the match cache, so every publish splits its topic and searches the
+ * tree. Subscribing and unsubscribing split the filter the same way.
+ *
+ * Run with:
+ *     make subs_publish_bench && ./subs_publish_bench
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mosquitto_broker_internal.h"
+
+#define TOPIC_COUNT     65536
+#define TOPIC_LEN       256
+#define CLIENTS         64
+#define PUBLISHES       2000000
+#define SUBSCRIBES      200000
+
+static long delivered;
+
+/* The parts of the broker that subs.c calls, reduced to what the bench needs */
+int db__message_insert(struct mosquitto_db *db, struct mosquitto *context, uint16_t mid,
+		enum mosquitto_msg_direction dir, int qos, bool retain, struct mosquitto_msg_store *stored,
+		mosquitto_property *properties)
+{
+	delivered++;
+	return 0;
+}
+
+void db__msg_store_ref_inc(struct mosquitto_msg_store *store)
+{
+	store->ref_count++;
+}
+
+void db__msg_store_ref_dec(struct mosquitto_db *db, struct mosquitto_msg_store **store)
+{
+	(*store)->ref_count--;
+}
+
+int mosquitto_acl_check(struct mosquitto_db *db, struct mosquitto *context, const char *topic,
+		long payloadlen, void* payload, int qos, bool retain, int access)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+uint16_t mosquitto__mid_generate(struct mosquitto *mosq)
+{
+	return 1;
+}
+
+int acl__find_acls(struct mosquitto_db *db, struct mosquitto *context)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+void acl__patterns_free(struct mosquitto *context)
+{
+}
+
+int log__printf(struct mosquitto *mosq, int priority, const char *fmt, ...)
+{
+	return 0;
+}
+
+int mosquitto_property_add_varint(mosquitto_property **proplist, int identifier, uint32_t value)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+/* realm/scene<n>/l3/.../l<depth-1>/obj<id>, depth levels in all */
+static void make_topic(char *buf, int depth, int scene, int id)
+{
+	int len;
+
+	len = snprintf(buf, TOPIC_LEN, "realm/scene%d", scene);
+	for(int level=3; level<depth; level++){
+		len += snprintf(&buf[len], TOPIC_LEN-len, "/l%d", level);
+	}
+	snprintf(&buf[len], TOPIC_LEN-len, "/obj%d", id);
+}
+
+
+static void bench_depth(struct mosquitto_db *db, int depth)
+{
+	static struct mosquitto clients[CLIENTS];
+	static char ids[CLIENTS][16];
+	static char topics[TOPIC_COUNT][TOPIC_LEN];
+	struct mosquitto_msg_store store, *stored;
+	char filter[TOPIC_LEN];
+	double start, publish, subscribe;
+	int i;
+
+	memset(&store, 0, sizeof(store));
+
+	/* Each client follows one scene, half of them with a + on the second to
+	 * last level */
+	for(i=0; i<CLIENTS; i++){
+		snprintf(ids[i], sizeof(ids[i]), "client%d", i);
+		memset(&clients[i], 0, sizeof(clients[i]));
+		clients[i].id = ids[i];
+		snprintf(filter, sizeof(filter), "realm/scene%d/#", i%16);
+		sub__add(db, &clients[i], filter, 0, 0, 0, &db->subs);
+		if(i%2){
+			make_topic(filter, depth, i%16, 0);
+			strcpy(strrchr(filter, '/'), "/+");
+			sub__add(db, &clients[i], filter, 0, 0, 0, &db->subs);
+		}
+	}
+	for(i=0; i<TOPIC_COUNT; i++){
+		make_topic(topics[i], depth, i%16, i);
+	}
+
+	start = now_ns();
+	for(i=0; i<PUBLISHES; i++){
+		stored = &store;
+		sub__messages_queue(db, "publisher", topics[i%TOPIC_COUNT], 0, 0, &stored);
+	}
+	publish = (now_ns() - start) / PUBLISHES;
+
+	start = now_ns();
+	for(i=0; i<SUBSCRIBES; i++){
+		uint8_t reason;
+		sub__add(db, &clients[i%CLIENTS], topics[i%TOPIC_COUNT], 0, 0, 0, &db->subs);
+		sub__remove(db, &clients[i%CLIENTS], topics[i%TOPIC_COUNT], db->subs, &reason);
+	}
+	subscribe = (now_ns() - start) / SUBSCRIBES;
+
+	printf("%6d %12.1f %14.1f\n", depth, publish, subscribe);
+
+	for(i=0; i<CLIENTS; i++){
+		sub__clean_session(db, &clients[i]);
+	}
+}
+
+
+int main(void)
+{
+	static struct mosquitto_db db;
+	static struct mosquitto__config config;
+
+	db.config = &config;
+	sub__add_hier_entry(NULL, &db.subs, "", 0);
+	sub__add_hier_entry(NULL, &db.subs, "$SYS", 4);
+
+	printf("%6s %12s %14s   (ns/op)\n", "depth", "publish", "sub+unsub");
+	for(int depth=3; depth<=12; depth++){
+		bench_depth(&db, depth);
+	}
+	sub__cache_free(&db);
+	return 0;
+}
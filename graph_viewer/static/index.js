@@ -55,7 +55,11 @@ document.addEventListener('DOMContentLoaded', function() {
             selector: 'edge',
             style: {
                 'content': function(elem) {
-                    return elem.data('bps') + " bytes/s";
+                    let label = elem.data('bps') + " bytes/s";
+                    if (elem.data('drops')) {
+                        label += ", " + elem.data('drops') + " dropped";
+                    }
+                    return label;
                 },
                 "font-size": 3.5,
                 'width': 1.0,
@@ -78,10 +82,16 @@ document.addEventListener('DOMContentLoaded', function() {
     }
     const clientMain = new Paho.MQTT.Client(brokerAddr, "graphViewer-" + (+new Date).toString(36));
     const graphTopic = "$NETWORK";
+    const deltaTopic = "$NETWORK/delta";
+    const snapshotTopic = "$NETWORK/snapshot";
 
     let prevJSON = [];
     let currIdx = 0;
 
+    let currJSON = null;    // latest full graph, kept up to date by deltas
+    let currSeq = 0;        // sequence number of the last applied delta
+    let snapshotPending = false;
+
     let action = null;
 
     let modal = document.getElementById("modalView");
@@ -111,6 +121,7 @@ document.addEventListener('DOMContentLoaded', function() {
     function onConnect() {
         console.log("Connected!");
         clientMain.subscribe(graphTopic);
+        clientMain.subscribe(deltaTopic);
         publish(clientMain, "$NETWORK/latency", "", 2);
         setInterval(() => {
             publish(clientMain, "$NETWORK/latency", "", 2);
@@ -204,6 +215,7 @@ document.addEventListener('DOMContentLoaded', function() {
                 subEdgeJSON["data"] = {};
                 subEdgeJSON["data"]["id"] = "edge_"+(cnt++);
                 subEdgeJSON["data"]["bps"] = subEdge["bps"];
+                subEdgeJSON["data"]["drops"] = subEdge["drops"];
                 subEdgeJSON["data"]["source"] = topic["name"];
                 subEdgeJSON["data"]["target"] = subEdge["client"];
                 subEdgeJSON["group"] = "edges";
@@ -213,6 +225,175 @@ document.addEventListener('DOMContentLoaded', function() {
         return res;
     }
 
+    // decodes a graph published with graph_format binary into the same object as the JSON graph
+    function decodeBinaryGraph(bytes) {
+        let view = new DataView(bytes.buffer, bytes.byteOffset, bytes.byteLength);
+        let textDecoder = new TextDecoder("utf-8");
+        let pos = 3; // "NG", version
+        let strings = [];
+
+        function readCount() {
+            let count = view.getUint32(pos, true);
+            pos += 4;
+            return count;
+        }
+        function readVarint() {
+            let value = 0, mul = 1, b;
+            do {
+                b = bytes[pos++];
+                value += (b & 0x7f) * mul;
+                mul *= 128;
+            } while (b & 0x80);
+            return value;
+        }
+        function readNumber() {
+            let value = readVarint();
+            return value === 0 ? null : (value - 1) / 1000;
+        }
+        function readString() {
+            return strings[readVarint()];
+        }
+
+        for (let i = readCount(); i > 0; i--) {
+            let len = readVarint();
+            strings.push(textDecoder.decode(bytes.subarray(pos, pos + len)));
+            pos += len;
+        }
+
+        let res = { "ips": [], "topics": [] };
+        for (let i = readCount(); i > 0; i--) {
+            let ip = { "id": readString(), "clients": [] };
+            for (let j = readCount(); j > 0; j--) {
+                let client = { "name": readString(), "latency": readNumber(), "published": [] };
+                for (let k = readCount(); k > 0; k--) {
+                    client["published"].push({ "topic": readString(), "bps": readNumber() });
+                }
+                ip["clients"].push(client);
+            }
+            res["ips"].push(ip);
+        }
+        for (let i = readCount(); i > 0; i--) {
+            let topic = { "name": readString(), "subscriptions": [] };
+            for (let j = readCount(); j > 0; j--) {
+                topic["subscriptions"].push({ "client": readString(), "bps": readNumber(), "mps": readNumber(), "drops": readVarint() });
+            }
+            res["topics"].push(topic);
+        }
+        res["seq"] = readVarint();
+        return res;
+    }
+
+    function isBinaryGraph(bytes) {
+        return bytes.length >= 3 && bytes[0] === 0x4e && bytes[1] === 0x47 && bytes[2] === 2; // "NG", version 2
+    }
+
+    function requestSnapshot() {
+        if (snapshotPending) return;
+        snapshotPending = true;
+        publish(clientMain, snapshotTopic, "", 0);
+    }
+
+    function findClient(json, name) {
+        for (let ip of json["ips"]) {
+            let client = ip["clients"].find(c => c["name"] === name);
+            if (client) return client;
+        }
+        return null;
+    }
+
+    function applyEvent(json, event) {
+        let idx, ip, client, topic;
+        switch (event["type"]) {
+            case "ip":
+                idx = json["ips"].findIndex(i => i["id"] === event["id"]);
+                if (event["op"] === "add" && idx < 0) {
+                    json["ips"].push({ "id": event["id"], "clients": [] });
+                }
+                else if (event["op"] === "delete" && idx >= 0) {
+                    json["ips"].splice(idx, 1);
+                }
+                break;
+            case "client":
+                ip = json["ips"].find(i => i["id"] === event["ip"]);
+                if (!ip) break;
+                idx = ip["clients"].findIndex(c => c["name"] === event["name"]);
+                if (event["op"] === "add" && idx < 0) {
+                    ip["clients"].push({ "name": event["name"], "latency": event["latency"], "published": [] });
+                }
+                else if (event["op"] === "delete" && idx >= 0) {
+                    // edges of a deleted client are deleted with it
+                    ip["clients"].splice(idx, 1);
+                    for (let t of json["topics"]) {
+                        t["subscriptions"] = t["subscriptions"].filter(s => s["client"] !== event["name"]);
+                    }
+                }
+                else if (event["op"] === "update" && idx >= 0) {
+                    ip["clients"][idx]["latency"] = event["latency"];
+                }
+                break;
+            case "topic":
+                idx = json["topics"].findIndex(t => t["name"] === event["name"]);
+                if (event["op"] === "add" && idx < 0) {
+                    json["topics"].push({ "name": event["name"], "bps": event["bps"], "subscriptions": [] });
+                }
+                else if (event["op"] === "delete" && idx >= 0) {
+                    // edges of a deleted topic are deleted with it
+                    json["topics"].splice(idx, 1);
+                    for (let i of json["ips"]) {
+                        for (let c of i["clients"]) {
+                            c["published"] = c["published"].filter(p => p["topic"] !== event["name"]);
+                        }
+                    }
+                }
+                else if (event["op"] === "update" && idx >= 0) {
+                    json["topics"][idx]["bps"] = event["bps"];
+                }
+                break;
+            case "pub":
+                client = findClient(json, event["client"]);
+                if (!client) break;
+                idx = client["published"].findIndex(p => p["topic"] === event["topic"]);
+                if (event["op"] === "add" && idx < 0) {
+                    client["published"].push({ "topic": event["topic"], "bps": event["bps"] });
+                }
+                else if (event["op"] === "delete" && idx >= 0) {
+                    client["published"].splice(idx, 1);
+                }
+                else if (event["op"] === "update" && idx >= 0) {
+                    client["published"][idx]["bps"] = event["bps"];
+                }
+                break;
+            case "sub":
+                topic = json["topics"].find(t => t["name"] === event["topic"]);
+                if (!topic) break;
+                idx = topic["subscriptions"].findIndex(s => s["client"] === event["client"]);
+                if (event["op"] === "add" && idx < 0) {
+                    topic["subscriptions"].push({ "client": event["client"], "bps": event["bps"], "mps": event["mps"], "drops": event["drops"] });
+                }
+                else if (event["op"] === "delete" && idx >= 0) {
+                    topic["subscriptions"].splice(idx, 1);
+                }
+                else if (event["op"] === "update" && idx >= 0) {
+                    topic["subscriptions"][idx]["bps"] = event["bps"];
+                    topic["subscriptions"][idx]["mps"] = event["mps"];
+                    topic["subscriptions"][idx]["drops"] = event["drops"];
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    function applyDelta(json, delta) {
+        // keep older graphs intact for the history buttons
+        let res = JSON.parse(JSON.stringify(json));
+        for (let i = 0; i < delta["events"].length; i++) {
+            applyEvent(res, delta["events"][i]);
+        }
+        res["seq"] = delta["seq"];
+        return res;
+    }
+
     function updateCy(json) {
         try {
             let cyJSON = createCyJSON(json);
@@ -226,7 +407,29 @@ document.addEventListener('DOMContentLoaded', function() {
     }
 
     function onMessageArrived(message) {
-        var newJSON = JSON.parse(message.payloadString);
+        var newJSON;
+        if (message.destinationName === deltaTopic) {
+            let delta = JSON.parse(message.payloadString);
+            if (currJSON === null) {
+                requestSnapshot();
+                return;
+            }
+            if (delta["seq"] <= currSeq) return;
+            if (delta["seq"] !== currSeq + 1) {
+                // missed a delta, drop the graph until a full snapshot arrives
+                currJSON = null;
+                requestSnapshot();
+                return;
+            }
+            newJSON = applyDelta(currJSON, delta);
+        }
+        else {
+            let bytes = message.payloadBytes;
+            newJSON = isBinaryGraph(bytes) ? decodeBinaryGraph(bytes) : JSON.parse(message.payloadString);
+            snapshotPending = false;
+        }
+        currJSON = newJSON;
+        currSeq = newJSON["seq"] || 0;
         msgText.value = JSON.stringify(newJSON, undefined, 4);
 
         if (!paused) updateCy(newJSON);
@@ -16,6 +16,8 @@ Contributors:
 
 #include "config.h"
 
+#include <assert.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -160,3 +162,186 @@ char *mosquitto__strdup(const char *s)
 
 	return str;
 }
+
+
+/* Each item is preceded by a header that points back to its slab, and links
+ * it into the slab's free list while it is not in use. The header is 16 bytes
+ * so that items keep the alignment malloc() would have given them. */
+struct mosquitto__pool_item{
+	struct mosquitto__slab *slab;
+	struct mosquitto__pool_item *next;
+};
+
+struct mosquitto__slab{
+	struct mosquitto__slab *next;
+	struct mosquitto__slab *prev;
+	struct mosquitto__pool_item *free_list;
+	unsigned int in_use;
+};
+
+#define POOL_ALIGN(A) (((A) + 15) & ~(size_t)15)
+
+static struct mosquitto__pool *pools = NULL;
+
+
+static size_t pool__stride(const struct mosquitto__pool *pool)
+{
+	return sizeof(struct mosquitto__pool_item) + POOL_ALIGN(pool->item_size);
+}
+
+
+static void pool__slab_link(struct mosquitto__pool *pool, struct mosquitto__slab *slab)
+{
+	slab->prev = NULL;
+	slab->next = pool->partial;
+	if(pool->partial){
+		pool->partial->prev = slab;
+	}
+	pool->partial = slab;
+}
+
+
+static void pool__slab_unlink(struct mosquitto__pool *pool, struct mosquitto__slab *slab)
+{
+	if(slab->prev){
+		slab->prev->next = slab->next;
+	}else{
+		pool->partial = slab->next;
+	}
+	if(slab->next){
+		slab->next->prev = slab->prev;
+	}
+	slab->next = NULL;
+	slab->prev = NULL;
+}
+
+
+static struct mosquitto__slab *pool__slab_new(struct mosquitto__pool *pool)
+{
+	struct mosquitto__slab *slab;
+	struct mosquitto__pool_item *item;
+	uint8_t *items;
+	size_t stride = pool__stride(pool);
+	int i;
+
+	slab = mosquitto__malloc(POOL_ALIGN(sizeof(struct mosquitto__slab)) + stride*MEMORY_POOL_SLAB_ITEMS);
+	if(!slab) return NULL;
+
+	if(!pool->registered){
+		struct mosquitto__pool **tail = &pools;
+		while(*tail){
+			tail = &(*tail)->next;
+		}
+		*tail = pool;
+		pool->registered = true;
+	}
+
+	items = (uint8_t *)slab + POOL_ALIGN(sizeof(struct mosquitto__slab));
+	slab->free_list = NULL;
+	slab->in_use = 0;
+	for(i=MEMORY_POOL_SLAB_ITEMS-1; i>=0; i--){
+		item = (struct mosquitto__pool_item *)&items[stride*i];
+		item->slab = slab;
+		item->next = slab->free_list;
+		slab->free_list = item;
+	}
+	pool__slab_link(pool, slab);
+	pool->slabs++;
+	pool->empty_slabs++;
+
+	return slab;
+}
+
+
+/* Returns a zeroed item, or NULL if a new slab was needed and could not be
+ * allocated. */
+void *memory__pool_alloc(struct mosquitto__pool *pool)
+{
+	struct mosquitto__slab *slab;
+	struct mosquitto__pool_item *item;
+
+	slab = pool->partial;
+	if(!slab){
+		slab = pool__slab_new(pool);
+		if(!slab) return NULL;
+	}
+
+	item = slab->free_list;
+	slab->free_list = item->next;
+	if(slab->in_use == 0){
+		pool->empty_slabs--;
+	}
+	slab->in_use++;
+	if(!slab->free_list){
+		pool__slab_unlink(pool, slab);
+	}
+	pool->items++;
+
+	memset(&item[1], 0, pool->item_size);
+	return &item[1];
+}
+
+
+void memory__pool_free(struct mosquitto__pool *pool, void *mem)
+{
+	struct mosquitto__pool_item *item;
+	struct mosquitto__slab *slab;
+
+	if(!mem) return;
+
+	item = (struct mosquitto__pool_item *)mem - 1;
+	slab = item->slab;
+	assert(slab->in_use > 0);
+
+	if(!slab->free_list){
+		pool__slab_link(pool, slab);
+	}
+	item->next = slab->free_list;
+	slab->free_list = item;
+	slab->in_use--;
+	pool->items--;
+
+	if(slab->in_use == 0){
+		/* Keep some empty slabs so that a burst of fan-out that is repeated
+		 * for every message doesn't allocate and free slabs each time. */
+		if(pool->empty_slabs >= MEMORY_POOL_EMPTY_SLABS){
+			pool__slab_unlink(pool, slab);
+			mosquitto__free(slab);
+			pool->slabs--;
+		}else{
+			pool->empty_slabs++;
+		}
+	}
+}
+
+
+size_t memory__pool_bytes(const struct mosquitto__pool *pool)
+{
+	return pool->slabs * (POOL_ALIGN(sizeof(struct mosquitto__slab)) + pool__stride(pool)*MEMORY_POOL_SLAB_ITEMS);
+}
+
+
+struct mosquitto__pool *memory__pool_list(void)
+{
+	return pools;
+}
+
+
+/* Frees the slabs that have nothing in use, for shutdown. */
+void memory__pool_cleanup(void)
+{
+	struct mosquitto__pool *pool;
+	struct mosquitto__slab *slab, *next;
+
+	for(pool=pools; pool; pool=pool->next){
+		for(slab=pool->partial; slab; slab=next){
+			next = slab->next;
+			if(slab->in_use == 0){
+				pool__slab_unlink(pool, slab);
+				mosquitto__free(slab);
+				pool->slabs--;
+				pool->empty_slabs--;
+			}
+		}
+	}
+}
@@ -17,6 +17,7 @@ Contributors:
 #ifndef MEMORY_MOSQ_H
 #define MEMORY_MOSQ_H
 
+#include <stdbool.h>
 #include <stdio.h>
 #include <sys/types.h>
 
@@ -38,4 +39,31 @@ char *mosquitto__strdup(const char *s);
 void memory__set_limit(size_t lim);
 #endif
 
+/* Fixed size items handed out from slabs of MEMORY_POOL_SLAB_ITEMS, for
+ * structs that are allocated and freed for every message. Up to
+ * MEMORY_POOL_EMPTY_SLABS slabs with nothing in use are kept for reuse. */
+#define MEMORY_POOL_SLAB_ITEMS 64
+#define MEMORY_POOL_EMPTY_SLABS 64
+
+struct mosquitto__slab;
+
+struct mosquitto__pool{
+	struct mosquitto__pool *next;
+	const char *name;
+	size_t item_size;
+	struct mosquitto__slab *partial; /* Slabs with at least one free item */
+	unsigned long items; /* In use */
+	unsigned long slabs;
+	unsigned long empty_slabs;
+	bool registered;
+};
+
+#define MEMORY_POOL_INIT(name, item_size) {NULL, (name), (item_size), NULL, 0, 0, 0, false}
+
+void *memory__pool_alloc(struct mosquitto__pool *pool);
+void memory__pool_free(struct mosquitto__pool *pool, void *mem);
+size_t memory__pool_bytes(const struct mosquitto__pool *pool);
+struct mosquitto__pool *memory__pool_list(void);
+void memory__pool_cleanup(void);
+
 #endif
@@ -309,7 +309,7 @@ void mosquitto__destroy(struct mosquitto *mosq)
 		}
 
 		packet__cleanup(packet);
-		mosquitto__free(packet);
+		packet__free(packet);
 	}
 
 	packet__cleanup(&mosq->in_packet);
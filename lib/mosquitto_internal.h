@@ -147,8 +147,35 @@ struct session_expiry_list {
 	struct session_expiry_list *next;
 };
 
+/* A serialised packet that is sent as it is to many clients. Each queued
+ * packet pointing at it holds a reference. If header_length is less than
+ * packet_length, payload only holds the headers and the message payload is
+ * sent from the stored message. */
+struct mosquitto__packet_buffer{
+	struct mosquitto__packet_buffer *next;
+	uint32_t remaining_length;
+	uint32_t packet_length;
+	uint32_t header_length;
+	uint32_t mid_pos;
+	int ref_count;
+	uint8_t command;
+	int8_t remaining_count;
+	bool mqtt5;
+	uint8_t payload[];
+};
+
+struct mosquitto_msg_store;
+
 struct mosquitto__packet{
 	uint8_t *payload;
+	struct mosquitto__packet_buffer *shared;
+#ifdef WITH_BROKER
+	/* Bytes from header_length on are sent from payload_ext, the payload of
+	 * store, which the packet holds a reference to. */
+	struct mosquitto_msg_store *store;
+	const uint8_t *payload_ext;
+	uint32_t header_length;
+#endif
 	struct mosquitto__packet *next;
 	uint32_t remaining_mult;
 	uint32_t remaining_length;
@@ -224,6 +251,11 @@ struct mosquitto {
 	time_t next_msg_out;
 	time_t ping_t;
 	struct mosquitto__packet in_packet;
+#ifdef WITH_BROKER
+	struct mosquitto__packet_buffer *in_buf;
+	uint32_t in_buf_pos;
+	uint32_t in_buf_len;
+#endif
 	struct mosquitto__packet *current_out_packet;
 	struct mosquitto__packet *out_packet;
 	struct mosquitto_message_all *will;
@@ -277,10 +309,14 @@ struct mosquitto {
 	struct mosquitto_msg_data msgs_in;
 	struct mosquitto_msg_data msgs_out;
 	struct mosquitto__acl_user *acl_list;
+	struct mosquitto__acl_cache *acl_cache;
+	struct mosquitto__aclhier *acl_patterns; /* Pattern ACLs with %c and %u substituted */
+	bool acl_patterns_expanded;
 	struct mosquitto__listener *listener;
 	struct mosquitto__packet *out_packet_last;
 	struct mosquitto__subhier **subs;
 	struct mosquitto__subshared_ref **shared_subs;
+	struct mosquitto__retain_queue *retain_queue;
 	char *auth_method;
 	int sub_count;
 	int shared_sub_count;
@@ -295,6 +331,9 @@ struct mosquitto {
 #  endif
 	bool ws_want_write;
 	bool assigned_id;
+#  ifdef WITH_GRAPH
+	uint64_t graph_id; /* Id of this connection in the network graph, 0 if none */
+#  endif
 #else
 #  ifdef WITH_SOCKS
 	char *socks5_host;
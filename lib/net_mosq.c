@@ -67,6 +67,7 @@ Contributors:
 #include "memory_mosq.h"
 #include "mqtt_protocol.h"
 #include "net_mosq.h"
+#include "packet_mosq.h"
 #include "time_mosq.h"
 #include "util_mosq.h"
 
@@ -234,6 +235,7 @@ int net__socket_close(struct mosquitto *mosq)
 	}
 
 #ifdef WITH_BROKER
+	packet__read_buf_free(mosq);
 	if(mosq->listener){
 		mosq->listener->client_count--;
 	}
@@ -979,6 +981,22 @@ ssize_t net__write(struct mosquitto *mosq, void *buf, size_t count)
 }
 
 
+#if defined(WITH_BROKER) && !defined(WIN32)
+/* Write several buffers with one call. Only for plain sockets, TLS
+ * connections must go through net__write(). */
+ssize_t net__writev(struct mosquitto *mosq, const struct iovec *iov, int iovcnt)
+{
+	assert(mosq);
+#ifdef WITH_TLS
+	assert(!mosq->ssl);
+#endif
+
+	errno = 0;
+	return writev(mosq->sock, iov, iovcnt);
+}
+#endif
+
+
 int net__socket_nonblock(mosq_sock_t *sock)
 {
 #ifndef WIN32
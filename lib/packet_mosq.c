@@ -84,6 +84,29 @@ int packet__alloc(struct mosquitto__packet *packet)
 	return MOSQ_ERR_SUCCESS;
 }
 
+#ifdef WITH_BROKER
+static struct mosquitto__pool packet_pool = MEMORY_POOL_INIT("packet", sizeof(struct mosquitto__packet));
+#endif
+
+/* Returns a zeroed packet, to be freed with packet__free() */
+struct mosquitto__packet *packet__new(void)
+{
+#ifdef WITH_BROKER
+	return memory__pool_alloc(&packet_pool);
+#else
+	return mosquitto__calloc(1, sizeof(struct mosquitto__packet));
+#endif
+}
+
+void packet__free(struct mosquitto__packet *packet)
+{
+#ifdef WITH_BROKER
+	memory__pool_free(&packet_pool, packet);
+#else
+	mosquitto__free(packet);
+#endif
+}
+
 void packet__cleanup(struct mosquitto__packet *packet)
 {
 	if(!packet) return;
@@ -93,13 +116,36 @@ void packet__cleanup(struct mosquitto__packet *packet)
 	packet->remaining_count = 0;
 	packet->remaining_mult = 1;
 	packet->remaining_length = 0;
-	mosquitto__free(packet->payload);
+	if(packet->shared){
+		packet__buffer_release(packet->shared);
+		packet->shared = NULL;
+	}else{
+		mosquitto__free(packet->payload);
+	}
 	packet->payload = NULL;
+#ifdef WITH_BROKER
+	if(packet->store){
+		db__msg_store_ref_dec(mosquitto__get_db(), &packet->store);
+		packet->store = NULL;
+		packet->payload_ext = NULL;
+	}
+#endif
 	packet->to_process = 0;
 	packet->pos = 0;
 }
 
 
+void packet__buffer_release(struct mosquitto__packet_buffer *buffer)
+{
+	if(!buffer) return;
+
+	buffer->ref_count--;
+	if(buffer->ref_count == 0){
+		mosquitto__free(buffer);
+	}
+}
+
+
 void packet__cleanup_all(struct mosquitto *mosq)
 {
 	struct mosquitto__packet *packet;
@@ -121,7 +167,7 @@ void packet__cleanup_all(struct mosquitto *mosq)
 		}
 
 		packet__cleanup(packet);
-		mosquitto__free(packet);
+		packet__free(packet);
 	}
 
 	packet__cleanup(&mosq->in_packet);
@@ -156,12 +202,14 @@ int packet__queue(struct mosquitto *mosq, struct mosquitto__packet *packet)
 	if(mosq->wsi){
 		libwebsocket_callback_on_writable(mosq->ws_context, mosq->wsi);
 		return MOSQ_ERR_SUCCESS;
-	}else{
-		return packet__write(mosq);
 	}
-#  else
-	return packet__write(mosq);
 #  endif
+	if(mosq->current_out_packet){
+		/* The socket was full last time, the main loop will write this
+		 * together with the rest of the queue once it can take more. */
+		return MOSQ_ERR_SUCCESS;
+	}
+	return packet__write(mosq);
 #else
 
 	/* Write a single byte to sockpairW (connected to sockpairR) to break out
@@ -199,11 +247,111 @@ int packet__check_oversize(struct mosquitto *mosq, uint32_t remaining_length)
 }
 
 
+#ifdef WITH_BROKER
+/* Returns the next run of packet's unwritten bytes that is contiguous in
+ * memory, which is all of them unless it is sent partly from a stored
+ * message. */
+static uint8_t *packet__write_span(struct mosquitto__packet *packet, uint32_t *len)
+{
+	if(packet->payload_ext){
+		if(packet->pos < packet->header_length){
+			*len = packet->header_length - packet->pos;
+			return &(packet->payload[packet->pos]);
+		}else{
+			*len = packet->to_process;
+			return (uint8_t *)&(packet->payload_ext[packet->pos - packet->header_length]);
+		}
+	}
+	*len = packet->to_process;
+	return &(packet->payload[packet->pos]);
+}
+#endif
+
+
+#if defined(WITH_BROKER) && !defined(WIN32)
+/* Adds the unwritten parts of packet to iov, taking up to two entries. */
+static int packet__write_iov(struct iovec *iov, int count, struct mosquitto__packet *packet)
+{
+	uint32_t len;
+
+	if(packet->to_process == 0) return count;
+
+	iov[count].iov_base = packet__write_span(packet, &len);
+	iov[count].iov_len = len;
+	count++;
+	if(len < packet->to_process){
+		iov[count].iov_base = (void *)packet->payload_ext;
+		iov[count].iov_len = packet->to_process - len;
+		count++;
+	}
+	return count;
+}
+
+
+/* Write what is left of packet and as many of the packets queued behind it
+ * as fit in one writev() call. */
+static ssize_t packet__write_gather(struct mosquitto *mosq, struct mosquitto__packet *packet)
+{
+	struct iovec iov[PACKET_WRITE_IOV_MAX];
+	struct mosquitto__packet *next;
+	int count = 0;
+#ifdef WITH_TLS
+	uint8_t *buf;
+	uint32_t len;
+
+	if(mosq->ssl){
+		buf = packet__write_span(packet, &len);
+		return net__write(mosq, buf, len);
+	}
+#endif
+
+	count = packet__write_iov(iov, count, packet);
+
+	pthread_mutex_lock(&mosq->out_packet_mutex);
+	for(next=mosq->out_packet; next && count<PACKET_WRITE_IOV_MAX-1; next=next->next){
+		count = packet__write_iov(iov, count, next);
+	}
+	pthread_mutex_unlock(&mosq->out_packet_mutex);
+
+	if(count == 1){
+		return net__write(mosq, iov[0].iov_base, iov[0].iov_len);
+	}
+	return net__writev(mosq, iov, count);
+}
+
+
+/* Account write_length bytes to packet and then to the packets queued
+ * behind it. */
+static void packet__write_advance(struct mosquitto *mosq, struct mosquitto__packet *packet, uint32_t write_length)
+{
+	uint32_t len;
+
+	len = write_length < packet->to_process ? write_length : packet->to_process;
+	packet->to_process -= len;
+	packet->pos += len;
+	write_length -= len;
+
+	pthread_mutex_lock(&mosq->out_packet_mutex);
+	for(packet=mosq->out_packet; packet && write_length > 0; packet=packet->next){
+		len = write_length < packet->to_process ? write_length : packet->to_process;
+		packet->to_process -= len;
+		packet->pos += len;
+		write_length -= len;
+	}
+	pthread_mutex_unlock(&mosq->out_packet_mutex);
+}
+#endif
+
+
 int packet__write(struct mosquitto *mosq)
 {
 	ssize_t write_length;
 	struct mosquitto__packet *packet;
 	int state;
+#if defined(WITH_BROKER) && defined(WIN32)
+	uint8_t *buf;
+	uint32_t len;
+#endif
 
 	if(!mosq) return MOSQ_ERR_INVAL;
 	if(mosq->sock == INVALID_SOCKET) return MOSQ_ERR_NO_CONN;
@@ -233,11 +381,22 @@ int packet__write(struct mosquitto *mosq)
 		packet = mosq->current_out_packet;
 
 		while(packet->to_process > 0){
+#if defined(WITH_BROKER) && !defined(WIN32)
+			write_length = packet__write_gather(mosq, packet);
+#elif defined(WITH_BROKER)
+			buf = packet__write_span(packet, &len);
+			write_length = net__write(mosq, buf, len);
+#else
 			write_length = net__write(mosq, &(packet->payload[packet->pos]), packet->to_process);
+#endif
 			if(write_length > 0){
 				G_BYTES_SENT_INC(write_length);
+#if defined(WITH_BROKER) && !defined(WIN32)
+				packet__write_advance(mosq, packet, write_length);
+#else
 				packet->to_process -= write_length;
 				packet->pos += write_length;
+#endif
 			}else{
 #ifdef WIN32
 				errno = WSAGetLastError();
@@ -282,7 +441,7 @@ int packet__write(struct mosquitto *mosq)
 		}else if(((packet->command)&0xF0) == CMD_DISCONNECT){
 			do_client_disconnect(mosq, MOSQ_ERR_SUCCESS, NULL);
 			packet__cleanup(packet);
-			mosquitto__free(packet);
+			packet__free(packet);
 			return MOSQ_ERR_SUCCESS;
 #endif
 		}else if(((packet->command)&0xF0) == CMD_PUBLISH){
@@ -301,7 +460,7 @@ int packet__write(struct mosquitto *mosq)
 		pthread_mutex_unlock(&mosq->out_packet_mutex);
 
 		packet__cleanup(packet);
-		mosquitto__free(packet);
+		packet__free(packet);
 
 		pthread_mutex_lock(&mosq->msgtime_mutex);
 		mosq->next_msg_out = mosquitto_time() + mosq->keepalive;
@@ -313,7 +472,63 @@ int packet__write(struct mosquitto *mosq)
 
 
 #ifdef WITH_BROKER
-int packet__read(struct mosquitto_db *db, struct mosquitto *mosq)
+/* Reads incoming data through mosq->in_buf, so that a client sending many
+ * small packets costs one net__read() per buffer full rather than several per
+ * packet. Returns the same as net__read(). */
+static ssize_t packet__recv(struct mosquitto *mosq, void *buf, size_t count)
+{
+	ssize_t len;
+
+	if(mosq->in_buf_pos == mosq->in_buf_len){
+		if(count >= PACKET_READ_BUF_SIZE){
+			/* Nothing to gain from copying large payloads twice */
+			return net__read(mosq, buf, count);
+		}
+		if(mosq->in_buf && mosq->in_buf->ref_count > 1){
+			/* Still in use by a packet that was handled in place */
+			packet__buffer_release(mosq->in_buf);
+			mosq->in_buf = NULL;
+		}
+		if(!mosq->in_buf){
+			mosq->in_buf = mosquitto__malloc(sizeof(struct mosquitto__packet_buffer) + PACKET_READ_BUF_SIZE);
+			if(!mosq->in_buf){
+				errno = ENOMEM;
+				return -1;
+			}
+			mosq->in_buf->ref_count = 1;
+		}
+		mosq->in_buf_pos = 0;
+		mosq->in_buf_len = 0;
+		len = net__read(mosq, mosq->in_buf->payload, PACKET_READ_BUF_SIZE);
+		if(len <= 0){
+			return len;
+		}
+		mosq->in_buf_len = (uint32_t)len;
+	}
+
+	if(count > mosq->in_buf_len - mosq->in_buf_pos){
+		count = mosq->in_buf_len - mosq->in_buf_pos;
+	}
+	memcpy(buf, &mosq->in_buf->payload[mosq->in_buf_pos], count);
+	mosq->in_buf_pos += (uint32_t)count;
+	return (ssize_t)count;
+}
+
+
+void packet__read_buf_free(struct mosquitto *mosq)
+{
+	packet__buffer_release(mosq->in_buf);
+	mosq->in_buf = NULL;
+	mosq->in_buf_pos = 0;
+	mosq->in_buf_len = 0;
+}
+#else
+#  define packet__recv(A, B, C) net__read((A), (B), (C))
+#endif
+
+
+#ifdef WITH_BROKER
+static int packet__read_one(struct mosquitto_db *db, struct mosquitto *mosq)
 #else
 int packet__read(struct mosquitto *mosq)
 #endif
@@ -350,7 +565,7 @@ int packet__read(struct mosquitto *mosq)
 	 * Finally, free the memory and reset everything to starting conditions.
 	 */
 	if(!mosq->in_packet.command){
-		read_length = net__read(mosq, &byte, 1);
+		read_length = packet__recv(mosq, &byte, 1);
 		if(read_length == 1){
 			mosq->in_packet.command = byte;
 #ifdef WITH_BROKER
@@ -390,7 +605,7 @@ int packet__read(struct mosquitto *mosq)
 	 */
 	if(mosq->in_packet.remaining_count <= 0){
 		do{
-			read_length = net__read(mosq, &byte, 1);
+			read_length = packet__recv(mosq, &byte, 1);
 			if(read_length == 1){
 				mosq->in_packet.remaining_count--;
 				/* Max 4 bytes length for remaining length as defined by protocol.
@@ -438,15 +653,28 @@ int packet__read(struct mosquitto *mosq)
 		// FIXME - client case for incoming message received from broker too large
 #endif
 		if(mosq->in_packet.remaining_length > 0){
-			mosq->in_packet.payload = mosquitto__malloc(mosq->in_packet.remaining_length*sizeof(uint8_t));
-			if(!mosq->in_packet.payload){
-				return MOSQ_ERR_NOMEM;
+#ifdef WITH_BROKER
+			if(mosq->in_buf_len - mosq->in_buf_pos >= mosq->in_packet.remaining_length){
+				/* The whole packet has already been read, so handle it where
+				 * it is rather than copying it out of the buffer. */
+				mosq->in_packet.payload = &mosq->in_buf->payload[mosq->in_buf_pos];
+				mosq->in_packet.shared = mosq->in_buf;
+				mosq->in_buf->ref_count++;
+				mosq->in_buf_pos += mosq->in_packet.remaining_length;
+				G_BYTES_RECEIVED_INC(mosq->in_packet.remaining_length);
+			}else
+#endif
+			{
+				mosq->in_packet.payload = mosquitto__malloc(mosq->in_packet.remaining_length*sizeof(uint8_t));
+				if(!mosq->in_packet.payload){
+					return MOSQ_ERR_NOMEM;
+				}
+				mosq->in_packet.to_process = mosq->in_packet.remaining_length;
 			}
-			mosq->in_packet.to_process = mosq->in_packet.remaining_length;
 		}
 	}
 	while(mosq->in_packet.to_process>0){
-		read_length = net__read(mosq, &(mosq->in_packet.payload[mosq->in_packet.pos]), mosq->in_packet.to_process);
+		read_length = packet__recv(mosq, &(mosq->in_packet.payload[mosq->in_packet.pos]), mosq->in_packet.to_process);
 		if(read_length > 0){
 			G_BYTES_RECEIVED_INC(read_length);
 			mosq->in_packet.to_process -= read_length;
@@ -498,3 +726,26 @@ int packet__read(struct mosquitto *mosq)
 	pthread_mutex_unlock(&mosq->msgtime_mutex);
 	return rc;
 }
+
+
+#ifdef WITH_BROKER
+int packet__read(struct mosquitto_db *db, struct mosquitto *mosq)
+{
+	int rc;
+
+	/* Handle every complete packet that the last read brought in before going
+	 * back to the socket. */
+	do{
+		rc = packet__read_one(db, mosq);
+	}while(rc == MOSQ_ERR_SUCCESS
+			&& mosq->sock != INVALID_SOCKET
+			&& mosq->in_buf_pos < mosq->in_buf_len
+			&& mosquitto__get_state(mosq) != mosq_cs_connect_pending);
+
+	if(mosq->in_buf_pos == mosq->in_buf_len){
+		/* Idle clients don't keep a buffer */
+		packet__read_buf_free(mosq);
+	}
+	return rc;
+}
+#endif
@@ -23,9 +23,22 @@ Contributors:
 struct mosquitto_db;
 #endif
 
+/* Most queued packets that are written with one call */
+#define PACKET_WRITE_IOV_MAX 64
+
+/* Size of the buffer that incoming data is read into in one call */
+#define PACKET_READ_BUF_SIZE 16384
+
+/* Stored payloads of at least this many bytes are sent to each client from
+ * the stored message rather than copied into the packet */
+#define PACKET_PAYLOAD_SHARE_MIN 1024
+
 int packet__alloc(struct mosquitto__packet *packet);
+struct mosquitto__packet *packet__new(void);
+void packet__free(struct mosquitto__packet *packet);
 void packet__cleanup(struct mosquitto__packet *packet);
 void packet__cleanup_all(struct mosquitto *mosq);
+void packet__buffer_release(struct mosquitto__packet_buffer *buffer);
 int packet__queue(struct mosquitto *mosq, struct mosquitto__packet *packet);
 
 int packet__check_oversize(struct mosquitto *mosq, uint32_t remaining_length);
@@ -50,6 +63,7 @@ int packet__varint_bytes(int32_t word);
 int packet__write(struct mosquitto *mosq);
 #ifdef WITH_BROKER
 int packet__read(struct mosquitto_db *db, struct mosquitto *mosq);
+void packet__read_buf_free(struct mosquitto *mosq);
 #else
 int packet__read(struct mosquitto *mosq);
 #endif
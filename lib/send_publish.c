@@ -128,7 +128,7 @@ int send__publish(struct mosquitto *mosq, uint16_t mid, const char *topic, uint3
 }
 
 
-int send__real_publish(struct mosquitto *mosq, uint16_t mid, const char *topic, uint32_t payloadlen, const void *payload, int qos, bool retain, bool dup, const mosquitto_property *cmsg_props, const mosquitto_property *store_props, uint32_t expiry_interval)
+static int send__publish_packet(struct mosquitto *mosq, uint16_t mid, const char *topic, uint32_t payloadlen, const void *payload, int qos, bool retain, bool dup, const mosquitto_property *cmsg_props, const mosquitto_property *store_props, uint32_t expiry_interval, struct mosquitto__packet **packet_out)
 {
 	struct mosquitto__packet *packet = NULL;
 	int packetlen;
@@ -176,7 +176,7 @@ int send__real_publish(struct mosquitto *mosq, uint16_t mid, const char *topic,
 		return MOSQ_ERR_OVERSIZE_PACKET;
 	}
 
-	packet = mosquitto__calloc(1, sizeof(struct mosquitto__packet));
+	packet = packet__new();
 	if(!packet) return MOSQ_ERR_NOMEM;
 
 	packet->mid = mid;
@@ -184,7 +184,7 @@ int send__real_publish(struct mosquitto *mosq, uint16_t mid, const char *topic,
 	packet->remaining_length = packetlen;
 	rc = packet__alloc(packet);
 	if(rc){
-		mosquitto__free(packet);
+		packet__free(packet);
 		return rc;
 	}
 	/* Variable header (topic string) */
@@ -211,5 +211,176 @@ int send__real_publish(struct mosquitto *mosq, uint16_t mid, const char *topic,
 		packet__write_bytes(packet, payload, payloadlen);
 	}
 
+	*packet_out = packet;
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+int send__real_publish(struct mosquitto *mosq, uint16_t mid, const char *topic, uint32_t payloadlen, const void *payload, int qos, bool retain, bool dup, const mosquitto_property *cmsg_props, const mosquitto_property *store_props, uint32_t expiry_interval)
+{
+	struct mosquitto__packet *packet = NULL;
+	int rc;
+
+	rc = send__publish_packet(mosq, mid, topic, payloadlen, payload, qos, retain, dup, cmsg_props, store_props, expiry_interval, &packet);
+	if(rc) return rc;
+
+	return packet__queue(mosq, packet);
+}
+
+
+
+#ifdef WITH_BROKER
+/* Serialise stored for clients like mosq, with a zero mid and no dup flag,
+ * and keep it with the stored message. Payloads of PACKET_PAYLOAD_SHARE_MIN
+ * bytes or more are left out, to be sent from the stored message. */
+static int send__publish_buffer(struct mosquitto *mosq, struct mosquitto_msg_store *stored, int qos, bool retain, struct mosquitto__packet_buffer **buffer_out)
+{
+	struct mosquitto__packet *packet = NULL;
+	struct mosquitto__packet header;
+	struct mosquitto__packet_buffer *buffer;
+	uint32_t remaining_length, header_length, payload_copy;
+	int rc;
+
+	/* The variable header alone, its fixed header is rewritten below with
+	 * the payload length included. */
+	rc = send__publish_packet(mosq, 0, stored->topic, 0, NULL, qos, retain, false, NULL, stored->properties, 0, &packet);
+	if(rc) return rc;
+
+	remaining_length = packet->remaining_length + stored->payloadlen;
+	if(packet__varint_bytes(remaining_length) > 4){
+		rc = MOSQ_ERR_PAYLOAD_SIZE;
+		goto cleanup;
+	}
+	if(packet__check_oversize(mosq, remaining_length)){
+		log__printf(NULL, MOSQ_LOG_NOTICE, "Dropping too large outgoing PUBLISH for %s (%d bytes)", mosq->id, remaining_length);
+		rc = MOSQ_ERR_OVERSIZE_PACKET;
+		goto cleanup;
+	}
+
+	payload_copy = stored->payloadlen < PACKET_PAYLOAD_SHARE_MIN ? stored->payloadlen : 0;
+	header_length = 1 + packet__varint_bytes(remaining_length) + packet->remaining_length;
+
+	buffer = mosquitto__malloc(sizeof(struct mosquitto__packet_buffer) + header_length + payload_copy);
+	if(!buffer){
+		rc = MOSQ_ERR_NOMEM;
+		goto cleanup;
+	}
+
+	memset(&header, 0, sizeof(header));
+	header.payload = buffer->payload;
+	header.packet_length = header_length + payload_copy;
+	packet__write_byte(&header, packet->command);
+	packet__write_varint(&header, remaining_length);
+	buffer->remaining_count = header.pos - 1;
+	buffer->mid_pos = header.pos + 2 + (stored->topic?strlen(stored->topic):0);
+	packet__write_bytes(&header, &packet->payload[1 + packet->remaining_count], packet->remaining_length);
+	if(payload_copy){
+		packet__write_bytes(&header, UHPA_ACCESS_PAYLOAD(stored), payload_copy);
+	}
+
+	buffer->remaining_length = remaining_length;
+	buffer->packet_length = 1 + buffer->remaining_count + remaining_length;
+	buffer->header_length = header_length + payload_copy;
+	buffer->command = packet->command;
+	buffer->mqtt5 = (mosq->protocol == mosq_p_mqtt5);
+	buffer->ref_count = 1;
+
+	buffer->next = stored->packets;
+	stored->packets = buffer;
+
+	*buffer_out = buffer;
+cleanup:
+	packet__cleanup(packet);
+	packet__free(packet);
+	return rc;
+}
+
+
+/* Send a stored message, serialising it once for every combination of qos,
+ * retain flag and protocol that it goes out with. QoS 0 packets are sent
+ * straight from the shared buffer, QoS 1 and 2 packets copy its headers to
+ * set their own mid and dup flag. Large payloads are not copied at all. */
+int send__publish_stored(struct mosquitto *mosq, uint16_t mid, struct mosquitto_msg_store *stored, int qos, bool retain, bool dup, const mosquitto_property *cmsg_props, uint32_t expiry_interval)
+{
+	struct mosquitto__packet_buffer *buffer;
+	struct mosquitto__packet *packet;
+	bool mqtt5;
+	uint8_t command;
+	int rc;
+
+	assert(mosq);
+	assert(stored);
+
+	mqtt5 = (mosq->protocol == mosq_p_mqtt5);
+
+	/* Subscription identifiers and the remaining expiry interval belong to
+	 * this one delivery, mount points and bridge remapping change the topic,
+	 * and websockets write into the packet buffer. */
+	if(cmsg_props || (mqtt5 && expiry_interval > 0)
+			|| (mosq->listener && mosq->listener->mount_point)
+#ifdef WITH_BRIDGE
+			|| mosq->bridge
+#endif
+#ifdef WITH_WEBSOCKETS
+			|| mosq->wsi
+#endif
+			){
+
+		return send__publish(mosq, mid, stored->topic, stored->payloadlen, UHPA_ACCESS_PAYLOAD(stored), qos, retain, dup, cmsg_props, stored->properties, expiry_interval);
+	}
+
+	if(mosq->sock == INVALID_SOCKET) return MOSQ_ERR_NO_CONN;
+
+	command = CMD_PUBLISH | (qos<<1) | retain;
+	for(buffer=stored->packets; buffer; buffer=buffer->next){
+		if(buffer->command == command && buffer->mqtt5 == mqtt5){
+			break;
+		}
+	}
+	if(buffer){
+		if(packet__check_oversize(mosq, buffer->remaining_length)){
+			log__printf(NULL, MOSQ_LOG_NOTICE, "Dropping too large outgoing PUBLISH for %s (%d bytes)", mosq->id, buffer->remaining_length);
+			return MOSQ_ERR_OVERSIZE_PACKET;
+		}
+	}else{
+		rc = send__publish_buffer(mosq, stored, qos, retain, &buffer);
+		if(rc) return rc;
+	}
+
+	log__printf(NULL, MOSQ_LOG_DEBUG, "Sending PUBLISH to %s (d%d, q%d, r%d, m%d, '%s', ... (%ld bytes))", mosq->id, dup, qos, retain, mid, stored->topic, (long)stored->payloadlen);
+	G_PUB_BYTES_SENT_INC(stored->payloadlen);
+
+	packet = packet__new();
+	if(!packet) return MOSQ_ERR_NOMEM;
+
+	packet->mid = mid;
+	packet->remaining_length = buffer->remaining_length;
+	packet->remaining_count = buffer->remaining_count;
+	packet->packet_length = buffer->packet_length;
+	if(qos == 0){
+		packet->command = buffer->command;
+		packet->payload = buffer->payload;
+		packet->shared = buffer;
+		buffer->ref_count++;
+	}else{
+		packet->command = buffer->command | ((dup&0x1)<<3);
+		packet->payload = mosquitto__malloc(buffer->header_length);
+		if(!packet->payload){
+			packet__free(packet);
+			return MOSQ_ERR_NOMEM;
+		}
+		memcpy(packet->payload, buffer->payload, buffer->header_length);
+		packet->payload[0] = packet->command;
+		packet->payload[buffer->mid_pos] = MOSQ_MSB(mid);
+		packet->payload[buffer->mid_pos+1] = MOSQ_LSB(mid);
+	}
+	if(buffer->header_length < buffer->packet_length){
+		packet->header_length = buffer->header_length;
+		packet->payload_ext = UHPA_ACCESS_PAYLOAD(stored);
+		packet->store = stored;
+		db__msg_store_ref_inc(stored);
+	}
+
 	return packet__queue(mosq, packet);
 }
+#endif
@@ -119,7 +119,7 @@ int socks5__send(struct mosquitto *mosq)
 	state = mosquitto__get_state(mosq);
 
 	if(state == mosq_cs_socks5_new){
-		packet = mosquitto__calloc(1, sizeof(struct mosquitto__packet));
+		packet = packet__new();
 		if(!packet) return MOSQ_ERR_NOMEM;
 
 		if(mosq->socks5_username){
@@ -147,13 +147,13 @@ int socks5__send(struct mosquitto *mosq)
 		mosq->in_packet.payload = mosquitto__malloc(sizeof(uint8_t)*2);
 		if(!mosq->in_packet.payload){
 			mosquitto__free(packet->payload);
-			mosquitto__free(packet);
+			packet__free(packet);
 			return MOSQ_ERR_NOMEM;
 		}
 
 		return packet__queue(mosq, packet);
 	}else if(state == mosq_cs_socks5_auth_ok){
-		packet = mosquitto__calloc(1, sizeof(struct mosquitto__packet));
+		packet = packet__new();
 		if(!packet) return MOSQ_ERR_NOMEM;
 
 		ipv4_pton_result = inet_pton(AF_INET, mosq->host, &addr_ipv4);
@@ -163,7 +163,7 @@ int socks5__send(struct mosquitto *mosq)
 			packet->packet_length = 10;
 			packet->payload = mosquitto__malloc(sizeof(uint8_t)*packet->packet_length);
 			if(!packet->payload){
-				mosquitto__free(packet);
+				packet__free(packet);
 				return MOSQ_ERR_NOMEM;
 			}
 			packet->payload[3] = SOCKS_ATYPE_IP_V4;
@@ -175,7 +175,7 @@ int socks5__send(struct mosquitto *mosq)
 			packet->packet_length = 22;
 			packet->payload = mosquitto__malloc(sizeof(uint8_t)*packet->packet_length);
 			if(!packet->payload){
-				mosquitto__free(packet);
+				packet__free(packet);
 				return MOSQ_ERR_NOMEM;
 			}
 			packet->payload[3] = SOCKS_ATYPE_IP_V6;
@@ -186,13 +186,13 @@ int socks5__send(struct mosquitto *mosq)
 		}else{
 			slen = strlen(mosq->host);
 			if(slen > UCHAR_MAX){
-				mosquitto__free(packet);
+				packet__free(packet);
 				return MOSQ_ERR_NOMEM;
 			}
 			packet->packet_length = 7 + slen;
 			packet->payload = mosquitto__malloc(sizeof(uint8_t)*packet->packet_length);
 			if(!packet->payload){
-				mosquitto__free(packet);
+				packet__free(packet);
 				return MOSQ_ERR_NOMEM;
 			}
 			packet->payload[3] = SOCKS_ATYPE_DOMAINNAME;
@@ -213,13 +213,13 @@ int socks5__send(struct mosquitto *mosq)
 		mosq->in_packet.payload = mosquitto__malloc(sizeof(uint8_t)*5);
 		if(!mosq->in_packet.payload){
 			mosquitto__free(packet->payload);
-			mosquitto__free(packet);
+			packet__free(packet);
 			return MOSQ_ERR_NOMEM;
 		}
 
 		return packet__queue(mosq, packet);
 	}else if(state == mosq_cs_socks5_send_userpass){
-		packet = mosquitto__calloc(1, sizeof(struct mosquitto__packet));
+		packet = packet__new();
 		if(!packet) return MOSQ_ERR_NOMEM;
 
 		ulen = strlen(mosq->socks5_username);
@@ -242,7 +242,7 @@ int socks5__send(struct mosquitto *mosq)
 		mosq->in_packet.payload = mosquitto__malloc(sizeof(uint8_t)*2);
 		if(!mosq->in_packet.payload){
 			mosquitto__free(packet->payload);
-			mosquitto__free(packet);
+			packet__free(packet);
 			return MOSQ_ERR_NOMEM;
 		}
 
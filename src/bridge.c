@@ -406,7 +406,9 @@ int bridge__connect(struct mosquitto_db *db, struct mosquitto *context)
 
 	HASH_ADD(hh_sock, db->contexts_by_sock, sock, sizeof(context->sock), context);
 
+#ifdef WITH_GRAPH
 	network_graph_add_client(context);
+#endif
 
 	rc2 = send__connect(context, context->keepalive, context->clean_start, NULL);
 	if(rc2 == MOSQ_ERR_SUCCESS){
@@ -437,14 +439,14 @@ void bridge__packet_cleanup(struct mosquitto *context)
 
 	if(context->current_out_packet){
 		packet__cleanup(context->current_out_packet);
-		mosquitto__free(context->current_out_packet);
+		packet__free(context->current_out_packet);
 		context->current_out_packet = NULL;
 	}
     while(context->out_packet){
 		packet__cleanup(context->out_packet);
 		packet = context->out_packet;
 		context->out_packet = context->out_packet->next;
-		mosquitto__free(packet);
+		packet__free(packet);
 	}
 	context->out_packet = NULL;
 	context->out_packet_last = NULL;
@@ -154,6 +154,7 @@ static void config__init_reload(struct mosquitto_db *db, struct mosquitto__confi
 	config->security_options.psk_file = NULL;
 
 	config->autosave_interval = 1800;
+	config->autosave_background = false;
 	config->autosave_on_changes = false;
 	mosquitto__free(config->clientid_prefixes);
 	config->connection_messages = true;
@@ -195,14 +196,20 @@ static void config__init_reload(struct mosquitto_db *db, struct mosquitto__confi
 	config->persistence_location = NULL;
 	mosquitto__free(config->persistence_file);
 	config->persistence_file = NULL;
+	config->persistence_log = false;
 	config->persistent_client_expiration = 0;
 	config->queue_qos0_messages = false;
 	config->retain_available = true;
+	config->retained_cache_size = 0;
+	config->retained_delivery_batch = 0;
 	config->set_tcp_nodelay = false;
 	config->sys_interval = 10;
 	config->upgrade_outgoing_qos = false;
 	config->graph_interval = 30;
 	config->graph_del_mult = 2;
+	config->graph_delta = false;
+	config->graph_keyframe_interval = 300;
+	config->graph_format = mosq_gf_json;
 
 	config__cleanup_plugins(config);
 }
@@ -548,6 +555,7 @@ void config__copy(struct mosquitto__config *src, struct mosquitto__config *dest)
 
 
 	dest->autosave_interval = src->autosave_interval;
+	dest->autosave_background = src->autosave_background;
 	dest->autosave_on_changes = src->autosave_on_changes;
 
 	mosquitto__free(dest->clientid_prefixes);
@@ -578,6 +586,7 @@ void config__copy(struct mosquitto__config *src, struct mosquitto__config *dest)
 	mosquitto__free(dest->persistence_filepath);
 	dest->persistence_filepath = src->persistence_filepath;
 
+	dest->persistence_log = src->persistence_log;
 	dest->persistent_client_expiration = src->persistent_client_expiration;
 
 
@@ -585,6 +594,9 @@ void config__copy(struct mosquitto__config *src, struct mosquitto__config *dest)
 	dest->sys_interval = src->sys_interval;
 	dest->graph_interval = src->graph_interval;
 	dest->graph_del_mult = src->graph_del_mult;
+	dest->graph_delta = src->graph_delta;
+	dest->graph_keyframe_interval = src->graph_keyframe_interval;
+	dest->graph_format = src->graph_format;
 	dest->upgrade_outgoing_qos = src->upgrade_outgoing_qos;
 
 #ifdef WITH_WEBSOCKETS
@@ -1017,6 +1029,8 @@ int config__read_file_core(struct mosquitto__config *config, bool reload, struct
 				}else if(!strcmp(token, "autosave_interval")){
 					if(conf__parse_int(&token, "autosave_interval", &config->autosave_interval, saveptr)) return MOSQ_ERR_INVAL;
 					if(config->autosave_interval < 0) config->autosave_interval = 0;
+				}else if(!strcmp(token, "autosave_background")){
+					if(conf__parse_bool(&token, "autosave_background", &config->autosave_background, saveptr)) return MOSQ_ERR_INVAL;
 				}else if(!strcmp(token, "autosave_on_changes")){
 					if(conf__parse_bool(&token, "autosave_on_changes", &config->autosave_on_changes, saveptr)) return MOSQ_ERR_INVAL;
 				}else if(!strcmp(token, "bind_address")){
@@ -1777,6 +1791,8 @@ int config__read_file_core(struct mosquitto__config *config, bool reload, struct
 					if(conf__parse_bool(&token, token, &config->persistence, saveptr)) return MOSQ_ERR_INVAL;
 				}else if(!strcmp(token, "persistence_file")){
 					if(conf__parse_string(&token, "persistence_file", &config->persistence_file, saveptr)) return MOSQ_ERR_INVAL;
+				}else if(!strcmp(token, "persistence_log")){
+					if(conf__parse_bool(&token, token, &config->persistence_log, saveptr)) return MOSQ_ERR_INVAL;
 				}else if(!strcmp(token, "persistence_location")){
 					if(conf__parse_string(&token, "persistence_location", &config->persistence_location, saveptr)) return MOSQ_ERR_INVAL;
 				}else if(!strcmp(token, "persistent_client_expiration")){
@@ -1907,6 +1923,20 @@ int config__read_file_core(struct mosquitto__config *config, bool reload, struct
 #endif
 				}else if(!strcmp(token, "retain_available")){
 					if(conf__parse_bool(&token, token, &config->retain_available, saveptr)) return MOSQ_ERR_INVAL;
+				}else if(!strcmp(token, "retained_cache_size")){
+					ssize_t size;
+					if(conf__parse_ssize_t(&token, "retained_cache_size", &size, saveptr)) return MOSQ_ERR_INVAL;
+					if(size < 0){
+						log__printf(NULL, MOSQ_LOG_ERR, "Error: Invalid retained_cache_size value (%ld).", size);
+						return MOSQ_ERR_INVAL;
+					}
+					config->retained_cache_size = (size_t)size;
+				}else if(!strcmp(token, "retained_delivery_batch")){
+					if(conf__parse_int(&token, "retained_delivery_batch", &config->retained_delivery_batch, saveptr)) return MOSQ_ERR_INVAL;
+					if(config->retained_delivery_batch < 0){
+						log__printf(NULL, MOSQ_LOG_ERR, "Error: Invalid retained_delivery_batch value (%d).", config->retained_delivery_batch);
+						return MOSQ_ERR_INVAL;
+					}
 				}else if(!strcmp(token, "retry_interval")){
 					log__printf(NULL, MOSQ_LOG_WARNING, "Warning: The retry_interval option is no longer available.");
 				}else if(!strcmp(token, "round_robin")){
@@ -1988,6 +2018,29 @@ int config__read_file_core(struct mosquitto__config *config, bool reload, struct
 						log__printf(NULL, MOSQ_LOG_ERR, "Error: Invalid graph_del_mult value (%d).", config->graph_interval);
 						return MOSQ_ERR_INVAL;
 					}
+				}else if(!strcmp(token, "graph_delta")){
+					if(conf__parse_bool(&token, "graph_delta", &config->graph_delta, saveptr)) return MOSQ_ERR_INVAL;
+				}else if(!strcmp(token, "graph_keyframe_interval")){
+					if(conf__parse_int(&token, "graph_keyframe_interval", &config->graph_keyframe_interval, saveptr)) return MOSQ_ERR_INVAL;
+					if(config->graph_keyframe_interval < 0 || config->graph_keyframe_interval > 65535){
+						log__printf(NULL, MOSQ_LOG_ERR, "Error: Invalid graph_keyframe_interval value (%d).", config->graph_keyframe_interval);
+						return MOSQ_ERR_INVAL;
+					}
+				}else if(!strcmp(token, "graph_format")){
+					token = strtok_r(NULL, " ", &saveptr);
+					if(token){
+						if(!strcmp(token, "json")){
+							config->graph_format = mosq_gf_json;
+						}else if(!strcmp(token, "binary")){
+							config->graph_format = mosq_gf_binary;
+						}else{
+							log__printf(NULL, MOSQ_LOG_ERR, "Error: Invalid graph_format value (%s).", token);
+							return MOSQ_ERR_INVAL;
+						}
+					}else{
+						log__printf(NULL, MOSQ_LOG_ERR, "Error: Empty graph_format value in configuration.");
+						return MOSQ_ERR_INVAL;
+					}
 				}else if(!strcmp(token, "threshold")){
 #ifdef WITH_BRIDGE
 					if(reload) continue; /* FIXME */
@@ -27,6 +27,7 @@ Contributors:
 #include "time_mosq.h"
 #include "util_mosq.h"
 #include "will_mosq.h"
+#include "network_graph.h"
 
 #include "uthash.h"
 
@@ -52,6 +53,9 @@ struct mosquitto *context__init(struct mosquitto_db *db, mosq_sock_t sock)
 	context->password = NULL;
 	context->listener = NULL;
 	context->acl_list = NULL;
+	context->acl_cache = NULL;
+	context->acl_patterns = NULL;
+	context->acl_patterns_expanded = false;
 
 	/* is_bridge records whether this client is a bridge or not. This could be
 	 * done by looking at context->bridge for bridges that we create ourself,
@@ -150,17 +154,27 @@ void context__cleanup(struct mosquitto_db *db, struct mosquitto *context, bool d
 
 	alias__free_all(context);
 
+#ifdef WITH_GRAPH
+	if(context->graph_id){
+		network_graph_delete_client(context);
+	}
+#endif
+
 	mosquitto__free(context->auth_method);
 	context->auth_method = NULL;
 
 	mosquitto__free(context->username);
 	context->username = NULL;
 
+	acl__cache_free(context);
+	acl__patterns_free(context);
+
 	mosquitto__free(context->password);
 	context->password = NULL;
 
 	net__socket_close(db, context);
 	if(do_free || context->clean_start){
+		sub__retain_queue_free(db, context, NULL);
 		sub__clean_session(db, context);
 		db__messages_delete(db, context);
 	}
@@ -178,14 +192,14 @@ void context__cleanup(struct mosquitto_db *db, struct mosquitto *context, bool d
 	packet__cleanup(&(context->in_packet));
 	if(context->current_out_packet){
 		packet__cleanup(context->current_out_packet);
-		mosquitto__free(context->current_out_packet);
+		packet__free(context->current_out_packet);
 		context->current_out_packet = NULL;
 	}
 	while(context->out_packet){
 		packet__cleanup(context->out_packet);
 		packet = context->out_packet;
 		context->out_packet = context->out_packet->next;
-		mosquitto__free(packet);
+		packet__free(packet);
 	}
 	if(do_free || context->clean_start){
 		db__messages_delete(db, context);
@@ -257,6 +271,10 @@ void context__disconnect(struct mosquitto_db *db, struct mosquitto *context)
 		}
 	}else{
 		session_expiry__add(db, context);
+#ifdef WITH_PERSISTENCE
+		/* Records the expiry time and last mid */
+		persist__log_client(db, context);
+#endif
 	}
 	mosquitto__set_state(context, mosq_cs_disconnected);
 }
@@ -268,6 +286,11 @@ void context__add_to_disused(struct mosquitto_db *db, struct mosquitto *context)
 	mosquitto__set_state(context, mosq_cs_disused);
 
 	if(context->id){
+#ifdef WITH_PERSISTENCE
+		if(context->clean_start == false){
+			persist__log_client_delete(db, context);
+		}
+#endif
 		context__remove_from_by_id(db, context);
 		mosquitto__free(context->id);
 		context->id = NULL;
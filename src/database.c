@@ -22,6 +22,7 @@ Contributors:
 
 #include "mosquitto_broker_internal.h"
 #include "memory_mosq.h"
+#include "packet_mosq.h"
 #include "send_mosq.h"
 #include "sys_tree.h"
 #include "time_mosq.h"
@@ -32,6 +33,9 @@ static unsigned long max_inflight_bytes = 0;
 static int max_queued = 100;
 static unsigned long max_queued_bytes = 0;
 
+static struct mosquitto__pool client_msg_pool = MEMORY_POOL_INIT("client_msg", sizeof(struct mosquitto_client_msg));
+static struct mosquitto__pool msg_store_pool = MEMORY_POOL_INIT("msg_store", sizeof(struct mosquitto_msg_store));
+
 /**
  * Is this context ready to take more in flight messages right now?
  * @param context the client context of interest
@@ -114,6 +118,7 @@ bool db__ready_for_queue(struct mosquitto *context, int qos, struct mosquitto_ms
 int db__open(struct mosquitto__config *config, struct mosquitto_db *db)
 {
 	struct mosquitto__subhier *subhier;
+	struct mosquitto__retainhier *retainhier;
 
 	if(!config || !db) return MOSQ_ERR_INVAL;
 
@@ -138,6 +143,14 @@ int db__open(struct mosquitto__config *config, struct mosquitto_db *db)
 	subhier = sub__add_hier_entry(NULL, &db->subs, "$SYS", strlen("$SYS"));
 	if(!subhier) return MOSQ_ERR_NOMEM;
 
+	db->retains = NULL;
+
+	retainhier = retain__add_hier_entry(NULL, &db->retains, "", strlen(""));
+	if(!retainhier) return MOSQ_ERR_NOMEM;
+
+	retainhier = retain__add_hier_entry(NULL, &db->retains, "$SYS", strlen("$SYS"));
+	if(!retainhier) return MOSQ_ERR_NOMEM;
+
 	db->unpwd = NULL;
 
 #ifdef WITH_PERSISTENCE
@@ -159,21 +172,43 @@ static void subhier_clean(struct mosquitto_db *db, struct mosquitto__subhier **s
 			mosquitto__free(leaf);
 			leaf = nextleaf;
 		}
+		subhier_clean(db, &peer->children);
+		mosquitto__free(peer->topic);
+
+		HASH_DELETE(hh, *subhier, peer);
+		mosquitto__free(peer);
+	}
+}
+
+static void retainhier_clean(struct mosquitto_db *db, struct mosquitto__retainhier **retainhier)
+{
+	struct mosquitto__retainhier *peer, *retainhier_tmp;
+
+	HASH_ITER(hh, *retainhier, peer, retainhier_tmp){
 		if(peer->retained){
 			db__msg_store_ref_dec(db, &peer->retained);
 		}
-		subhier_clean(db, &peer->children);
+		retainhier_clean(db, &peer->children);
 		mosquitto__free(peer->topic);
 
-		HASH_DELETE(hh, *subhier, peer);
+		HASH_DELETE(hh, *retainhier, peer);
 		mosquitto__free(peer);
 	}
 }
 
 int db__close(struct mosquitto_db *db)
 {
+#ifdef WITH_PERSISTENCE
+	/* Nothing freed from here on has been removed from the broker. */
+	persist__log_close(db);
+#endif
+	sub__cache_free(db);
 	subhier_clean(db, &db->subs);
+	retainhier_clean(db, &db->retains);
 	db__msg_store_clean(db);
+#ifdef WITH_PERSISTENCE
+	persist__map_close(db);
+#endif
 
 	return MOSQ_ERR_SUCCESS;
 }
@@ -192,6 +227,7 @@ void db__msg_store_add(struct mosquitto_db *db, struct mosquitto_msg_store *stor
 
 void db__msg_store_remove(struct mosquitto_db *db, struct mosquitto_msg_store *store)
 {
+	struct mosquitto__packet_buffer *buffer;
 	int i;
 
 	if(store->prev){
@@ -207,6 +243,10 @@ void db__msg_store_remove(struct mosquitto_db *db, struct mosquitto_msg_store *s
 	}
 	db->msg_store_count--;
 	db->msg_store_bytes -= store->payloadlen;
+#ifdef WITH_PERSISTENCE
+	persist__log_msg_store_delete(db, store);
+	persist__payload_free(db, store);
+#endif
 
 	mosquitto__free(store->source_id);
 	mosquitto__free(store->source_username);
@@ -216,10 +256,15 @@ void db__msg_store_remove(struct mosquitto_db *db, struct mosquitto_msg_store *s
 		}
 		mosquitto__free(store->dest_ids);
 	}
+	while(store->packets){
+		buffer = store->packets;
+		store->packets = buffer->next;
+		packet__buffer_release(buffer);
+	}
 	mosquitto__free(store->topic);
 	mosquitto_property_free_all(&store->properties);
 	UHPA_FREE_PAYLOAD(store);
-	mosquitto__free(store);
+	memory__pool_free(&msg_store_pool, store);
 }
 
 
@@ -235,6 +280,16 @@ void db__msg_store_clean(struct mosquitto_db *db)
 	}
 }
 
+struct mosquitto_client_msg *db__client_msg_new(void)
+{
+	return memory__pool_alloc(&client_msg_pool);
+}
+
+void db__client_msg_free(struct mosquitto_client_msg *msg)
+{
+	memory__pool_free(&client_msg_pool, msg);
+}
+
 void db__msg_store_ref_inc(struct mosquitto_msg_store *store)
 {
 	store->ref_count++;
@@ -246,6 +301,10 @@ void db__msg_store_ref_dec(struct mosquitto_db *db, struct mosquitto_msg_store *
 	if((*store)->ref_count == 0){
 		db__msg_store_remove(db, *store);
 		*store = NULL;
+#ifdef WITH_PERSISTENCE
+	}else if((*store)->ref_count == 1 && (*store)->payload_mapped){
+		persist__payload_release(db, *store);
+#endif
 	}
 }
 
@@ -265,7 +324,7 @@ void db__msg_store_compact(struct mosquitto_db *db)
 }
 
 
-static void db__message_remove(struct mosquitto_db *db, struct mosquitto_msg_data *msg_data, struct mosquitto_client_msg *item)
+static void db__message_remove(struct mosquitto_db *db, struct mosquitto *context, struct mosquitto_msg_data *msg_data, struct mosquitto_client_msg *item)
 {
 	if(!msg_data || !item){
 		return;
@@ -273,6 +332,9 @@ static void db__message_remove(struct mosquitto_db *db, struct mosquitto_msg_dat
 
 	DL_DELETE(msg_data->inflight, item);
 	if(item->store){
+#ifdef WITH_PERSISTENCE
+		persist__log_client_msg_delete(db, context, item);
+#endif
 		msg_data->msg_count--;
 		msg_data->msg_bytes -= item->store->payloadlen;
 		if(item->qos > 0){
@@ -283,7 +345,7 @@ static void db__message_remove(struct mosquitto_db *db, struct mosquitto_msg_dat
 	}
 
 	mosquitto_property_free_all(&item->properties);
-	mosquitto__free(item);
+	db__client_msg_free(item);
 }
 
 
@@ -316,7 +378,7 @@ int db__message_delete_outgoing(struct mosquitto_db *db, struct mosquitto *conte
 				return MOSQ_ERR_PROTOCOL;
 			}
 			msg_index--;
-			db__message_remove(db, &context->msgs_out, tail);
+			db__message_remove(db, context, &context->msgs_out, tail);
 		}
 	}
 
@@ -464,7 +526,7 @@ int db__message_insert(struct mosquitto_db *db, struct mosquitto *context, uint1
 	}
 #endif
 
-	msg = mosquitto__malloc(sizeof(struct mosquitto_client_msg));
+	msg = db__client_msg_new();
 	if(!msg) return MOSQ_ERR_NOMEM;
 	msg->prev = NULL;
 	msg->next = NULL;
@@ -488,6 +550,12 @@ int db__message_insert(struct mosquitto_db *db, struct mosquitto *context, uint1
 	}else{
 		DL_APPEND(msg_data->inflight, msg);
 	}
+#ifdef WITH_PERSISTENCE
+	if(msg->qos > 0 || state == mosq_ms_queued){
+		/* QoS 0 messages sent straight away are not worth keeping. */
+		persist__log_client_msg(db, context, msg);
+	}
+#endif
 	msg_data->msg_count++;
 	msg_data->msg_bytes+= msg->store->payloadlen;
 	if(qos > 0){
@@ -549,6 +617,11 @@ int db__message_update_outgoing(struct mosquitto *context, uint16_t mid, enum mo
 			}
 			tail->state = state;
 			tail->timestamp = mosquitto_time();
+#ifdef WITH_PERSISTENCE
+			if(tail->persisted){
+				persist__log_client_msg(mosquitto__get_db(), context, tail);
+			}
+#endif
 			return MOSQ_ERR_SUCCESS;
 		}
 	}
@@ -564,7 +637,7 @@ void db__messages_delete_list(struct mosquitto_db *db, struct mosquitto_client_m
 		DL_DELETE(*head, tail);
 		db__msg_store_ref_dec(db, &tail->store);
 		mosquitto_property_free_all(&tail->properties);
-		mosquitto__free(tail);
+		db__client_msg_free(tail);
 	}
 	*head = NULL;
 }
@@ -648,7 +721,7 @@ int db__message_store(struct mosquitto_db *db, const struct mosquitto *source, u
 	assert(db);
 	assert(stored);
 
-	temp = mosquitto__calloc(1, sizeof(struct mosquitto_msg_store));
+	temp = memory__pool_alloc(&msg_store_pool);
 	if(!temp){
 		log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
 		rc = MOSQ_ERR_NOMEM;
@@ -689,7 +762,9 @@ int db__message_store(struct mosquitto_db *db, const struct mosquitto *source, u
 	temp->payloadlen = payloadlen;
 	temp->properties = properties;
 	temp->origin = origin;
-	if(payloadlen){
+	/* A payload left in the persistence file has no pointer until it is
+	 * loaded. */
+	if(payloadlen && (payloadlen <= sizeof(payload->array) || payload->ptr)){
 		UHPA_MOVE(temp->payload, *payload, payloadlen);
 	}else{
 		temp->payload.ptr = NULL;
@@ -721,7 +796,7 @@ error:
 		mosquitto__free(temp->source_id);
 		mosquitto__free(temp->source_username);
 		mosquitto__free(temp->topic);
-		mosquitto__free(temp);
+		memory__pool_free(&msg_store_pool, temp);
 	}
 	mosquitto_property_free_all(&properties);
 	UHPA_FREE(*payload, payloadlen);
@@ -845,7 +920,7 @@ int db__message_reconnect_reset_incoming(struct mosquitto_db *db, struct mosquit
 		if(msg->qos != 2){
 			/* Anything <QoS 2 can be completely retried by the client at
 			 * no harm. */
-			db__message_remove(db, &context->msgs_in, msg);
+			db__message_remove(db, context, &context->msgs_in, msg);
 		}else{
 			/* Message state can be preserved here because it should match
 			 * whatever the client has got. */
@@ -922,12 +997,12 @@ int db__message_release_incoming(struct mosquitto_db *db, struct mosquitto *cont
 			 * keep resending it. That means we don't send it to other
 			 * clients. */
 			if(!topic){
-				db__message_remove(db, &context->msgs_in, tail);
+				db__message_remove(db, context, &context->msgs_in, tail);
 				deleted = true;
 			}else{
 				rc = sub__messages_queue(db, source_id, topic, 2, retain, &tail->store);
 				if(rc == MOSQ_ERR_SUCCESS || rc == MOSQ_ERR_NO_SUBSCRIBERS){
-					db__message_remove(db, &context->msgs_in, tail);
+					db__message_remove(db, context, &context->msgs_in, tail);
 					deleted = true;
 				}else{
 					return 1;
@@ -964,12 +1039,9 @@ int db__message_write(struct mosquitto_db *db, struct mosquitto *context)
 	uint16_t mid;
 	int retries;
 	int retain;
-	const char *topic;
 	int qos;
-	uint32_t payloadlen;
-	const void *payload;
 	int msg_count = 0;
-	mosquitto_property *cmsg_props = NULL, *store_props = NULL;
+	mosquitto_property *cmsg_props = NULL;
 	time_t now = 0;
 	uint32_t expiry_interval;
 
@@ -990,7 +1062,7 @@ int db__message_write(struct mosquitto_db *db, struct mosquitto *context)
 			}
 			if(now > tail->store->message_expiry_time){
 				/* Message is expired, must not send. */
-				db__message_remove(db, &context->msgs_in, tail);
+				db__message_remove(db, context, &context->msgs_in, tail);
 				continue;
 			}
 		}
@@ -1037,7 +1109,7 @@ int db__message_write(struct mosquitto_db *db, struct mosquitto *context)
 			}
 			if(now > tail->store->message_expiry_time){
 				/* Message is expired, must not send. */
-				db__message_remove(db, &context->msgs_out, tail);
+				db__message_remove(db, context, &context->msgs_out, tail);
 				continue;
 			}else{
 				expiry_interval = tail->store->message_expiry_time - now;
@@ -1048,53 +1120,61 @@ int db__message_write(struct mosquitto_db *db, struct mosquitto *context)
 		mid = tail->mid;
 		retries = tail->dup;
 		retain = tail->retain;
-		topic = tail->store->topic;
 		qos = tail->qos;
-		payloadlen = tail->store->payloadlen;
-		payload = UHPA_ACCESS_PAYLOAD(tail->store);
 		cmsg_props = tail->properties;
-		store_props = tail->store->properties;
 
 		switch(tail->state){
 			case mosq_ms_publish_qos0:
-				rc = send__publish(context, mid, topic, payloadlen, payload, qos, retain, retries, cmsg_props, store_props, expiry_interval);
+				rc = send__publish_stored(context, mid, tail->store, qos, retain, retries, cmsg_props, expiry_interval);
 				if(rc == MOSQ_ERR_SUCCESS || rc == MOSQ_ERR_OVERSIZE_PACKET){
-					db__message_remove(db, &context->msgs_out, tail);
 #ifdef WITH_GRAPH
-					network_graph_add_sub_edge(context, topic);
+					if(rc == MOSQ_ERR_SUCCESS){
+						network_graph_add_sub_bytes(context, tail->store->topic, tail->store->db_id, tail->store->payloadlen);
+					}
 #endif
+					db__message_remove(db, context, &context->msgs_out, tail);
 				}else{
 					return rc;
 				}
 				break;
 
 			case mosq_ms_publish_qos1:
-				rc = send__publish(context, mid, topic, payloadlen, payload, qos, retain, retries, cmsg_props, store_props, expiry_interval);
+				rc = send__publish_stored(context, mid, tail->store, qos, retain, retries, cmsg_props, expiry_interval);
 				if(rc == MOSQ_ERR_SUCCESS){
 					tail->timestamp = mosquitto_time();
 					tail->dup = 1; /* Any retry attempts are a duplicate. */
 					tail->state = mosq_ms_wait_for_puback;
+#ifdef WITH_PERSISTENCE
+					if(tail->persisted && !retries){
+						persist__log_client_msg(db, context, tail);
+					}
+#endif
 #ifdef WITH_GRAPH
-					network_graph_add_sub_edge(context, topic);
+					network_graph_add_sub_bytes(context, tail->store->topic, tail->store->db_id, tail->store->payloadlen);
 #endif
 				}else if(rc == MOSQ_ERR_OVERSIZE_PACKET){
-					db__message_remove(db, &context->msgs_out, tail);
+					db__message_remove(db, context, &context->msgs_out, tail);
 				}else{
 					return rc;
 				}
 				break;
 
 			case mosq_ms_publish_qos2:
-				rc = send__publish(context, mid, topic, payloadlen, payload, qos, retain, retries, cmsg_props, store_props, expiry_interval);
+				rc = send__publish_stored(context, mid, tail->store, qos, retain, retries, cmsg_props, expiry_interval);
 				if(rc == MOSQ_ERR_SUCCESS){
 					tail->timestamp = mosquitto_time();
 					tail->dup = 1; /* Any retry attempts are a duplicate. */
 					tail->state = mosq_ms_wait_for_pubrec;
+#ifdef WITH_PERSISTENCE
+					if(tail->persisted && !retries){
+						persist__log_client_msg(db, context, tail);
+					}
+#endif
 #ifdef WITH_GRAPH
-					network_graph_add_sub_edge(context, topic);
+					network_graph_add_sub_bytes(context, tail->store->topic, tail->store->db_id, tail->store->payloadlen);
 #endif
 				}else if(rc == MOSQ_ERR_OVERSIZE_PACKET){
-					db__message_remove(db, &context->msgs_out, tail);
+					db__message_remove(db, context, &context->msgs_out, tail);
 				}else{
 					return rc;
 				}
@@ -0,0 +1,120 @@
+#include <math.h>
+#include <string.h>
+
+#include "graph_binary.h"
+#include "graph_json.h"
+
+#define VARINT_MAX_LEN  10
+
+/*****************************************************************************/
+
+/*
+ * Makes sure there is space for len more bytes, doubling the buffer if needed
+ */
+static bool bin_reserve(struct graph_binary *bin, size_t len) {
+    size_t size;
+    uint8_t *data;
+
+    if (bin->error) return false;
+    if (bin->len + len <= bin->size) return true;
+
+    size = bin->size ? bin->size : 64;
+    while (size < bin->len + len) {
+        size *= 2;
+    }
+    data = (uint8_t *)graph__realloc(bin->data, size);
+    if (data == NULL) {
+        bin->error = true;
+        return false;
+    }
+    bin->data = data;
+    bin->size = size;
+    return true;
+}
+
+static inline void bin_put_u32(uint8_t *dst, uint32_t value) {
+    dst[0] = value & 0xFF;
+    dst[1] = (value >> 8) & 0xFF;
+    dst[2] = (value >> 16) & 0xFF;
+    dst[3] = (value >> 24) & 0xFF;
+}
+
+/*****************************************************************************/
+
+int graph_binary_init(struct graph_binary *bin, size_t size) {
+    bin->data = NULL;
+    bin->size = 0;
+    bin->error = false;
+    graph_binary_reset(bin);
+    if (size > 0 && !bin_reserve(bin, size)) {
+        return -1;
+    }
+    return 0;
+}
+
+void graph_binary_cleanup(struct graph_binary *bin) {
+    graph__free(bin->data);
+    bin->data = NULL;
+    bin->size = 0;
+    graph_binary_reset(bin);
+}
+
+void graph_binary_reset(struct graph_binary *bin) {
+    bin->len = 0;
+    bin->depth = 0;
+    bin->error = false;
+}
+
+void graph_binary_list_start(struct graph_binary *bin) {
+    if (bin->depth >= GRAPH_BINARY_MAX_DEPTH || !bin_reserve(bin, 4)) {
+        bin->error = true;
+        return;
+    }
+    bin->count_pos[bin->depth] = bin->len;
+    bin->count[bin->depth] = 0;
+    ++bin->depth;
+    bin->len += 4;
+}
+
+void graph_binary_list_item(struct graph_binary *bin) {
+    if (bin->depth > 0) {
+        ++bin->count[bin->depth - 1];
+    }
+}
+
+void graph_binary_list_end(struct graph_binary *bin) {
+    if (bin->depth == 0) return;
+    --bin->depth;
+    if (!bin->error) {
+        bin_put_u32(bin->data + bin->count_pos[bin->depth], bin->count[bin->depth]);
+    }
+}
+
+void graph_binary_add_varint(struct graph_binary *bin, uint64_t value) {
+    if (!bin_reserve(bin, VARINT_MAX_LEN)) return;
+    while (value >= 0x80) {
+        bin->data[bin->len++] = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    bin->data[bin->len++] = value;
+}
+
+void graph_binary_add_number(struct graph_binary *bin, double value) {
+    if (isnan(value) || isinf(value) || value < 0) {
+        graph_binary_add_varint(bin, 0);
+        return;
+    }
+    graph_binary_add_varint(bin, (uint64_t)llround(value * 1000) + 1);
+}
+
+void graph_binary_add_string(struct graph_binary *bin, const char *str) {
+    size_t len = strlen(str);
+    graph_binary_add_varint(bin, len);
+    graph_binary_add_bytes(bin, str, len);
+}
+
+void graph_binary_add_bytes(struct graph_binary *bin, const void *data, size_t len) {
+    if (len == 0 || !bin_reserve(bin, len)) return;
+    memcpy(bin->data + bin->len, data, len);
+    bin->len += len;
+}
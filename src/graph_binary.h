@@ -0,0 +1,97 @@
+#ifndef GRAPH_BINARY_H
+#define GRAPH_BINARY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define GRAPH_BINARY_MAX_DEPTH  8
+
+/**
+ * @brief Binary writer for the compact graph format. Integers are written as
+ *        LEB128 varints, list lengths as 32 bit little endian counts that are
+ *        filled in when the list is closed. Like the JSON writer, the buffer
+ *        keeps its memory between uses.
+ */
+struct graph_binary
+{
+    uint8_t *data;                          /**< serialized bytes */
+    size_t len;                             /**< number of bytes written */
+    size_t size;                            /**< number of bytes allocated */
+    int depth;                              /**< current list nesting level */
+    size_t count_pos[GRAPH_BINARY_MAX_DEPTH];   /**< offset of the count of each open list */
+    uint32_t count[GRAPH_BINARY_MAX_DEPTH];     /**< number of items in each open list */
+    bool error;                             /**< set if an allocation failed, output is invalid */
+};
+
+/**
+ * @brief Function for initializing a writer.
+ *
+ * @param[in]   bin         writer structure.
+ * @param[in]   size        initial buffer size in bytes.
+ *
+ * @return      status code.
+ */
+int graph_binary_init(struct graph_binary *bin, size_t size);
+
+/**
+ * @brief Function for freeing the buffer of a writer.
+ *
+ * @param[in]   bin         writer structure.
+ */
+void graph_binary_cleanup(struct graph_binary *bin);
+
+/**
+ * @brief Function for emptying a writer before a new message, keeping its buffer.
+ *
+ * @param[in]   bin         writer structure.
+ */
+void graph_binary_reset(struct graph_binary *bin);
+
+/**
+ * @brief Functions for opening and closing a list. Opening writes a placeholder
+ *        count that is set to the number of graph_binary_list_item calls when
+ *        the list is closed.
+ *
+ * @param[in]   bin         writer structure.
+ */
+void graph_binary_list_start(struct graph_binary *bin);
+void graph_binary_list_item(struct graph_binary *bin);
+void graph_binary_list_end(struct graph_binary *bin);
+
+/**
+ * @brief Function for writing an unsigned integer as a varint.
+ *
+ * @param[in]   bin         writer structure.
+ * @param[in]   value       value to write.
+ */
+void graph_binary_add_varint(struct graph_binary *bin, uint64_t value);
+
+/**
+ * @brief Function for writing a number with three decimals, as the varint of
+ *        value * 1000 + 1. NaN, infinite and negative numbers are written as
+ *        0, which decodes to null.
+ *
+ * @param[in]   bin         writer structure.
+ * @param[in]   value       value to write.
+ */
+void graph_binary_add_number(struct graph_binary *bin, double value);
+
+/**
+ * @brief Function for writing a string as its varint length followed by its bytes.
+ *
+ * @param[in]   bin         writer structure.
+ * @param[in]   str         NUL terminated string.
+ */
+void graph_binary_add_string(struct graph_binary *bin, const char *str);
+
+/**
+ * @brief Function for appending raw bytes.
+ *
+ * @param[in]   bin         writer structure.
+ * @param[in]   data        bytes to append.
+ * @param[in]   len         length of data.
+ */
+void graph_binary_add_bytes(struct graph_binary *bin, const void *data, size_t len);
+
+#endif
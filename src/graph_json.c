@@ -0,0 +1,195 @@
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "graph_json.h"
+
+#define NUMBUF_LEN      32
+
+static const char hex_chars[] = "0123456789abcdef";
+
+/*****************************************************************************/
+
+/*
+ * Makes sure there is space for len more bytes, doubling the buffer if needed
+ */
+static bool json_reserve(struct graph_json *json, size_t len) {
+    size_t size;
+    char *data;
+
+    if (json->error) return false;
+    if (json->len + len <= json->size) return true;
+
+    size = json->size ? json->size : 64;
+    while (size < json->len + len) {
+        size *= 2;
+    }
+    data = (char *)graph__realloc(json->data, size);
+    if (data == NULL) {
+        json->error = true;
+        return false;
+    }
+    json->data = data;
+    json->size = size;
+    return true;
+}
+
+static inline void json_append(struct graph_json *json, const char *data, size_t len) {
+    if (json_reserve(json, len)) {
+        memcpy(json->data + json->len, data, len);
+        json->len += len;
+    }
+}
+
+static inline void json_putc(struct graph_json *json, char c) {
+    if (json_reserve(json, 1)) {
+        json->data[json->len++] = c;
+    }
+}
+
+/*
+ * Writes a quoted string, escaping quotes, backslashes and control characters
+ */
+static void json_append_string(struct graph_json *json, const char *str) {
+    const char *start = str;
+    unsigned char c;
+    char esc[6];
+
+    json_putc(json, '"');
+    for (; (c = (unsigned char)*str) != '\0'; ++str) {
+        if (c >= 0x20 && c != '"' && c != '\\') continue;
+
+        // copy the unescaped run before this character in one go
+        json_append(json, start, str - start);
+        start = str + 1;
+        switch (c) {
+            case '"':  json_append(json, "\\\"", 2); break;
+            case '\\': json_append(json, "\\\\", 2); break;
+            case '\b': json_append(json, "\\b", 2); break;
+            case '\f': json_append(json, "\\f", 2); break;
+            case '\n': json_append(json, "\\n", 2); break;
+            case '\r': json_append(json, "\\r", 2); break;
+            case '\t': json_append(json, "\\t", 2); break;
+            default:
+                esc[0] = '\\';
+                esc[1] = 'u';
+                esc[2] = '0';
+                esc[3] = '0';
+                esc[4] = hex_chars[c >> 4];
+                esc[5] = hex_chars[c & 0xF];
+                json_append(json, esc, 6);
+                break;
+        }
+    }
+    json_append(json, start, str - start);
+    json_putc(json, '"');
+}
+
+/*
+ * Writes the separator and member name that go before every value
+ */
+static void json_begin_value(struct graph_json *json, const char *key) {
+    if (!json->first[json->depth]) {
+        json_putc(json, ',');
+    }
+    json->first[json->depth] = false;
+
+    if (key != NULL) {
+        json_append_string(json, key);
+        json_putc(json, ':');
+    }
+}
+
+static void json_open(struct graph_json *json, const char *key, char c) {
+    json_begin_value(json, key);
+    json_putc(json, c);
+    if (json->depth + 1 >= GRAPH_JSON_MAX_DEPTH) {
+        json->error = true;
+        return;
+    }
+    json->first[++json->depth] = true;
+}
+
+static void json_close(struct graph_json *json, char c) {
+    json_putc(json, c);
+    if (json->depth > 0) {
+        --json->depth;
+    }
+}
+
+/*****************************************************************************/
+
+int graph_json_init(struct graph_json *json, size_t size) {
+    json->data = NULL;
+    json->size = 0;
+    json->error = false;
+    graph_json_reset(json);
+    if (size > 0 && !json_reserve(json, size)) {
+        return -1;
+    }
+    return 0;
+}
+
+void graph_json_cleanup(struct graph_json *json) {
+    graph__free(json->data);
+    json->data = NULL;
+    json->size = 0;
+    graph_json_reset(json);
+}
+
+void graph_json_reset(struct graph_json *json) {
+    json->len = 0;
+    json->depth = 0;
+    json->first[0] = true;
+    json->error = false;
+}
+
+void graph_json_object_start(struct graph_json *json, const char *key) {
+    json_open(json, key, '{');
+}
+
+void graph_json_object_end(struct graph_json *json) {
+    json_close(json, '}');
+}
+
+void graph_json_array_start(struct graph_json *json, const char *key) {
+    json_open(json, key, '[');
+}
+
+void graph_json_array_end(struct graph_json *json) {
+    json_close(json, ']');
+}
+
+void graph_json_add_string(struct graph_json *json, const char *key, const char *value) {
+    json_begin_value(json, key);
+    if (value == NULL) {
+        json_append(json, "null", 4);
+    }
+    else {
+        json_append_string(json, value);
+    }
+}
+
+void graph_json_add_number(struct graph_json *json, const char *key, double value) {
+    char numbuf[NUMBUF_LEN];
+    int len;
+
+    json_begin_value(json, key);
+    if (isnan(value) || isinf(value)) {
+        json_append(json, "null", 4);
+        return;
+    }
+    if (value == (double)(long long)value && fabs(value) < 1e15) {
+        len = snprintf(numbuf, NUMBUF_LEN, "%lld", (long long)value);
+    }
+    else {
+        len = snprintf(numbuf, NUMBUF_LEN, "%.15g", value);
+    }
+    json_append(json, numbuf, len);
+}
+
+void graph_json_add_raw(struct graph_json *json, const char *data, size_t len) {
+    if (len == 0) return;
+    json_begin_value(json, NULL);
+    json_append(json, data, len);
+}
@@ -0,0 +1,87 @@
+#ifndef GRAPH_JSON_H
+#define GRAPH_JSON_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define GRAPH_JSON_MAX_DEPTH    8
+
+/**
+ * @brief Streaming JSON writer. Values are serialized straight into a growable
+ *        buffer that keeps its memory between uses, so generating a document
+ *        needs no intermediate tree and no allocation once the buffer is large
+ *        enough.
+ */
+struct graph_json
+{
+    char *data;                         /**< serialized JSON, not NUL terminated */
+    size_t len;                         /**< number of bytes written */
+    size_t size;                        /**< number of bytes allocated */
+    int depth;                          /**< current object/array nesting level */
+    bool first[GRAPH_JSON_MAX_DEPTH];   /**< whether the next value at a level is the first */
+    bool error;                         /**< set if an allocation failed, output is invalid */
+};
+
+/**
+ * @brief Memory functions used by the writer. Provided by network_graph.c so that
+ *        the writer is counted in the graph memory usage.
+ */
+void *graph__realloc(void *ptr, size_t size);
+void graph__free(void *mem);
+
+/**
+ * @brief Function for initializing a writer.
+ *
+ * @param[in]   json        writer structure.
+ * @param[in]   size        initial buffer size in bytes.
+ *
+ * @return      status code.
+ */
+int graph_json_init(struct graph_json *json, size_t size);
+
+/**
+ * @brief Function for freeing the buffer of a writer.
+ *
+ * @param[in]   json        writer structure.
+ */
+void graph_json_cleanup(struct graph_json *json);
+
+/**
+ * @brief Function for emptying a writer before a new document, keeping its buffer.
+ *
+ * @param[in]   json        writer structure.
+ */
+void graph_json_reset(struct graph_json *json);
+
+/**
+ * @brief Functions for opening and closing an object or array.
+ *
+ * @param[in]   json        writer structure.
+ * @param[in]   key         member name if inside an object, NULL otherwise.
+ */
+void graph_json_object_start(struct graph_json *json, const char *key);
+void graph_json_object_end(struct graph_json *json);
+void graph_json_array_start(struct graph_json *json, const char *key);
+void graph_json_array_end(struct graph_json *json);
+
+/**
+ * @brief Functions for writing a value. NaN and infinite numbers are written as null.
+ *
+ * @param[in]   json        writer structure.
+ * @param[in]   key         member name if inside an object, NULL otherwise.
+ * @param[in]   value       value to write.
+ */
+void graph_json_add_string(struct graph_json *json, const char *key, const char *value);
+void graph_json_add_number(struct graph_json *json, const char *key, double value);
+
+/**
+ * @brief Function for appending a list of values that has already been serialized,
+ *        e.g. the contents of another writer, at the current position.
+ *
+ * @param[in]   json        writer structure.
+ * @param[in]   data        comma separated JSON values.
+ * @param[in]   len         length of data.
+ */
+void graph_json_add_raw(struct graph_json *json, const char *data, size_t len);
+
+#endif
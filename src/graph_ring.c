@@ -0,0 +1,124 @@
+#include <string.h>
+
+#include "graph_ring.h"
+#include "graph_json.h"
+
+/*****************************************************************************/
+
+int graph_ring_init(struct graph_ring *ring, size_t event_count, size_t string_size) {
+    size_t count = 1;
+
+    while (count < event_count) {
+        count *= 2;
+    }
+    ring->events = (struct graph_event *)graph__realloc(NULL, count * sizeof(struct graph_event));
+    ring->strings = (char *)graph__realloc(NULL, string_size);
+    if (ring->events == NULL || ring->strings == NULL) {
+        graph_ring_cleanup(ring);
+        return -1;
+    }
+    ring->event_mask = count - 1;
+    ring->string_size = string_size;
+    ring->dropped = 0;
+    atomic_init(&ring->event_head, 0);
+    atomic_init(&ring->string_head, 0);
+    atomic_init(&ring->event_tail, 0);
+    atomic_init(&ring->string_tail, 0);
+    ring->event_tail_cache = 0;
+    ring->string_tail_cache = 0;
+    ring->event_head_cache = 0;
+    return 0;
+}
+
+void graph_ring_cleanup(struct graph_ring *ring) {
+    graph__free(ring->events);
+    graph__free(ring->strings);
+    ring->events = NULL;
+    ring->strings = NULL;
+}
+
+bool graph_ring_push(struct graph_ring *ring, struct graph_event *event, const char *str1, const char *str2) {
+    size_t head = atomic_load_explicit(&ring->event_head, memory_order_relaxed);
+    size_t string_head = atomic_load_explicit(&ring->string_head, memory_order_relaxed);
+    size_t len1 = 0, len2 = 0, pos;
+
+    if (head - ring->event_tail_cache > ring->event_mask) {
+        ring->event_tail_cache = atomic_load_explicit(&ring->event_tail, memory_order_acquire);
+        if (head - ring->event_tail_cache > ring->event_mask) {
+            ++ring->dropped;
+            return false;
+        }
+    }
+
+    event->str_pos = GRAPH_RING_NO_STRING;
+    if (str1 != NULL) {
+        len1 = strlen(str1) + 1;
+        len2 = str2 != NULL ? strlen(str2) + 1 : 0;
+        pos = string_head % ring->string_size;
+        // strings are never split, skip the end of the buffer instead
+        if (pos + len1 + len2 > ring->string_size) {
+            string_head += ring->string_size - pos;
+            pos = 0;
+        }
+        if (string_head + len1 + len2 - ring->string_tail_cache > ring->string_size) {
+            ring->string_tail_cache = atomic_load_explicit(&ring->string_tail, memory_order_acquire);
+            if (string_head + len1 + len2 - ring->string_tail_cache > ring->string_size) {
+                ++ring->dropped;
+                return false;
+            }
+        }
+        memcpy(ring->strings + pos, str1, len1);
+        if (len2 > 0) {
+            memcpy(ring->strings + pos + len1, str2, len2);
+        }
+        event->str_pos = pos;
+        string_head += len1 + len2;
+    }
+    event->str_end = string_head;
+
+    ring->events[head & ring->event_mask] = *event;
+    atomic_store_explicit(&ring->string_head, string_head, memory_order_relaxed);
+    atomic_store_explicit(&ring->event_head, head + 1, memory_order_release);
+    return true;
+}
+
+struct graph_event *graph_ring_peek(struct graph_ring *ring) {
+    size_t tail = atomic_load_explicit(&ring->event_tail, memory_order_relaxed);
+
+    if (tail == ring->event_head_cache) {
+        ring->event_head_cache = atomic_load_explicit(&ring->event_head, memory_order_acquire);
+        if (tail == ring->event_head_cache) {
+            return NULL;
+        }
+    }
+    return &ring->events[tail & ring->event_mask];
+}
+
+void graph_ring_pop(struct graph_ring *ring, struct graph_event *event) {
+    size_t tail = atomic_load_explicit(&ring->event_tail, memory_order_relaxed);
+
+    atomic_store_explicit(&ring->string_tail, event->str_end, memory_order_release);
+    atomic_store_explicit(&ring->event_tail, tail + 1, memory_order_release);
+}
+
+const char *graph_ring_string(struct graph_ring *ring, struct graph_event *event) {
+    if (event->str_pos == GRAPH_RING_NO_STRING) {
+        return NULL;
+    }
+    return ring->strings + event->str_pos;
+}
+
+bool graph_ring_half_full(struct graph_ring *ring) {
+    size_t head = atomic_load_explicit(&ring->event_head, memory_order_relaxed);
+
+    if (head - ring->event_tail_cache <= ring->event_mask / 2) {
+        return false;
+    }
+    ring->event_tail_cache = atomic_load_explicit(&ring->event_tail, memory_order_acquire);
+    return head - ring->event_tail_cache > ring->event_mask / 2;
+}
+
+size_t graph_ring_used(struct graph_ring *ring) {
+    return atomic_load_explicit(&ring->event_head, memory_order_acquire)
+            - atomic_load_explicit(&ring->event_tail, memory_order_acquire);
+}
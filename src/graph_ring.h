@@ -0,0 +1,134 @@
+#ifndef GRAPH_RING_H
+#define GRAPH_RING_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define GRAPH_RING_CACHE_LINE   64
+#define GRAPH_RING_NO_STRING    UINT32_MAX
+
+/**
+ * @brief Fixed size event passed from the broker to the graph thread. Its
+ *        strings are copied to the string buffer of the ring, NUL terminated
+ *        and back to back.
+ */
+struct graph_event
+{
+    uint8_t type;                       /**< what happened, see enum graph_event_type */
+    uint8_t flag;                       /**< retain for publishes, dropped for deliveries */
+    uint32_t len;                       /**< payload length */
+    uint32_t str_pos;                   /**< offset of the strings, GRAPH_RING_NO_STRING if none */
+    uint64_t str_end;                   /**< string buffer position after the strings */
+    uint64_t client_id;                 /**< graph id of the connection */
+    uint64_t arg;                       /**< stored message id or time in ns */
+};
+
+/**
+ * @brief Lock-free single producer, single consumer queue of events. The
+ *        producer owns the heads and the consumer owns the tails, each pair is
+ *        on its own cache line next to the last value it read of the other
+ *        side, so the other line is only read when the cached value runs out.
+ *        Strings are never split at the end of the string buffer, the producer
+ *        skips to the start instead. A push that does not fit is dropped and
+ *        counted, the producer never waits.
+ */
+struct graph_ring
+{
+    struct graph_event *events;         /**< event slots, a power of two */
+    char *strings;                      /**< string buffer */
+    size_t event_mask;                  /**< number of event slots - 1 */
+    size_t string_size;                 /**< size of the string buffer */
+    unsigned long dropped;              /**< events that did not fit, written by the producer */
+    char pad0[GRAPH_RING_CACHE_LINE];
+    atomic_size_t event_head;           /**< next event slot to write */
+    atomic_size_t string_head;          /**< next string byte to write */
+    size_t event_tail_cache;            /**< event_tail last read by the producer */
+    size_t string_tail_cache;           /**< string_tail last read by the producer */
+    char pad1[GRAPH_RING_CACHE_LINE];
+    atomic_size_t event_tail;           /**< next event slot to read */
+    atomic_size_t string_tail;          /**< first string byte still in use */
+    size_t event_head_cache;            /**< event_head last read by the consumer */
+    char pad2[GRAPH_RING_CACHE_LINE];
+};
+
+/**
+ * @brief Function for allocating the buffers of a ring.
+ *
+ * @param[in]   ring        ring structure.
+ * @param[in]   event_count number of event slots, rounded up to a power of two.
+ * @param[in]   string_size size of the string buffer in bytes.
+ *
+ * @return      status code.
+ */
+int graph_ring_init(struct graph_ring *ring, size_t event_count, size_t string_size);
+
+/**
+ * @brief Function for freeing the buffers of a ring.
+ *
+ * @param[in]   ring        ring structure.
+ */
+void graph_ring_cleanup(struct graph_ring *ring);
+
+/**
+ * @brief Function for adding an event, called by the producer only.
+ *
+ * @param[in]   ring        ring structure.
+ * @param[in]   event       event to copy, its string fields are set by the ring.
+ * @param[in]   str1        first string or NULL.
+ * @param[in]   str2        second string or NULL, only used after str1.
+ *
+ * @return      false if the ring was full and the event was dropped.
+ */
+bool graph_ring_push(struct graph_ring *ring, struct graph_event *event, const char *str1, const char *str2);
+
+/**
+ * @brief Function for getting the oldest event, called by the consumer only.
+ *        The event and its strings stay valid until graph_ring_pop.
+ *
+ * @param[in]   ring        ring structure.
+ *
+ * @return      oldest event or NULL if the ring is empty.
+ */
+struct graph_event *graph_ring_peek(struct graph_ring *ring);
+
+/**
+ * @brief Function for releasing the event returned by graph_ring_peek.
+ *
+ * @param[in]   ring        ring structure.
+ * @param[in]   event       event returned by graph_ring_peek.
+ */
+void graph_ring_pop(struct graph_ring *ring, struct graph_event *event);
+
+/**
+ * @brief Function for getting the first string of an event.
+ *
+ * @param[in]   ring        ring structure.
+ * @param[in]   event       event returned by graph_ring_peek.
+ *
+ * @return      first string or NULL if the event has none.
+ */
+const char *graph_ring_string(struct graph_ring *ring, struct graph_event *event);
+
+/**
+ * @brief Function for checking if more than half of the event slots are used,
+ *        called by the producer only.
+ *
+ * @param[in]   ring        ring structure.
+ *
+ * @return      true if more than half of the slots are used.
+ */
+bool graph_ring_half_full(struct graph_ring *ring);
+
+/**
+ * @brief Function for getting the number of queued events, may be called by
+ *        either side.
+ *
+ * @param[in]   ring        ring structure.
+ *
+ * @return      number of events.
+ */
+size_t graph_ring_used(struct graph_ring *ring);
+
+#endif
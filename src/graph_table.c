@@ -0,0 +1,134 @@
+#include <string.h>
+
+#include "graph_table.h"
+#include "graph_json.h"
+
+/*****************************************************************************/
+
+/*
+ * Smallest power of two that keeps count items at most half the slots
+ */
+static size_t graph_table_size_for(size_t count) {
+    size_t size = GRAPH_TABLE_MIN_SIZE;
+    while (size < count * 2) {
+        size *= 2;
+    }
+    return size;
+}
+
+/*
+ * Puts an item in the first free slot of its probe sequence
+ */
+static void graph_table_insert(struct graph_table *table, unsigned long hash, void *item) {
+    size_t idx = graph_table_slot(table, hash);
+    struct graph_table_entry *entry;
+
+    for (;; idx = (idx + 1) & table->mask) {
+        entry = &table->entries[idx];
+        if (entry->item == NULL || entry->item == GRAPH_TABLE_DELETED) {
+            break;
+        }
+    }
+    if (entry->item == GRAPH_TABLE_DELETED) {
+        --table->deleted;
+    }
+    entry->hash = hash;
+    entry->item = item;
+    ++table->used;
+}
+
+/*
+ * Moves all items to new_size slots, dropping the deleted markers
+ */
+static int graph_table_resize(struct graph_table *table, size_t new_size) {
+    struct graph_table_entry *old_entries = table->entries;
+    size_t old_size = table->entries != NULL ? table->mask + 1 : 0;
+    unsigned int shift = 64;
+
+    table->entries = (struct graph_table_entry *)graph__realloc(NULL, new_size * sizeof(struct graph_table_entry));
+    if (table->entries == NULL) {
+        table->entries = old_entries;
+        return -1;
+    }
+    memset(table->entries, 0, new_size * sizeof(struct graph_table_entry));
+    for (size_t size = new_size; size > 1; size /= 2) {
+        --shift;
+    }
+    table->mask = new_size - 1;
+    table->shift = shift;
+    table->used = 0;
+    table->deleted = 0;
+
+    for (size_t i = 0; i < old_size; ++i) {
+        if (old_entries[i].item != NULL && old_entries[i].item != GRAPH_TABLE_DELETED) {
+            graph_table_insert(table, old_entries[i].hash, old_entries[i].item);
+        }
+    }
+    graph__free(old_entries);
+    return 0;
+}
+
+int graph_table_init(struct graph_table *table, size_t size) {
+    table->entries = NULL;
+    return graph_table_resize(table, graph_table_size_for(size));
+}
+
+void graph_table_cleanup(struct graph_table *table) {
+    graph__free(table->entries);
+    table->entries = NULL;
+    table->used = 0;
+    table->deleted = 0;
+}
+
+int graph_table_add(struct graph_table *table, unsigned long hash, void *item) {
+    size_t size = table->mask + 1;
+
+    if ((table->used + table->deleted + 1) * 4 > size * 3) {
+        // a find stops at the first empty slot, so one has to stay free
+        if (graph_table_resize(table, graph_table_size_for(table->used + 1))
+                && table->used + table->deleted + 1 >= size) {
+            return -1;
+        }
+    }
+    graph_table_insert(table, hash, item);
+    return 0;
+}
+
+void graph_table_remove(struct graph_table *table, unsigned long hash, void *item) {
+    size_t idx = graph_table_slot(table, hash);
+    struct graph_table_entry *entry;
+
+    for (;; idx = (idx + 1) & table->mask) {
+        entry = &table->entries[idx];
+        if (entry->item == NULL) {
+            return;
+        }
+        if (entry->item == item) {
+            break;
+        }
+    }
+    --table->used;
+
+    // no probe sequence continues past an empty slot, so the markers in front
+    // of it are not needed either
+    if (table->entries[(idx + 1) & table->mask].item == NULL) {
+        entry->item = NULL;
+        for (idx = (idx - 1) & table->mask; table->entries[idx].item == GRAPH_TABLE_DELETED;
+                idx = (idx - 1) & table->mask) {
+            table->entries[idx].item = NULL;
+            --table->deleted;
+        }
+    }
+    else {
+        entry->item = GRAPH_TABLE_DELETED;
+        ++table->deleted;
+    }
+}
+
+void graph_table_shrink(struct graph_table *table) {
+    size_t size = table->mask + 1;
+
+    if (size > GRAPH_TABLE_MIN_SIZE && table->used * 8 < size) {
+        graph_table_resize(table, graph_table_size_for(table->used));
+    }
+}
@@ -0,0 +1,133 @@
+#ifndef GRAPH_TABLE_H
+#define GRAPH_TABLE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define GRAPH_TABLE_MIN_SIZE    4
+#define GRAPH_TABLE_DELETED     ((void *)1)
+
+/**
+ * @brief Slot of a graph table. The hash is stored next to the item, so a
+ *        probe only touches the item when the hashes are equal.
+ */
+struct graph_table_entry
+{
+    unsigned long hash;                 /**< hash of the key of item */
+    void *item;                         /**< NULL if empty, GRAPH_TABLE_DELETED if removed */
+};
+
+/**
+ * @brief Open addressing hash table of pointers with linear probing, used for
+ *        the ip, client, topic and graph id dictionaries of the network graph.
+ *        Removed items leave a GRAPH_TABLE_DELETED marker instead of moving
+ *        the items after them, so a table can be iterated while items are
+ *        removed from it. Markers are dropped when the table is resized.
+ */
+struct graph_table
+{
+    struct graph_table_entry *entries;  /**< slots, a power of two */
+    size_t mask;                        /**< number of slots - 1 */
+    unsigned int shift;                 /**< 64 - log2(number of slots) */
+    size_t used;                        /**< number of items */
+    size_t deleted;                     /**< number of GRAPH_TABLE_DELETED slots */
+};
+
+/**
+ * @brief Function for allocating an empty table.
+ *
+ * @param[in]   table       table structure.
+ * @param[in]   size        expected number of items.
+ *
+ * @return      status code.
+ */
+int graph_table_init(struct graph_table *table, size_t size);
+
+/**
+ * @brief Function for freeing the slots of a table, not the items.
+ *
+ * @param[in]   table       table structure.
+ */
+void graph_table_cleanup(struct graph_table *table);
+
+/**
+ * @brief Function for adding an item that is not in the table yet. Grows the
+ *        table when more than 3/4 of the slots are in use.
+ *
+ * @param[in]   table       table structure.
+ * @param[in]   hash        hash of the key of item.
+ * @param[in]   item        item to add.
+ *
+ * @return      status code.
+ */
+int graph_table_add(struct graph_table *table, unsigned long hash, void *item);
+
+/**
+ * @brief Function for removing an item. Never moves other items.
+ *
+ * @param[in]   table       table structure.
+ * @param[in]   hash        hash the item was added with.
+ * @param[in]   item        item to remove.
+ */
+void graph_table_remove(struct graph_table *table, unsigned long hash, void *item);
+
+/**
+ * @brief Function for shrinking a table that is less than 1/8 full. Must not
+ *        be called while the table is iterated.
+ *
+ * @param[in]   table       table structure.
+ */
+void graph_table_shrink(struct graph_table *table);
+
+/**
+ * @brief Function for getting the first slot to probe for a hash. The hash is
+ *        multiplied by 2^64 / golden ratio and the top bits are used, so keys
+ *        that only differ in their last characters and sequential graph ids
+ *        spread over the whole table.
+ */
+static inline size_t graph_table_slot(const struct graph_table *table, unsigned long hash) {
+    return (size_t)(((uint64_t)hash * UINT64_C(0x9E3779B97F4A7C15)) >> table->shift);
+}
+
+/**
+ * @brief Function for finding an item by key.
+ *
+ * @param[in]   table       table structure.
+ * @param[in]   hash        hash of key.
+ * @param[in]   key         key passed to match.
+ * @param[in]   match       compares the key of an item with key, only called
+ *                          for items with an equal hash.
+ *
+ * @return      item or NULL if not found.
+ */
+static inline void *graph_table_find(const struct graph_table *table, unsigned long hash, const void *key,
+                                     bool (*match)(const void *item, const void *key)) {
+    size_t idx = graph_table_slot(table, hash);
+    struct graph_table_entry *entry;
+
+    for (;; idx = (idx + 1) & table->mask) {
+        entry = &table->entries[idx];
+        if (entry->item == NULL) {
+            return NULL;
+        }
+        if (entry->hash == hash && entry->item != GRAPH_TABLE_DELETED && match(entry->item, key)) {
+            return entry->item;
+        }
+    }
+}
+
+/**
+ * @brief Function for iterating over a table by slot, from 0 to table->mask.
+ *
+ * @param[in]   table       table structure.
+ * @param[in]   idx         slot index.
+ *
+ * @return      item in the slot or NULL if the slot is empty.
+ */
+static inline void *graph_table_at(const struct graph_table *table, size_t idx) {
+    void *item = table->entries[idx].item;
+    return item != GRAPH_TABLE_DELETED ? item : NULL;
+}
+
+#endif
@@ -0,0 +1,99 @@
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "graph_thread.h"
+#include "graph_ring.h"
+#include "network_graph.h"
+
+/*****************************************************************************/
+
+static pthread_t thread;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;  /**< protects stop, outbox and waiting on cond */
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static atomic_bool waiting = false;             /**< graph thread waits on cond */
+static bool stop = false;
+static struct graph_message *outbox = NULL;     /**< messages for the main thread */
+static struct graph_message **outbox_tail = &outbox;
+
+/*****************************************************************************/
+
+int graph_thread_start(void *(*func)(void *)) {
+    sigset_t sigs, old_sigs;
+    int rc;
+
+    stop = false;
+    sigfillset(&sigs);
+    pthread_sigmask(SIG_SETMASK, &sigs, &old_sigs);
+    rc = pthread_create(&thread, NULL, func, NULL);
+    pthread_sigmask(SIG_SETMASK, &old_sigs, NULL);
+    return rc;
+}
+
+void graph_thread_stop(void) {
+    struct graph_message *msg;
+
+    pthread_mutex_lock(&mutex);
+    stop = true;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&mutex);
+    pthread_join(thread, NULL);
+
+    while (outbox != NULL) {
+        msg = outbox;
+        outbox = outbox->next;
+        free(msg->payload);
+        free(msg);
+    }
+    outbox_tail = &outbox;
+}
+
+bool graph_thread_wait(struct graph_ring *ring, int timeout) {
+    struct timespec deadline;
+    bool stopping;
+
+    pthread_mutex_lock(&mutex);
+    stopping = stop;
+    if (!stopping) {
+        atomic_store(&waiting, true);
+        // a push after this check sees waiting and signals once we wait
+        if (graph_ring_used(ring) == 0) {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += timeout;
+            pthread_cond_timedwait(&cond, &mutex, &deadline);
+        }
+        atomic_store(&waiting, false);
+        stopping = stop;
+    }
+    pthread_mutex_unlock(&mutex);
+    return stopping;
+}
+
+void graph_thread_wake(struct graph_ring *ring) {
+    if (atomic_load(&waiting) && graph_ring_used(ring) > 0) {
+        pthread_mutex_lock(&mutex);
+        pthread_cond_signal(&cond);
+        pthread_mutex_unlock(&mutex);
+    }
+}
+
+void graph_thread_put(struct graph_message *msg) {
+    msg->next = NULL;
+    pthread_mutex_lock(&mutex);
+    *outbox_tail = msg;
+    outbox_tail = &msg->next;
+    pthread_mutex_unlock(&mutex);
+}
+
+struct graph_message *graph_thread_take(void) {
+    struct graph_message *msg;
+
+    pthread_mutex_lock(&mutex);
+    msg = outbox;
+    outbox = NULL;
+    outbox_tail = &outbox;
+    pthread_mutex_unlock(&mutex);
+    return msg;
+}
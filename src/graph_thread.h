@@ -0,0 +1,63 @@
+#ifndef GRAPH_THREAD_H
+#define GRAPH_THREAD_H
+
+#include <stdbool.h>
+
+struct graph_ring;
+struct graph_message;
+
+/*
+ * The broker is built with dummy pthread macros (lib/dummypthread.h), so the
+ * graph thread and the locking around it live in their own file.
+ */
+
+/**
+ * @brief Function for starting the graph thread with all signals blocked, they
+ *        are handled by the main thread.
+ *
+ * @param[in]   func        thread function.
+ *
+ * @return      status code.
+ */
+int graph_thread_start(void *(*func)(void *));
+
+/**
+ * @brief Function for asking the graph thread to stop and waiting for it.
+ */
+void graph_thread_stop(void);
+
+/**
+ * @brief Function for waiting until events are queued, the thread is woken up,
+ *        or timeout seconds passed. Called by the graph thread.
+ *
+ * @param[in]   ring        events from the broker.
+ * @param[in]   timeout     maximum time to wait in seconds.
+ *
+ * @return      true if the thread should stop.
+ */
+bool graph_thread_wait(struct graph_ring *ring, int timeout);
+
+/**
+ * @brief Function for waking up the graph thread if it waits and events are
+ *        queued. Only locks if the graph thread waits.
+ *
+ * @param[in]   ring        events from the broker.
+ */
+void graph_thread_wake(struct graph_ring *ring);
+
+/**
+ * @brief Function for handing a finished message to the main thread.
+ *
+ * @param[in]   msg         message, owned by the main thread afterwards.
+ */
+void graph_thread_put(struct graph_message *msg);
+
+/**
+ * @brief Function for taking all finished messages, oldest first. Called by
+ *        the main thread.
+ *
+ * @return      list of messages or NULL.
+ */
+struct graph_message *graph_thread_take(void);
+
+#endif
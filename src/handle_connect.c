@@ -93,9 +93,12 @@ void connection_check_acl(struct mosquitto_db *db, struct mosquitto *context, st
 								   msg_tail->store->qos, msg_tail->store->retain, MOSQ_ACL_READ) != MOSQ_ERR_SUCCESS){
 
 				DL_DELETE((*head), msg_tail);
+#ifdef WITH_PERSISTENCE
+				persist__log_client_msg_delete(db, context, msg_tail);
+#endif
 				db__msg_store_ref_dec(db, &msg_tail->store);
 				mosquitto_property_free_all(&msg_tail->properties);
-				mosquitto__free(msg_tail);
+				db__client_msg_free(msg_tail);
 			}
 		}
 	}
@@ -147,6 +150,9 @@ int connect__on_authorised(struct mosquitto_db *db, struct mosquitto *context, v
 			context->sub_count = found_context->sub_count;
 			found_context->sub_count = 0;
 			context->last_mid = found_context->last_mid;
+			/* Retained messages not sent before the old connection went. */
+			context->retain_queue = found_context->retain_queue;
+			found_context->retain_queue = NULL;
 
 			for(i=0; i<context->sub_count; i++){
 				if(context->subs[i]){
@@ -161,6 +167,14 @@ int connect__on_authorised(struct mosquitto_db *db, struct mosquitto *context, v
 			}
 		}
 
+#ifdef WITH_PERSISTENCE
+		if(found_context->clean_start == false
+				&& (context->clean_start == true || found_context->session_expiry_interval == 0)){
+
+			/* The old session is not being resumed */
+			persist__log_client_delete(db, found_context);
+		}
+#endif
 		if(context->clean_start == true){
 			sub__clean_session(db, found_context);
 		}
@@ -174,6 +188,12 @@ int connect__on_authorised(struct mosquitto_db *db, struct mosquitto *context, v
 		do_disconnect(db, found_context, MOSQ_ERR_SUCCESS);
 	}
 
+	rc = acl__cache_init(db, context);
+	if(rc){
+		free(auth_data_out);
+		return rc;
+	}
+
 	rc = acl__find_acls(db, context);
 	if(rc){
 		free(auth_data_out);
@@ -227,6 +247,7 @@ int connect__on_authorised(struct mosquitto_db *db, struct mosquitto *context, v
 #ifdef WITH_PERSISTENCE
 	if(!context->clean_start){
 		db->persistence_changes++;
+		persist__log_client(db, context);
 	}
 #endif
 	context->maximum_qos = context->listener->maximum_qos;
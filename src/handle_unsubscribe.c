@@ -100,6 +100,7 @@ int handle__unsubscribe(struct mosquitto_db *db, struct mosquitto *context)
 
 		log__printf(NULL, MOSQ_LOG_DEBUG, "\t%s", sub);
 		rc = sub__remove(db, context, sub, db->subs, &reason);
+		sub__retain_queue_free(db, context, sub);
 		log__printf(NULL, MOSQ_LOG_UNSUBSCRIBE, "%s %s", context->id, sub);
 #ifdef WITH_GRAPH
 		network_graph_delete_sub_edge(context, sub);
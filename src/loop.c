@@ -121,6 +121,7 @@ int mosquitto_main_loop(struct mosquitto_db *db, mosq_sock_t *listensock, int li
 	time_t now = 0;
 	int time_count;
 	int fdcount;
+	int timeout;
 	struct mosquitto *context, *ctxt_tmp;
 #ifndef WIN32
 	sigset_t sigblock, origsig;
@@ -213,7 +214,7 @@ int mosquitto_main_loop(struct mosquitto_db *db, mosq_sock_t *listensock, int li
 
 #ifdef WITH_GRAPH
 		if(db->config->graph_interval > 0){
-			network_graph_update(db, db->config->graph_interval);
+			network_graph_publish(db);
 		}
 #endif
 
@@ -365,6 +366,7 @@ int mosquitto_main_loop(struct mosquitto_db *db, mosq_sock_t *listensock, int li
 		}
 #endif
 
+		timeout = 100;
 		time_count = 0;
 		HASH_ITER(hh_sock, db->contexts_by_sock, context, ctxt_tmp){
 			if(time_count > 0){
@@ -425,7 +427,14 @@ int mosquitto_main_loop(struct mosquitto_db *db, mosq_sock_t *listensock, int li
 						|| context->bridge
 						|| now - context->last_msg_in <= (time_t)(context->keepalive)*3/2){
 
+					if(sub__retain_queue_ready(context)){
+						sub__retain_queue_send(db, context, db->config->retained_delivery_batch);
+					}
 					if(db__message_write(db, context) == MOSQ_ERR_SUCCESS){
+						if(sub__retain_queue_ready(context)){
+							/* Send the next batch without waiting. */
+							timeout = 0;
+						}
 #ifdef WITH_EPOLL
 						if(context->current_out_packet || context->state == mosq_cs_connect_pending || context->ws_want_write){
 							if(!(context->events & EPOLLOUT)) {
@@ -477,13 +486,13 @@ int mosquitto_main_loop(struct mosquitto_db *db, mosq_sock_t *listensock, int li
 #ifndef WIN32
 		sigprocmask(SIG_SETMASK, &sigblock, &origsig);
 #ifdef WITH_EPOLL
-		fdcount = epoll_wait(db->epollfd, events, MAX_EVENTS, 100);
+		fdcount = epoll_wait(db->epollfd, events, MAX_EVENTS, timeout);
 #else
-		fdcount = poll(pollfds, pollfd_index, 100);
+		fdcount = poll(pollfds, pollfd_index, timeout);
 #endif
 		sigprocmask(SIG_SETMASK, &origsig, NULL);
 #else
-		fdcount = WSAPoll(pollfds, pollfd_index, 100);
+		fdcount = WSAPoll(pollfds, pollfd_index, timeout);
 #endif
 #ifdef WITH_EPOLL
 		switch(fdcount){
@@ -553,12 +562,12 @@ int mosquitto_main_loop(struct mosquitto_db *db, mosq_sock_t *listensock, int li
 		if(db->config->persistence && db->config->autosave_interval){
 			if(db->config->autosave_on_changes){
 				if(db->persistence_changes >= db->config->autosave_interval){
-					persist__backup(db, false);
+					persist__backup_background(db);
 					db->persistence_changes = 0;
 				}
 			}else{
 				if(last_backup + db->config->autosave_interval < mosquitto_time()){
-					persist__backup(db, false);
+					persist__backup_background(db);
 					last_backup = mosquitto_time();
 				}
 			}
@@ -567,9 +576,13 @@ int mosquitto_main_loop(struct mosquitto_db *db, mosq_sock_t *listensock, int li
 
 #ifdef WITH_PERSISTENCE
 		if(flag_db_backup){
-			persist__backup(db, false);
+			persist__backup_background(db);
 			flag_db_backup = false;
 		}
+#  ifndef WIN32
+		persist__background_check(db, false);
+#  endif
+		persist__log_flush(db);
 #endif
 		if(flag_reload){
 			log__printf(NULL, MOSQ_LOG_INFO, "Reloading config.");
@@ -400,6 +400,7 @@ int main(int argc, char *argv[])
 	if(config.persistence){
 		persist__backup(&int_db, true);
 	}
+	persist__log_close(&int_db);
 #endif
 	session_expiry__remove_all(&int_db);
 
@@ -450,6 +451,7 @@ int main(int argc, char *argv[])
 #ifdef WITH_GRAPH
 	network_graph_cleanup();
 #endif
+	memory__pool_cleanup();
 
 	return rc;
 }
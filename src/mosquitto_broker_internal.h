@@ -166,6 +166,11 @@ enum mosquitto_msg_origin{
 	mosq_mo_broker = 1
 };
 
+enum mosquitto__graph_format{
+	mosq_gf_json = 0,
+	mosq_gf_binary = 1
+};
+
 struct mosquitto__auth_plugin{
 	void *lib;
 	void *user_data;
@@ -273,6 +278,7 @@ struct mosquitto__listener {
 struct mosquitto__config {
 	bool allow_duplicate_messages;
 	int autosave_interval;
+	bool autosave_background;
 	bool autosave_on_changes;
 	bool check_retain_source;
 	char *clientid_prefixes;
@@ -296,15 +302,21 @@ struct mosquitto__config {
 	char *persistence_location;
 	char *persistence_file;
 	char *persistence_filepath;
+	bool persistence_log;
 	time_t persistent_client_expiration;
 	char *pid_file;
 	bool queue_qos0_messages;
 	bool per_listener_settings;
 	bool retain_available;
+	size_t retained_cache_size;
+	int retained_delivery_batch;
 	bool set_tcp_nodelay;
 	int sys_interval;
 	int graph_interval;
 	int graph_del_mult;
+	bool graph_delta;
+	int graph_keyframe_interval;
+	enum mosquitto__graph_format graph_format;
 	bool upgrade_outgoing_qos;
 	char *user;
 #ifdef WITH_WEBSOCKETS
@@ -348,11 +360,37 @@ struct mosquitto__subhier {
 	struct mosquitto__subhier *children;
 	struct mosquitto__subleaf *subs;
 	struct mosquitto__subshared *shared;
+	char *topic;
+	uint16_t topic_len;
+};
+
+/* Topic levels that hold retained messages, or lead to levels that do. Kept
+ * apart from struct mosquitto__subhier so that finding the retained messages
+ * for a wildcard subscription doesn't walk the levels that only have
+ * subscribers. */
+struct mosquitto__retainhier {
+	UT_hash_handle hh;
+	struct mosquitto__retainhier *parent;
+	struct mosquitto__retainhier *children;
 	struct mosquitto_msg_store *retained;
 	char *topic;
 	uint16_t topic_len;
 };
 
+/* The retained messages found for a subscription that haven't been sent to
+ * the client yet, msgs[pos] is the next. Holds a reference to each message. */
+struct mosquitto__retain_queue {
+	struct mosquitto__retain_queue *prev;
+	struct mosquitto__retain_queue *next;
+	char *sub;
+	struct mosquitto_msg_store **msgs;
+	int count;
+	int size;
+	int pos;
+	uint32_t identifier;
+	int qos;
+};
+
 struct mosquitto_msg_store_load{
 	UT_hash_handle hh;
 	dbid_t db_id;
@@ -372,6 +410,7 @@ struct mosquitto_msg_store{
 	char* topic;
 	mosquitto_property *properties;
 	mosquitto__payload_uhpa payload;
+	struct mosquitto__packet_buffer *packets;
 	time_t message_expiry_time;
 	uint32_t payloadlen;
 	uint16_t source_mid;
@@ -379,6 +418,15 @@ struct mosquitto_msg_store{
 	uint8_t qos;
 	bool retain;
 	uint8_t origin;
+	bool persisted;
+	bool is_retained; /* Still the retained message of its topic */
+#ifdef WITH_PERSISTENCE
+	/* Where the payload is in the mapped persistence file, if it can be
+	 * dropped from memory and read back from there. */
+	const void *payload_mapped;
+	struct mosquitto_msg_store *cache_prev;
+	struct mosquitto_msg_store *cache_next;
+#endif
 };
 
 struct mosquitto_client_msg{
@@ -393,6 +441,7 @@ struct mosquitto_client_msg{
 	enum mosquitto_msg_direction direction;
 	enum mosquitto_msg_state state;
 	bool dup;
+	bool persisted;
 };
 
 struct mosquitto__unpwd{
@@ -414,15 +463,79 @@ struct mosquitto__acl{
 	int ccount;
 };
 
+/* Topic levels of a list of ACLs, like struct mosquitto__subhier. Checking a
+ * topic walks its levels once instead of matching it against every ACL. The
+ * "+" and "#" levels are kept out of children so they need no lookup. */
+struct mosquitto__aclhier{
+	UT_hash_handle hh;
+	struct mosquitto__aclhier *children;
+	struct mosquitto__aclhier *child_plus;
+	struct mosquitto__aclhier *child_hash;
+	int access; /* Access of the ACLs that end at this level */
+	uint16_t topic_len;
+	char topic[];
+};
+
 struct mosquitto__acl_user{
 	struct mosquitto__acl_user *next;
 	char *username;
 	struct mosquitto__acl *acl;
+	struct mosquitto__aclhier *aclhier;
+};
+
+#define ACL_CACHE_SIZE 64
+
+/* A decision of mosquitto_acl_check() for a topic and access type. Only
+ * decisions made without asking a plugin are cached, plugins may look at the
+ * payload, qos or retain flag. The topic buffer is kept when the entry is
+ * replaced or cleared, and only grows, so a miss doesn't allocate once the
+ * buffers are big enough for the client's topics. */
+struct mosquitto__acl_cache_entry{
+	char *topic;
+	size_t topic_size;
+	unsigned int hash;
+	int access;
+	int rc;
+	bool used;
+};
+
+/* Per client cache of ACL decisions, indexed by hash of topic and access.
+ * Dropped when gen is older than db->acl_cache_gen. */
+struct mosquitto__acl_cache{
+	unsigned long gen;
+	struct mosquitto__acl_cache_entry entries[ACL_CACHE_SIZE];
+};
+
+#define SUB_CACHE_SIZE 1024
+
+/* Subscription tree nodes that a message published on topic is delivered
+ * to, in the order sub__search() finds them. Only used while epoch equals
+ * db->subs_epoch, which changes whenever subscriptions or tree nodes are
+ * added or removed. seen_hash is the last topic that missed this entry, a
+ * topic is only stored the second time it is seen in a row. */
+struct mosquitto__sub_cache_entry{
+	char *topic;
+	struct mosquitto__subhier **hiers;
+	unsigned long epoch;
+	unsigned int hash;
+	unsigned int seen_hash;
+	int hier_count;
+};
+
+/* Outcome of persistence database saves, for the $SYS tree. */
+struct mosquitto__persist_stats{
+	time_t last_save;
+	unsigned long saves;
+	unsigned long failures;
+	unsigned long last_duration; /* milliseconds */
+	bool saving;
+	bool last_failed;
 };
 
 struct mosquitto_db{
 	dbid_t last_db_id;
 	struct mosquitto__subhier *subs;
+	struct mosquitto__retainhier *retains;
 	struct mosquitto__unpwd *unpwd;
 	struct mosquitto__unpwd *psk_id;
 	struct mosquitto *contexts_by_id;
@@ -449,6 +562,12 @@ struct mosquitto_db{
 	int retained_count;
 #endif
 	int persistence_changes;
+#ifdef WITH_PERSISTENCE
+	struct mosquitto__persist_stats persist_stats;
+#endif
+	unsigned long acl_cache_gen;
+	unsigned long subs_epoch;
+	struct mosquitto__sub_cache_entry *sub_cache;
 	struct mosquitto *ll_for_free;
 #ifdef WITH_EPOLL
 	int epollfd;
@@ -609,7 +728,28 @@ int db__open(struct mosquitto__config *config, struct mosquitto_db *db);
 int db__close(struct mosquitto_db *db);
 #ifdef WITH_PERSISTENCE
 int persist__backup(struct mosquitto_db *db, bool shutdown);
+int persist__backup_background(struct mosquitto_db *db);
+#ifndef WIN32
+void persist__background_check(struct mosquitto_db *db, bool wait);
+#endif
 int persist__restore(struct mosquitto_db *db);
+int persist__log_open(struct mosquitto_db *db, bool truncate);
+void persist__log_close(struct mosquitto_db *db);
+void persist__log_flush(struct mosquitto_db *db);
+void persist__log_client(struct mosquitto_db *db, struct mosquitto *context);
+void persist__log_client_delete(struct mosquitto_db *db, struct mosquitto *context);
+void persist__log_client_msg(struct mosquitto_db *db, struct mosquitto *context, struct mosquitto_client_msg *cmsg);
+void persist__log_client_msg_delete(struct mosquitto_db *db, struct mosquitto *context, struct mosquitto_client_msg *cmsg);
+void persist__log_msg_store_delete(struct mosquitto_db *db, struct mosquitto_msg_store *stored);
+void persist__log_retain(struct mosquitto_db *db, struct mosquitto_msg_store *stored);
+void persist__log_sub(struct mosquitto_db *db, struct mosquitto *context, const char *sub, int qos, uint32_t identifier, int options);
+void persist__log_sub_delete(struct mosquitto_db *db, struct mosquitto *context, const char *sub);
+int persist__payload_load(struct mosquitto_db *db, struct mosquitto_msg_store *stored);
+int persist__payload_pin(struct mosquitto_db *db, struct mosquitto_msg_store *stored);
+void persist__payload_unretain(struct mosquitto_db *db, struct mosquitto_msg_store *stored);
+void persist__payload_release(struct mosquitto_db *db, struct mosquitto_msg_store *stored);
+void persist__payload_free(struct mosquitto_db *db, struct mosquitto_msg_store *stored);
+void persist__map_close(struct mosquitto_db *db);
 #endif
 void db__limits_set(unsigned long inflight_bytes, int queued, unsigned long queued_bytes);
 /* Return the number of in-flight messages in count. */
@@ -633,6 +773,8 @@ void db__msg_store_compact(struct mosquitto_db *db);
 int db__message_reconnect_reset(struct mosquitto_db *db, struct mosquitto *context);
 bool db__ready_for_flight(struct mosquitto_msg_data *msgs, int qos);
 bool db__ready_for_queue(struct mosquitto *context, int qos, struct mosquitto_msg_data *msg_data);
+struct mosquitto_client_msg *db__client_msg_new(void);
+void db__client_msg_free(struct mosquitto_client_msg *msg);
 void sys_tree__init(struct mosquitto_db *db);
 void sys_tree__update(struct mosquitto_db *db, int interval, time_t start_time);
 
@@ -645,7 +787,12 @@ int sub__remove(struct mosquitto_db *db, struct mosquitto *context, const char *
 void sub__tree_print(struct mosquitto__subhier *root, int level);
 int sub__clean_session(struct mosquitto_db *db, struct mosquitto *context);
 int sub__retain_queue(struct mosquitto_db *db, struct mosquitto *context, const char *sub, int sub_qos, uint32_t subscription_identifier);
+void sub__retain_queue_send(struct mosquitto_db *db, struct mosquitto *context, int limit);
+bool sub__retain_queue_ready(struct mosquitto *context);
+void sub__retain_queue_free(struct mosquitto_db *db, struct mosquitto *context, const char *sub);
+struct mosquitto__retainhier *retain__add_hier_entry(struct mosquitto__retainhier *parent, struct mosquitto__retainhier **sibling, const char *topic, size_t len);
 int sub__messages_queue(struct mosquitto_db *db, const char *source_id, const char *topic, int qos, int retain, struct mosquitto_msg_store **stored);
+void sub__cache_free(struct mosquitto_db *db);
 
 /* ============================================================
  * Context functions
@@ -691,6 +838,10 @@ int property__process_disconnect(struct mosquitto *context, mosquitto_property *
  * Security related functions
  * ============================================================ */
 int acl__find_acls(struct mosquitto_db *db, struct mosquitto *context);
+int acl__cache_init(struct mosquitto_db *db, struct mosquitto *context);
+void acl__cache_clear(struct mosquitto *context);
+void acl__cache_free(struct mosquitto *context);
+void acl__patterns_free(struct mosquitto *context);
 int mosquitto_security_module_init(struct mosquitto_db *db);
 int mosquitto_security_module_cleanup(struct mosquitto_db *db);
 
@@ -1,6 +1,5 @@
 #include <string.h>
 #include <math.h>
-#include <cJSON/cJSON.h>
 #include <time.h>
 
 #  if defined(__APPLE__)
@@ -17,19 +16,43 @@
 #include "memory_mosq.h"
 #include "sys_tree.h"
 #include "network_graph.h"
+#include "graph_json.h"
+#include "graph_binary.h"
+#include "graph_ring.h"
+#include "graph_thread.h"
 
 #define GRAPH_QOS       2
 #define BUFLEN          100
+#define JSON_BUFLEN     4096
+
+#define RING_EVENTS     16384
+#define RING_STRINGS    (1024 * 1024)
+
+#define GRAPH_TOPIC             "$NETWORK"
+#define GRAPH_DELTA_TOPIC       "$NETWORK/delta"
+#define GRAPH_SNAPSHOT_TOPIC    "$NETWORK/snapshot"
+
+#define GRAPH_BINARY_MAGIC      "NG"
+#define GRAPH_BINARY_VERSION    2
 
-#define ID_STR_LEN      26
 #define ID_CHARS_LEN    62
 
 /*****************************************************************************/
 
-static struct network_graph *graph = NULL;      /**< global graph structure */
-static cJSON_Hooks *hooks = NULL;
+static struct network_graph *graph = NULL;      /**< global graph structure, owned by the graph thread */
 
 static int ttl_cnt = 0;
+static int keyframe_interval = 0;
+static int graph_interval = 0;
+
+static struct graph_ring *ring = NULL;          /**< events for the graph thread, NULL if the graph is off */
+static struct graph_pending *pending = NULL;    /**< connects and disconnects waiting for room in the ring */
+static struct graph_pending **pending_tail = &pending;
+
+static uint64_t last_graph_id = 0;              /**< last graph id given to a connection */
+static uint64_t msg_ids[GRAPH_MSG_TOPICS];      /**< messages the graph thread has the topic of, mirrors graph->msg_topics */
+static unsigned long dropped_logged = 0;        /**< dropped events that were logged */
+static time_t dropped_log_time = 0;
 
 static unsigned long memcount = 0;
 static unsigned long max_memcount = 0;
@@ -54,13 +77,11 @@ static unsigned long sdbm_hash(const char *str) {
     return hash;
 }
 
-static char *create_random_id(void) {
-    char *id = (char *)malloc(ID_STR_LEN * sizeof(char));
-    for (int i = 0; i < ID_STR_LEN-1; i++) {
+static void create_random_id(char *id) {
+    for (int i = 0; i < GRAPH_ID_STR_LEN-1; i++) {
         id[i] = id_chars[random() % ID_CHARS_LEN];
     }
-    id[ID_STR_LEN-1] = '\0';
-    return id;
+    id[GRAPH_ID_STR_LEN-1] = '\0';
 }
 
 /*
@@ -91,6 +112,22 @@ void *graph__calloc(size_t nmemb, size_t size) {
     return mem;
 }
 
+/*
+ * Realloc wrapper for counting graph memory usage
+ */
+void *graph__realloc(void *ptr, size_t size) {
+    size_t old_size = ptr ? malloc_usable_size(ptr) : 0;
+    void *mem = realloc(ptr, size);
+    if (mem != NULL) {
+        memcount -= old_size;
+        memcount += malloc_usable_size(mem);
+        if (memcount > max_memcount){
+            max_memcount = memcount;
+        }
+    }
+    return mem;
+}
+
 /*
  * Free wrapper for counting graph memory usage
  */
@@ -119,36 +156,132 @@ char *graph__strdup(const char *s) {
 /*****************************************************************************/
 
 /*
- * Creates an ip container struct from a given IP address
+ * Starts an event in the pending delta. Returns false if delta mode is off.
  */
-static struct ip_container *create_ip_container(const char *ip_addr) {
-    struct ip_container *ip_cont = (struct ip_container *)graph__malloc(sizeof(struct ip_container));
-    if (!ip_cont) {
-        return NULL;
+static bool graph_delta_start(const char *op, const char *type) {
+    if (graph->delta == NULL) return false;
+    graph_json_object_start(graph->delta, NULL);
+    graph_json_add_string(graph->delta, "op", op);
+    graph_json_add_string(graph->delta, "type", type);
+    return true;
+}
+
+/*
+ * Records an added or deleted IP container
+ */
+static void graph_delta_ip(const char *op, struct ip_container *ip_cont) {
+    /*
+    {
+        "op": "add",
+        "type": "ip",
+        "id": "<random id>"
+    }
+    */
+    if (!graph_delta_start(op, "ip")) return;
+    graph_json_add_string(graph->delta, "id", ip_cont->id);
+    graph_json_object_end(graph->delta);
+}
+
+/*
+ * Records an added, deleted or updated client
+ */
+static void graph_delta_client(const char *op, struct ip_container *ip_cont, struct client *client) {
+    /*
+    {
+        "op": "update",
+        "type": "client",
+        "ip": "<random id>",
+        "name": "client1",
+        "latency": 400
     }
-    ip_cont->next = NULL;
-    ip_cont->prev = NULL;
+    */
+    if (!graph_delta_start(op, "client")) return;
+    graph_json_add_string(graph->delta, "ip", ip_cont->id);
+    graph_json_add_string(graph->delta, "name", client->name);
+    graph_json_add_number(graph->delta, "latency", client->latency);
+    graph_json_object_end(graph->delta);
+}
 
-    ip_cont->id = create_random_id();
+/*
+ * Records an added, deleted or updated topic
+ */
+static void graph_delta_topic(const char *op, struct topic *topic) {
+    /*
+    {
+        "op": "update",
+        "type": "topic",
+        "name": "topic1/sub_topic1",
+        "bps": 9000
+    }
+    */
+    if (!graph_delta_start(op, "topic")) return;
+    graph_json_add_string(graph->delta, "name", topic->name);
+    graph_json_add_number(graph->delta, "bps", topic->bytes_per_sec);
+    graph_json_object_end(graph->delta);
+}
 
-    ip_cont->client_dict = (struct client_dict *)graph__malloc(sizeof(struct client_dict));
-    if (!ip_cont->client_dict) {
-        graph__free(ip_cont->id);
-        graph__free(ip_cont);
-        return NULL;
+/*
+ * Records an added, deleted or updated publisher edge
+ */
+static void graph_delta_pub_edge(const char *op, struct client *client, struct pub_edge *pub_edge) {
+    /*
+    {
+        "op": "update",
+        "type": "pub",
+        "client": "client1",
+        "topic": "topic1/sub_topic1",
+        "bps": 9000
+    }
+    */
+    if (!graph_delta_start(op, "pub")) return;
+    graph_json_add_string(graph->delta, "client", client->name);
+    graph_json_add_string(graph->delta, "topic", pub_edge->pub->name);
+    graph_json_add_number(graph->delta, "bps", pub_edge->bytes_per_sec);
+    graph_json_object_end(graph->delta);
+}
+
+/*
+ * Records an added, deleted or updated subscription edge
+ */
+static void graph_delta_sub_edge(const char *op, struct topic *topic, struct sub_edge *sub_edge) {
+    /*
+    {
+        "op": "update",
+        "type": "sub",
+        "topic": "topic1/sub_topic1",
+        "client": "client1",
+        "bps": 9000,
+        "mps": 10,
+        "drops": 0
     }
+    */
+    if (!graph_delta_start(op, "sub")) return;
+    graph_json_add_string(graph->delta, "topic", topic->name);
+    graph_json_add_string(graph->delta, "client", sub_edge->sub->name);
+    graph_json_add_number(graph->delta, "bps", sub_edge->bytes_per_sec);
+    graph_json_add_number(graph->delta, "mps", sub_edge->msgs_per_sec);
+    graph_json_add_number(graph->delta, "drops", sub_edge->drops_last);
+    graph_json_object_end(graph->delta);
+}
+
+/*****************************************************************************/
 
-    ip_cont->client_dict->client_list = (struct client **)graph__calloc(1, sizeof(struct client *));
-    if (!ip_cont->client_dict->client_list) {
-        graph__free(ip_cont->id);
-        graph__free(ip_cont->client_dict);
+/*
+ * Creates an ip container struct from a given IP address
+ */
+static struct ip_container *create_ip_container(const char *ip_addr) {
+    size_t len = strlen(ip_addr) + 1;
+    struct ip_container *ip_cont = (struct ip_container *)graph__malloc(sizeof(struct ip_container) + len);
+    if (!ip_cont) {
+        return NULL;
+    }
+    create_random_id(ip_cont->id);
+    if (graph_table_init(&ip_cont->clients, 1)) {
         graph__free(ip_cont);
         return NULL;
     }
-    ip_cont->client_dict->max_size = 1;
-    ip_cont->client_dict->used = 0;
-
     ip_cont->hash = sdbm_hash(ip_addr);
+    memcpy(ip_cont->address, ip_addr, len);
     return ip_cont;
 }
 
@@ -156,15 +289,20 @@ static struct ip_container *create_ip_container(const char *ip_addr) {
  * Creates an client struct from a given client id and ip address
  */
 static struct client *create_client(const char *id, const char *address) {
-    struct client *client = (struct client *)graph__malloc(sizeof(struct client));
+    size_t len = strlen(id) + 1;
+    struct client *client = (struct client *)graph__malloc(sizeof(struct client) + len);
     if (!client) return NULL;
     client->latency = NAN;
     client->time_prev = -1;
-    client->name = graph__strdup(id);
     client->pub_list = NULL;
-    client->next = NULL;
-    client->prev = NULL;
+    memset(client->pub_cache, 0, sizeof(client->pub_cache));
+    client->sub_list = NULL;
+    client->id = 0;
+    client->ip = NULL;
     client->hash = sdbm_hash(id);
+    client->str_gen = 0;
+    client->str_idx = 0;
+    memcpy(client->name, id, len);
     return client;
 }
 
@@ -172,18 +310,20 @@ static struct client *create_client(const char *id, const char *address) {
  * Creates an topic struct from a given topic name
  */
 static struct topic *create_topic(const char *name, uint8_t retain) {
-    struct topic *topic = (struct topic *)graph__malloc(sizeof(struct topic));
+    size_t len = strlen(name) + 1;
+    struct topic *topic = (struct topic *)graph__malloc(sizeof(struct topic) + len);
     if (!topic) return NULL;
     topic->retain = retain;
     topic->ttl_cnt = ttl_cnt;
-    topic->name = graph__strdup(name);
-    topic->next = NULL;
-    topic->prev = NULL;
     topic->sub_list = NULL;
     topic->hash = sdbm_hash(name);
     topic->ref_cnt = 0;
     topic->bytes = 0;
     topic->bytes_per_sec = 0.0;
+    topic->str_gen = 0;
+    topic->str_idx = 0;
+    topic->msg_refs = 0;
+    memcpy(topic->name, name, len);
     return topic;
 }
 
@@ -196,8 +336,17 @@ static struct sub_edge *create_sub_edge(const char *src, const char *tgt) {
     struct sub_edge *sub_edge = (struct sub_edge *)graph__malloc(sizeof(struct sub_edge));
     if (!sub_edge) return NULL;
     sub_edge->sub = NULL;
+    sub_edge->topic = NULL;
     sub_edge->next = NULL;
     sub_edge->prev = NULL;
+    sub_edge->client_next = NULL;
+    sub_edge->client_prev = NULL;
+    sub_edge->bytes = 0;
+    sub_edge->msgs = 0;
+    sub_edge->drops = 0;
+    sub_edge->drops_last = 0;
+    sub_edge->bytes_per_sec = 0.0;
+    sub_edge->msgs_per_sec = 0.0;
     return sub_edge;
 }
 
@@ -220,67 +369,37 @@ static struct pub_edge *create_pub_edge(const char *src, const char *tgt, struct
 }
 
 /*
- * Searches for an IP container given an address
+ * Key comparisons for the graph tables, only called on equal hashes
  */
-static struct ip_container *find_ip_container(const char *address) {
-    unsigned long hash = sdbm_hash(address),
-                   idx = hash % graph->ip_dict->max_size;
-    struct ip_container *ip_cont = graph->ip_dict->ip_list[idx];
-    for (; ip_cont != NULL; ip_cont = ip_cont->next) {
-        if (hash == ip_cont->hash) {
-            return ip_cont;
-        }
-    }
-    return NULL;
+static bool ip_container_match(const void *item, const void *key) {
+    return strcmp(((const struct ip_container *)item)->address, (const char *)key) == 0;
 }
 
-/*
- * Change the size of the ip hash table
- */
-static int graph_set_ip_dict_size(unsigned int new_size) {
-    size_t idx;
-    struct ip_container **ip_list_copy, *temp;
-    ip_list_copy = graph->ip_dict->ip_list;
-    graph->ip_dict->ip_list = (struct ip_container **)graph__calloc(new_size, sizeof(struct ip_container *));
-    if (graph->ip_dict->ip_list == NULL) return -1;
+static bool client_match(const void *item, const void *key) {
+    return strcmp(((const struct client *)item)->name, (const char *)key) == 0;
+}
 
-    // rehash all elems of old dict and place them in new dict
-    for (size_t i = 0; i < graph->ip_dict->max_size; ++i) {
-        while (ip_list_copy[i] != NULL) {
-            temp = ip_list_copy[i];
-            ip_list_copy[i] = ip_list_copy[i]->next;
-            idx = temp->hash % new_size;
-            temp->prev = NULL;
-            temp->next = graph->ip_dict->ip_list[idx];
-            if (graph->ip_dict->ip_list[idx] != NULL) {
-                graph->ip_dict->ip_list[idx]->prev = temp;
-            }
-            graph->ip_dict->ip_list[idx] = temp;
-        }
-    }
-    graph->ip_dict->max_size = new_size;
+static bool client_id_match(const void *item, const void *key) {
+    return ((const struct client *)item)->id == *(const uint64_t *)key;
+}
 
-    graph__free(ip_list_copy);
+static bool topic_match(const void *item, const void *key) {
+    return strcmp(((const struct topic *)item)->name, (const char *)key) == 0;
+}
 
-    return 0;
+/*
+ * Searches for an IP container given an address
+ */
+static struct ip_container *find_ip_container(const char *address) {
+    return (struct ip_container *)graph_table_find(&graph->ips, sdbm_hash(address), address, ip_container_match);
 }
 
 /*
  * Adds an IP container to the network graph
  */
 static int graph_add_ip(struct ip_container *ip_cont) {
-    size_t idx;
-    if (graph->ip_dict->used == graph->ip_dict->max_size) {
-        graph_set_ip_dict_size(graph->ip_dict->max_size * 2);
-    }
-
-    idx = ip_cont->hash % graph->ip_dict->max_size;
-    ip_cont->next = graph->ip_dict->ip_list[idx];
-    if (graph->ip_dict->ip_list[idx] != NULL) {
-        graph->ip_dict->ip_list[idx]->prev = ip_cont;
-    }
-    graph->ip_dict->ip_list[idx] = ip_cont;
-    ++graph->ip_dict->used;
+    if (graph_table_add(&graph->ips, ip_cont->hash, ip_cont)) return -1;
+    graph_delta_ip("add", ip_cont);
     return 0;
 }
 
@@ -288,88 +407,55 @@ static int graph_add_ip(struct ip_container *ip_cont) {
  * Searches for a client in an IP container given a client id
  */
 static struct client *find_client(struct ip_container *ip_cont, const char *id) {
-    unsigned long hash = sdbm_hash(id),
-                   idx = hash % ip_cont->client_dict->max_size;
-    struct client *client = ip_cont->client_dict->client_list[idx];
-    for (; client != NULL; client = client->next) {
-        if (hash == client->hash) {
-            return client;
-        }
-    }
-    return NULL;
+    return (struct client *)graph_table_find(&ip_cont->clients, sdbm_hash(id), id, client_match);
 }
 
 /*
- * Change the size of the client hash table
+ * Adds a client to an IP container
  */
-static int graph_set_client_dict_size(struct ip_container *ip_cont, unsigned int new_size) {
-    size_t idx;
-    struct client **client_list_copy, *temp;
-    client_list_copy = ip_cont->client_dict->client_list;
-    ip_cont->client_dict->client_list = (struct client **)graph__calloc(new_size, sizeof(struct client *));
-    if (ip_cont->client_dict->client_list == NULL) return -1;
-
-    // rehash all elems of old dict and place them in new dict
-    for (size_t i = 0; i < ip_cont->client_dict->max_size; ++i) {
-        while (client_list_copy[i] != NULL) {
-            temp = client_list_copy[i];
-            client_list_copy[i] = client_list_copy[i]->next;
-            idx = temp->hash % new_size;
-            temp->prev = NULL;
-            temp->next = ip_cont->client_dict->client_list[idx];
-            if (ip_cont->client_dict->client_list[idx] != NULL) {
-                ip_cont->client_dict->client_list[idx]->prev = temp;
-            }
-            ip_cont->client_dict->client_list[idx] = temp;
-        }
-    }
-    ip_cont->client_dict->max_size = new_size;
-
-    graph__free(client_list_copy);
-
+static int graph_add_client(struct ip_container *ip_cont, struct client *client) {
+    if (graph_table_add(&ip_cont->clients, client->hash, client)) return -1;
+    client->ip = ip_cont;
+    graph_delta_client("add", ip_cont, client);
     return 0;
 }
 
 /*
- * Adds a client to an IP container
+ * Searches for a client given the graph id of its connection
  */
-static int graph_add_client(struct ip_container *ip_cont, struct client *client) {
-    size_t idx;
-    if (ip_cont->client_dict->used == ip_cont->client_dict->max_size) {
-        graph_set_client_dict_size(ip_cont, ip_cont->client_dict->max_size * 2);
-    }
+static struct client *find_client_by_id(uint64_t id) {
+    return (struct client *)graph_table_find(&graph->ids, id, &id, client_id_match);
+}
 
-    idx = client->hash % ip_cont->client_dict->max_size;
-    client->next = ip_cont->client_dict->client_list[idx];
-    if (ip_cont->client_dict->client_list[idx] != NULL) {
-        ip_cont->client_dict->client_list[idx]->prev = client;
-    }
-    ip_cont->client_dict->client_list[idx] = client;
-    ++ip_cont->client_dict->used;
-    return 0;
+/*
+ * Adds a client to the client id hash table
+ */
+static int graph_add_client_id(struct client *client) {
+    return graph_table_add(&graph->ids, client->id, client);
+}
+
+/*
+ * Removes a client from the client id hash table
+ */
+static void graph_remove_client_id(struct client *client) {
+    graph_table_remove(&graph->ids, client->id, client);
+    graph_table_shrink(&graph->ids);
 }
+
 /*
  * Searches for a published topic
  */
 static struct topic *find_topic(const char *topic) {
-    unsigned long hash = sdbm_hash(topic),
-                        idx = hash % graph->topic_dict->max_size;
-    struct topic *curr = graph->topic_dict->topic_list[idx];
-    for (; curr != NULL; curr = curr->next) {
-        if (hash == curr->hash) {
-            return curr;
-        }
-    }
-    return NULL;
+    return (struct topic *)graph_table_find(&graph->topics, sdbm_hash(topic), topic, topic_match);
 }
 
 /*
- * Searches for a sub edge
+ * Searches for a sub edge in the subscriptions of a client
  */
 static struct sub_edge *find_sub_edge(struct topic *topic, struct client *client) {
-    struct sub_edge *curr = topic->sub_list;
-    for (; curr != NULL; curr = curr->next) {
-        if (curr->sub == client) {
+    struct sub_edge *curr = client->sub_list;
+    for (; curr != NULL; curr = curr->client_next) {
+        if (curr->topic == topic) {
             return curr;
         }
     }
@@ -390,56 +476,73 @@ static struct pub_edge *find_pub_edge(struct client *client, struct topic *topic
 }
 
 /*
- * Change the size of the topic hash table
+ * Searches the pub edges a client published to last, moving a hit to the front
  */
-static int graph_set_topic_dict_size(unsigned int new_size) {
-    size_t idx;
-    struct topic **topic_list_copy, *temp;
-    topic_list_copy = graph->topic_dict->topic_list;
-    graph->topic_dict->topic_list = (struct topic **)graph__calloc(new_size, sizeof(struct topic *));
-    if (graph->topic_dict->topic_list == NULL) return -1;
-
-    // rehash all elems of old dict and place them in new dict
-    for (size_t i = 0; i < graph->topic_dict->max_size; ++i) {
-        while (topic_list_copy[i] != NULL) {
-            temp = topic_list_copy[i];
-            topic_list_copy[i] = topic_list_copy[i]->next;
-            idx = temp->hash % new_size;
-            temp->prev = NULL;
-            temp->next = graph->topic_dict->topic_list[idx];
-            if (graph->topic_dict->topic_list[idx] != NULL) {
-                graph->topic_dict->topic_list[idx]->prev = temp;
+static struct pub_edge *pub_cache_find(struct client *client, const char *topic) {
+    struct pub_edge *pub_edge;
+    for (int i = 0; i < GRAPH_PUB_CACHE_SIZE && client->pub_cache[i] != NULL; ++i) {
+        pub_edge = client->pub_cache[i];
+        if (strcmp(pub_edge->pub->name, topic) == 0) {
+            for (; i > 0; --i) {
+                client->pub_cache[i] = client->pub_cache[i-1];
             }
-            graph->topic_dict->topic_list[idx] = temp;
+            client->pub_cache[0] = pub_edge;
+            return pub_edge;
         }
     }
-    graph->topic_dict->max_size = new_size;
+    return NULL;
+}
 
-    graph__free(topic_list_copy);
+/*
+ * Puts a pub edge at the front of the cache, dropping the least recently used one
+ */
+static void pub_cache_add(struct client *client, struct pub_edge *pub_edge) {
+    for (int i = GRAPH_PUB_CACHE_SIZE-1; i > 0; --i) {
+        client->pub_cache[i] = client->pub_cache[i-1];
+    }
+    client->pub_cache[0] = pub_edge;
+}
 
-    return 0;
+/*
+ * Removes a pub edge that is about to be freed from the cache
+ */
+static void pub_cache_remove(struct client *client, struct pub_edge *pub_edge) {
+    int i, j;
+    for (i = 0, j = 0; i < GRAPH_PUB_CACHE_SIZE; ++i) {
+        if (client->pub_cache[i] != pub_edge) {
+            client->pub_cache[j++] = client->pub_cache[i];
+        }
+    }
+    for (; j < GRAPH_PUB_CACHE_SIZE; ++j) {
+        client->pub_cache[j] = NULL;
+    }
 }
 
 /*
  * Adds a topic to the topic list
  */
 static int graph_add_topic(struct topic *topic) {
-    size_t idx;
-    if (graph->topic_dict->used == graph->topic_dict->max_size) {
-        graph_set_topic_dict_size(graph->topic_dict->max_size * 2);
-    }
-
-    idx = topic->hash % graph->topic_dict->max_size;
-    topic->next = graph->topic_dict->topic_list[idx];
-    if (graph->topic_dict->topic_list[idx] != NULL) {
-        graph->topic_dict->topic_list[idx]->prev = topic;
-    }
-    graph->topic_dict->topic_list[idx] = topic;
-    ++graph->topic_dict->used;
+    if (graph_table_add(&graph->topics, topic->hash, topic)) return -1;
+    graph_delta_topic("add", topic);
 
     return 0;
 }
 
+/*
+ * Unlinks a sub edge from the subscriptions of its client
+ */
+static inline void graph_detach_client_sub(struct sub_edge *sub_edge) {
+    if (sub_edge->sub->sub_list == sub_edge) {
+        sub_edge->sub->sub_list = sub_edge->client_next;
+    }
+    if (sub_edge->client_next != NULL) {
+        sub_edge->client_next->client_prev = sub_edge->client_prev;
+    }
+    if (sub_edge->client_prev != NULL) {
+        sub_edge->client_prev->client_next = sub_edge->client_next;
+    }
+}
+
 /*
  * Delete all the subcription edges of a topic
  */
@@ -448,38 +551,28 @@ static int graph_delete_topic_sub_edges(struct topic *topic) {
     while (curr != NULL) {
         temp = curr;
         curr = curr->next;
+        graph_detach_client_sub(temp);
         graph__free(temp);
     }
     topic->sub_list = NULL;
     return 0;
 }
 
-/*
- * Detaches a topic from the topic list
- */
-static inline void graph_detach_topic(struct topic *topic) {
-    size_t idx = topic->hash % graph->topic_dict->max_size;
-    if (graph->topic_dict->topic_list[idx] == topic) {
-        graph->topic_dict->topic_list[idx] = graph->topic_dict->topic_list[idx]->next;
-    }
-    if (topic->next != NULL) {
-        topic->next->prev = topic->prev;
-    }
-    if (topic->prev != NULL) {
-        topic->prev->next = topic->next;
-    }
-}
-
 /*
  * Delete a topic
  */
 static int graph_delete_topic(struct topic *topic) {
-    graph_detach_topic(topic);
+    graph_delta_topic("delete", topic);
+    if (topic->msg_refs > 0) {
+        for (int i = 0; i < GRAPH_MSG_TOPICS; i++) {
+            if (graph->msg_topics[i].topic == topic) {
+                graph->msg_topics[i].topic = NULL;
+            }
+        }
+    }
+    graph_table_remove(&graph->topics, topic->hash, topic);
     graph_delete_topic_sub_edges(topic);
-    graph__free(topic->name);
     graph__free(topic);
-
-    --graph->topic_dict->used;
     return 0;
 }
 
@@ -487,11 +580,21 @@ static int graph_delete_topic(struct topic *topic) {
  * Adds a sub edge to the sub list
  */
 static int graph_add_sub_edge(struct topic *topic, struct sub_edge *sub_edge) {
+    struct client *client = sub_edge->sub;
+
+    sub_edge->topic = topic;
     sub_edge->next = topic->sub_list;
     if (topic->sub_list != NULL) {
         topic->sub_list->prev = sub_edge;
     }
     topic->sub_list = sub_edge;
+
+    sub_edge->client_next = client->sub_list;
+    if (client->sub_list != NULL) {
+        client->sub_list->client_prev = sub_edge;
+    }
+    client->sub_list = sub_edge;
+    graph_delta_sub_edge("add", topic, sub_edge);
     return 0;
 }
 
@@ -499,6 +602,7 @@ static int graph_add_sub_edge(struct topic *topic, struct sub_edge *sub_edge) {
  * Delete a sub edge from the sub list
  */
 static int graph_delete_sub(struct topic *topic, struct sub_edge *sub_edge) {
+    graph_delta_sub_edge("delete", topic, sub_edge);
     if (topic->sub_list == sub_edge) {
         topic->sub_list = topic->sub_list->next;
     }
@@ -508,20 +612,11 @@ static int graph_delete_sub(struct topic *topic, struct sub_edge *sub_edge) {
     if (sub_edge->prev != NULL) {
         sub_edge->prev->next = sub_edge->next;
     }
+    graph_detach_client_sub(sub_edge);
     graph__free(sub_edge);
     return 0;
 }
 
-/*
- * Delete a sub edge from the sub list
- */
-static int graph_delete_sub_edge(struct topic *topic, struct client *client) {
-    struct sub_edge *sub_edge = find_sub_edge(topic, client);
-    if (sub_edge == NULL) return -1;
-    graph_delete_sub(topic, sub_edge);
-    return 0;
-}
-
 /*
  * Adds a pub edge to the pub list
  */
@@ -531,6 +626,7 @@ static int graph_add_pub_edge(struct client *client, struct pub_edge *pub_edge)
         client->pub_list->prev = pub_edge;
     }
     client->pub_list = pub_edge;
+    graph_delta_pub_edge("add", client, pub_edge);
     return 0;
 }
 
@@ -562,6 +658,7 @@ static int graph_delete_client_pub_edges(struct client *client) {
         graph__free(temp);
     }
     client->pub_list = NULL;
+    memset(client->pub_cache, 0, sizeof(client->pub_cache));
     return 0;
 }
 
@@ -569,6 +666,8 @@ static int graph_delete_client_pub_edges(struct client *client) {
  * Delete a pub edge from the pub list
  */
 static int graph_delete_pub(struct client *client, struct pub_edge *pub_edge) {
+    graph_delta_pub_edge("delete", client, pub_edge);
+    pub_cache_remove(client, pub_edge);
     if (client->pub_list == pub_edge) {
         client->pub_list = client->pub_list->next;
     }
@@ -597,25 +696,12 @@ static int graph_delete_pub_edge(struct client *client, struct topic *topic) {
  * Delete an IP container
  */
 static int graph_delete_ip(struct ip_container *ip_cont) {
-    size_t idx = ip_cont->hash % graph->ip_dict->max_size;
-    if (graph->ip_dict->ip_list[idx] == ip_cont) {
-        graph->ip_dict->ip_list[idx] = graph->ip_dict->ip_list[idx]->next;
-    }
-    if (ip_cont->next != NULL) {
-        ip_cont->next->prev = ip_cont->prev;
-    }
-    if (ip_cont->prev != NULL) {
-        ip_cont->prev->next = ip_cont->next;
-    }
-    graph__free(ip_cont->id);
-    graph__free(ip_cont->client_dict->client_list);
-    graph__free(ip_cont->client_dict);
+    graph_delta_ip("delete", ip_cont);
+    graph_table_remove(&graph->ips, ip_cont->hash, ip_cont);
+    graph_table_cleanup(&ip_cont->clients);
     graph__free(ip_cont);
 
-    if (graph->ip_dict->used < graph->ip_dict->max_size / 4) {
-        graph_set_ip_dict_size(graph->ip_dict->max_size / 2);
-    }
-    --graph->ip_dict->used;
+    graph_table_shrink(&graph->ips);
     return 0;
 }
 
@@ -623,37 +709,23 @@ static int graph_delete_ip(struct ip_container *ip_cont) {
  * Delete a client
  */
 static int graph_delete_client(struct ip_container *ip_cont, struct client *client) {
-    struct topic *curr;
-    size_t idx = client->hash % ip_cont->client_dict->max_size;
-    if (ip_cont->client_dict->client_list[idx] == client) {
-        ip_cont->client_dict->client_list[idx] = ip_cont->client_dict->client_list[idx]->next;
-    }
-    if (client->next != NULL) {
-        client->next->prev = client->prev;
-    }
-    if (client->prev != NULL) {
-        client->prev->next = client->next;
-    }
+    graph_remove_client_id(client);
+    graph_table_remove(&ip_cont->clients, client->hash, client);
 
     // unlink client from all subbed topics
-    for (size_t i = 0; i < graph->topic_dict->max_size; ++i) {
-        curr = graph->topic_dict->topic_list[i];
-        for (; curr != NULL; curr = curr->next) {
-            graph_delete_sub_edge(curr, client);
-        }
+    while (client->sub_list != NULL) {
+        graph_delete_sub(client->sub_list->topic, client->sub_list);
     }
 
     graph_delete_client_pub_edges(client);
-    graph__free(client->name);
+    // deleting the client also deletes its pub edges for delta consumers
+    graph_delta_client("delete", ip_cont, client);
     graph__free(client);
 
-    if (ip_cont->client_dict->used < ip_cont->client_dict->max_size / 4) {
-        graph_set_client_dict_size(ip_cont, ip_cont->client_dict->max_size / 2);
-    }
-    --ip_cont->client_dict->used;
+    graph_table_shrink(&ip_cont->clients);
 
     // if IP container is empty, delete it
-    if (ip_cont->client_dict->used == 0) {
+    if (ip_cont->clients.used == 0) {
         graph_delete_ip(ip_cont);
     }
     return 0;
@@ -661,158 +733,191 @@ static int graph_delete_client(struct ip_container *ip_cont, struct client *clie
 
 /*****************************************************************************/
 
+static void *graph_thread_main(void *arg);
+
 int network_graph_init(struct mosquitto_db *db) {
     if (db->config->graph_interval == 0) {
         return 0;
     }
     ttl_cnt = db->config->graph_del_mult;
+    keyframe_interval = db->config->graph_keyframe_interval;
+    graph_interval = db->config->graph_interval;
 
     graph = (struct network_graph *)graph__malloc(sizeof(struct network_graph));
     if (!graph) return -1;
 
     graph->changed = false;
-
-    graph->ip_dict = (struct ip_dict *)graph__malloc(sizeof(struct ip_dict));
-    if (!graph->ip_dict) return -1;
-    graph->ip_dict->ip_list = (struct ip_container **)graph__calloc(1, sizeof(struct ip_container *));
-    if (!graph->ip_dict->ip_list) return -1;
-    graph->ip_dict->max_size = 1;
-    graph->ip_dict->used = 0;
-
-    graph->topic_dict = (struct topic_dict *)graph__malloc(sizeof(struct topic_dict));
-    if (!graph->topic_dict) return -1;
-    graph->topic_dict->topic_list = (struct topic **)graph__calloc(1, sizeof(struct topic *));
-    if (!graph->topic_dict->topic_list) return -1;
-    graph->topic_dict->max_size = 1;
-    graph->topic_dict->used = 0;
-
-    hooks = (cJSON_Hooks *)graph__malloc(sizeof(cJSON_Hooks));
-    hooks->malloc_fn = graph__malloc;
-    hooks->free_fn = graph__free;
-    cJSON_InitHooks(hooks);
+    graph->snapshot_requested = false;
+    graph->seq = 0;
+    graph->last_snapshot = 0;
+    graph->json = NULL;
+    graph->bin = NULL;
+    graph->bin_msg = NULL;
+    graph->bin_gen = 0;
+    memset(graph->msg_topics, 0, sizeof(graph->msg_topics));
+    memset(msg_ids, 0, sizeof(msg_ids));
+    graph->delta = NULL;
+    graph->delta_msg = NULL;
+
+    if (graph_table_init(&graph->ips, 1)) return -1;
+    if (graph_table_init(&graph->topics, 1)) return -1;
+    if (graph_table_init(&graph->ids, 1)) return -1;
+
+    if (db->config->graph_format == mosq_gf_binary) {
+        graph->bin = (struct graph_binary *)graph__malloc(sizeof(struct graph_binary));
+        if (!graph->bin || graph_binary_init(graph->bin, JSON_BUFLEN)) return -1;
+        graph->bin_msg = (struct graph_binary *)graph__malloc(sizeof(struct graph_binary));
+        if (!graph->bin_msg || graph_binary_init(graph->bin_msg, JSON_BUFLEN)) return -1;
+    }
+    else {
+        graph->json = (struct graph_json *)graph__malloc(sizeof(struct graph_json));
+        if (!graph->json || graph_json_init(graph->json, JSON_BUFLEN)) return -1;
+    }
+
+    if (db->config->graph_delta) {
+        graph->delta = (struct graph_json *)graph__malloc(sizeof(struct graph_json));
+        if (!graph->delta || graph_json_init(graph->delta, JSON_BUFLEN)) return -1;
+        graph->delta_msg = (struct graph_json *)graph__malloc(sizeof(struct graph_json));
+        if (!graph->delta_msg || graph_json_init(graph->delta_msg, JSON_BUFLEN)) return -1;
+    }
+
+    ring = (struct graph_ring *)graph__malloc(sizeof(struct graph_ring));
+    if (!ring || graph_ring_init(ring, RING_EVENTS, RING_STRINGS)) return -1;
+
+    if (graph_thread_start(graph_thread_main)) {
+        log__printf(NULL, MOSQ_LOG_ERR, "Error: Unable to start network graph thread.");
+        graph_ring_cleanup(ring);
+        graph__free(ring);
+        ring = NULL;
+        return -1;
+    }
 
     return 0;
 }
 
 int network_graph_cleanup(void) {
-    struct ip_container *ip_curr, *ip_temp;
-    struct client *client_curr, *client_temp;
-    struct topic *topic_curr, *topic_temp;
-
-    for (size_t i = 0; i < graph->ip_dict->max_size; ++i) {
-        ip_curr = graph->ip_dict->ip_list[i];
-        while (ip_curr != NULL) {
-            for (size_t j = 0; j < ip_curr->client_dict->max_size; ++j) {
-                client_curr = ip_curr->client_dict->client_list[j];
-                while (client_curr != NULL) {
-                    client_temp = client_curr;
-                    client_curr = client_curr->next;
-                    graph__free(client_curr->name);
-                    graph__free(client_curr);
+    struct ip_container *ip_cont;
+    struct client *client;
+    struct pub_edge *pub_edge, *pub_edge_next;
+    struct topic *topic;
+
+    if (graph == NULL) return 0;
+
+    if (ring != NULL) {
+        graph_thread_stop();
+        graph_ring_cleanup(ring);
+        graph__free(ring);
+        ring = NULL;
+    }
+    while (pending != NULL) {
+        struct graph_pending *next = pending->next;
+        free(pending->str1);
+        free(pending->str2);
+        free(pending);
+        pending = next;
+    }
+    pending_tail = &pending;
+
+    // topics first, deleting their sub edges unlinks them from the clients
+    for (size_t i = 0; i <= graph->topics.mask; ++i) {
+        if ((topic = graph_table_at(&graph->topics, i)) == NULL) continue;
+        graph_delete_topic_sub_edges(topic);
+        graph__free(topic);
+    }
+
+    for (size_t i = 0; i <= graph->ips.mask; ++i) {
+        if ((ip_cont = graph_table_at(&graph->ips, i)) == NULL) continue;
+        for (size_t j = 0; j <= ip_cont->clients.mask; ++j) {
+            if ((client = graph_table_at(&ip_cont->clients, j)) != NULL) {
+                // the topics are already gone, so only the edges are freed
+                for (pub_edge = client->pub_list; pub_edge != NULL; pub_edge = pub_edge_next) {
+                    pub_edge_next = pub_edge->next;
+                    graph__free(pub_edge);
                 }
+                graph__free(client);
             }
-            ip_temp = ip_curr;
-            ip_curr = ip_curr->next;
-            graph__free(ip_temp->id);
-            graph__free(ip_temp->client_dict->client_list);
-            graph__free(ip_temp->client_dict);
-            graph__free(ip_temp);
         }
+        graph_table_cleanup(&ip_cont->clients);
+        graph__free(ip_cont);
     }
 
-    for (size_t i = 0; i < graph->topic_dict->max_size; ++i) {
-        topic_curr = graph->topic_dict->topic_list[i];
-        while (topic_curr != NULL) {
-            topic_temp = topic_curr;
-            topic_curr = topic_curr->next;
-            graph_delete_topic_sub_edges(topic_temp);
-            free(topic_temp->name);
-            graph__free(topic_temp);
-        }
+    graph_table_cleanup(&graph->ips);
+    graph_table_cleanup(&graph->topics);
+    graph_table_cleanup(&graph->ids);
+    if (graph->json) {
+        graph_json_cleanup(graph->json);
+        graph__free(graph->json);
+    }
+    if (graph->bin) {
+        graph_binary_cleanup(graph->bin);
+        graph__free(graph->bin);
+        graph_binary_cleanup(graph->bin_msg);
+        graph__free(graph->bin_msg);
+    }
+    if (graph->delta) {
+        graph_json_cleanup(graph->delta);
+        graph__free(graph->delta);
+        graph_json_cleanup(graph->delta_msg);
+        graph__free(graph->delta_msg);
     }
-
-    graph__free(graph->ip_dict->ip_list);
-    graph__free(graph->ip_dict);
-    graph__free(graph->topic_dict->topic_list);
-    graph__free(graph->topic_dict);
     graph__free(graph);
-
-    cJSON_free(hooks);
+    graph = NULL;
     return 0;
 }
 
 /*
- * Called after client connects
+ * Client connected. A node with the same name and address is taken over, its
+ * old connection is not known to the graph anymore.
  */
-int network_graph_add_client(struct mosquitto *context) {
-    char *address, *id;
+static void graph_on_connect(uint64_t id, const char *name, const char *address) {
     struct ip_container *ip_cont;
-
-    address = context->address;
-#ifdef WITH_BROKER
-    if (context->is_bridge && context->bridge != NULL) {
-        address = context->bridge->addresses[context->bridge->cur_address].address;
-    }
-#endif
-    id = context->id;
+    struct client *client;
 
     if ((ip_cont = find_ip_container(address)) == NULL) {
         ip_cont = create_ip_container(address);
         graph_add_ip(ip_cont);
     }
 
-    if (find_client(ip_cont, id) == NULL) {
-        graph_add_client(ip_cont, create_client(id, address));
+    if ((client = find_client(ip_cont, name)) == NULL) {
+        client = create_client(name, address);
+        graph_add_client(ip_cont, client);
+    }
+    else {
+        graph_remove_client_id(client);
     }
+    client->id = id;
+    graph_add_client_id(client);
 
     graph->changed = true;
-
-    return 0;
 }
 
 /*
- * Called after client publishes to topic
+ * Client published to topic
  */
-int network_graph_add_topic(struct mosquitto *context, uint8_t retain, const char *topic, uint32_t payloadlen) {
-    if (topic[0] == '$') return 0; // ignore $SYS/#, $NETWORK/# topics
-    char *address, *id;
-    struct ip_container *ip_cont;
-    struct client *client;
+static void graph_on_publish(struct client *client, uint8_t retain, const char *topic, uint32_t payloadlen) {
     struct topic *topic_vert;
     struct pub_edge *pub_edge;
-    cJSON *data;
 
-    address = context->address;
-#ifdef WITH_BROKER
-    if (context->is_bridge && context->bridge != NULL) {
-        address = context->bridge->addresses[context->bridge->cur_address].address;
-    }
-#endif
-    id = context->id;
-
-    if ((ip_cont = find_ip_container(address)) == NULL) {
-        log__printf(NULL, MOSQ_LOG_DEBUG, "ERROR: could not find ip!");
-        return -1;
-    }
-
-    if ((client = find_client(ip_cont, id)) == NULL) {
-        log__printf(NULL, MOSQ_LOG_DEBUG, "ERROR: could not find client!");
-        return -1;
-    }
-
-    // topic doesnt exist
-    if ((topic_vert = find_topic(topic)) == NULL) {
-        topic_vert = create_topic(topic, retain);
-        graph_add_topic(topic_vert);
-        ++topic_vert->ref_cnt;
-        pub_edge = create_pub_edge(id, topic, topic_vert);
-        graph_add_pub_edge(client, pub_edge);
-    }
-    // topic exists, but pub edge doesnt
-    else if ((pub_edge = find_pub_edge(client, topic_vert)) == NULL) {
-        ++topic_vert->ref_cnt;
-        pub_edge = create_pub_edge(id, topic, topic_vert);
-        graph_add_pub_edge(client, pub_edge);
+    // client published to the topic recently
+    if ((pub_edge = pub_cache_find(client, topic)) != NULL) {
+        topic_vert = pub_edge->pub;
+    }
+    else {
+        // topic doesnt exist
+        if ((topic_vert = find_topic(topic)) == NULL) {
+            topic_vert = create_topic(topic, retain);
+            graph_add_topic(topic_vert);
+            ++topic_vert->ref_cnt;
+            pub_edge = create_pub_edge(client->name, topic, topic_vert);
+            graph_add_pub_edge(client, pub_edge);
+        }
+        // topic exists, but pub edge doesnt
+        else if ((pub_edge = find_pub_edge(client, topic_vert)) == NULL) {
+            ++topic_vert->ref_cnt;
+            pub_edge = create_pub_edge(client->name, topic, topic_vert);
+            graph_add_pub_edge(client, pub_edge);
+        }
+        pub_cache_add(client, pub_edge);
     }
 
     pub_edge->ttl_cnt = ttl_cnt;
@@ -823,128 +928,293 @@ int network_graph_add_topic(struct mosquitto *context, uint8_t retain, const cha
 
         graph->changed = true;
     }
-
-    return 0;
 }
 
 /*
- * Called after client subscribes to topic
+ * Client subscribed to topic
  */
-int network_graph_add_sub_edge(struct mosquitto *context, const char *topic) {
-    if (topic[0] == '$') return 0; // ignore $SYS or $NETWORK topics
-    bool match;
-    char *address, *id;
-    struct ip_container *ip_cont;
-    struct client *client;
+static void graph_on_subscribe(struct client *client, const char *topic) {
     struct topic *topic_vert;
     struct sub_edge *sub_edge;
-    cJSON *data;
-
-    address = context->address;
-#ifdef WITH_BROKER
-    if (context->is_bridge && context->bridge != NULL) {
-        address = context->bridge->addresses[context->bridge->cur_address].address;
-    }
-#endif
-    id = context->id;
-
-    if ((ip_cont = find_ip_container(address)) == NULL) {
-        log__printf(NULL, MOSQ_LOG_DEBUG, "ERROR: could not find ip!");
-        return -1;
-    }
-
-    if ((client = find_client(ip_cont, id)) == NULL) {
-        log__printf(NULL, MOSQ_LOG_DEBUG, "ERROR: could not find client!");
-        return -1;
-    }
 
     topic_vert = find_topic(topic);
     if (topic_vert && find_sub_edge(topic_vert, client) == NULL) {
-        sub_edge = create_sub_edge(topic_vert->name, id);
+        sub_edge = create_sub_edge(topic_vert->name, client->name);
         sub_edge->sub = client;
         graph_add_sub_edge(topic_vert, sub_edge);
         graph->changed = true;
     }
-
-    return 0;
 }
 
 /*
- * Called after client unsubscribes to topic
+ * Looks up the topic of a stored message. The broker only sends the topic if
+ * the slot of the message doesn't hold it yet, so a slot is replaced exactly
+ * when the broker replaced its copy in msg_ids.
  */
-int network_graph_delete_sub_edge(struct mosquitto *context, const char *topic) {
-    bool match;
-    struct ip_container *ip_cont;
-    struct client *client;
-    struct topic *topic_vert;
+static struct topic *graph_msg_topic(uint64_t msg_id, const char *topic) {
+    struct graph_msg_topic *slot = &graph->msg_topics[msg_id & (GRAPH_MSG_TOPICS - 1)];
 
-    if ((ip_cont = find_ip_container(context->address)) == NULL) {
-        log__printf(NULL, MOSQ_LOG_DEBUG, "ERROR: could not find ip!");
-        return -1;
+    if (topic != NULL) {
+        if (slot->topic != NULL) {
+            --slot->topic->msg_refs;
+        }
+        slot->msg_id = msg_id;
+        slot->topic = find_topic(topic);
+        if (slot->topic != NULL) {
+            ++slot->topic->msg_refs;
+        }
     }
+    // the event with the topic of this message was dropped
+    else if (slot->msg_id != msg_id) {
+        return NULL;
+    }
+    return slot->topic;
+}
 
-    if ((client = find_client(ip_cont, context->id)) == NULL) {
-        log__printf(NULL, MOSQ_LOG_DEBUG, "ERROR: could not find client!");
-        return -1;
+/*
+ * Message was queued for a subscriber
+ */
+static void graph_on_delivery(struct client *client, struct topic *topic, bool dropped) {
+    struct sub_edge *sub_edge;
+
+    if ((sub_edge = find_sub_edge(topic, client)) == NULL) {
+        sub_edge = create_sub_edge(topic->name, client->name);
+        sub_edge->sub = client;
+        graph_add_sub_edge(topic, sub_edge);
+        graph->changed = true;
+    }
+    if (dropped) {
+        ++sub_edge->drops;
     }
+}
 
-    for (size_t i = 0; i < graph->topic_dict->max_size; ++i) {
-        topic_vert = graph->topic_dict->topic_list[i];
-        for (; topic_vert != NULL; topic_vert = topic_vert->next) {
-            mosquitto_topic_matches_sub(topic, topic_vert->name, &match);
-            if (match) {
-                graph_delete_sub_edge(topic_vert, client);
-            }
+/*
+ * PUBLISH was written to a subscriber
+ */
+static void graph_on_sub_bytes(struct client *client, struct topic *topic, uint32_t payloadlen) {
+    struct sub_edge *sub_edge;
+
+    if ((sub_edge = find_sub_edge(topic, client)) == NULL) return;
+
+    sub_edge->bytes += payloadlen;
+    ++sub_edge->msgs;
+}
+
+/*
+ * Client unsubscribed from topic
+ */
+static void graph_on_unsubscribe(struct client *client, const char *topic) {
+    bool match;
+    struct sub_edge *sub_edge, *temp;
+
+    // a shared subscription matches with the filter after $share/<group>/
+    if (strncmp(topic, "$share/", 7) == 0) {
+        if ((topic = strchr(topic + 7, '/')) == NULL) return;
+        ++topic;
+    }
+
+    // only the topics this client is subbed to can match
+    sub_edge = client->sub_list;
+    while (sub_edge != NULL) {
+        temp = sub_edge;
+        sub_edge = sub_edge->client_next;
+        mosquitto_topic_matches_sub(topic, temp->topic->name, &match);
+        if (match) {
+            graph_delete_sub(temp->topic, temp);
         }
     }
 
     graph->changed = true;
-
-    return 0;
 }
 
 /*
- * Called after sending PUBREL
+ * Client sent PUBCOMP for a $NETWORK/latency message
  */
-int network_graph_latency_start(struct mosquitto *context, const char *topic) {
-    // do not update latency if topic is not $NETWORK/latency
-    if (strncmp(topic, "$NETWORK/latency", 15) != 0) return 0;
+static void graph_on_latency_end(struct client *client, time_t time_ns) {
+    if (client->time_prev > 0) {
+        client->latency = (double)(time_ns - client->time_prev);
+        client->latency = round3(client->latency / 1000); // ms
+        client->time_prev = -1;
+        graph_delta_client("update", client->ip, client);
 
-    char *address, *id;
-    struct ip_container *ip_cont;
+        graph->changed = true;
+    }
+}
+
+/*
+ * Applies an event from the broker to the graph
+ */
+static void graph_handle_event(struct graph_event *event, const char *str) {
     struct client *client;
+    struct topic *topic = NULL;
+
+    switch (event->type) {
+        case graph_ev_connect:
+            graph_on_connect(event->client_id, str, str + strlen(str) + 1);
+            return;
+        case graph_ev_snapshot:
+            graph->snapshot_requested = true;
+            return;
+        case graph_ev_delivery:
+        case graph_ev_sub_bytes:
+            // before the client lookup, msg_ids has the topic even if the client is gone
+            if ((topic = graph_msg_topic(event->arg, str)) == NULL) return;
+            break;
+        default:
+            break;
+    }
+
+    // unknown if the connection was taken over or its connect event was dropped
+    if ((client = find_client_by_id(event->client_id)) == NULL) return;
+
+    switch (event->type) {
+        case graph_ev_disconnect:
+            graph_delete_client(client->ip, client);
+            graph->changed = true;
+            break;
+        case graph_ev_publish:
+            graph_on_publish(client, event->flag, str, event->len);
+            break;
+        case graph_ev_subscribe:
+            graph_on_subscribe(client, str);
+            break;
+        case graph_ev_unsubscribe:
+            graph_on_unsubscribe(client, str);
+            break;
+        case graph_ev_delivery:
+            graph_on_delivery(client, topic, event->flag);
+            break;
+        case graph_ev_sub_bytes:
+            graph_on_sub_bytes(client, topic, event->len);
+            break;
+        case graph_ev_latency_start:
+            client->time_prev = event->arg;
+            break;
+        case graph_ev_latency_end:
+            graph_on_latency_end(client, event->arg);
+            break;
+        default:
+            break;
+    }
+}
 
-    address = context->address;
-#ifdef WITH_BROKER
-    if (context->is_bridge && context->bridge != NULL) {
-        address = context->bridge->addresses[context->bridge->cur_address].address;
+/*****************************************************************************/
+
+/*
+ * Pushes the kept connects and disconnects in order, returns false if some
+ * still do not fit
+ */
+static bool graph_push_pending(void) {
+    struct graph_pending *p;
+
+    while ((p = pending) != NULL) {
+        if (!graph_ring_push(ring, &p->event, p->str1, p->str2)) {
+            --ring->dropped; // still kept, not dropped
+            return false;
+        }
+        pending = p->next;
+        if (pending == NULL) {
+            pending_tail = &pending;
+        }
+        free(p->str1);
+        free(p->str2);
+        free(p);
     }
-#endif
-    id = context->id;
+    return true;
+}
 
-    if ((ip_cont = find_ip_container(address)) == NULL) {
-        log__printf(NULL, MOSQ_LOG_DEBUG, "ERROR: could not find ip!");
-        return -1;
+/*
+ * Queues an event for the graph thread, drops it if the ring is full
+ */
+static bool graph_push(struct graph_event *event, const char *str1, const char *str2) {
+    bool pushed;
+
+    // kept connects and disconnects go first, so a full ring drops the others
+    if (pending != NULL && !graph_push_pending()) {
+        ++ring->dropped;
+        pushed = false;
+    }
+    else {
+        pushed = graph_ring_push(ring, event, str1, str2);
     }
 
-    if ((client = find_client(ip_cont, id)) == NULL) {
-        log__printf(NULL, MOSQ_LOG_DEBUG, "ERROR: could not find client!");
-        return -1;
+    // the main loop wakes the graph thread once per iteration, or earlier
+    // if an iteration queues many events
+    if (graph_ring_half_full(ring)) {
+        graph_thread_wake(ring);
     }
+    return pushed;
+}
 
-    client->time_prev = mosquitto_time_ns();
+/*
+ * Queues a connect or disconnect, keeps it on the main thread until it fits
+ * if the ring is full. A lost disconnect would leave the client in the graph
+ * for good.
+ */
+static void graph_push_kept(struct graph_event *event, const char *str1, const char *str2) {
+    struct graph_pending *p;
+
+    if (graph_push(event, str1, str2)) return;
+
+    // only the main thread uses the kept events, so they are not graph memory
+    p = (struct graph_pending *)calloc(1, sizeof(struct graph_pending));
+    if (p == NULL) return; // counted as dropped
+    p->event = *event;
+    if (str1 != NULL) {
+        p->str1 = strdup(str1);
+        p->str2 = str2 != NULL ? strdup(str2) : NULL;
+        if (p->str1 == NULL || (str2 != NULL && p->str2 == NULL)) {
+            free(p->str1);
+            free(p->str2);
+            free(p);
+            return;
+        }
+    }
+    --ring->dropped;
+    *pending_tail = p;
+    pending_tail = &p->next;
+}
+
+/*
+ * Queues an event about a stored message. The topic is left out if the graph
+ * thread already has it, which is the case for every subscriber after the
+ * first and for most writes.
+ */
+static void graph_push_msg(struct graph_event *event, const char *topic) {
+    uint64_t *slot = &msg_ids[event->arg & (GRAPH_MSG_TOPICS - 1)];
+
+    if (*slot == event->arg) {
+        graph_push(event, NULL, NULL);
+    }
+    else if (graph_push(event, topic, NULL)) {
+        *slot = event->arg;
+    }
+}
 
+/*
+ * Queues an event with the graph id of a connection
+ */
+static int graph_push_client(struct mosquitto *context, uint8_t type, const char *topic) {
+    struct graph_event event;
+
+    if (ring == NULL) return 0;
+    if (context->graph_id == 0) return -1;
+
+    memset(&event, 0, sizeof(event));
+    event.type = type;
+    event.client_id = context->graph_id;
+    graph_push(&event, topic, NULL);
     return 0;
 }
 
 /*
- * Called after client sends PUBCOMP
+ * Called after client connects
  */
-int network_graph_latency_end(struct mosquitto *context) {
-    char *address, *id;
-    struct ip_container *ip_cont;
-    struct client *client;
-    cJSON *data;
+int network_graph_add_client(struct mosquitto *context) {
+    struct graph_event event;
+    char *address;
+
+    if (ring == NULL) return 0;
 
     address = context->address;
 #ifdef WITH_BROKER
@@ -952,98 +1222,180 @@ int network_graph_latency_end(struct mosquitto *context) {
         address = context->bridge->addresses[context->bridge->cur_address].address;
     }
 #endif
-    id = context->id;
 
-    if ((ip_cont = find_ip_container(address)) == NULL) {
-        log__printf(NULL, MOSQ_LOG_DEBUG, "ERROR: could not find ip!");
-        return -1;
+    // a bridge reconnects with the same context
+    if (context->graph_id != 0) {
+        network_graph_delete_client(context);
     }
+    context->graph_id = ++last_graph_id;
 
-    if ((client = find_client(ip_cont, id)) == NULL) {
-        log__printf(NULL, MOSQ_LOG_DEBUG, "ERROR: could not find client!");
-        return -1;
-    }
+    memset(&event, 0, sizeof(event));
+    event.type = graph_ev_connect;
+    event.client_id = context->graph_id;
+    graph_push_kept(&event, context->id, address);
 
-    if (client->time_prev > 0) {
-        client->latency = (double)(mosquitto_time_ns() - client->time_prev);
-        client->latency = round3(client->latency / 1000); // ms
-        client->time_prev = -1;
+    return 0;
+}
 
-        graph->changed = true;
+/*
+ * Called after client publishes to topic
+ */
+int network_graph_add_topic(struct mosquitto *context, uint8_t retain, const char *topic, uint32_t payloadlen) {
+    struct graph_event event;
+
+    if (ring == NULL) return 0;
+    if (context->graph_id == 0) return -1;
+
+    if (topic[0] == '$') { // ignore $SYS/#, $NETWORK/# topics
+        if (strcmp(topic, GRAPH_SNAPSHOT_TOPIC) == 0) {
+            memset(&event, 0, sizeof(event));
+            event.type = graph_ev_snapshot;
+            graph_push(&event, NULL, NULL);
+        }
+        return 0;
     }
 
+    memset(&event, 0, sizeof(event));
+    event.type = graph_ev_publish;
+    event.flag = retain;
+    event.len = payloadlen;
+    event.client_id = context->graph_id;
+    graph_push(&event, topic, NULL);
+
     return 0;
 }
 
 /*
- * Called before client disconnects
+ * Called after client subscribes to topic
  */
-int network_graph_delete_client(struct mosquitto *context) {
-    struct ip_container *ip_cont;
-    struct client *client;
-    struct topic *topic_vert;
+int network_graph_add_sub_edge(struct mosquitto *context, const char *topic) {
+    if (topic[0] == '$') return 0; // ignore $SYS or $NETWORK topics
 
-    if ((ip_cont = find_ip_container(context->address)) == NULL) {
-        log__printf(NULL, MOSQ_LOG_DEBUG, "ERROR: could not find ip!");
-        return -1;
-    }
+    return graph_push_client(context, graph_ev_subscribe, topic);
+}
 
-    if ((client = find_client(ip_cont, context->id)) == NULL) {
-        log__printf(NULL, MOSQ_LOG_DEBUG, "ERROR: could not find client!");
-        return -1;
-    }
-    else if (graph_delete_client(ip_cont, client) < 0) {
-        log__printf(NULL, MOSQ_LOG_DEBUG, "ERROR: could not delete client!");
-        return -1;
-    }
+/*
+ * Called after a message is queued for a subscriber
+ */
+int network_graph_add_delivery(struct mosquitto *context, const char *topic, uint64_t msg_id, bool dropped) {
+    struct graph_event event;
 
-    graph->changed = true;
+    // offline clients with a persistent session have no node
+    if (ring == NULL || context->graph_id == 0) return 0;
+    if (topic[0] == '$') return 0; // ignore $SYS or $NETWORK topics
+
+    memset(&event, 0, sizeof(event));
+    event.type = graph_ev_delivery;
+    event.flag = dropped;
+    event.client_id = context->graph_id;
+    event.arg = msg_id;
+    graph_push_msg(&event, topic);
 
     return 0;
 }
 
 /*
- * Created empty graph JSON
+ * Called after a PUBLISH is written to a subscriber
  */
-static cJSON *graph_json_create() {
-    /*
-    {
-        "ips": [],
-        "topics": []
-    }
-    */
-    cJSON *root, *ips, *topics;
-    root = cJSON_CreateObject();
-    ips = cJSON_CreateArray();
-    topics = cJSON_CreateArray();
-    cJSON_AddItemToObject(root, "ips", ips);
-    cJSON_AddItemToObject(root, "topics", topics);
-    return root;
+int network_graph_add_sub_bytes(struct mosquitto *context, const char *topic, uint64_t msg_id, uint32_t payloadlen) {
+    struct graph_event event;
+
+    if (ring == NULL || context->graph_id == 0) return 0;
+    if (topic[0] == '$') return 0; // ignore $SYS or $NETWORK topics
+
+    memset(&event, 0, sizeof(event));
+    event.type = graph_ev_sub_bytes;
+    event.len = payloadlen;
+    event.client_id = context->graph_id;
+    event.arg = msg_id;
+    graph_push_msg(&event, topic);
+
+    return 0;
 }
 
 /*
- * Adds an ip address to JSON
+ * Called after client unsubscribes to topic
+ */
+int network_graph_delete_sub_edge(struct mosquitto *context, const char *topic) {
+    return graph_push_client(context, graph_ev_unsubscribe, topic);
+}
+
+/*
+ * Called after sending PUBREL
  */
-static cJSON *graph_json_add_ip(cJSON *root, struct ip_container *ip) {
+int network_graph_latency_start(struct mosquitto *context, const char *topic) {
+    // do not update latency if topic is not $NETWORK/latency
+    if (strncmp(topic, "$NETWORK/latency", 15) != 0) return 0;
+
+    struct graph_event event;
+
+    if (ring == NULL) return 0;
+    if (context->graph_id == 0) return -1;
+
+    memset(&event, 0, sizeof(event));
+    event.type = graph_ev_latency_start;
+    event.client_id = context->graph_id;
+    event.arg = mosquitto_time_ns();
+    graph_push(&event, NULL, NULL);
+
+    return 0;
+}
+
+/*
+ * Called after client sends PUBCOMP
+ */
+int network_graph_latency_end(struct mosquitto *context) {
+    struct graph_event event;
+
+    if (ring == NULL) return 0;
+    if (context->graph_id == 0) return -1;
+
+    memset(&event, 0, sizeof(event));
+    event.type = graph_ev_latency_end;
+    event.client_id = context->graph_id;
+    event.arg = mosquitto_time_ns();
+    graph_push(&event, NULL, NULL);
+
+    return 0;
+}
+
+/*
+ * Called before client disconnects
+ */
+int network_graph_delete_client(struct mosquitto *context) {
+    struct graph_event event;
+
+    if (ring == NULL) return 0;
+    if (context->graph_id == 0) return -1;
+
+    memset(&event, 0, sizeof(event));
+    event.type = graph_ev_disconnect;
+    event.client_id = context->graph_id;
+    graph_push_kept(&event, NULL, NULL);
+
+    context->graph_id = 0;
+    return 0;
+}
+
+/*
+ * Writes an ip address to JSON, its clients follow
+ */
+static void json_write_ip(struct graph_json *json, struct ip_container *ip) {
     /*
     {
         "id": "<random id>",
         "clients": []
     }
     */
-    cJSON *ip_json, *ips;
-    ips = cJSON_GetObjectItem(root, "ips");
-    ip_json = cJSON_CreateObject();
-    cJSON_AddStringToObject(ip_json, "id", ip->id);
-    cJSON_AddItemToObject(ip_json, "clients", cJSON_CreateArray());
-    cJSON_AddItemToArray(ips, ip_json);
-    return ip_json;
+    graph_json_object_start(json, NULL);
+    graph_json_add_string(json, "id", ip->id);
+    graph_json_array_start(json, "clients");
 }
 
 /*
- * Adds a client to JSON
+ * Writes a client to JSON, its publisher edges follow
  */
-static cJSON *ip_json_add_client(cJSON *ip_json, struct client *client) {
+static void json_write_client(struct graph_json *json, struct client *client) {
     /*
     {
         "name": "client1",
@@ -1051,186 +1403,511 @@ static cJSON *ip_json_add_client(cJSON *ip_json, struct client *client) {
         "published": []
     }
     */
-    cJSON *client_json, *clients;
-    clients = cJSON_GetObjectItem(ip_json, "clients");
-    client_json = cJSON_CreateObject();
-    cJSON_AddStringToObject(client_json, "name", client->name);
-    cJSON_AddNumberToObject(client_json, "latency", client->latency);
-    cJSON_AddItemToObject(client_json, "published", cJSON_CreateArray());
-    cJSON_AddItemToArray(clients, client_json);
-    return client_json;
+    graph_json_object_start(json, NULL);
+    graph_json_add_string(json, "name", client->name);
+    graph_json_add_number(json, "latency", client->latency);
+    graph_json_array_start(json, "published");
 }
 
 /*
- * Adds a publisher edge to JSON
+ * Writes a publisher edge to JSON
  */
-static void client_json_add_pub(cJSON *client, struct pub_edge *pub_edge) {
+static void json_write_pub(struct graph_json *json, struct pub_edge *pub_edge) {
     /*
         {
             "topic": "topic1/sub_topic1",
             "bps": 9000
         }
     */
-    cJSON *topic_json, *topics;
-    topics = cJSON_GetObjectItem(client, "published");
-    topic_json = cJSON_CreateObject();
-    cJSON_AddStringToObject(topic_json, "topic", pub_edge->pub->name);
-    cJSON_AddNumberToObject(topic_json, "bps", pub_edge->bytes_per_sec);
-    cJSON_AddItemToArray(topics, topic_json);
+    graph_json_object_start(json, NULL);
+    graph_json_add_string(json, "topic", pub_edge->pub->name);
+    graph_json_add_number(json, "bps", pub_edge->bytes_per_sec);
+    graph_json_object_end(json);
 }
 
 /*
- * Adds a subscription edge to JSON
+ * Writes a topic to JSON, its subscription edges follow
  */
-static cJSON *graph_json_add_topic(cJSON *root, struct topic *topic) {
+static void json_write_topic(struct graph_json *json, struct topic *topic) {
     /*
     {
         "name": "topic1/sub_topic1",
         "subscriptions": []
     }
     */
-    cJSON *topic_json, *topics;
-    topics = cJSON_GetObjectItem(root, "topics");
-    topic_json = cJSON_CreateObject();
-    cJSON_AddStringToObject(topic_json, "name", topic->name);
-    cJSON_AddItemToObject(topic_json, "subscriptions", cJSON_CreateArray());
-    cJSON_AddItemToArray(topics, topic_json);
-    return topic_json;
+    graph_json_object_start(json, NULL);
+    graph_json_add_string(json, "name", topic->name);
+    graph_json_array_start(json, "subscriptions");
 }
 
 /*
- * Adds an ip address to JSON
+ * Writes a subscription edge to JSON
  */
-static void topic_json_add_sub(cJSON *topic, struct sub_edge *sub_edge, double bytes_per_sec) {
+static void json_write_sub(struct graph_json *json, struct sub_edge *sub_edge) {
     /*
     {
         "client": "client1",
-        "bps": 9000
+        "bps": 9000,
+        "mps": 10,
+        "drops": 0
+    }
+    */
+    graph_json_object_start(json, NULL);
+    graph_json_add_string(json, "client", sub_edge->sub->name);
+    graph_json_add_number(json, "bps", sub_edge->bytes_per_sec);
+    graph_json_add_number(json, "mps", sub_edge->msgs_per_sec);
+    graph_json_add_number(json, "drops", sub_edge->drops_last);
+    graph_json_object_end(json);
+}
+
+/*
+ * Closes the list of children and the object written by json_write_ip,
+ * json_write_client and json_write_topic
+ */
+static inline void json_write_end(struct graph_json *json) {
+    graph_json_array_end(json);
+    graph_json_object_end(json);
+}
+
+/*
+ * Returns the index of a string in the binary string table, adding it if it
+ * is not in the table of the current snapshot yet
+ */
+static uint32_t bin_intern(unsigned long *str_gen, uint32_t *str_idx, const char *str) {
+    if (*str_gen != graph->bin_gen) {
+        *str_gen = graph->bin_gen;
+        // the string table is the only open list of the message
+        *str_idx = graph->bin_msg->count[0];
+        graph_binary_list_item(graph->bin_msg);
+        graph_binary_add_string(graph->bin_msg, str);
+    }
+    return *str_idx;
+}
+
+/*
+ * Writes an ip address in binary, its clients follow
+ */
+static void bin_write_ip(struct graph_binary *bin, struct ip_container *ip) {
+    /*
+    varint id, u32 client count
+    */
+    unsigned long str_gen = 0;
+    uint32_t str_idx = 0;
+
+    graph_binary_list_item(bin);
+    graph_binary_add_varint(bin, bin_intern(&str_gen, &str_idx, ip->id));
+    graph_binary_list_start(bin);
+}
+
+/*
+ * Writes a client in binary, its publisher edges follow
+ */
+static void bin_write_client(struct graph_binary *bin, struct client *client) {
+    /*
+    varint name, number latency, u32 published count
+    */
+    graph_binary_list_item(bin);
+    graph_binary_add_varint(bin, bin_intern(&client->str_gen, &client->str_idx, client->name));
+    graph_binary_add_number(bin, client->latency);
+    graph_binary_list_start(bin);
+}
+
+/*
+ * Writes a publisher edge in binary
+ */
+static void bin_write_pub(struct graph_binary *bin, struct pub_edge *pub_edge) {
+    /*
+    varint topic, number bps
+    */
+    struct topic *topic = pub_edge->pub;
+
+    graph_binary_list_item(bin);
+    graph_binary_add_varint(bin, bin_intern(&topic->str_gen, &topic->str_idx, topic->name));
+    graph_binary_add_number(bin, pub_edge->bytes_per_sec);
+}
+
+/*
+ * Writes a topic in binary, its subscription edges follow
+ */
+static void bin_write_topic(struct graph_binary *bin, struct topic *topic) {
+    /*
+    varint name, u32 subscription count
+    */
+    graph_binary_list_item(bin);
+    graph_binary_add_varint(bin, bin_intern(&topic->str_gen, &topic->str_idx, topic->name));
+    graph_binary_list_start(bin);
+}
+
+/*
+ * Writes a subscription edge in binary
+ */
+static void bin_write_sub(struct graph_binary *bin, struct sub_edge *sub_edge) {
+    /*
+    varint client, number bps, number mps, varint drops
+    */
+    struct client *client = sub_edge->sub;
+
+    graph_binary_list_item(bin);
+    graph_binary_add_varint(bin, bin_intern(&client->str_gen, &client->str_idx, client->name));
+    graph_binary_add_number(bin, sub_edge->bytes_per_sec);
+    graph_binary_add_number(bin, sub_edge->msgs_per_sec);
+    graph_binary_add_varint(bin, sub_edge->drops_last);
+}
+
+/*****************************************************************************/
+
+/*
+ * Starts a full snapshot of the graph in the configured format
+ */
+static void graph_snapshot_start(void) {
+    /*
+    binary format, integers are little endian:
+        "NG", u8 version, u32 string count, strings (varint length, bytes),
+        u32 ip count, ips, u32 topic count, topics, varint seq
+    every name in ips and topics is a varint index into the strings
+    */
+    uint8_t version = GRAPH_BINARY_VERSION;
+
+    if (graph->bin) {
+        ++graph->bin_gen;
+        graph_binary_reset(graph->bin_msg);
+        graph_binary_add_bytes(graph->bin_msg, GRAPH_BINARY_MAGIC, strlen(GRAPH_BINARY_MAGIC));
+        graph_binary_add_bytes(graph->bin_msg, &version, 1);
+        graph_binary_list_start(graph->bin_msg);
+
+        graph_binary_reset(graph->bin);
+        graph_binary_list_start(graph->bin);
+    }
+    else {
+        /*
+        {
+            "ips": [],
+            "topics": [],
+            "seq": 42
+        }
+        */
+        graph_json_reset(graph->json);
+        graph_json_object_start(graph->json, NULL);
+        graph_json_array_start(graph->json, "ips");
+    }
+}
+
+static void graph_write_ip(struct ip_container *ip) {
+    if (graph->bin) bin_write_ip(graph->bin, ip);
+    else json_write_ip(graph->json, ip);
+}
+
+static void graph_write_client(struct client *client) {
+    if (graph->bin) bin_write_client(graph->bin, client);
+    else json_write_client(graph->json, client);
+}
+
+static void graph_write_pub(struct pub_edge *pub_edge) {
+    if (graph->bin) bin_write_pub(graph->bin, pub_edge);
+    else json_write_pub(graph->json, pub_edge);
+}
+
+static void graph_write_topic(struct topic *topic) {
+    if (graph->bin) bin_write_topic(graph->bin, topic);
+    else json_write_topic(graph->json, topic);
+}
+
+static void graph_write_sub(struct sub_edge *sub_edge) {
+    if (graph->bin) bin_write_sub(graph->bin, sub_edge);
+    else json_write_sub(graph->json, sub_edge);
+}
+
+static void graph_write_end(void) {
+    if (graph->bin) graph_binary_list_end(graph->bin);
+    else json_write_end(graph->json);
+}
+
+/*
+ * Ends the list of ips and starts the list of topics
+ */
+static void graph_snapshot_topics(void) {
+    if (graph->bin) {
+        graph_binary_list_end(graph->bin);
+        graph_binary_list_start(graph->bin);
+    }
+    else {
+        graph_json_array_end(graph->json);
+        graph_json_array_start(graph->json, "topics");
+    }
+}
+
+/*
+ * Hands a copy of a message to the main loop, which queues it
+ */
+static void graph_queue(const char *topic, uint32_t payloadlen, const void *payload, int retain, uint32_t expiry) {
+    struct graph_message *msg;
+
+    // freed by the main thread, so not counted as graph memory
+    msg = (struct graph_message *)malloc(sizeof(struct graph_message));
+    if (msg == NULL) return;
+    msg->payload = malloc(payloadlen > 0 ? payloadlen : 1);
+    if (msg->payload == NULL) {
+        free(msg);
+        return;
+    }
+    memcpy(msg->payload, payload, payloadlen);
+    msg->topic = topic;
+    msg->payloadlen = payloadlen;
+    msg->retain = retain;
+    msg->expiry = expiry;
+    graph_thread_put(msg);
+}
+
+/*
+ * Finishes the snapshot and publishes it to $NETWORK if the graph changed
+ */
+static void graph_snapshot_publish(void) {
+    const void *data;
+    size_t len;
+    bool error;
+
+    // sequence number of the last delta that is part of this snapshot
+    if (graph->bin) {
+        graph_binary_list_end(graph->bin);
+        graph_binary_add_varint(graph->bin, graph->seq);
+        graph_binary_list_end(graph->bin_msg);
+        graph_binary_add_bytes(graph->bin_msg, graph->bin->data, graph->bin->len);
+        data = graph->bin_msg->data;
+        len = graph->bin_msg->len;
+        error = graph->bin->error || graph->bin_msg->error;
+    }
+    else {
+        graph_json_array_end(graph->json);
+        graph_json_add_number(graph->json, "seq", graph->seq);
+        graph_json_object_end(graph->json);
+        data = graph->json->data;
+        len = graph->json->len;
+        error = graph->json->error;
+    }
+
+    if (!error && (graph->changed || graph->snapshot_requested)) {
+        graph_queue(GRAPH_TOPIC, len, data, 1, 0);
+        graph->changed = false;
+    }
+}
+
+/*
+ * Publishes the pending delta to $NETWORK/delta
+ */
+static void graph_delta_publish(void) {
+    /*
+    {
+        "seq": 42,
+        "events": []
     }
     */
-    cJSON *sub_json, *subs;
-    subs = cJSON_GetObjectItem(topic, "subscriptions");
-    sub_json = cJSON_CreateObject();
-    cJSON_AddStringToObject(sub_json, "client", sub_edge->sub->name);
-    cJSON_AddNumberToObject(sub_json, "bps", bytes_per_sec);
-    cJSON_AddItemToArray(subs, sub_json);
+    struct graph_json *json = graph->delta_msg;
+
+    if (graph->delta->len == 0) return;
+
+    graph_json_reset(json);
+    graph_json_object_start(json, NULL);
+    graph_json_add_number(json, "seq", ++graph->seq);
+    graph_json_array_start(json, "events");
+    graph_json_add_raw(json, graph->delta->data, graph->delta->len);
+    graph_json_array_end(json);
+    graph_json_object_end(json);
+
+    if (!json->error && !graph->delta->error) {
+        graph_queue(GRAPH_DELTA_TOPIC, json->len, json->data, 0, 0);
+    }
+    graph_json_reset(graph->delta);
 }
 
 /*
- * Called every graph->interval seconds
+ * Called by the graph thread, updates the graph every interval seconds
  */
-void network_graph_update(struct mosquitto_db *db, int interval) {
+static void graph_update(int interval) {
     static time_t last_update = 0;
     static unsigned long current_heap = -1;
     static unsigned long max_heap = -1;
 
     time_t now = mosquitto_time();
 
-    char *json_buf, heap_buf[BUFLEN];
-    cJSON *root, *ip_json, *client_json, *topic_json;
+    char heap_buf[BUFLEN];
+    bool snapshot;
 
     struct ip_container *ip_cont;
     struct client *client;
     struct sub_edge *sub_edge;
     struct pub_edge *pub_edge, *curr_pub_edge;
-    struct topic *topic, *temp;
+    struct topic *topic;
 
     double temp_bytes;
+    double temp_msgs;
 
     if (interval && now - interval > last_update) {
-        root = graph_json_create();
+        // in delta mode the full graph is only written for keyframes and requests
+        snapshot = graph->delta == NULL || graph->snapshot_requested
+                || (keyframe_interval && now - keyframe_interval > graph->last_snapshot);
+        if (snapshot) graph_snapshot_start();
 
         // graph has a list of all IP addresses
-        for (size_t i = 0; i < graph->ip_dict->max_size; ++i) {
-            ip_cont = graph->ip_dict->ip_list[i];
-
-            for (; ip_cont != NULL; ip_cont = ip_cont->next) {
-                ip_json = graph_json_add_ip(root, ip_cont);
+        for (size_t i = 0; i <= graph->ips.mask; ++i) {
+            if ((ip_cont = graph_table_at(&graph->ips, i)) != NULL) {
+                if (snapshot) graph_write_ip(ip_cont);
 
-                for (size_t j = 0; j < ip_cont->client_dict->max_size; ++j) {
-                    client = ip_cont->client_dict->client_list[j];
-
-                    for (; client != NULL; client = client->next) {
-                        client_json = ip_json_add_client(ip_json, client);
+                for (size_t j = 0; j <= ip_cont->clients.mask; ++j) {
+                    if ((client = graph_table_at(&ip_cont->clients, j)) != NULL) {
+                        if (snapshot) graph_write_client(client);
 
                         pub_edge = client->pub_list;
                         while (pub_edge != NULL) { // client may have published topics
                             curr_pub_edge = pub_edge;
                             pub_edge = pub_edge->next;
 
-                            temp_bytes = (double)curr_pub_edge->bytes / (now - last_update);
+                            temp_bytes = round3((double)curr_pub_edge->bytes / (now - last_update));
                             curr_pub_edge->bytes = 0;
-                            curr_pub_edge->bytes_per_sec = round3(temp_bytes);
 
-                            if (curr_pub_edge->bytes_per_sec == 0.0 && --curr_pub_edge->ttl_cnt <= 0) {
+                            if (temp_bytes == 0.0 && --curr_pub_edge->ttl_cnt <= 0) {
                                 graph_delete_pub(client, curr_pub_edge);
                                 graph->changed = true;
                             }
                             else {
-                                client_json_add_pub(client_json, curr_pub_edge);
+                                if (curr_pub_edge->bytes_per_sec != temp_bytes) {
+                                    curr_pub_edge->bytes_per_sec = temp_bytes;
+                                    graph_delta_pub_edge("update", client, curr_pub_edge);
+                                }
+                                if (snapshot) graph_write_pub(curr_pub_edge);
                             }
                         }
+                        if (snapshot) graph_write_end();
                     }
                 }
+                if (snapshot) graph_write_end();
             }
         }
 
+        if (snapshot) graph_snapshot_topics();
+
         // graph has a list of all topics
-        for (size_t i = 0; i < graph->topic_dict->max_size; ++i) {
-            topic = graph->topic_dict->topic_list[i];
-            while (topic != NULL) {
+        for (size_t i = 0; i <= graph->topics.mask; ++i) {
+            if ((topic = graph_table_at(&graph->topics, i)) != NULL) {
                 // only delete after ttl_cnt <= 0 if retained
                 if (topic->retain && topic->ref_cnt == 0 && --topic->ttl_cnt <= 0) {
-                    temp = topic;
-                    topic = topic->next;
-                    graph_delete_topic(temp);
+                    graph_delete_topic(topic);
                     graph->changed = true;
                 }
                 else {
-                    topic_json = graph_json_add_topic(root, topic);
-
                     // update incoming bytes/s to topic
-                    temp_bytes = (double)topic->bytes / (now - last_update);
+                    temp_bytes = round3((double)topic->bytes / (now - last_update));
                     topic->bytes = 0;
-                    topic->bytes_per_sec = round3(temp_bytes);
+                    if (topic->bytes_per_sec != temp_bytes) {
+                        topic->bytes_per_sec = temp_bytes;
+                        graph_delta_topic("update", topic);
+                    }
 
-                    sub_edge = topic->sub_list;
-                    // each topic has a list of subscribed clients
-                    for (; sub_edge != NULL; sub_edge = sub_edge->next) {
-                        topic_json_add_sub(topic_json, sub_edge, topic->bytes_per_sec);
+                    // update outgoing bytes/s, messages/s and drops to each subscriber
+                    for (sub_edge = topic->sub_list; sub_edge != NULL; sub_edge = sub_edge->next) {
+                        temp_bytes = round3((double)sub_edge->bytes / (now - last_update));
+                        temp_msgs = round3((double)sub_edge->msgs / (now - last_update));
+                        sub_edge->bytes = 0;
+                        sub_edge->msgs = 0;
+                        if (sub_edge->bytes_per_sec != temp_bytes || sub_edge->msgs_per_sec != temp_msgs ||
+                                sub_edge->drops_last != sub_edge->drops) {
+                            sub_edge->bytes_per_sec = temp_bytes;
+                            sub_edge->msgs_per_sec = temp_msgs;
+                            sub_edge->drops_last = sub_edge->drops;
+                            graph_delta_sub_edge("update", topic, sub_edge);
+                        }
+                        sub_edge->drops = 0;
+                    }
+
+                    if (snapshot) {
+                        graph_write_topic(topic);
+
+                        sub_edge = topic->sub_list;
+                        // each topic has a list of subscribed clients
+                        for (; sub_edge != NULL; sub_edge = sub_edge->next) {
+                            graph_write_sub(sub_edge);
+                        }
+                        graph_write_end();
                     }
-                    topic = topic->next;
                 }
             }
         }
 
-        if (graph->topic_dict->used < graph->topic_dict->max_size / 4) {
-            graph_set_topic_dict_size(graph->topic_dict->max_size / 2);
+        graph_table_shrink(&graph->topics);
+
+        // publish the changes since the last interval to $NETWORK/delta topic
+        if (graph->delta != NULL) {
+            graph_delta_publish();
         }
 
         // publish the updated graph to $NETWORK topic
-        json_buf = cJSON_PrintUnformatted(root);
-        if (json_buf != NULL && graph->changed) {
-            db__messages_easy_queue(db, NULL, "$NETWORK", GRAPH_QOS, strlen(json_buf), json_buf, 1, 0, NULL);
-            graph->changed = false;
+        if (snapshot) {
+            graph_snapshot_publish();
+            graph->snapshot_requested = false;
+            graph->last_snapshot = now;
         }
-        cJSON_free(json_buf);
-        cJSON_Delete(root);
 
         // update current graph memory usage topic
         if (current_heap != memcount) {
             current_heap = memcount;
             snprintf(heap_buf, BUFLEN, "%lu", current_heap);
-            db__messages_easy_queue(db, NULL, "$NETWORK/heap/current", GRAPH_QOS, strlen(heap_buf), heap_buf, 1, 60, NULL);
+            graph_queue("$NETWORK/heap/current", strlen(heap_buf), heap_buf, 1, 60);
         }
 
         // update current graph maximum memory usage topic
         if (max_heap != memcount) {
             max_heap = max_memcount;
             snprintf(heap_buf, BUFLEN, "%lu", max_heap);
-            db__messages_easy_queue(db, NULL, "$NETWORK/heap/maximum", GRAPH_QOS, strlen(heap_buf), heap_buf, 1, 60, NULL);
+            graph_queue("$NETWORK/heap/maximum", strlen(heap_buf), heap_buf, 1, 60);
         }
 
         last_update = mosquitto_time();
     }
 }
+
+/*
+ * Graph thread, applies the events from the broker and updates the graph
+ */
+static void *graph_thread_main(void *arg) {
+    struct graph_event *event;
+
+    do {
+        while ((event = graph_ring_peek(ring)) != NULL) {
+            graph_handle_event(event, graph_ring_string(ring, event));
+            graph_ring_pop(ring, event);
+        }
+        graph_update(graph_interval);
+        // the update checks the time once a second
+    } while (!graph_thread_wait(ring, 1));
+
+    return NULL;
+}
+
+/*
+ * Called every main loop iteration
+ */
+void network_graph_publish(struct mosquitto_db *db) {
+    struct graph_message *msg, *next;
+
+    if (ring == NULL) return;
+
+    // connects and disconnects kept while the ring was full
+    if (pending != NULL) {
+        graph_push_pending();
+    }
+    // events of this iteration
+    graph_thread_wake(ring);
+
+    for (msg = graph_thread_take(); msg != NULL; msg = next) {
+        next = msg->next;
+        db__messages_easy_queue(db, NULL, msg->topic, GRAPH_QOS, msg->payloadlen, msg->payload, msg->retain, msg->expiry, NULL);
+        free(msg->payload);
+        free(msg);
+    }
+
+    if (ring->dropped != dropped_logged && mosquitto_time() > dropped_log_time) {
+        log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Network graph event queue full, %lu events dropped.",
+                ring->dropped - dropped_logged);
+        dropped_logged = ring->dropped;
+        dropped_log_time = mosquitto_time();
+    }
+}
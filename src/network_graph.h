@@ -1,20 +1,42 @@
 #ifndef NETWORK_GRAPH_H
 #define NETWORK_GRAPH_H
 
+#include <time.h>
+
 #include "mosquitto.h"
+#include "graph_ring.h"
+#include "graph_table.h"
+
+#define GRAPH_PUB_CACHE_SIZE    2
+#define GRAPH_ID_STR_LEN        26
+#define GRAPH_MSG_TOPICS        1024    /* power of two */
 
+struct mosquitto_db;
+struct graph_json;
+struct graph_binary;
 struct client;
 struct topic;
+struct ip_container;
 
 /**
  * @brief Subscription Edge structure. Points to a client that is subcribed to
- *        a specific topic and holds JSON of an edge.
+ *        a specific topic. Each edge is in the list of its topic and in the
+ *        list of its client.
  */
 struct sub_edge
 {
     struct client *sub;                 /**< pointer to client that is subbed to topic */
-    struct sub_edge *next;
+    struct topic *topic;                /**< pointer to topic that client is subbed to */
+    struct sub_edge *next;              /**< next edge of the topic */
     struct sub_edge *prev;
+    struct sub_edge *client_next;       /**< next edge of the client */
+    struct sub_edge *client_prev;
+    uint32_t bytes;                     /**< bytes written to the client this interval */
+    uint32_t msgs;                      /**< messages written to the client this interval */
+    uint32_t drops;                     /**< messages dropped this interval, client queue was full */
+    uint32_t drops_last;                /**< messages dropped in the last interval */
+    double bytes_per_sec;               /**< outgoing bytes/s to client */
+    double msgs_per_sec;                /**< outgoing messages/s to client */
 };
 
 /**
@@ -27,7 +49,7 @@ struct pub_edge
     struct topic *pub;                  /**< pointer to topic that is client is pubbed to */
     struct pub_edge *next;
     struct pub_edge *prev;
-    uint16_t bytes;
+    uint32_t bytes;
     double bytes_per_sec;               /**< incoming bytes/s to topic */
 };
 
@@ -39,14 +61,15 @@ struct topic
 {
     uint8_t retain;                     /**< whether or not topic is retained for ttl_cnt seconds */
     int ttl_cnt;                        /**< "ttl counter", if == 0, delete */
-    char *name;                         /**< full topic name */
-    struct topic *next;
-    struct topic *prev;
     struct sub_edge *sub_list;          /**< list of all subscriptions */
     uint16_t ref_cnt;                   /**< # of clients pubbed to topic */
-    uint16_t bytes;
-    double bytes_per_sec;               /**< outgoing bytes/s from topic */
+    uint32_t bytes;
+    double bytes_per_sec;               /**< incoming bytes/s to topic */
     unsigned long hash;                 /**< hash(name) */
+    unsigned long str_gen;              /**< binary snapshot that str_idx belongs to */
+    uint32_t str_idx;                   /**< index of name in the binary string table */
+    unsigned int msg_refs;              /**< slots of the message topic cache holding this topic */
+    char name[];                        /**< full topic name */
 };
 
 /**
@@ -56,13 +79,17 @@ struct topic
  */
 struct client
 {
-    struct client *next;
-    struct client *prev;
+    uint64_t id;                        /**< graph id of the connection the node belongs to */
+    struct ip_container *ip;            /**< IP container the client is in */
     struct pub_edge *pub_list;          /**< current topics client is pubbing to */
-    char *name;
+    struct pub_edge *pub_cache[GRAPH_PUB_CACHE_SIZE];   /**< most recently published to edges, MRU first */
+    struct sub_edge *sub_list;          /**< topics client is subbed to */
     double latency;                     /**< response time in ns */
     time_t time_prev;
     unsigned long hash;                 /**< hash(name) */
+    unsigned long str_gen;              /**< binary snapshot that str_idx belongs to */
+    uint32_t str_idx;                   /**< index of name in the binary string table */
+    char name[];
 };
 
 /**
@@ -71,56 +98,91 @@ struct client
  */
 struct ip_container
 {
-    char *id;
-    struct ip_container *next;
-    struct ip_container *prev;
-    struct client_dict *client_dict;    /**< dict of all clients with specific IP address */
+    char id[GRAPH_ID_STR_LEN];          /**< random id, published instead of the address */
+    struct graph_table clients;         /**< all clients with specific IP address */
     unsigned long hash;                 /**< hash(IP) */
+    char address[];
 };
 
 /**
- * @brief IP Dictionary structure. Holds a hash table of ip container structures.
+ * @brief Events the broker sends to the graph thread.
  */
-struct ip_dict
+enum graph_event_type
 {
-    size_t used;                        /**< current number of slots used */
-    size_t max_size;                    /**< maximum number of slots */
-    struct ip_container **ip_list;      /**< list of all ip addresses */
+    graph_ev_connect = 0,               /**< strings: client id, address */
+    graph_ev_disconnect,
+    graph_ev_publish,                   /**< string: topic, flag: retain, len: payload length */
+    graph_ev_subscribe,                 /**< string: topic */
+    graph_ev_unsubscribe,               /**< string: topic */
+    graph_ev_delivery,                  /**< string: topic or none if cached, flag: dropped, arg: message id */
+    graph_ev_sub_bytes,                 /**< string: topic or none if cached, len: payload length, arg: message id */
+    graph_ev_latency_start,             /**< arg: time in ns */
+    graph_ev_latency_end,               /**< arg: time in ns */
+    graph_ev_snapshot,
 };
 
 /**
- * @brief Topic Dictionary structure. Holds a hash table of topic node structures.
+ * @brief Message finished by the graph thread, queued by the main loop.
  */
-struct topic_dict {
-    size_t used;                        /**< current number of slots used */
-    size_t max_size;                    /**< maximum number of slots */
-    struct topic **topic_list;          /**< list of all topics */
+struct graph_message
+{
+    struct graph_message *next;
+    const char *topic;
+    void *payload;
+    uint32_t payloadlen;
+    int retain;
+    uint32_t expiry;                    /**< message expiry interval in seconds */
 };
 
 /**
- * @brief Client Dictionary structure. Holds a hash table of client node structures.
+ * @brief Connect or disconnect event that did not fit in the ring. The main
+ *        thread keeps it and pushes it before any other event.
  */
-struct client_dict
+struct graph_pending
 {
-    size_t used;                        /**< current number of slots used */
-    size_t max_size;                    /**< maximum number of slots */
-    struct client **client_list;        /**< list of all clients connect with ip */
+    struct graph_pending *next;
+    struct graph_event event;
+    char *str1;                         /**< client id of a connect, NULL otherwise */
+    char *str2;                         /**< address of a connect, NULL otherwise */
+};
+
+/**
+ * @brief Slot of the message topic cache. The broker leaves the topic out of
+ *        delivery and sub bytes events of a message the slot already holds.
+ */
+struct graph_msg_topic
+{
+    uint64_t msg_id;                    /**< stored message id */
+    struct topic *topic;                /**< topic of the message, NULL if not in the graph */
 };
 
 /**
  * @brief Network Graph structure. Holds a set of ip containers and a set of topic node
- *        structures.
+ *        structures. Only the graph thread uses it after network_graph_init.
  */
 struct network_graph
 {
     bool changed;                       /**< whether or not the graph needs to be updated */
-    struct ip_dict *ip_dict;
-    struct topic_dict *topic_dict;
+    bool snapshot_requested;            /**< whether a client asked for a full snapshot */
+    unsigned long seq;                  /**< sequence number of the last published delta */
+    time_t last_snapshot;               /**< time the last full snapshot was published */
+    struct graph_json *json;            /**< reused buffer for the full graph, NULL in binary format */
+    struct graph_binary *bin;           /**< reused buffer for the binary graph body, NULL in JSON format */
+    struct graph_binary *bin_msg;       /**< reused buffer for the binary header, string table and body */
+    unsigned long bin_gen;              /**< number of the binary snapshot being written */
+    struct graph_msg_topic msg_topics[GRAPH_MSG_TOPICS]; /**< topics of recent messages, see graph_msg_topic() */
+    struct graph_json *delta;           /**< pending changes, NULL if delta mode is off */
+    struct graph_json *delta_msg;       /**< reused buffer for publishing the delta */
+    struct graph_table ips;             /**< all ip containers by address */
+    struct graph_table topics;          /**< all topics by name */
+    struct graph_table ids;             /**< all clients by graph id */
 };
 
 
 /**
- * @brief Function for initalizing the main network graph at broker startup.
+ * @brief Function for initalizing the main network graph at broker startup and
+ *        starting the graph thread. The hooks below only queue an event for the
+ *        graph thread, which owns the graph, updates it and serializes it.
  *
  * @param[in]   db          mosquitto database structure that stores config params.
  *
@@ -129,8 +191,8 @@ struct network_graph
 int network_graph_init(struct mosquitto_db *db);
 
 /**
- * @brief Function for freeing up memory used by the main network graph at
- *        end of broker program.
+ * @brief Function for stopping the graph thread and freeing up memory used by
+ *        the main network graph at end of broker program.
  *
  * @return      status code.
  */
@@ -138,6 +200,8 @@ int network_graph_cleanup(void);
 
 /**
  * @brief Function for adding a client node to the network graph after CONNECT.
+ *        The connection gets a new graph id that the other hooks send instead
+ *        of the client id.
  *
  * @param[in]   context     mosquitto client structure.
  *
@@ -156,6 +220,34 @@ int network_graph_add_client(struct mosquitto *context);
  */
 int network_graph_add_sub_edge(struct mosquitto *context, const char *topic);
 
+/**
+ * @brief Function for adding a subscription edge to the network graph when a
+ *        message is queued for a subscriber. The subscriber was matched by the
+ *        subscription tree, so this covers wildcard and shared subscriptions.
+ *        The topic is looked up once per message, not once per subscriber.
+ *
+ * @param[in]   context     mosquitto client structure of the subscriber.
+ * @param[in]   topic       name of topic the message was published to.
+ * @param[in]   msg_id      id of the stored message.
+ * @param[in]   dropped     whether the message was dropped because the queue was full.
+ *
+ * @return      status code.
+ */
+int network_graph_add_delivery(struct mosquitto *context, const char *topic, uint64_t msg_id, bool dropped);
+
+/**
+ * @brief Function for counting a PUBLISH written to a subscriber on its
+ *        subscription edge.
+ *
+ * @param[in]   context     mosquitto client structure of the subscriber.
+ * @param[in]   topic       name of topic the message was published to.
+ * @param[in]   msg_id      id of the stored message.
+ * @param[in]   payloadlen  length of payload of publish message.
+ *
+ * @return      status code.
+ */
+int network_graph_add_sub_bytes(struct mosquitto *context, const char *topic, uint64_t msg_id, uint32_t payloadlen);
+
 /**
  * @brief Function for adding a topic node to the network graph after PUBLISH.
  *
@@ -210,12 +302,16 @@ int network_graph_latency_start(struct mosquitto *context, const char *topic);
 int network_graph_latency_end(struct mosquitto *context);
 
 /**
- * @brief Function to periodically generate and publish JSON that represents the network
- *        graph. Called every interval seconds.
+ * @brief Function for queueing the messages the graph thread finished, called
+ *        from the main loop. Every interval seconds the graph thread generates JSON
+ *        that represents the network graph. In delta mode, only the changes since the
+ *        last interval are published on $NETWORK/delta and the full graph is published
+ *        on $NETWORK every graph_keyframe_interval seconds or when requested by a
+ *        publish to $NETWORK/snapshot. The full graph is JSON or, with graph_format
+ *        binary, a string table followed by index based node and edge lists.
  *
  * @param[in]   db          mosquitto database structure.
- * @param[in]   interval    interval for periodic network graph publishing.
  */
-void network_graph_update(struct mosquitto_db *db, int interval);
+void network_graph_publish(struct mosquitto_db *db);
 
 #endif
@@ -27,8 +27,20 @@ extern const unsigned char magic[15];
 #define DB_CHUNK_RETAIN 4
 #define DB_CHUNK_SUB 5
 #define DB_CHUNK_CLIENT 6
+/* Only found in the persistence log */
+#define DB_CHUNK_MSG_STORE_DELETE 7
+#define DB_CHUNK_CLIENT_MSG_DELETE 8
+#define DB_CHUNK_SUB_DELETE 9
+#define DB_CHUNK_CLIENT_DELETE 10
 /* End DB read/write */
 
+/* With retained_cache_size set, payloads at least this large are left in the
+ * persistence file until they are needed. */
+#define PERSIST_LAZY_PAYLOAD_MIN 1024
+
+/* Size of the stdio buffer used when restoring. */
+#define PERSIST_READ_BUFFER (1024*1024)
+
 #define read_e(f, b, c) if(fread(b, 1, c, f) != c){ goto error; }
 #define write_e(f, b, c) if(fwrite(b, 1, c, f) != c){ goto error; }
 
@@ -116,6 +128,10 @@ struct P_msg_store{
 	struct mosquitto source;
 	char *topic;
 	mosquitto_property *properties;
+	/* If lazy_min is set, payloads of at least lazy_min bytes are not read,
+	 * and payload_offset is where they are in the file. */
+	uint32_t lazy_min;
+	long payload_offset;
 };
 
 
@@ -141,8 +157,53 @@ struct P_retain{
 };
 
 
+struct PF_msg_store_delete{
+	dbid_t store_id;
+};
+struct P_msg_store_delete{
+	struct PF_msg_store_delete F;
+};
+
+
+struct PF_client_msg_delete{
+	dbid_t store_id;
+	uint16_t mid;
+	uint16_t id_len;
+	uint8_t direction;
+	/* tail: 3 byte padding */
+};
+struct P_client_msg_delete{
+	struct PF_client_msg_delete F;
+	char *client_id;
+};
+
+
+struct PF_sub_delete{
+	uint16_t id_len;
+	uint16_t topic_len;
+};
+struct P_sub_delete{
+	struct PF_sub_delete F;
+	char *client_id;
+	char *topic;
+};
+
+
+struct PF_client_delete{
+	uint16_t id_len;
+};
+struct P_client_delete{
+	struct PF_client_delete F;
+	char *client_id;
+};
+
+
 int persist__read_string_len(FILE *db_fptr, char **str, uint16_t len);
 int persist__read_string(FILE *db_fptr, char **str);
+char *persist__filepath(struct mosquitto_db *db, const char *ext);
+int persist__map_open(struct mosquitto_db *db);
+const void *persist__map_payload(long offset, uint32_t payloadlen);
+void persist__map_refresh(struct mosquitto_db *db);
 
 int persist__chunk_header_read(FILE *db_fptr, int *chunk, int *length);
 
@@ -161,6 +222,10 @@ int persist__chunk_client_msg_read_v56(FILE *db_fptr, struct P_client_msg *chunk
 int persist__chunk_msg_store_read_v56(FILE *db_fptr, struct P_msg_store *chunk, uint32_t length);
 int persist__chunk_retain_read_v56(FILE *db_fptr, struct P_retain *chunk);
 int persist__chunk_sub_read_v56(FILE *db_fptr, struct P_sub *chunk);
+int persist__chunk_msg_store_delete_read_v6(FILE *db_fptr, struct P_msg_store_delete *chunk);
+int persist__chunk_client_msg_delete_read_v6(FILE *db_fptr, struct P_client_msg_delete *chunk);
+int persist__chunk_sub_delete_read_v6(FILE *db_fptr, struct P_sub_delete *chunk);
+int persist__chunk_client_delete_read_v6(FILE *db_fptr, struct P_client_delete *chunk);
 
 int persist__chunk_cfg_write_v6(FILE *db_fptr, struct PF_cfg *chunk);
 int persist__chunk_client_write_v6(FILE *db_fptr, struct P_client *chunk);
@@ -168,5 +233,9 @@ int persist__chunk_client_msg_write_v6(FILE *db_fptr, struct P_client_msg *chunk
 int persist__chunk_message_store_write_v6(FILE *db_fptr, struct P_msg_store *chunk);
 int persist__chunk_retain_write_v6(FILE *db_fptr, struct P_retain *chunk);
 int persist__chunk_sub_write_v6(FILE *db_fptr, struct P_sub *chunk);
+int persist__chunk_msg_store_delete_write_v6(FILE *db_fptr, struct P_msg_store_delete *chunk);
+int persist__chunk_client_msg_delete_write_v6(FILE *db_fptr, struct P_client_msg_delete *chunk);
+int persist__chunk_sub_delete_write_v6(FILE *db_fptr, struct P_sub_delete *chunk);
+int persist__chunk_client_delete_write_v6(FILE *db_fptr, struct P_client_delete *chunk);
 
 #endif
@@ -0,0 +1,438 @@
+/*
+Copyright (c) 2010-2020 Roger Light <roger@atchoo.org>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   Roger Light - initial implementation and documentation.
+*/
+
+#include "config.h"
+
+#ifdef WITH_PERSISTENCE
+
+#ifndef WIN32
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <utlist.h>
+
+#include "mosquitto_broker_internal.h"
+#include "memory_mosq.h"
+#include "persist.h"
+
+/* ============================================================
+ * Retained payload cache
+ *
+ * With retained_cache_size set, the payloads of retained messages restored
+ * from the persistence file are not read at startup. The file is mapped
+ * instead, and a payload is copied out of the mapping the first time a
+ * subscription needs it. Loaded payloads of messages that are only held by
+ * their topic go on a least recently used list, and the oldest are freed
+ * again once the list holds more than retained_cache_size bytes. A message
+ * that is queued for a client keeps its payload until it is delivered.
+ *
+ * Each save writes a new file, which is then mapped in place of the old one,
+ * so retained messages published since the last save can be dropped from
+ * memory too.
+ * ============================================================ */
+
+struct persist__map_entry{
+	dbid_t store_id;
+	const void *payload;
+};
+
+static char *map_base = NULL;
+static size_t map_len = 0;
+static struct mosquitto_msg_store *cache_head = NULL;
+static size_t cache_bytes = 0;
+static unsigned long cache_count = 0;
+
+
+#ifndef WIN32
+static int persist__map_file(const char *path, char **base, size_t *len)
+{
+	struct stat st;
+	void *addr;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if(fd < 0) return 1;
+	if(fstat(fd, &st) || st.st_size == 0){
+		close(fd);
+		return 1;
+	}
+	addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(addr == MAP_FAILED) return 1;
+
+	madvise(addr, st.st_size, MADV_RANDOM);
+	*base = addr;
+	*len = st.st_size;
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+/* Pages that have been copied from are dropped from the process, so only the
+ * cache counts towards its memory use. The page cache keeps them for as long
+ * as the system can spare the memory. */
+static void persist__map_release(const void *addr, size_t len)
+{
+	long pagesize = sysconf(_SC_PAGESIZE);
+	uintptr_t start, end;
+
+	start = (uintptr_t)addr & ~(uintptr_t)(pagesize-1);
+	end = ((uintptr_t)addr + len + pagesize-1) & ~(uintptr_t)(pagesize-1);
+	madvise((void *)start, end-start, MADV_DONTNEED);
+}
+#endif
+
+
+/* Map the persistence file that is about to be restored. Returns
+ * MOSQ_ERR_SUCCESS if payloads can be left in it. */
+int persist__map_open(struct mosquitto_db *db)
+{
+#ifdef WIN32
+	return 1;
+#else
+	if(db->config->retained_cache_size == 0) return 1;
+
+	persist__map_close(db);
+	if(persist__map_file(db->config->persistence_filepath, &map_base, &map_len)){
+		log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Unable to map %s, retained messages will be read in full: %s.",
+				db->config->persistence_filepath, strerror(errno));
+		return 1;
+	}
+	return MOSQ_ERR_SUCCESS;
+#endif
+}
+
+
+void persist__map_close(struct mosquitto_db *db)
+{
+#ifndef WIN32
+	if(map_base){
+		munmap(map_base, map_len);
+	}
+#endif
+	map_base = NULL;
+	map_len = 0;
+	cache_head = NULL;
+	cache_bytes = 0;
+	cache_count = 0;
+}
+
+
+/* The payload at offset in the file being restored, or NULL if it isn't all
+ * there. */
+const void *persist__map_payload(long offset, uint32_t payloadlen)
+{
+	if(!map_base || offset <= 0 || (size_t)offset + payloadlen > map_len){
+		return NULL;
+	}
+	return map_base + offset;
+}
+
+
+static void persist__cache_add(struct mosquitto_msg_store *stored)
+{
+	DL_PREPEND2(cache_head, stored, cache_prev, cache_next);
+	cache_bytes += stored->payloadlen;
+	cache_count++;
+}
+
+
+static void persist__cache_remove(struct mosquitto_msg_store *stored)
+{
+	DL_DELETE2(cache_head, stored, cache_prev, cache_next);
+	stored->cache_prev = NULL;
+	stored->cache_next = NULL;
+	cache_bytes -= stored->payloadlen;
+	cache_count--;
+}
+
+
+/* Free the least recently used payloads until the cache holds no more than
+ * limit bytes. Each entry is looked at once at most, so a cache full of
+ * messages that are queued for clients can't stall the loop. */
+static void persist__cache_evict(size_t limit)
+{
+	struct mosquitto_msg_store *stored;
+	unsigned long count = cache_count;
+
+	while(cache_bytes > limit && count > 0){
+		stored = cache_head->cache_prev;
+		count--;
+		persist__cache_remove(stored);
+		if(stored->ref_count > 1){
+			/* Queued for a client, try again later. */
+			persist__cache_add(stored);
+			continue;
+		}
+		UHPA_FREE_PAYLOAD(stored);
+	}
+}
+
+
+static int persist__payload_read(struct mosquitto_msg_store *stored)
+{
+	if(UHPA_ALLOC_PAYLOAD(stored) == 0){
+		log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+		return MOSQ_ERR_NOMEM;
+	}
+	memcpy(UHPA_ACCESS_PAYLOAD(stored), stored->payload_mapped, stored->payloadlen);
+#ifndef WIN32
+	persist__map_release(stored->payload_mapped, stored->payloadlen);
+#endif
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+/* Make sure the payload of a retained message is in memory. */
+int persist__payload_load(struct mosquitto_db *db, struct mosquitto_msg_store *stored)
+{
+	size_t limit = db->config->retained_cache_size;
+	int rc;
+
+	if(!stored->payload_mapped) return MOSQ_ERR_SUCCESS;
+
+	if(stored->cache_prev){
+		if(stored != cache_head){
+			DL_DELETE2(cache_head, stored, cache_prev, cache_next);
+			DL_PREPEND2(cache_head, stored, cache_prev, cache_next);
+		}
+		return MOSQ_ERR_SUCCESS;
+	}
+	if(stored->payload.ptr){
+		persist__cache_add(stored);
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	/* Make room first, so this payload can't be the one to go. */
+	persist__cache_evict(limit > stored->payloadlen ? limit - stored->payloadlen : 0);
+	rc = persist__payload_read(stored);
+	if(rc) return rc;
+	persist__cache_add(stored);
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+/* Load the payload of a message that something other than its topic is
+ * about to hold, and keep it in memory from now on. */
+int persist__payload_pin(struct mosquitto_db *db, struct mosquitto_msg_store *stored)
+{
+	int rc;
+
+	if(!stored->payload_mapped) return MOSQ_ERR_SUCCESS;
+
+	if(stored->cache_prev){
+		persist__cache_remove(stored);
+	}else if(stored->payload.ptr == NULL){
+		rc = persist__payload_read(stored);
+		if(rc) return rc;
+	}
+	stored->payload_mapped = NULL;
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+/* The message is no longer retained for its topic. If it is still queued
+ * for a client its payload is in memory, and must stay there. */
+void persist__payload_unretain(struct mosquitto_db *db, struct mosquitto_msg_store *stored)
+{
+	if(stored->cache_prev){
+		persist__cache_remove(stored);
+		stored->payload_mapped = NULL;
+	}
+}
+
+
+/* The message has been sent to the last client it was queued for. Eviction
+ * skips queued messages, so this is where an over full cache catches up. */
+void persist__payload_release(struct mosquitto_db *db, struct mosquitto_msg_store *stored)
+{
+	if(stored->cache_prev && cache_bytes > db->config->retained_cache_size){
+		persist__cache_remove(stored);
+		UHPA_FREE_PAYLOAD(stored);
+	}
+}
+
+
+void persist__payload_free(struct mosquitto_db *db, struct mosquitto_msg_store *stored)
+{
+	if(stored->cache_prev){
+		persist__cache_remove(stored);
+	}
+	stored->payload_mapped = NULL;
+}
+
+
+#ifndef WIN32
+static int persist__map_entry_cmp(const void *a, const void *b)
+{
+	const struct persist__map_entry *ea = a, *eb = b;
+
+	if(ea->store_id < eb->store_id) return -1;
+	if(ea->store_id > eb->store_id) return 1;
+	return 0;
+}
+
+
+/* Find where each large payload is in a newly written file, from the chunk
+ * headers alone. */
+static int persist__map_index(char *base, size_t len, struct persist__map_entry **index, size_t *count)
+{
+	struct persist__map_entry *entries = NULL, *tmp;
+	struct PF_header header;
+	struct PF_msg_store F;
+	size_t size = 0, n = 0;
+	size_t pos, offset;
+	uint32_t i32temp, length;
+
+	pos = 15 + 2*sizeof(uint32_t);
+	if(len < pos || memcmp(base, magic, 15)) return 1;
+	memcpy(&i32temp, base + 15 + sizeof(uint32_t), sizeof(uint32_t));
+	if(ntohl(i32temp) != MOSQ_DB_VERSION) return 1;
+
+	while(pos + sizeof(struct PF_header) <= len){
+		memcpy(&header, base + pos, sizeof(struct PF_header));
+		pos += sizeof(struct PF_header);
+		length = ntohl(header.length);
+		if(length > len - pos){
+			mosquitto__free(entries);
+			return 1;
+		}
+
+		if(ntohl(header.chunk) == DB_CHUNK_MSG_STORE && length >= sizeof(struct PF_msg_store)){
+			memcpy(&F, base + pos, sizeof(struct PF_msg_store));
+			if(ntohl(F.payloadlen) >= PERSIST_LAZY_PAYLOAD_MIN){
+				if(n == size){
+					size = size?size*2:1024;
+					tmp = mosquitto__realloc(entries, size*sizeof(struct persist__map_entry));
+					if(!tmp){
+						mosquitto__free(entries);
+						return MOSQ_ERR_NOMEM;
+					}
+					entries = tmp;
+				}
+				offset = pos + sizeof(struct PF_msg_store)
+						+ ntohs(F.source_id_len) + ntohs(F.source_username_len) + ntohs(F.topic_len);
+
+				entries[n].store_id = F.store_id;
+				entries[n].payload = base + offset;
+				n++;
+			}
+		}
+		pos += length;
+	}
+
+	if(n){
+		qsort(entries, n, sizeof(struct persist__map_entry), persist__map_entry_cmp);
+	}
+	*index = entries;
+	*count = n;
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+/* Point the retained messages below node at their payloads in the new file.
+ * Returns 1 if a payload that is only in the old file could not be loaded,
+ * in which case the old file has to stay mapped. */
+static int persist__map_relocate(struct mosquitto__retainhier *node, struct persist__map_entry *index, size_t count)
+{
+	struct mosquitto__retainhier *branch, *branch_tmp;
+	struct mosquitto_msg_store *stored;
+	struct persist__map_entry key, *entry = NULL;
+	int rc = 0;
+
+	HASH_ITER(hh, node, branch, branch_tmp){
+		stored = branch->retained;
+		if(stored && stored->payloadlen >= PERSIST_LAZY_PAYLOAD_MIN){
+			if(count){
+				key.store_id = stored->db_id;
+				entry = bsearch(&key, index, count, sizeof(struct persist__map_entry), persist__map_entry_cmp);
+			}
+			if(entry){
+				stored->payload_mapped = entry->payload;
+				if(!stored->cache_prev && stored->payload.ptr){
+					persist__cache_add(stored);
+				}
+			}else if(stored->payload_mapped){
+				/* Not in the new file, so it has to be loaded from the old
+				 * one before that goes. */
+				if(stored->cache_prev){
+					persist__cache_remove(stored);
+					stored->payload_mapped = NULL;
+				}else if(stored->payload.ptr || persist__payload_read(stored) == MOSQ_ERR_SUCCESS){
+					stored->payload_mapped = NULL;
+				}else{
+					rc = 1;
+				}
+			}
+			entry = NULL;
+		}
+		if(branch->children && persist__map_relocate(branch->children, index, count)){
+			rc = 1;
+		}
+	}
+	return rc;
+}
+#endif
+
+
+/* Called after a snapshot has been written successfully. */
+void persist__map_refresh(struct mosquitto_db *db)
+{
+#ifndef WIN32
+	struct persist__map_entry *index = NULL;
+	size_t count = 0;
+	char *base;
+	size_t len;
+	int rc;
+
+	if(db->config->retained_cache_size == 0) return;
+
+	if(persist__map_file(db->config->persistence_filepath, &base, &len)){
+		log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Unable to map %s: %s.",
+				db->config->persistence_filepath, strerror(errno));
+		return;
+	}
+	rc = persist__map_index(base, len, &index, &count);
+	if(rc){
+		log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Unable to index %s.", db->config->persistence_filepath);
+		munmap(base, len);
+		return;
+	}
+
+	if(persist__map_relocate(db->retains, index, count)){
+		/* Left for good, the messages that need it still point into it. */
+		log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Out of memory, keeping the previous persistence file mapped.");
+	}else if(map_base){
+		munmap(map_base, map_len);
+	}
+	mosquitto__free(index);
+
+	/* Reading the headers brought pages in. */
+	madvise(base, len, MADV_DONTNEED);
+	map_base = base;
+	map_len = len;
+
+	persist__cache_evict(db->config->retained_cache_size);
+#endif
+}
+
+#endif
@@ -41,6 +41,10 @@ uint32_t db_version;
 
 const unsigned char magic[15] = {0x00, 0xB5, 0x00, 'm','o','s','q','u','i','t','t','o',' ','d','b'};
 
+/* The messages of a client follow it in the file, so the last client found
+ * is checked before looking it up. */
+static struct mosquitto *last_context = NULL;
+
 static int persist__restore_sub(struct mosquitto_db *db, const char *client_id, const char *sub, int qos, uint32_t identifier, int options);
 
 static struct mosquitto *persist__find_or_add_context(struct mosquitto_db *db, const char *client_id, uint16_t last_mid)
@@ -50,7 +54,11 @@ static struct mosquitto *persist__find_or_add_context(struct mosquitto_db *db, c
 	if(!client_id) return NULL;
 
 	context = NULL;
-	HASH_FIND(hh_id, db->contexts_by_id, client_id, strlen(client_id), context);
+	if(last_context && last_context->id && !strcmp(last_context->id, client_id)){
+		context = last_context;
+	}else{
+		HASH_FIND(hh_id, db->contexts_by_id, client_id, strlen(client_id), context);
+	}
 	if(!context){
 		context = context__init(db, -1);
 		if(!context) return NULL;
@@ -67,6 +75,7 @@ static struct mosquitto *persist__find_or_add_context(struct mosquitto_db *db, c
 	if(last_mid){
 		context->last_mid = last_mid;
 	}
+	last_context = context;
 	return context;
 }
 
@@ -108,6 +117,21 @@ int persist__read_string(FILE *db_fptr, char **str)
 }
 
 
+/* The persistence file path with ext appended, e.g. ".log" */
+char *persist__filepath(struct mosquitto_db *db, const char *ext)
+{
+	char *path;
+	size_t len;
+
+	len = strlen(db->config->persistence_filepath) + strlen(ext) + 1;
+	path = mosquitto__malloc(len);
+	if(!path) return NULL;
+	snprintf(path, len, "%s%s", db->config->persistence_filepath, ext);
+
+	return path;
+}
+
+
 static int persist__client_msg_restore(struct mosquitto_db *db, struct P_client_msg *chunk)
 {
 	struct mosquitto_client_msg *cmsg;
@@ -118,10 +142,15 @@ static int persist__client_msg_restore(struct mosquitto_db *db, struct P_client_
 	HASH_FIND(hh, db->msg_store_load, &chunk->F.store_id, sizeof(dbid_t), load);
 	if(!load){
 		/* Can't find message - probably expired */
+		mosquitto_property_free_all(&chunk->properties);
 		return MOSQ_ERR_SUCCESS;
 	}
+	if(persist__payload_pin(db, load->store)){
+		mosquitto_property_free_all(&chunk->properties);
+		return MOSQ_ERR_NOMEM;
+	}
 
-	cmsg = mosquitto__calloc(1, sizeof(struct mosquitto_client_msg));
+	cmsg = db__client_msg_new();
 	if(!cmsg){
 		log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
 		return MOSQ_ERR_NOMEM;
@@ -137,13 +166,14 @@ static int persist__client_msg_restore(struct mosquitto_db *db, struct P_client_
 	cmsg->state = chunk->F.state;
 	cmsg->dup = chunk->F.retain_dup&0x0F;
 	cmsg->properties = chunk->properties;
+	cmsg->persisted = true;
 
 	cmsg->store = load->store;
 	db__msg_store_ref_inc(cmsg->store);
 
 	context = persist__find_or_add_context(db, chunk->client_id, 0);
 	if(!context){
-		mosquitto__free(cmsg);
+		db__client_msg_free(cmsg);
 		log__printf(NULL, MOSQ_LOG_ERR, "Error restoring persistent database, message store corrupt.");
 		return 1;
 	}
@@ -246,7 +276,7 @@ static int persist__client_msg_chunk_restore(struct mosquitto_db *db, FILE *db_f
 }
 
 
-static int persist__msg_store_chunk_restore(struct mosquitto_db *db, FILE *db_fptr, uint32_t length)
+static int persist__msg_store_chunk_restore(struct mosquitto_db *db, FILE *db_fptr, uint32_t length, bool lazy)
 {
 	struct P_msg_store chunk;
 	struct mosquitto_msg_store *stored = NULL;
@@ -257,6 +287,9 @@ static int persist__msg_store_chunk_restore(struct mosquitto_db *db, FILE *db_fp
 	int i;
 
 	memset(&chunk, 0, sizeof(struct P_msg_store));
+	if(lazy){
+		chunk.lazy_min = PERSIST_LAZY_PAYLOAD_MIN;
+	}
 
 	if(db_version == 6 || db_version == 5){
 		rc = persist__chunk_msg_store_read_v56(db_fptr, &chunk, length);
@@ -268,6 +301,21 @@ static int persist__msg_store_chunk_restore(struct mosquitto_db *db, FILE *db_fp
 		return rc;
 	}
 
+	if(chunk.F.store_id > db->last_db_id){
+		db->last_db_id = chunk.F.store_id;
+	}
+	HASH_FIND(hh, db->msg_store_load, &chunk.F.store_id, sizeof(dbid_t), load);
+	if(load){
+		/* Already in the snapshot, the log was not truncated after the
+		 * snapshot was last written. */
+		mosquitto__free(chunk.source.id);
+		mosquitto__free(chunk.source.username);
+		mosquitto__free(chunk.topic);
+		mosquitto_property_free_all(&chunk.properties);
+		UHPA_FREE(chunk.payload, chunk.F.payloadlen);
+		return MOSQ_ERR_SUCCESS;
+	}
+
 	if(chunk.F.source_port){
 		for(i=0; i<db->config->listener_count; i++){
 			if(db->config->listeners[i].port == chunk.F.source_port){
@@ -316,8 +364,21 @@ static int persist__msg_store_chunk_restore(struct mosquitto_db *db, FILE *db_fp
 
 	if(rc == MOSQ_ERR_SUCCESS){
 		stored->source_listener = chunk.source.listener;
+		stored->persisted = true;
+		if(chunk.payload_offset){
+			stored->payload_mapped = persist__map_payload(chunk.payload_offset, chunk.F.payloadlen);
+			if(!stored->payload_mapped){
+				mosquitto__free(load);
+				fclose(db_fptr);
+				log__printf(NULL, MOSQ_LOG_ERR, "Error restoring persistent database, message store corrupt.");
+				return 1;
+			}
+		}
 		load->db_id = stored->db_id;
 		load->store = stored;
+		/* Held until the restore is complete, so replaying the log can't
+		 * leave load pointing at a freed message. */
+		db__msg_store_ref_inc(stored);
 
 		HASH_ADD(hh, db->msg_store_load, db_id, sizeof(dbid_t), load);
 		return MOSQ_ERR_SUCCESS;
@@ -381,6 +442,203 @@ static int persist__sub_chunk_restore(struct mosquitto_db *db, FILE *db_fptr)
 }
 
 
+/* Find a message restored from the snapshot or earlier in the log. */
+static struct mosquitto_client_msg *persist__client_msg_find(struct mosquitto_msg_data *msg_data, uint16_t mid, dbid_t store_id, struct mosquitto_client_msg ***head)
+{
+	struct mosquitto_client_msg *cmsg;
+
+	DL_FOREACH(msg_data->inflight, cmsg){
+		if(cmsg->mid == mid && cmsg->store->db_id == store_id){
+			*head = &msg_data->inflight;
+			return cmsg;
+		}
+	}
+	DL_FOREACH(msg_data->queued, cmsg){
+		if(cmsg->mid == mid && cmsg->store->db_id == store_id){
+			*head = &msg_data->queued;
+			return cmsg;
+		}
+	}
+	return NULL;
+}
+
+
+/* In the log, a client message that already exists is a change of state. */
+static int persist__client_msg_log_chunk_restore(struct mosquitto_db *db, FILE *db_fptr, uint32_t length)
+{
+	struct P_client_msg chunk;
+	struct mosquitto *context = NULL;
+	struct mosquitto_msg_data *msg_data;
+	struct mosquitto_client_msg *cmsg, **head;
+	int rc;
+
+	memset(&chunk, 0, sizeof(struct P_client_msg));
+
+	rc = persist__chunk_client_msg_read_v56(db_fptr, &chunk, length);
+	if(rc){
+		fclose(db_fptr);
+		return rc;
+	}
+
+	if(chunk.client_id){
+		HASH_FIND(hh_id, db->contexts_by_id, chunk.client_id, strlen(chunk.client_id), context);
+	}
+	if(context){
+		msg_data = chunk.F.direction == mosq_md_out?&context->msgs_out:&context->msgs_in;
+		cmsg = persist__client_msg_find(msg_data, chunk.F.mid, chunk.F.store_id, &head);
+		if(cmsg){
+			cmsg->state = chunk.F.state;
+			cmsg->dup = chunk.F.retain_dup&0x0F;
+			if(head == &msg_data->queued && cmsg->state != mosq_ms_queued){
+				/* Sent since it was queued */
+				DL_DELETE(msg_data->queued, cmsg);
+				DL_APPEND(msg_data->inflight, cmsg);
+				if(cmsg->qos > 0 && msg_data->inflight_quota > 0){
+					msg_data->inflight_quota--;
+				}
+			}
+			mosquitto_property_free_all(&chunk.properties);
+			mosquitto__free(chunk.client_id);
+			return MOSQ_ERR_SUCCESS;
+		}
+	}
+
+	rc = persist__client_msg_restore(db, &chunk);
+	mosquitto__free(chunk.client_id);
+
+	return rc;
+}
+
+
+static int persist__client_msg_delete_chunk_restore(struct mosquitto_db *db, FILE *db_fptr)
+{
+	struct P_client_msg_delete chunk;
+	struct mosquitto *context = NULL;
+	struct mosquitto_msg_data *msg_data;
+	struct mosquitto_client_msg *cmsg, **head;
+	int rc;
+
+	memset(&chunk, 0, sizeof(struct P_client_msg_delete));
+
+	rc = persist__chunk_client_msg_delete_read_v6(db_fptr, &chunk);
+	if(rc){
+		fclose(db_fptr);
+		return rc;
+	}
+
+	if(chunk.client_id){
+		HASH_FIND(hh_id, db->contexts_by_id, chunk.client_id, strlen(chunk.client_id), context);
+	}
+	if(context){
+		if(chunk.F.direction == mosq_md_out){
+			msg_data = &context->msgs_out;
+		}else{
+			msg_data = &context->msgs_in;
+		}
+		cmsg = persist__client_msg_find(msg_data, chunk.F.mid, chunk.F.store_id, &head);
+		if(cmsg){
+			DL_DELETE(*head, cmsg);
+			msg_data->msg_count--;
+			msg_data->msg_bytes -= cmsg->store->payloadlen;
+			if(cmsg->qos > 0){
+				msg_data->msg_count12--;
+				msg_data->msg_bytes12 -= cmsg->store->payloadlen;
+				if(head == &msg_data->inflight && msg_data->inflight_quota < msg_data->inflight_maximum){
+					msg_data->inflight_quota++;
+				}
+			}
+			db__msg_store_ref_dec(db, &cmsg->store);
+			mosquitto_property_free_all(&cmsg->properties);
+			db__client_msg_free(cmsg);
+		}
+	}
+	mosquitto__free(chunk.client_id);
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static int persist__msg_store_delete_chunk_restore(struct mosquitto_db *db, FILE *db_fptr)
+{
+	struct P_msg_store_delete chunk;
+	struct mosquitto_msg_store_load *load;
+	int rc;
+
+	memset(&chunk, 0, sizeof(struct P_msg_store_delete));
+
+	rc = persist__chunk_msg_store_delete_read_v6(db_fptr, &chunk);
+	if(rc){
+		fclose(db_fptr);
+		return rc;
+	}
+
+	HASH_FIND(hh, db->msg_store_load, &chunk.F.store_id, sizeof(dbid_t), load);
+	if(load){
+		HASH_DELETE(hh, db->msg_store_load, load);
+		db__msg_store_ref_dec(db, &load->store);
+		mosquitto__free(load);
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static int persist__sub_delete_chunk_restore(struct mosquitto_db *db, FILE *db_fptr)
+{
+	struct P_sub_delete chunk;
+	struct mosquitto *context = NULL;
+	uint8_t reason;
+	int rc;
+
+	memset(&chunk, 0, sizeof(struct P_sub_delete));
+
+	rc = persist__chunk_sub_delete_read_v6(db_fptr, &chunk);
+	if(rc){
+		fclose(db_fptr);
+		return rc;
+	}
+
+	if(chunk.client_id && chunk.topic){
+		HASH_FIND(hh_id, db->contexts_by_id, chunk.client_id, strlen(chunk.client_id), context);
+		if(context){
+			sub__remove(db, context, chunk.topic, db->subs, &reason);
+		}
+	}
+
+	mosquitto__free(chunk.client_id);
+	mosquitto__free(chunk.topic);
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static int persist__client_delete_chunk_restore(struct mosquitto_db *db, FILE *db_fptr)
+{
+	struct P_client_delete chunk;
+	struct mosquitto *context = NULL;
+	int rc;
+
+	memset(&chunk, 0, sizeof(struct P_client_delete));
+
+	rc = persist__chunk_client_delete_read_v6(db_fptr, &chunk);
+	if(rc){
+		fclose(db_fptr);
+		return rc;
+	}
+
+	if(chunk.client_id){
+		HASH_FIND(hh_id, db->contexts_by_id, chunk.client_id, strlen(chunk.client_id), context);
+		if(context){
+			/* Freed along with its subscriptions and messages by the main
+			 * loop, like an expired session. */
+			context__add_to_disused(db, context);
+		}
+	}
+	mosquitto__free(chunk.client_id);
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+
 int persist__chunk_header_read(FILE *db_fptr, int *chunk, int *length)
 {
 	if(db_version == 6 || db_version == 5){
@@ -391,7 +649,7 @@ int persist__chunk_header_read(FILE *db_fptr, int *chunk, int *length)
 }
 
 
-int persist__restore(struct mosquitto_db *db)
+static int persist__snapshot_restore(struct mosquitto_db *db)
 {
 	FILE *fptr;
 	char header[15];
@@ -401,20 +659,13 @@ int persist__restore(struct mosquitto_db *db)
 	int chunk, length;
 	ssize_t rlen;
 	char *err;
-	struct mosquitto_msg_store_load *load, *load_tmp;
 	struct PF_cfg cfg_chunk;
-
-	assert(db);
-	assert(db->config);
-
-	if(!db->config->persistence || db->config->persistence_filepath == NULL){
-		return MOSQ_ERR_SUCCESS;
-	}
-
-	db->msg_store_load = NULL;
+	bool lazy;
 
 	fptr = mosquitto__fopen(db->config->persistence_filepath, "rb", false);
 	if(fptr == NULL) return MOSQ_ERR_SUCCESS;
+	/* Chunks are read a field at a time, read ahead in large blocks. */
+	setvbuf(fptr, NULL, _IOFBF, PERSIST_READ_BUFFER);
 	rlen = fread(&header, 1, 15, fptr);
 	if(rlen == 0){
 		fclose(fptr);
@@ -446,6 +697,9 @@ int persist__restore(struct mosquitto_db *db)
 			}
 		}
 
+		/* Large payloads are left in the file, to be read when needed */
+		lazy = persist__map_open(db) == MOSQ_ERR_SUCCESS;
+
 		while(persist__chunk_header_read(fptr, &chunk, &length) == MOSQ_ERR_SUCCESS){
 			switch(chunk){
 				case DB_CHUNK_CFG:
@@ -470,7 +724,7 @@ int persist__restore(struct mosquitto_db *db)
 					break;
 
 				case DB_CHUNK_MSG_STORE:
-					if(persist__msg_store_chunk_restore(db, fptr, length)) return 1;
+					if(persist__msg_store_chunk_restore(db, fptr, length, lazy)) return 1;
 					break;
 
 				case DB_CHUNK_CLIENT_MSG:
@@ -503,10 +757,6 @@ int persist__restore(struct mosquitto_db *db)
 
 	fclose(fptr);
 
-	HASH_ITER(hh, db->msg_store_load, load, load_tmp){
-		HASH_DELETE(hh, db->msg_store_load, load);
-		mosquitto__free(load);
-	}
 	return rc;
 error:
 	err = strerror(errno);
@@ -515,6 +765,155 @@ error:
 	return 1;
 }
 
+/* Replay the changes made since the snapshot was written. A record that was
+ * only partly written when the broker stopped ends the replay. */
+static int persist__log_restore(struct mosquitto_db *db, const char *ext, bool *found, bool *damaged)
+{
+	FILE *fptr;
+	char *logfile;
+	char header[15];
+	uint32_t crc;
+	uint32_t i32temp;
+	int chunk, length;
+	long size;
+
+	logfile = persist__filepath(db, ext);
+	if(!logfile) return MOSQ_ERR_NOMEM;
+
+	fptr = mosquitto__fopen(logfile, "rb", false);
+	if(fptr == NULL){
+		mosquitto__free(logfile);
+		return MOSQ_ERR_SUCCESS;
+	}
+	setvbuf(fptr, NULL, _IOFBF, PERSIST_READ_BUFFER);
+	log__printf(NULL, MOSQ_LOG_INFO, "Replaying persistence log %s.", logfile);
+	mosquitto__free(logfile);
+	*found = true;
+
+	fseek(fptr, 0, SEEK_END);
+	size = ftell(fptr);
+	fseek(fptr, 0, SEEK_SET);
+
+	if(fread(&header, 1, 15, fptr) != 15
+			|| fread(&crc, 1, sizeof(uint32_t), fptr) != sizeof(uint32_t)
+			|| fread(&i32temp, 1, sizeof(uint32_t), fptr) != sizeof(uint32_t)){
+
+		*damaged = true;
+		fclose(fptr);
+		return MOSQ_ERR_SUCCESS;
+	}
+	if(memcmp(header, magic, 15) || ntohl(i32temp) != MOSQ_DB_VERSION){
+		fclose(fptr);
+		log__printf(NULL, MOSQ_LOG_ERR, "Error: Unable to restore persistence log. Unrecognised file format.");
+		return 1;
+	}
+	db_version = MOSQ_DB_VERSION;
+
+	while(ftell(fptr) < size){
+		if(persist__chunk_header_read(fptr, &chunk, &length)
+				|| length < 0 || ftell(fptr) + length > size){
+
+			*damaged = true;
+			break;
+		}
+		switch(chunk){
+			case DB_CHUNK_MSG_STORE:
+				if(persist__msg_store_chunk_restore(db, fptr, length, false)) return 1;
+				break;
+
+			case DB_CHUNK_CLIENT_MSG:
+				if(persist__client_msg_log_chunk_restore(db, fptr, length)) return 1;
+				break;
+
+			case DB_CHUNK_RETAIN:
+				if(persist__retain_chunk_restore(db, fptr)) return 1;
+				break;
+
+			case DB_CHUNK_SUB:
+				if(persist__sub_chunk_restore(db, fptr)) return 1;
+				break;
+
+			case DB_CHUNK_CLIENT:
+				if(persist__client_chunk_restore(db, fptr)) return 1;
+				break;
+
+			case DB_CHUNK_MSG_STORE_DELETE:
+				if(persist__msg_store_delete_chunk_restore(db, fptr)) return 1;
+				break;
+
+			case DB_CHUNK_CLIENT_MSG_DELETE:
+				if(persist__client_msg_delete_chunk_restore(db, fptr)) return 1;
+				break;
+
+			case DB_CHUNK_SUB_DELETE:
+				if(persist__sub_delete_chunk_restore(db, fptr)) return 1;
+				break;
+
+			case DB_CHUNK_CLIENT_DELETE:
+				if(persist__client_delete_chunk_restore(db, fptr)) return 1;
+				break;
+
+			default:
+				log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Unsupported chunk \"%d\" in persistence log. Ignoring.", chunk);
+				fseek(fptr, length, SEEK_CUR);
+				break;
+		}
+	}
+	fclose(fptr);
+
+	if(*damaged){
+		log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Persistence log ends with an incomplete record, ignoring it.");
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+int persist__restore(struct mosquitto_db *db)
+{
+	struct mosquitto_msg_store_load *load, *load_tmp;
+	bool damaged = false;
+	bool found_old = false, found = false;
+	int rc;
+
+	assert(db);
+	assert(db->config);
+
+	if(!db->config->persistence || db->config->persistence_filepath == NULL){
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	db->msg_store_load = NULL;
+
+	rc = persist__snapshot_restore(db);
+	if(rc == MOSQ_ERR_SUCCESS){
+		/* A background save that did not complete leaves the log that was
+		 * current when it started as .log.old, which comes before .log */
+		rc = persist__log_restore(db, ".log.old", &found_old, &damaged);
+	}
+	if(rc == MOSQ_ERR_SUCCESS && !damaged){
+		rc = persist__log_restore(db, ".log", &found, &damaged);
+	}
+
+	last_context = NULL;
+	HASH_ITER(hh, db->msg_store_load, load, load_tmp){
+		HASH_DELETE(hh, db->msg_store_load, load);
+		/* Messages that nothing refers to are kept, as they always have
+		 * been. */
+		load->store->ref_count--;
+		mosquitto__free(load);
+	}
+	if(rc) return rc;
+
+	if(damaged || found_old){
+		/* Anything appended after an incomplete record would never be
+		 * replayed, and .log.old must not be left for the next background
+		 * save to overwrite, so start again from a new snapshot. */
+		return persist__backup(db, false);
+	}
+	return persist__log_open(db, false);
+}
+
+
 static int persist__restore_sub(struct mosquitto_db *db, const char *client_id, const char *sub, int qos, uint32_t identifier, int options)
 {
 	struct mosquitto *context;
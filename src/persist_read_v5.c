@@ -187,7 +187,12 @@ int persist__chunk_msg_store_read_v56(FILE *db_fptr, struct P_msg_store *chunk,
 		return rc;
 	}
 
-	if(chunk->F.payloadlen > 0){
+	if(chunk->lazy_min && chunk->F.payloadlen >= chunk->lazy_min){
+		chunk->payload_offset = ftell(db_fptr);
+		if(fseek(db_fptr, chunk->F.payloadlen, SEEK_CUR)){
+			goto error;
+		}
+	}else if(chunk->F.payloadlen > 0){
 		if(UHPA_ALLOC(chunk->payload, chunk->F.payloadlen) == 0){
 			mosquitto__free(chunk->source.id);
 			mosquitto__free(chunk->source.username);
@@ -269,4 +274,64 @@ error:
 	return 1;
 }
 
+int persist__chunk_msg_store_delete_read_v6(FILE *db_fptr, struct P_msg_store_delete *chunk)
+{
+	if(fread(&chunk->F, sizeof(struct PF_msg_store_delete), 1, db_fptr) != 1){
+		log__printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
+		return 1;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+int persist__chunk_client_msg_delete_read_v6(FILE *db_fptr, struct P_client_msg_delete *chunk)
+{
+	read_e(db_fptr, &chunk->F, sizeof(struct PF_client_msg_delete));
+	chunk->F.mid = ntohs(chunk->F.mid);
+	chunk->F.id_len = ntohs(chunk->F.id_len);
+
+	return persist__read_string_len(db_fptr, &chunk->client_id, chunk->F.id_len);
+error:
+	log__printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
+	return 1;
+}
+
+
+int persist__chunk_sub_delete_read_v6(FILE *db_fptr, struct P_sub_delete *chunk)
+{
+	int rc;
+
+	read_e(db_fptr, &chunk->F, sizeof(struct PF_sub_delete));
+	chunk->F.id_len = ntohs(chunk->F.id_len);
+	chunk->F.topic_len = ntohs(chunk->F.topic_len);
+
+	rc = persist__read_string_len(db_fptr, &chunk->client_id, chunk->F.id_len);
+	if(rc){
+		return rc;
+	}
+	rc = persist__read_string_len(db_fptr, &chunk->topic, chunk->F.topic_len);
+	if(rc){
+		mosquitto__free(chunk->client_id);
+		chunk->client_id = NULL;
+		return rc;
+	}
+
+	return MOSQ_ERR_SUCCESS;
+error:
+	log__printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
+	return 1;
+}
+
+
+int persist__chunk_client_delete_read_v6(FILE *db_fptr, struct P_client_delete *chunk)
+{
+	read_e(db_fptr, &chunk->F, sizeof(struct PF_client_delete));
+	chunk->F.id_len = ntohs(chunk->F.id_len);
+
+	return persist__read_string_len(db_fptr, &chunk->client_id, chunk->F.id_len);
+error:
+	log__printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
+	return 1;
+}
+
 #endif
@@ -20,6 +20,9 @@ Contributors:
 
 #ifndef WIN32
 #include <arpa/inet.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #endif
 #include <assert.h>
 #include <errno.h>
@@ -31,11 +34,101 @@ Contributors:
 
 #include "mosquitto_broker_internal.h"
 #include "memory_mosq.h"
+#include "mqtt_protocol.h"
 #include "persist.h"
 #include "time_mosq.h"
 #include "misc_mosq.h"
 #include "util_mosq.h"
 
+static FILE *log_fptr = NULL;
+static bool log_dirty = false;
+/* The log was renamed to .log.old for a background save that has not
+ * completed yet */
+static bool log_rotated = false;
+#ifndef WIN32
+static pid_t save_pid = 0;
+static uint64_t save_start;
+#endif
+
+
+static void persist__client_chunk_init(struct mosquitto *context, struct P_client *chunk)
+{
+	memset(chunk, 0, sizeof(struct P_client));
+
+	chunk->F.session_expiry_time = context->session_expiry_time;
+	chunk->F.session_expiry_interval = context->session_expiry_interval;
+	chunk->F.last_mid = context->last_mid;
+	chunk->F.id_len = strlen(context->id);
+	chunk->client_id = context->id;
+	if(context->username){
+		chunk->F.username_len = strlen(context->username);
+		chunk->username = context->username;
+	}
+	if(context->listener){
+		chunk->F.listener_port = context->listener->port;
+	}
+}
+
+
+static void persist__client_msg_chunk_init(struct mosquitto *context, struct mosquitto_client_msg *cmsg, struct P_client_msg *chunk)
+{
+	memset(chunk, 0, sizeof(struct P_client_msg));
+
+	chunk->F.store_id = cmsg->store->db_id;
+	chunk->F.mid = cmsg->mid;
+	chunk->F.id_len = strlen(context->id);
+	chunk->F.qos = cmsg->qos;
+	chunk->F.retain_dup = (cmsg->retain&0x0F)<<4 | (cmsg->dup&0x0F);
+	chunk->F.direction = cmsg->direction;
+	chunk->F.state = cmsg->state;
+	chunk->client_id = context->id;
+	chunk->properties = cmsg->properties;
+}
+
+
+static void persist__msg_store_chunk_init(struct mosquitto_msg_store *stored, struct P_msg_store *chunk)
+{
+	memset(chunk, 0, sizeof(struct P_msg_store));
+
+	if(!strncmp(stored->topic, "$SYS", 4)){
+		/* Don't save $SYS messages as retained otherwise they can give
+		 * misleading information when reloaded. They should still be saved
+		 * because a disconnected durable client may have them in their
+		 * queue. */
+		chunk->F.retain = 0;
+	}else{
+		chunk->F.retain = (uint8_t)stored->retain;
+	}
+
+	chunk->F.store_id = stored->db_id;
+	chunk->F.expiry_time = stored->message_expiry_time;
+	chunk->F.payloadlen = stored->payloadlen;
+	chunk->F.source_mid = stored->source_mid;
+	if(stored->source_id){
+		chunk->F.source_id_len = strlen(stored->source_id);
+		chunk->source.id = stored->source_id;
+	}
+	if(stored->source_username){
+		chunk->F.source_username_len = strlen(stored->source_username);
+		chunk->source.username = stored->source_username;
+	}
+
+	chunk->F.topic_len = strlen(stored->topic);
+	chunk->topic = stored->topic;
+
+	if(stored->source_listener){
+		chunk->F.source_port = stored->source_listener->port;
+	}
+	chunk->F.qos = stored->qos;
+	chunk->payload = stored->payload;
+	if(stored->payload_mapped && stored->payload.ptr == NULL){
+		/* Copied straight from the mapped file, without loading it */
+		chunk->payload.ptr = (void *)stored->payload_mapped;
+	}
+	chunk->properties = stored->properties;
+}
+
+
 static int persist__client_messages_save(struct mosquitto_db *db, FILE *db_fptr, struct mosquitto *context, struct mosquitto_client_msg *queue)
 {
 	struct P_client_msg chunk;
@@ -46,8 +139,6 @@ static int persist__client_messages_save(struct mosquitto_db *db, FILE *db_fptr,
 	assert(db_fptr);
 	assert(context);
 
-	memset(&chunk, 0, sizeof(struct P_client_msg));
-
 	cmsg = queue;
 	while(cmsg){
 		if(!strncmp(cmsg->store->topic, "$SYS", 4)
@@ -60,20 +151,13 @@ static int persist__client_messages_save(struct mosquitto_db *db, FILE *db_fptr,
 			continue;
 		}
 
-		chunk.F.store_id = cmsg->store->db_id;
-		chunk.F.mid = cmsg->mid;
-		chunk.F.id_len = strlen(context->id);
-		chunk.F.qos = cmsg->qos;
-		chunk.F.retain_dup = (cmsg->retain&0x0F)<<4 | (cmsg->dup&0x0F);
-		chunk.F.direction = cmsg->direction;
-		chunk.F.state = cmsg->state;
-		chunk.client_id = context->id;
-		chunk.properties = cmsg->properties;
+		persist__client_msg_chunk_init(context, cmsg, &chunk);
 
 		rc = persist__chunk_client_msg_write_v6(db_fptr, &chunk);
 		if(rc){
 			return rc;
 		}
+		cmsg->persisted = true;
 
 		cmsg = cmsg->next;
 	}
@@ -91,8 +175,6 @@ static int persist__message_store_save(struct mosquitto_db *db, FILE *db_fptr)
 	assert(db);
 	assert(db_fptr);
 
-	memset(&chunk, 0, sizeof(struct P_msg_store));
-
 	stored = db->msg_store;
 	while(stored){
 		if(stored->ref_count < 1 || stored->topic == NULL){
@@ -100,56 +182,21 @@ static int persist__message_store_save(struct mosquitto_db *db, FILE *db_fptr)
 			continue;
 		}
 
-		if(!strncmp(stored->topic, "$SYS", 4)){
-			if(stored->ref_count <= 1 && stored->dest_id_count == 0){
-				/* $SYS messages that are only retained shouldn't be persisted. */
-				stored = stored->next;
-				continue;
-			}
-			/* Don't save $SYS messages as retained otherwise they can give
-			 * misleading information when reloaded. They should still be saved
-			 * because a disconnected durable client may have them in their
-			 * queue. */
-			chunk.F.retain = 0;
-		}else{
-			chunk.F.retain = (uint8_t)stored->retain;
-		}
+		if(!strncmp(stored->topic, "$SYS", 4)
+				&& stored->ref_count <= 1 && stored->dest_id_count == 0){
 
-		chunk.F.store_id = stored->db_id;
-		chunk.F.expiry_time = stored->message_expiry_time;
-		chunk.F.payloadlen = stored->payloadlen;
-		chunk.F.source_mid = stored->source_mid;
-		if(stored->source_id){
-			chunk.F.source_id_len = strlen(stored->source_id);
-			chunk.source.id = stored->source_id;
-		}else{
-			chunk.F.source_id_len = 0;
-			chunk.source.id = NULL;
-		}
-		if(stored->source_username){
-			chunk.F.source_username_len = strlen(stored->source_username);
-			chunk.source.username = stored->source_username;
-		}else{
-			chunk.F.source_username_len = 0;
-			chunk.source.username = NULL;
+			/* $SYS messages that are only retained shouldn't be persisted. */
+			stored = stored->next;
+			continue;
 		}
 
-		chunk.F.topic_len = strlen(stored->topic);
-		chunk.topic = stored->topic;
-
-		if(stored->source_listener){
-			chunk.F.source_port = stored->source_listener->port;
-		}else{
-			chunk.F.source_port = 0;
-		}
-		chunk.F.qos = stored->qos;
-		chunk.payload = stored->payload;
-		chunk.properties = stored->properties;
+		persist__msg_store_chunk_init(stored, &chunk);
 
 		rc = persist__chunk_message_store_write_v6(db_fptr, &chunk);
 		if(rc){
 			return rc;
 		}
+		stored->persisted = true;
 		stored = stored->next;
 	}
 
@@ -165,22 +212,9 @@ static int persist__client_save(struct mosquitto_db *db, FILE *db_fptr)
 	assert(db);
 	assert(db_fptr);
 
-	memset(&chunk, 0, sizeof(struct P_client));
-
 	HASH_ITER(hh_id, db->contexts_by_id, context, ctxt_tmp){
 		if(context && context->clean_start == false){
-			chunk.F.session_expiry_time = context->session_expiry_time;
-			chunk.F.session_expiry_interval = context->session_expiry_interval;
-			chunk.F.last_mid = context->last_mid;
-			chunk.F.id_len = strlen(context->id);
-			chunk.client_id = context->id;
-			if(context->username){
-				chunk.F.username_len = strlen(context->username);
-				chunk.username = context->username;
-			}
-			if(context->listener){
-				chunk.F.listener_port = context->listener->port;
-			}
+			persist__client_chunk_init(context, &chunk);
 
 			rc = persist__chunk_client_write_v6(db_fptr, &chunk);
 			if(rc){
@@ -198,17 +232,15 @@ static int persist__client_save(struct mosquitto_db *db, FILE *db_fptr)
 }
 
 
-static int persist__subs_retain_save(struct mosquitto_db *db, FILE *db_fptr, struct mosquitto__subhier *node, const char *topic, int level)
+static int persist__subs_save(struct mosquitto_db *db, FILE *db_fptr, struct mosquitto__subhier *node, const char *topic, int level)
 {
 	struct mosquitto__subhier *subhier, *subhier_tmp;
 	struct mosquitto__subleaf *sub;
-	struct P_retain retain_chunk;
 	struct P_sub sub_chunk;
 	char *thistopic;
 	size_t slen;
 	int rc;
 
-	memset(&retain_chunk, 0, sizeof(struct P_retain));
 	memset(&sub_chunk, 0, sizeof(struct P_sub));
 
 	slen = strlen(topic) + node->topic_len + 2;
@@ -239,39 +271,100 @@ static int persist__subs_retain_save(struct mosquitto_db *db, FILE *db_fptr, str
 		}
 		sub = sub->next;
 	}
-	if(node->retained){
-		if(strncmp(node->retained->topic, "$SYS", 4)){
-			/* Don't save $SYS messages. */
-			retain_chunk.F.store_id = node->retained->db_id;
-			rc = persist__chunk_retain_write_v6(db_fptr, &retain_chunk);
-			if(rc){
-				mosquitto__free(thistopic);
-				return rc;
-			}
-		}
-	}
 
 	HASH_ITER(hh, node->children, subhier, subhier_tmp){
-		persist__subs_retain_save(db, db_fptr, subhier, thistopic, level+1);
+		persist__subs_save(db, db_fptr, subhier, thistopic, level+1);
 	}
 	mosquitto__free(thistopic);
 	return MOSQ_ERR_SUCCESS;
 }
 
-static int persist__subs_retain_save_all(struct mosquitto_db *db, FILE *db_fptr)
+static int persist__subs_save_all(struct mosquitto_db *db, FILE *db_fptr)
 {
 	struct mosquitto__subhier *subhier, *subhier_tmp;
 
 	HASH_ITER(hh, db->subs, subhier, subhier_tmp){
 		if(subhier->children){
-			persist__subs_retain_save(db, db_fptr, subhier->children, "", 0);
+			persist__subs_save(db, db_fptr, subhier->children, "", 0);
 		}
 	}
 	
 	return MOSQ_ERR_SUCCESS;
 }
 
-int persist__backup(struct mosquitto_db *db, bool shutdown)
+static int persist__retain_save(struct mosquitto_db *db, FILE *db_fptr, struct mosquitto__retainhier *node)
+{
+	struct mosquitto__retainhier *retainhier, *retainhier_tmp;
+	struct P_retain retain_chunk;
+	int rc;
+
+	if(node->retained && strncmp(node->retained->topic, "$SYS", 4)){
+		/* Don't save $SYS messages. */
+		memset(&retain_chunk, 0, sizeof(struct P_retain));
+		retain_chunk.F.store_id = node->retained->db_id;
+		rc = persist__chunk_retain_write_v6(db_fptr, &retain_chunk);
+		if(rc) return rc;
+	}
+
+	HASH_ITER(hh, node->children, retainhier, retainhier_tmp){
+		rc = persist__retain_save(db, db_fptr, retainhier);
+		if(rc) return rc;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+static int persist__retain_save_all(struct mosquitto_db *db, FILE *db_fptr)
+{
+	struct mosquitto__retainhier *retainhier, *retainhier_tmp;
+
+	HASH_ITER(hh, db->retains, retainhier, retainhier_tmp){
+		persist__retain_save(db, db_fptr, retainhier);
+	}
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+static uint64_t persist__time_ms(void)
+{
+#ifdef WIN32
+	return GetTickCount64();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+#endif
+}
+
+
+static void persist__remove_file(struct mosquitto_db *db, const char *ext)
+{
+	char *path;
+
+	path = persist__filepath(db, ext);
+	if(path){
+		remove(path);
+		mosquitto__free(path);
+	}
+}
+
+
+static void persist__save_done(struct mosquitto_db *db, int rc, uint64_t start)
+{
+	db->persist_stats.saving = false;
+	db->persist_stats.last_duration = (unsigned long)(persist__time_ms() - start);
+	if(rc){
+		db->persist_stats.failures++;
+		db->persist_stats.last_failed = true;
+	}else{
+		db->persist_stats.saves++;
+		db->persist_stats.last_failed = false;
+		db->persist_stats.last_save = time(NULL);
+	}
+}
+
+
+static int persist__snapshot_write(struct mosquitto_db *db, bool shutdown)
 {
 	int rc = 0;
 	FILE *db_fptr = NULL;
@@ -282,11 +375,6 @@ int persist__backup(struct mosquitto_db *db, bool shutdown)
 	int len;
 	struct PF_cfg cfg_chunk;
 
-	if(!db || !db->config || !db->config->persistence_filepath) return MOSQ_ERR_INVAL;
-	if(db->config->persistence == false) return MOSQ_ERR_SUCCESS;
-
-	log__printf(NULL, MOSQ_LOG_INFO, "Saving in-memory database to %s.", db->config->persistence_filepath);
-
 	len = strlen(db->config->persistence_filepath)+5;
 	outfile = mosquitto__malloc(len+1);
 	if(!outfile){
@@ -350,7 +438,8 @@ int persist__backup(struct mosquitto_db *db, bool shutdown)
 	}
 
 	persist__client_save(db, db_fptr);
-	persist__subs_retain_save_all(db, db_fptr);
+	persist__subs_save_all(db, db_fptr);
+	persist__retain_save_all(db, db_fptr);
 
 #ifndef WIN32
 	/**
@@ -402,4 +491,422 @@ error:
 }
 
 
+int persist__backup(struct mosquitto_db *db, bool shutdown)
+{
+	uint64_t start;
+	int rc;
+
+	if(!db || !db->config || !db->config->persistence_filepath) return MOSQ_ERR_INVAL;
+	if(db->config->persistence == false) return MOSQ_ERR_SUCCESS;
+
+#ifndef WIN32
+	/* A background save that finished after this one would replace it with
+	 * older data. */
+	persist__background_check(db, true);
+#endif
+
+	log__printf(NULL, MOSQ_LOG_INFO, "Saving in-memory database to %s.", db->config->persistence_filepath);
+
+	start = persist__time_ms();
+	rc = persist__snapshot_write(db, shutdown);
+	persist__save_done(db, rc, start);
+	if(rc) return rc;
+
+	/* Everything in the log is now in the snapshot. */
+	persist__log_close(db);
+	persist__remove_file(db, ".log.old");
+	log_rotated = false;
+	if(db->config->persistence_log && !shutdown){
+		persist__log_open(db, true);
+	}else{
+		persist__remove_file(db, ".log");
+	}
+	if(!shutdown){
+		persist__map_refresh(db);
+	}
+	return rc;
+}
+
+
+/* ============================================================
+ * Background save
+ *
+ * With autosave_background, autosaves fork a child that writes the snapshot
+ * from its copy-on-write image of the parent's memory, so the main loop is
+ * not held up while the whole state is written out. The persistence log is
+ * moved to .log.old as the child starts and only removed once it succeeds.
+ * ============================================================ */
+
+#ifndef WIN32
+static void persist__background_child(struct mosquitto_db *db)
+{
+	struct mosquitto *context, *ctxt_tmp;
+	int i, j;
+
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGHUP, SIG_DFL);
+	signal(SIGUSR1, SIG_DFL);
+	signal(SIGUSR2, SIG_DFL);
+
+	/* Connections the parent closes must not be held open by the child. */
+	HASH_ITER(hh_sock, db->contexts_by_sock, context, ctxt_tmp){
+		if(context->sock != INVALID_SOCKET){
+			close(context->sock);
+		}
+	}
+	for(i=0; i<db->config->listener_count; i++){
+		for(j=0; j<db->config->listeners[i].sock_count; j++){
+			close(db->config->listeners[i].socks[j]);
+		}
+	}
+
+	/* _exit() so that stdio buffers copied from the parent, such as an
+	 * unflushed persistence log, are not written a second time. */
+	_exit(persist__snapshot_write(db, false)?1:0);
+}
+#endif
+
+
+int persist__backup_background(struct mosquitto_db *db)
+{
+#ifdef WIN32
+	return persist__backup(db, false);
+#else
+	char *logfile, *oldfile;
+	pid_t pid;
+	int rc;
+
+	if(!db || !db->config || !db->config->persistence_filepath) return MOSQ_ERR_INVAL;
+	if(db->config->persistence == false) return MOSQ_ERR_SUCCESS;
+
+	if(save_pid){
+		/* Still running, one at a time. */
+		return MOSQ_ERR_SUCCESS;
+	}
+	if(!db->config->autosave_background || log_rotated){
+		/* After a failed background save the old log has to be folded into
+		 * a snapshot before the current log can be moved aside again. */
+		return persist__backup(db, false);
+	}
+
+	if(log_fptr){
+		logfile = persist__filepath(db, ".log");
+		oldfile = persist__filepath(db, ".log.old");
+		if(!logfile || !oldfile){
+			mosquitto__free(logfile);
+			mosquitto__free(oldfile);
+			return MOSQ_ERR_NOMEM;
+		}
+		rc = rename(logfile, oldfile);
+		mosquitto__free(logfile);
+		mosquitto__free(oldfile);
+		if(rc){
+			log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Unable to move persistence log aside: %s.", strerror(errno));
+			return persist__backup(db, false);
+		}
+		log_rotated = true;
+		/* Closing the old log flushes what is left of it to .log.old */
+		persist__log_open(db, true);
+	}
+
+	log__printf(NULL, MOSQ_LOG_INFO, "Saving in-memory database to %s in the background.", db->config->persistence_filepath);
+
+	pid = fork();
+	if(pid < 0){
+		log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Unable to start background save: %s.", strerror(errno));
+		return persist__backup(db, false);
+	}else if(pid == 0){
+		persist__background_child(db);
+	}
+
+	save_pid = pid;
+	save_start = persist__time_ms();
+	db->persist_stats.saving = true;
+	return MOSQ_ERR_SUCCESS;
+#endif
+}
+
+
+#ifndef WIN32
+void persist__background_check(struct mosquitto_db *db, bool wait)
+{
+	pid_t rc;
+	int status = 0;
+
+	if(save_pid == 0) return;
+
+	do{
+		rc = waitpid(save_pid, &status, wait?0:WNOHANG);
+	}while(rc == -1 && errno == EINTR);
+	if(rc == 0) return;
+
+	save_pid = 0;
+	if(rc == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0){
+		log__printf(NULL, MOSQ_LOG_ERR, "Error: Background save of in-memory database failed.");
+		persist__save_done(db, 1, save_start);
+		return;
+	}
+	persist__save_done(db, 0, save_start);
+	if(log_rotated){
+		persist__remove_file(db, ".log.old");
+		log_rotated = false;
+	}
+	persist__map_refresh(db);
+}
+#endif
+
+
+/* ============================================================
+ * Persistence log
+ *
+ * With persistence_log, every change to persistent state is appended to
+ * <persistence_file>.log as it happens, in the same chunk format as the
+ * snapshot plus the delete chunks. persist__backup() compacts the log into a
+ * new snapshot. Records are flushed once per main loop iteration.
+ * ============================================================ */
+
+static void persist__log_failed(struct mosquitto_db *db)
+{
+	log__printf(NULL, MOSQ_LOG_ERR, "Error: Unable to write persistence log, changes will be saved at the next autosave.");
+	persist__log_close(db);
+}
+
+
+int persist__log_open(struct mosquitto_db *db, bool truncate)
+{
+	uint32_t db_version_w = htonl(MOSQ_DB_VERSION);
+	uint32_t crc = 0;
+	char *logfile;
+
+	persist__log_close(db);
+
+	if(!db->config->persistence || !db->config->persistence_log || !db->config->persistence_filepath){
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	logfile = persist__filepath(db, ".log");
+	if(!logfile) return MOSQ_ERR_NOMEM;
+
+#ifndef WIN32
+	if(truncate){
+		/* The log may have been created before privileges were dropped. */
+		unlink(logfile);
+	}
+#endif
+	log_fptr = mosquitto__fopen(logfile, truncate?"wb":"ab", true);
+	if(log_fptr == NULL){
+		log__printf(NULL, MOSQ_LOG_ERR, "Error: Unable to open persistence log %s: %s.", logfile, strerror(errno));
+		mosquitto__free(logfile);
+		return 1;
+	}
+	mosquitto__free(logfile);
+
+	fseek(log_fptr, 0, SEEK_END);
+	if(ftell(log_fptr) == 0){
+		write_e(log_fptr, magic, 15);
+		write_e(log_fptr, &crc, sizeof(uint32_t));
+		write_e(log_fptr, &db_version_w, sizeof(uint32_t));
+		log_dirty = true;
+	}
+	return MOSQ_ERR_SUCCESS;
+error:
+	persist__log_failed(db);
+	return 1;
+}
+
+
+void persist__log_close(struct mosquitto_db *db)
+{
+	if(log_fptr){
+		fclose(log_fptr);
+		log_fptr = NULL;
+	}
+	log_dirty = false;
+}
+
+
+void persist__log_flush(struct mosquitto_db *db)
+{
+	if(log_fptr && log_dirty){
+		if(fflush(log_fptr)){
+			persist__log_failed(db);
+		}
+		log_dirty = false;
+	}
+}
+
+
+/* Messages are only written the first time something that is persisted
+ * refers to them, so messages that no durable client or retained topic ever
+ * holds never reach the log. */
+static int persist__log_msg_store(struct mosquitto_msg_store *stored)
+{
+	struct P_msg_store chunk;
+
+	if(stored->persisted) return MOSQ_ERR_SUCCESS;
+
+	persist__msg_store_chunk_init(stored, &chunk);
+	if(persist__chunk_message_store_write_v6(log_fptr, &chunk)){
+		return 1;
+	}
+	stored->persisted = true;
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+void persist__log_client(struct mosquitto_db *db, struct mosquitto *context)
+{
+	struct P_client chunk;
+
+	if(!log_fptr || context->clean_start || !context->id) return;
+
+	persist__client_chunk_init(context, &chunk);
+	if(persist__chunk_client_write_v6(log_fptr, &chunk)){
+		persist__log_failed(db);
+		return;
+	}
+	log_dirty = true;
+}
+
+
+void persist__log_client_delete(struct mosquitto_db *db, struct mosquitto *context)
+{
+	struct P_client_delete chunk;
+
+	if(!log_fptr || !context->id) return;
+
+	memset(&chunk, 0, sizeof(struct P_client_delete));
+	chunk.F.id_len = strlen(context->id);
+	chunk.client_id = context->id;
+
+	if(persist__chunk_client_delete_write_v6(log_fptr, &chunk)){
+		persist__log_failed(db);
+		return;
+	}
+	log_dirty = true;
+}
+
+
+void persist__log_client_msg(struct mosquitto_db *db, struct mosquitto *context, struct mosquitto_client_msg *cmsg)
+{
+	struct P_client_msg chunk;
+
+	if(!log_fptr || context->clean_start || !context->id || !cmsg->store->topic) return;
+
+	if(persist__log_msg_store(cmsg->store)){
+		persist__log_failed(db);
+		return;
+	}
+	persist__client_msg_chunk_init(context, cmsg, &chunk);
+	if(persist__chunk_client_msg_write_v6(log_fptr, &chunk)){
+		persist__log_failed(db);
+		return;
+	}
+	cmsg->persisted = true;
+	log_dirty = true;
+}
+
+
+void persist__log_client_msg_delete(struct mosquitto_db *db, struct mosquitto *context, struct mosquitto_client_msg *cmsg)
+{
+	struct P_client_msg_delete chunk;
+
+	if(!log_fptr || !cmsg->persisted || !context->id) return;
+
+	memset(&chunk, 0, sizeof(struct P_client_msg_delete));
+	chunk.F.store_id = cmsg->store->db_id;
+	chunk.F.mid = cmsg->mid;
+	chunk.F.id_len = strlen(context->id);
+	chunk.F.direction = cmsg->direction;
+	chunk.client_id = context->id;
+
+	if(persist__chunk_client_msg_delete_write_v6(log_fptr, &chunk)){
+		persist__log_failed(db);
+		return;
+	}
+	log_dirty = true;
+}
+
+
+void persist__log_msg_store_delete(struct mosquitto_db *db, struct mosquitto_msg_store *stored)
+{
+	struct P_msg_store_delete chunk;
+
+	if(!log_fptr || !stored->persisted) return;
+
+	memset(&chunk, 0, sizeof(struct P_msg_store_delete));
+	chunk.F.store_id = stored->db_id;
+
+	if(persist__chunk_msg_store_delete_write_v6(log_fptr, &chunk)){
+		persist__log_failed(db);
+		return;
+	}
+	log_dirty = true;
+}
+
+
+void persist__log_retain(struct mosquitto_db *db, struct mosquitto_msg_store *stored)
+{
+	struct P_retain chunk;
+
+	if(!log_fptr || !stored->topic) return;
+
+	if(persist__log_msg_store(stored)){
+		persist__log_failed(db);
+		return;
+	}
+	memset(&chunk, 0, sizeof(struct P_retain));
+	chunk.F.store_id = stored->db_id;
+
+	if(persist__chunk_retain_write_v6(log_fptr, &chunk)){
+		persist__log_failed(db);
+		return;
+	}
+	log_dirty = true;
+}
+
+
+void persist__log_sub(struct mosquitto_db *db, struct mosquitto *context, const char *sub, int qos, uint32_t identifier, int options)
+{
+	struct P_sub chunk;
+
+	if(!log_fptr || !context || context->clean_start || !context->id) return;
+
+	memset(&chunk, 0, sizeof(struct P_sub));
+	chunk.F.identifier = identifier;
+	chunk.F.id_len = strlen(context->id);
+	chunk.F.topic_len = strlen(sub);
+	chunk.F.qos = (uint8_t)qos;
+	chunk.F.options = (uint8_t)(options & (MQTT_SUB_OPT_NO_LOCAL | MQTT_SUB_OPT_RETAIN_AS_PUBLISHED));
+	chunk.client_id = context->id;
+	chunk.topic = (char *)sub;
+
+	if(persist__chunk_sub_write_v6(log_fptr, &chunk)){
+		persist__log_failed(db);
+		return;
+	}
+	log_dirty = true;
+}
+
+
+void persist__log_sub_delete(struct mosquitto_db *db, struct mosquitto *context, const char *sub)
+{
+	struct P_sub_delete chunk;
+
+	if(!log_fptr || !context || context->clean_start || !context->id) return;
+
+	memset(&chunk, 0, sizeof(struct P_sub_delete));
+	chunk.F.id_len = strlen(context->id);
+	chunk.F.topic_len = strlen(sub);
+	chunk.client_id = context->id;
+	chunk.topic = (char *)sub;
+
+	if(persist__chunk_sub_delete_write_v6(log_fptr, &chunk)){
+		persist__log_failed(db);
+		return;
+	}
+	log_dirty = true;
+}
+
 #endif
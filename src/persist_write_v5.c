@@ -241,4 +241,88 @@ error:
 	log__printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
 	return 1;
 }
+
+int persist__chunk_msg_store_delete_write_v6(FILE *db_fptr, struct P_msg_store_delete *chunk)
+{
+	struct PF_header header;
+
+	header.chunk = htonl(DB_CHUNK_MSG_STORE_DELETE);
+	header.length = htonl(sizeof(struct PF_msg_store_delete));
+
+	write_e(db_fptr, &header, sizeof(struct PF_header));
+	write_e(db_fptr, &chunk->F, sizeof(struct PF_msg_store_delete));
+
+	return MOSQ_ERR_SUCCESS;
+error:
+	log__printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
+	return 1;
+}
+
+
+int persist__chunk_client_msg_delete_write_v6(FILE *db_fptr, struct P_client_msg_delete *chunk)
+{
+	struct PF_header header;
+	uint16_t id_len = chunk->F.id_len;
+
+	chunk->F.mid = htons(chunk->F.mid);
+	chunk->F.id_len = htons(chunk->F.id_len);
+
+	header.chunk = htonl(DB_CHUNK_CLIENT_MSG_DELETE);
+	header.length = htonl(sizeof(struct PF_client_msg_delete) + id_len);
+
+	write_e(db_fptr, &header, sizeof(struct PF_header));
+	write_e(db_fptr, &chunk->F, sizeof(struct PF_client_msg_delete));
+	write_e(db_fptr, chunk->client_id, id_len);
+
+	return MOSQ_ERR_SUCCESS;
+error:
+	log__printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
+	return 1;
+}
+
+
+int persist__chunk_sub_delete_write_v6(FILE *db_fptr, struct P_sub_delete *chunk)
+{
+	struct PF_header header;
+	uint16_t id_len = chunk->F.id_len;
+	uint16_t topic_len = chunk->F.topic_len;
+
+	chunk->F.id_len = htons(chunk->F.id_len);
+	chunk->F.topic_len = htons(chunk->F.topic_len);
+
+	header.chunk = htonl(DB_CHUNK_SUB_DELETE);
+	header.length = htonl(sizeof(struct PF_sub_delete) +
+			id_len + topic_len);
+
+	write_e(db_fptr, &header, sizeof(struct PF_header));
+	write_e(db_fptr, &chunk->F, sizeof(struct PF_sub_delete));
+	write_e(db_fptr, chunk->client_id, id_len);
+	write_e(db_fptr, chunk->topic, topic_len);
+
+	return MOSQ_ERR_SUCCESS;
+error:
+	log__printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
+	return 1;
+}
+
+
+int persist__chunk_client_delete_write_v6(FILE *db_fptr, struct P_client_delete *chunk)
+{
+	struct PF_header header;
+	uint16_t id_len = chunk->F.id_len;
+
+	chunk->F.id_len = htons(chunk->F.id_len);
+
+	header.chunk = htonl(DB_CHUNK_CLIENT_DELETE);
+	header.length = htonl(sizeof(struct PF_client_delete) + id_len);
+
+	write_e(db_fptr, &header, sizeof(struct PF_header));
+	write_e(db_fptr, &chunk->F, sizeof(struct PF_client_delete));
+	write_e(db_fptr, chunk->client_id, id_len);
+
+	return MOSQ_ERR_SUCCESS;
+error:
+	log__printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
+	return 1;
+}
 #endif
@@ -23,6 +23,7 @@ Contributors:
 #include "mosquitto_plugin.h"
 #include "memory_mosq.h"
 #include "lib_load.h"
+#include "sys_tree.h"
 
 typedef int (*FUNC_auth_plugin_version)(void);
 
@@ -491,6 +492,8 @@ int mosquitto_security_init(struct mosquitto_db *db, bool reload)
  */
 int mosquitto_security_apply(struct mosquitto_db *db)
 {
+	/* Cached ACL decisions may not hold for the reloaded ACLs. */
+	db->acl_cache_gen++;
 	return mosquitto_security_apply_default(db);
 }
 
@@ -622,12 +625,101 @@ static int acl__check_dollar(const char *topic, int access)
 }
 
 
+int acl__cache_init(struct mosquitto_db *db, struct mosquitto *context)
+{
+	if(!context->acl_cache){
+		context->acl_cache = mosquitto__calloc(1, sizeof(struct mosquitto__acl_cache));
+		if(!context->acl_cache) return MOSQ_ERR_NOMEM;
+	}
+	acl__cache_clear(context);
+	context->acl_cache->gen = db->acl_cache_gen;
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+void acl__cache_clear(struct mosquitto *context)
+{
+	int i;
+
+	if(!context->acl_cache) return;
+
+	for(i=0; i<ACL_CACHE_SIZE; i++){
+		context->acl_cache->entries[i].used = false;
+	}
+}
+
+
+void acl__cache_free(struct mosquitto *context)
+{
+	int i;
+
+	if(!context->acl_cache) return;
+
+	for(i=0; i<ACL_CACHE_SIZE; i++){
+		mosquitto__free(context->acl_cache->entries[i].topic);
+	}
+	mosquitto__free(context->acl_cache);
+	context->acl_cache = NULL;
+}
+
+
+/* FNV-1a */
+static unsigned int acl__cache_hash(const char *topic)
+{
+	unsigned int hash = 2166136261U;
+
+	while(*topic){
+		hash ^= (unsigned char)*topic++;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+
+static struct mosquitto__acl_cache_entry *acl__cache_entry(struct mosquitto_db *db, struct mosquitto *context, unsigned int hash, int access)
+{
+	if(context->acl_cache->gen != db->acl_cache_gen){
+		acl__cache_clear(context);
+		context->acl_cache->gen = db->acl_cache_gen;
+	}
+	return &context->acl_cache->entries[(hash + access) & (ACL_CACHE_SIZE-1)];
+}
+
+
+static void acl__cache_store(struct mosquitto__acl_cache_entry *entry, const char *topic, unsigned int hash, int access, int rc)
+{
+	size_t len, size;
+	char *buf;
+
+	/* Errors are not decisions, ask again next time. */
+	if(rc != MOSQ_ERR_SUCCESS && rc != MOSQ_ERR_ACL_DENIED) return;
+
+	entry->used = false;
+	len = strlen(topic) + 1;
+	if(len > entry->topic_size){
+		/* Rounded up so slightly longer topics fit next time. */
+		size = (len + 63) & ~(size_t)63;
+		buf = mosquitto__realloc(entry->topic, size);
+		if(!buf) return;
+		entry->topic = buf;
+		entry->topic_size = size;
+	}
+	memcpy(entry->topic, topic, len);
+	entry->used = true;
+	entry->hash = hash;
+	entry->access = access;
+	entry->rc = rc;
+}
+
+
 int mosquitto_acl_check(struct mosquitto_db *db, struct mosquitto *context, const char *topic, long payloadlen, void* payload, int qos, bool retain, int access)
 {
 	int rc;
 	int i;
 	struct mosquitto__security_options *opts;
 	struct mosquitto_acl_msg msg;
+	struct mosquitto__acl_cache_entry *entry = NULL;
+	unsigned int hash = 0;
 
 	if(!context->id){
 		return MOSQ_ERR_ACL_DENIED;
@@ -636,8 +728,19 @@ int mosquitto_acl_check(struct mosquitto_db *db, struct mosquitto *context, cons
 	rc = acl__check_dollar(topic, access);
 	if(rc) return rc;
 
+	if(context->acl_cache){
+		hash = acl__cache_hash(topic);
+		entry = acl__cache_entry(db, context, hash, access);
+		if(entry->used && entry->hash == hash && entry->access == access && !strcmp(entry->topic, topic)){
+			G_ACL_CACHE_HITS_INC();
+			return entry->rc;
+		}
+		G_ACL_CACHE_MISSES_INC();
+	}
+
 	rc = mosquitto_acl_check_default(db, context, topic, access);
 	if(rc != MOSQ_ERR_PLUGIN_DEFER){
+		if(entry) acl__cache_store(entry, topic, hash, access, rc);
 		return rc;
 	}
 	/* Default check has accepted or deferred at this point.
@@ -650,6 +753,10 @@ int mosquitto_acl_check(struct mosquitto_db *db, struct mosquitto *context, cons
 	}else{
 		opts = &db->config->security_options;
 	}
+	if(opts->auth_plugin_config_count == 0){
+		if(entry) acl__cache_store(entry, topic, hash, access, rc);
+		return rc;
+	}
 
 	memset(&msg, 0, sizeof(msg));
 	msg.topic = topic;
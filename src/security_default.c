@@ -30,6 +30,7 @@ Contributors:
 static int aclfile__parse(struct mosquitto_db *db, struct mosquitto__security_options *security_opts);
 static int unpwd__file_parse(struct mosquitto__unpwd **unpwd, const char *password_file);
 static int acl__cleanup(struct mosquitto_db *db, bool reload);
+static int acl__expand_patterns(struct mosquitto__security_options *security_opts, struct mosquitto *context);
 static int unpwd__cleanup(struct mosquitto__unpwd **unpwd, bool reload);
 static int psk__file_parse(struct mosquitto_db *db, struct mosquitto__unpwd **psk_id, const char *psk_file);
 #ifdef WITH_TLS
@@ -153,6 +154,153 @@ int mosquitto_security_cleanup_default(struct mosquitto_db *db, bool reload)
 }
 
 
+/* Add the levels of an ACL topic to a tree, creating the root if needed.
+ * Topics that mosquitto_topic_matches_sub() would reject can never match and
+ * are left out. */
+static int aclhier__add(struct mosquitto__aclhier **root, const char *topic, int access)
+{
+	struct mosquitto__aclhier *node, *child, **wildcard;
+	const char *level, *end;
+	size_t len;
+
+	if(topic[0] == '\0' || mosquitto_sub_topic_check(topic) != MOSQ_ERR_SUCCESS){
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	if(!(*root)){
+		*root = mosquitto__calloc(1, sizeof(struct mosquitto__aclhier));
+		if(!(*root)) return MOSQ_ERR_NOMEM;
+	}
+
+	node = *root;
+	level = topic;
+	while(level){
+		end = strchr(level, '/');
+		if(end){
+			len = end - level;
+		}else{
+			len = strlen(level);
+		}
+
+		if(len == 1 && level[0] == '+'){
+			wildcard = &node->child_plus;
+		}else if(len == 1 && level[0] == '#'){
+			wildcard = &node->child_hash;
+		}else{
+			wildcard = NULL;
+		}
+		if(wildcard){
+			child = *wildcard;
+		}else{
+			HASH_FIND(hh, node->children, level, len, child);
+		}
+		if(!child){
+			child = mosquitto__calloc(1, sizeof(struct mosquitto__aclhier) + len + 1);
+			if(!child) return MOSQ_ERR_NOMEM;
+			memcpy(child->topic, level, len);
+			child->topic_len = len;
+			if(wildcard){
+				*wildcard = child;
+			}else{
+				HASH_ADD_KEYPTR(hh, node->children, child->topic, child->topic_len, child);
+			}
+		}
+		node = child;
+
+		if(end){
+			level = end+1;
+		}else{
+			level = NULL;
+		}
+	}
+	node->access |= access;
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static void aclhier__free(struct mosquitto__aclhier *node)
+{
+	struct mosquitto__aclhier *child, *child_tmp;
+
+	if(!node) return;
+
+	HASH_ITER(hh, node->children, child, child_tmp){
+		HASH_DELETE(hh, node->children, child);
+		aclhier__free(child);
+	}
+	aclhier__free(node->child_plus);
+	aclhier__free(node->child_hash);
+	mosquitto__free(node);
+}
+
+
+/* topic is the rest of the topic from the level below node, or NULL when all
+ * levels have been matched. */
+static bool aclhier__match(struct mosquitto__aclhier *node, const char *topic, int access)
+{
+	struct mosquitto__aclhier *child;
+	const char *end, *next;
+	size_t len;
+
+	/* "a/#" also matches "a" */
+	if(node->child_hash && (node->child_hash->access & access)){
+		return true;
+	}
+	if(!topic){
+		return (node->access & access) != 0;
+	}
+
+	end = strchr(topic, '/');
+	if(end){
+		len = end - topic;
+		next = end+1;
+	}else{
+		len = strlen(topic);
+		next = NULL;
+	}
+
+	if(node->children){
+		HASH_FIND(hh, node->children, topic, len, child);
+		if(child && aclhier__match(child, next, access)){
+			return true;
+		}
+	}
+	if(node->child_plus && aclhier__match(node->child_plus, next, access)){
+		return true;
+	}
+	return false;
+}
+
+
+/* Equivalent to calling mosquitto_topic_matches_sub() for every ACL in the
+ * tree and checking the access of the ACLs that match. */
+static bool aclhier__check(struct mosquitto__aclhier *root, const char *topic, int access)
+{
+	struct mosquitto__aclhier *child;
+	const char *end, *next;
+	size_t len;
+
+	if(!root || topic[0] == '\0') return false;
+
+	if(topic[0] == '$'){
+		/* Wildcards at the first level do not match $ topics. */
+		end = strchr(topic, '/');
+		if(end){
+			len = end - topic;
+			next = end+1;
+		}else{
+			len = strlen(topic);
+			next = NULL;
+		}
+		HASH_FIND(hh, root->children, topic, len, child);
+		return child && aclhier__match(child, next, access);
+	}
+
+	return aclhier__match(root, topic, access);
+}
+
+
 int add__acl(struct mosquitto__security_options *security_opts, const char *user, const char *topic, int access)
 {
 	struct mosquitto__acl_user *acl_user=NULL, *user_tail;
@@ -201,6 +349,7 @@ int add__acl(struct mosquitto__security_options *security_opts, const char *user
 		}
 		acl_user->next = NULL;
 		acl_user->acl = NULL;
+		acl_user->aclhier = NULL;
 	}
 
 	acl = mosquitto__malloc(sizeof(struct mosquitto__acl));
@@ -216,6 +365,17 @@ int add__acl(struct mosquitto__security_options *security_opts, const char *user
 	acl->ccount = 0;
 	acl->ucount = 0;
 
+	if(aclhier__add(&acl_user->aclhier, topic, access)){
+		mosquitto__free(local_topic);
+		mosquitto__free(acl);
+		if(new_user){
+			aclhier__free(acl_user->aclhier);
+			mosquitto__free(acl_user->username);
+			mosquitto__free(acl_user);
+		}
+		return MOSQ_ERR_NOMEM;
+	}
+
 	/* Add acl to user acl list */
 	if(acl_user->acl){
 		acl_tail = acl_user->acl;
@@ -306,12 +466,7 @@ int add__acl_pattern(struct mosquitto__security_options *security_opts, const ch
 
 int mosquitto_acl_check_default(struct mosquitto_db *db, struct mosquitto *context, const char *topic, int access)
 {
-	char *local_acl;
-	struct mosquitto__acl *acl_root;
-	bool result;
-	int i;
-	int len, tlen, clen, ulen;
-	char *s;
+	int rc;
 	struct mosquitto__security_options *security_opts = NULL;
 
 	if(!db || !context || !topic) return MOSQ_ERR_INVAL;
@@ -330,34 +485,11 @@ int mosquitto_acl_check_default(struct mosquitto_db *db, struct mosquitto *conte
 	if(access == MOSQ_ACL_SUBSCRIBE) return MOSQ_ERR_SUCCESS; /* FIXME - implement ACL subscription strings. */
 	if(!context->acl_list && !security_opts->acl_patterns) return MOSQ_ERR_ACL_DENIED;
 
-	if(context->acl_list){
-		acl_root = context->acl_list->acl;
-	}else{
-		acl_root = NULL;
+	if(context->acl_list && aclhier__check(context->acl_list->aclhier, topic, access)){
+		return MOSQ_ERR_SUCCESS;
 	}
 
-	/* Loop through all ACLs for this client. */
-	while(acl_root){
-		/* Loop through the topic looking for matches to this ACL. */
-
-		/* If subscription starts with $, acl_root->topic must also start with $. */
-		if(topic[0] == '$' && acl_root->topic[0] != '$'){
-			acl_root = acl_root->next;
-			continue;
-		}
-		mosquitto_topic_matches_sub(acl_root->topic, topic, &result);
-		if(result){
-			if(access & acl_root->access){
-				/* And access is allowed. */
-				return MOSQ_ERR_SUCCESS;
-			}
-		}
-		acl_root = acl_root->next;
-	}
-
-	acl_root = security_opts->acl_patterns;
-
-	if(acl_root){
+	if(security_opts->acl_patterns){
 		/* We are using pattern based acls. Check whether the username or
 		 * client id contains a + or # and if so deny access.
 		 *
@@ -376,57 +508,15 @@ int mosquitto_acl_check_default(struct mosquitto_db *db, struct mosquitto *conte
 		}
 	}
 
-	/* Loop through all pattern ACLs. */
+	/* Loop through all pattern ACLs, expanded for this client. */
 	if(!context->id) return MOSQ_ERR_ACL_DENIED;
-	clen = strlen(context->id);
-
-	while(acl_root){
-		tlen = strlen(acl_root->topic);
-
-		if(acl_root->ucount && !context->username){
-			acl_root = acl_root->next;
-			continue;
-		}
 
-		if(context->username){
-			ulen = strlen(context->username);
-			len = tlen + acl_root->ccount*(clen-2) + acl_root->ucount*(ulen-2);
-		}else{
-			ulen = 0;
-			len = tlen + acl_root->ccount*(clen-2);
-		}
-		local_acl = mosquitto__malloc(len+1);
-		if(!local_acl) return 1; /* FIXME */
-		s = local_acl;
-		for(i=0; i<tlen; i++){
-			if(i<tlen-1 && acl_root->topic[i] == '%'){
-				if(acl_root->topic[i+1] == 'c'){
-					i++;
-					strncpy(s, context->id, clen);
-					s+=clen;
-					continue;
-				}else if(context->username && acl_root->topic[i+1] == 'u'){
-					i++;
-					strncpy(s, context->username, ulen);
-					s+=ulen;
-					continue;
-				}
-			}
-			s[0] = acl_root->topic[i];
-			s++;
-		}
-		local_acl[len] = '\0';
-
-		mosquitto_topic_matches_sub(local_acl, topic, &result);
-		mosquitto__free(local_acl);
-		if(result){
-			if(access & acl_root->access){
-				/* And access is allowed. */
-				return MOSQ_ERR_SUCCESS;
-			}
-		}
-
-		acl_root = acl_root->next;
+	if(security_opts->acl_patterns && !context->acl_patterns_expanded){
+		rc = acl__expand_patterns(security_opts, context);
+		if(rc) return rc;
+	}
+	if(aclhier__check(context->acl_patterns, topic, access)){
+		return MOSQ_ERR_SUCCESS;
 	}
 
 	return MOSQ_ERR_ACL_DENIED;
@@ -577,6 +667,85 @@ static void free__acl(struct mosquitto__acl *acl)
 }
 
 
+/* Substitute %c and %u in the pattern ACLs once for this client, the client
+ * id and username do not change while it is connected. Patterns using %u can
+ * never match a client without a username and are left out. */
+static int acl__expand_patterns(struct mosquitto__security_options *security_opts, struct mosquitto *context)
+{
+	struct mosquitto__acl *acl_root;
+	char *local_acl;
+	int i;
+	int len, tlen, clen, ulen;
+	char *s;
+	int rc;
+
+	acl__patterns_free(context);
+
+	if(!context->id){
+		context->acl_patterns_expanded = true;
+		return MOSQ_ERR_SUCCESS;
+	}
+	clen = strlen(context->id);
+	if(context->username){
+		ulen = strlen(context->username);
+	}else{
+		ulen = 0;
+	}
+
+	for(acl_root = security_opts->acl_patterns; acl_root; acl_root = acl_root->next){
+		if(acl_root->ucount && !context->username){
+			continue;
+		}
+
+		tlen = strlen(acl_root->topic);
+		len = tlen + acl_root->ccount*(clen-2) + acl_root->ucount*(ulen-2);
+
+		local_acl = mosquitto__malloc(len+1);
+		if(!local_acl){
+			acl__patterns_free(context);
+			return MOSQ_ERR_NOMEM;
+		}
+		s = local_acl;
+		for(i=0; i<tlen; i++){
+			if(i<tlen-1 && acl_root->topic[i] == '%'){
+				if(acl_root->topic[i+1] == 'c'){
+					i++;
+					strncpy(s, context->id, clen);
+					s+=clen;
+					continue;
+				}else if(context->username && acl_root->topic[i+1] == 'u'){
+					i++;
+					strncpy(s, context->username, ulen);
+					s+=ulen;
+					continue;
+				}
+			}
+			s[0] = acl_root->topic[i];
+			s++;
+		}
+		local_acl[len] = '\0';
+
+		rc = aclhier__add(&context->acl_patterns, local_acl, acl_root->access);
+		mosquitto__free(local_acl);
+		if(rc){
+			acl__patterns_free(context);
+			return rc;
+		}
+	}
+	context->acl_patterns_expanded = true;
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+void acl__patterns_free(struct mosquitto *context)
+{
+	aclhier__free(context->acl_patterns);
+	context->acl_patterns = NULL;
+	context->acl_patterns_expanded = false;
+}
+
+
 static void acl__cleanup_single(struct mosquitto__security_options *security_opts)
 {
 	struct mosquitto__acl_user *user_tail;
@@ -585,6 +754,7 @@ static void acl__cleanup_single(struct mosquitto__security_options *security_opt
 		user_tail = security_opts->acl_list->next;
 
 		free__acl(security_opts->acl_list->acl);
+		aclhier__free(security_opts->acl_list->aclhier);
 		mosquitto__free(security_opts->acl_list->username);
 		mosquitto__free(security_opts->acl_list);
 
@@ -615,6 +785,7 @@ static int acl__cleanup(struct mosquitto_db *db, bool reload)
 	 */
 	HASH_ITER(hh_id, db->contexts_by_id, context, ctxt_tmp){
 		context->acl_list = NULL;
+		acl__patterns_free(context);
 	}
 
 	if(db->config->per_listener_settings){
@@ -634,6 +805,9 @@ int acl__find_acls(struct mosquitto_db *db, struct mosquitto *context)
 	struct mosquitto__acl_user *acl_tail;
 	struct mosquitto__security_options *security_opts;
 
+	/* The username may have changed, cached decisions are for the old one. */
+	acl__cache_clear(context);
+
 	/* Associate user with its ACL, assuming we have ACLs loaded. */
 	if(db->config->per_listener_settings){
 		if(!context->listener){
@@ -664,7 +838,7 @@ int acl__find_acls(struct mosquitto_db *db, struct mosquitto *context)
 		context->acl_list = NULL;
 	}
 
-	return MOSQ_ERR_SUCCESS;
+	return acl__expand_patterns(security_opts, context);
 }
 
 
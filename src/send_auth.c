@@ -58,11 +58,11 @@ int send__auth(struct mosquitto_db *db, struct mosquitto *context, int reason_co
 
 	if(packet__check_oversize(context, remaining_length)){
 		mosquitto_property_free_all(&properties);
-		mosquitto__free(packet);
+		packet__free(packet);
 		return MOSQ_ERR_OVERSIZE_PACKET;
 	}
 
-	packet = mosquitto__calloc(1, sizeof(struct mosquitto__packet));
+	packet = packet__new();
 	if(!packet) return MOSQ_ERR_NOMEM;
 
 	packet->command = CMD_AUTH;
@@ -71,7 +71,7 @@ int send__auth(struct mosquitto_db *db, struct mosquitto *context, int reason_co
 	rc = packet__alloc(packet);
 	if(rc){
 		mosquitto_property_free_all(&properties);
-		mosquitto__free(packet);
+		packet__free(packet);
 		return rc;
 	}
 	packet__write_byte(packet, reason_code);
@@ -55,15 +55,43 @@ Contributors:
 #include "memory_mosq.h"
 #include "mqtt_protocol.h"
 #include "util_mosq.h"
+#include "network_graph.h"
+#include "sys_tree.h"
 
 #include "utlist.h"
 
+/* One level of a topic, pointing into the topic string so it is not NUL
+ * terminated. */
 struct sub__token {
 	struct sub__token *next;
-	char *topic;
+	const char *topic;
 	uint16_t topic_len;
 };
 
+#define SUB_TOKENS_LOCAL 16
+
+#define SUB_MATCHES_LOCAL 16
+
+/* Subscription tree nodes found for a published topic. Most topics match a
+ * few nodes, those fit in local and need no allocation. */
+struct sub__matches {
+	struct mosquitto__subhier **hiers;
+	int count;
+	int size;
+	struct mosquitto__subhier *local[SUB_MATCHES_LOCAL];
+};
+
+/* Where the message was published from, for check_retain_source. Retained
+ * messages from one client are usually found together, so its ACLs are only
+ * looked up again when the client changes. Holds a reference to the message
+ * that the details in context point into. */
+struct retain__source {
+	struct mosquitto context;
+	struct mosquitto_msg_store *stored;
+};
+
+static int retain__store(struct mosquitto_db *db, const char *topic, struct mosquitto_msg_store *stored);
+
 
 static int subs__send(struct mosquitto_db *db, struct mosquitto__subleaf *leaf, const char *topic, int qos, int retain, struct mosquitto_msg_store *stored)
 {
@@ -73,6 +101,14 @@ static int subs__send(struct mosquitto_db *db, struct mosquitto__subleaf *leaf,
 	mosquitto_property *properties = NULL;
 	int rc2;
 
+#ifdef WITH_PERSISTENCE
+	/* Only when restoring a retained message that a shared subscription
+	 * matches. */
+	if(stored->payload_mapped && persist__payload_pin(db, stored)){
+		return 1;
+	}
+#endif
+
 	/* Check for ACL topic access. */
 	rc2 = mosquitto_acl_check(db, leaf->context, topic, stored->payloadlen, UHPA_ACCESS(stored->payload, stored->payloadlen), stored->qos, stored->retain, MOSQ_ACL_READ);
 	if(rc2 == MOSQ_ERR_ACL_DENIED){
@@ -102,9 +138,13 @@ static int subs__send(struct mosquitto_db *db, struct mosquitto__subleaf *leaf,
 		if(leaf->identifier){
 			mosquitto_property_add_varint(&properties, MQTT_PROP_SUBSCRIPTION_IDENTIFIER, leaf->identifier);
 		}
-		if(db__message_insert(db, leaf->context, mid, mosq_md_out, msg_qos, client_retain, stored, properties) == 1){
+		rc2 = db__message_insert(db, leaf->context, mid, mosq_md_out, msg_qos, client_retain, stored, properties);
+		if(rc2 == 1){
 			return 1;
 		}
+#ifdef WITH_GRAPH
+		network_graph_add_delivery(leaf->context, topic, stored->db_id, rc2 == 2);
+#endif
 	}else{
 		return 1; /* Application error */
 	}
@@ -131,37 +171,12 @@ static int subs__shared_process(struct mosquitto_db *db, struct mosquitto__subhi
 	return rc;
 }
 
-static int subs__process(struct mosquitto_db *db, struct mosquitto__subhier *hier, const char *source_id, const char *topic, int qos, int retain, struct mosquitto_msg_store *stored, bool set_retain)
+static int subs__process(struct mosquitto_db *db, struct mosquitto__subhier *hier, const char *source_id, const char *topic, int qos, int retain, struct mosquitto_msg_store *stored)
 {
 	int rc = 0;
 	int rc2;
 	struct mosquitto__subleaf *leaf;
 
-	if(retain && set_retain){
-#ifdef WITH_PERSISTENCE
-		if(strncmp(topic, "$SYS", 4)){
-			/* Retained messages count as a persistence change, but only if
-			 * they aren't for $SYS. */
-			db->persistence_changes++;
-		}
-#endif
-		if(hier->retained){
-			db__msg_store_ref_dec(db, &hier->retained);
-#ifdef WITH_SYS_TREE
-			db->retained_count--;
-#endif
-		}
-		if(stored->payloadlen){
-			hier->retained = stored;
-			db__msg_store_ref_inc(hier->retained);
-#ifdef WITH_SYS_TREE
-			db->retained_count++;
-#endif
-		}else{
-			hier->retained = NULL;
-		}
-	}
-
 	rc = subs__shared_process(db, hier, topic, qos, retain, stored);
 
 	leaf = hier->subs;
@@ -183,44 +198,17 @@ static int subs__process(struct mosquitto_db *db, struct mosquitto__subhier *hie
 	}
 }
 
-static struct sub__token *sub__topic_append(struct sub__token **tail, struct sub__token **topics, char *topic)
-{
-	struct sub__token *new_topic;
-
-	if(!topic){
-		return NULL;
-	}
-	new_topic = mosquitto__malloc(sizeof(struct sub__token));
-	if(!new_topic){
-		return NULL;
-	}
-	new_topic->next = NULL;
-	new_topic->topic_len = strlen(topic);
-	new_topic->topic = mosquitto__malloc(new_topic->topic_len+1);
-	if(!new_topic->topic){
-		mosquitto__free(new_topic);
-		return NULL;
-	}
-	strncpy(new_topic->topic, topic, new_topic->topic_len+1);
-
-	if(*tail){
-		(*tail)->next = new_topic;
-		*tail = (*tail)->next;
-	}else{
-		*topics = new_topic;
-		*tail = new_topic;
-	}
-	return new_topic;
-}
-
-static int sub__topic_tokenise(const char *subtopic, struct sub__token **topics)
+/* Split a topic into its levels. Topics not starting with $ get an extra
+ * empty first level, the root of the normal topic tree. The tokens are
+ * written to local, which must have SUB_TOKENS_LOCAL entries, or to a heap
+ * array for deeper topics. Free with sub__topic_tokens_free(). */
+static int sub__topic_tokenise(const char *subtopic, struct sub__token *local, struct sub__token **topics)
 {
-	struct sub__token *new_topic, *tail = NULL;
+	struct sub__token *tokens;
 	size_t len;
-	size_t start, stop, tlen;
-	int i;
-	char *topic;
+	size_t start, i;
 	int count = 0;
+	int levels;
 
 	assert(subtopic);
 	assert(topics);
@@ -230,95 +218,112 @@ static int sub__topic_tokenise(const char *subtopic, struct sub__token **topics)
 		return 1;
 	}
 
+	levels = 1;
+	for(i=0; i<len; i++){
+		if(subtopic[i] == '/'){
+			levels++;
+		}
+	}
+	/* Set limit on hierarchy levels, to restrict stack usage. A leading "/"
+	 * is not counted. */
+	if(levels - (subtopic[0] == '/') > TOPIC_HIERARCHY_LIMIT){
+		return 1;
+	}
 	if(subtopic[0] != '$'){
-		new_topic = sub__topic_append(&tail, topics, "");
-		if(!new_topic) goto cleanup;
+		levels++;
 	}
 
-	if(subtopic[0] == '/'){
-		new_topic = sub__topic_append(&tail, topics, "");
-		if(!new_topic) goto cleanup;
-
-		start = 1;
+	if(levels > SUB_TOKENS_LOCAL){
+		tokens = mosquitto__malloc(levels*sizeof(struct sub__token));
+		if(!tokens) return 1;
 	}else{
-		start = 0;
+		tokens = local;
 	}
 
-	for(i=start; i<len+1; i++){
+	if(subtopic[0] != '$'){
+		tokens[count].topic = "";
+		tokens[count].topic_len = 0;
+		count++;
+	}
+	start = 0;
+	for(i=0; i<len+1; i++){
 		if(subtopic[i] == '/' || subtopic[i] == '\0'){
-			stop = i;
+			tokens[count].topic = &subtopic[start];
+			tokens[count].topic_len = i-start;
 			count++;
-
-			if(start != stop){
-				tlen = stop-start;
-
-				topic = mosquitto__malloc(tlen+1);
-				if(!topic) goto cleanup;
-				memcpy(topic, &subtopic[start], tlen);
-				topic[tlen] = '\0';
-				new_topic = sub__topic_append(&tail, topics, topic);
-				mosquitto__free(topic);
-			}else{
-				new_topic = sub__topic_append(&tail, topics, "");
-			}
-			if(!new_topic) goto cleanup;
 			start = i+1;
 		}
 	}
-
-	if(count > TOPIC_HIERARCHY_LIMIT){
-		/* Set limit on hierarchy levels, to restrict stack usage. */
-		goto cleanup;
+	for(levels=0; levels<count-1; levels++){
+		tokens[levels].next = &tokens[levels+1];
 	}
+	tokens[count-1].next = NULL;
 
-	if(*topics != NULL){
-		return MOSQ_ERR_SUCCESS;
-	}else{
-		return 1;
-	}
+	*topics = tokens;
+	return MOSQ_ERR_SUCCESS;
+}
 
-cleanup:
-	tail = *topics;
-	*topics = NULL;
-	while(tail){
-		mosquitto__free(tail->topic);
-		new_topic = tail->next;
-		mosquitto__free(tail);
-		tail = new_topic;
+static void sub__topic_tokens_free(struct sub__token *tokens, struct sub__token *local)
+{
+	if(tokens != local){
+		mosquitto__free(tokens);
 	}
-	return 1;
 }
 
-static void sub__topic_tokens_free(struct sub__token *tokens)
+static bool sub__token_is(const struct sub__token *token, const char *str)
 {
-	struct sub__token *tail;
+	return token->topic_len == strlen(str) && !memcmp(token->topic, str, token->topic_len);
+}
 
-	while(tokens){
-		tail = tokens->next;
-		mosquitto__free(tokens->topic);
-		mosquitto__free(tokens);
-		tokens = tail;
+/* For a "$share/<name>/<filter>" subscription, copy the share name and point
+ * tokens at the filter, with its first level replaced by the root "". */
+static int sub__topic_share(struct sub__token **tokens, char **sharename)
+{
+	struct sub__token *t = *tokens;
+
+	if(!sub__token_is(t, "$share")){
+		return MOSQ_ERR_SUCCESS;
+	}
+	if(!t->next || !t->next->next){
+		return MOSQ_ERR_PROTOCOL;
 	}
+	t = t->next;
+
+	*sharename = mosquitto__malloc(t->topic_len+1);
+	if(!(*sharename)){
+		return MOSQ_ERR_NOMEM;
+	}
+	memcpy(*sharename, t->topic, t->topic_len);
+	(*sharename)[t->topic_len] = '\0';
+
+	t->topic = "";
+	t->topic_len = 0;
+	*tokens = t;
+
+	return MOSQ_ERR_SUCCESS;
 }
 
 
-static int sub__add_leaf(struct mosquitto *context, int qos, uint32_t identifier, int options, struct mosquitto__subleaf **head, struct mosquitto__subleaf **newleaf)
+/* subscribed is whether the client's own list of subscriptions already has
+ * this one, so that adding to a topic with many subscribers doesn't have to
+ * look through all of them. */
+static int sub__add_leaf(struct mosquitto *context, int qos, uint32_t identifier, int options, struct mosquitto__subleaf **head, struct mosquitto__subleaf **newleaf, bool subscribed)
 {
 	struct mosquitto__subleaf *leaf;
 
 	*newleaf = NULL;
-	leaf = *head;
 
-	while(leaf){
-		if(leaf->context && leaf->context->id && !strcmp(leaf->context->id, context->id)){
-			/* Client making a second subscription to same topic. Only
-			 * need to update QoS. Return MOSQ_ERR_SUB_EXISTS to
-			 * indicate this to the calling function. */
-			leaf->qos = qos;
-			leaf->identifier = identifier;
-			return MOSQ_ERR_SUB_EXISTS;
+	if(subscribed){
+		DL_FOREACH(*head, leaf){
+			if(leaf->context == context){
+				/* Client making a second subscription to same topic. Only
+				 * need to update QoS. Return MOSQ_ERR_SUB_EXISTS to
+				 * indicate this to the calling function. */
+				leaf->qos = qos;
+				leaf->identifier = identifier;
+				return MOSQ_ERR_SUB_EXISTS;
+			}
 		}
-		leaf = leaf->next;
 	}
 	leaf = mosquitto__calloc(1, sizeof(struct mosquitto__subleaf));
 	if(!leaf) return MOSQ_ERR_NOMEM;
@@ -355,6 +360,7 @@ static int sub__add_shared(struct mosquitto_db *db, struct mosquitto *context, i
 	struct mosquitto__subshared_ref *shared_ref;
 	int i;
 	unsigned int slen;
+	bool subscribed = false;
 	int rc;
 
 	slen = strlen(sharename);
@@ -373,7 +379,13 @@ static int sub__add_shared(struct mosquitto_db *db, struct mosquitto *context, i
 		HASH_ADD_KEYPTR(hh, subhier->shared, shared->name, slen, shared);
 	}
 
-	rc = sub__add_leaf(context, qos, identifier, options, &shared->subs, &newleaf);
+	for(i=0; i<context->shared_sub_count; i++){
+		if(context->shared_subs[i] && context->shared_subs[i]->shared == shared){
+			subscribed = true;
+			break;
+		}
+	}
+	rc = sub__add_leaf(context, qos, identifier, options, &shared->subs, &newleaf, subscribed);
 	if(rc > 0){
 		if(shared->subs == NULL){
 			HASH_DELETE(hh, subhier->shared, shared);
@@ -427,10 +439,17 @@ static int sub__add_normal(struct mosquitto_db *db, struct mosquitto *context, i
 {
 	struct mosquitto__subleaf *newleaf = NULL;
 	struct mosquitto__subhier **subs;
+	bool subscribed = false;
 	int i;
 	int rc;
 
-	rc = sub__add_leaf(context, qos, identifier, options, &subhier->subs, &newleaf);
+	for(i=0; i<context->sub_count; i++){
+		if(context->subs[i] == subhier){
+			subscribed = true;
+			break;
+		}
+	}
+	rc = sub__add_leaf(context, qos, identifier, options, &subhier->subs, &newleaf, subscribed);
 	if(rc > 0){
 		return rc;
 	}
@@ -479,6 +498,7 @@ static int sub__add_context(struct mosquitto_db *db, struct mosquitto *context,
 			/* Not found */
 			branch = sub__add_hier_entry(subhier, &subhier->children, tokens->topic, tokens->topic_len);
 			if(!branch) return MOSQ_ERR_NOMEM;
+			db->subs_epoch++;
 		}
 		subhier = branch;
 		tokens = tokens ->next;
@@ -596,7 +616,7 @@ static int sub__remove_recurse(struct mosquitto_db *db, struct mosquitto *contex
 	HASH_FIND(hh, subhier->children, tokens->topic, tokens->topic_len, branch);
 	if(branch){
 		sub__remove_recurse(db, context, branch, tokens->next, reason, sharename);
-		if(!branch->children && !branch->subs && !branch->retained && !branch->shared){
+		if(!branch->children && !branch->subs && !branch->shared){
 			HASH_DELETE(hh, subhier->children, branch);
 			mosquitto__free(branch->topic);
 			mosquitto__free(branch);
@@ -605,31 +625,71 @@ static int sub__remove_recurse(struct mosquitto_db *db, struct mosquitto *contex
 	return MOSQ_ERR_SUCCESS;
 }
 
-static int sub__search(struct mosquitto_db *db, struct mosquitto__subhier *subhier, struct sub__token *tokens, const char *source_id, const char *topic, int qos, int retain, struct mosquitto_msg_store *stored, bool set_retain)
+static void sub__matches_init(struct sub__matches *matches)
+{
+	matches->hiers = matches->local;
+	matches->count = 0;
+	matches->size = SUB_MATCHES_LOCAL;
+}
+
+
+static void sub__matches_free(struct sub__matches *matches)
+{
+	if(matches->hiers != matches->local){
+		mosquitto__free(matches->hiers);
+	}
+}
+
+
+static int sub__matches_add(struct sub__matches *matches, struct mosquitto__subhier *hier)
+{
+	struct mosquitto__subhier **hiers;
+
+	if(matches->count == matches->size){
+		if(matches->hiers == matches->local){
+			hiers = mosquitto__malloc(2*matches->size*sizeof(struct mosquitto__subhier *));
+			if(!hiers) return MOSQ_ERR_NOMEM;
+			memcpy(hiers, matches->local, matches->count*sizeof(struct mosquitto__subhier *));
+		}else{
+			hiers = mosquitto__realloc(matches->hiers, 2*matches->size*sizeof(struct mosquitto__subhier *));
+			if(!hiers) return MOSQ_ERR_NOMEM;
+		}
+		matches->hiers = hiers;
+		matches->size *= 2;
+	}
+	matches->hiers[matches->count] = hier;
+	matches->count++;
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static int sub__search_found(struct sub__matches *matches, struct mosquitto__subhier *hier)
+{
+	if(!hier->subs && !hier->shared){
+		return MOSQ_ERR_SUCCESS;
+	}
+	return sub__matches_add(matches, hier);
+}
+
+
+/* Find the nodes that have subscriptions matching the topic in tokens. */
+static int sub__search(struct mosquitto__subhier *subhier, struct sub__token *tokens, struct sub__matches *matches)
 {
 	/* FIXME - need to take into account source_id if the client is a bridge */
 	struct mosquitto__subhier *branch;
 	int rc;
-	bool have_subscribers = false;
 
 	if(tokens){
 		/* Check for literal match */
 		HASH_FIND(hh, subhier->children, tokens->topic, tokens->topic_len, branch);
 
 		if(branch){
-			rc = sub__search(db, branch, tokens->next, source_id, topic, qos, retain, stored, set_retain);
-			if(rc == MOSQ_ERR_SUCCESS){
-				have_subscribers = true;
-			}else if(rc != MOSQ_ERR_NO_SUBSCRIBERS){
-				return rc;
-			}
+			rc = sub__search(branch, tokens->next, matches);
+			if(rc) return rc;
 			if(!tokens->next){
-				rc = subs__process(db, branch, source_id, topic, qos, retain, stored, set_retain);
-				if(rc == MOSQ_ERR_SUCCESS){
-					have_subscribers = true;
-				}else if(rc != MOSQ_ERR_NO_SUBSCRIBERS){
-					return rc;
-				}
+				rc = sub__search_found(matches, branch);
+				if(rc) return rc;
 			}
 		}
 
@@ -637,19 +697,11 @@ static int sub__search(struct mosquitto_db *db, struct mosquitto__subhier *subhi
 		HASH_FIND(hh, subhier->children, "+", 1, branch);
 
 		if(branch){
-			rc = sub__search(db, branch, tokens->next, source_id, topic, qos, retain, stored, false);
-			if(rc == MOSQ_ERR_SUCCESS){
-				have_subscribers = true;
-			}else if(rc != MOSQ_ERR_NO_SUBSCRIBERS){
-				return rc;
-			}
+			rc = sub__search(branch, tokens->next, matches);
+			if(rc) return rc;
 			if(!tokens->next){
-				rc = subs__process(db, branch, source_id, topic, qos, retain, stored, false);
-				if(rc == MOSQ_ERR_SUCCESS){
-					have_subscribers = true;
-				}else if(rc != MOSQ_ERR_NO_SUBSCRIBERS){
-					return rc;
-				}
+				rc = sub__search_found(matches, branch);
+				if(rc) return rc;
 			}
 		}
 	}
@@ -661,7 +713,22 @@ static int sub__search(struct mosquitto_db *db, struct mosquitto__subhier *subhi
 		 * subscriptions but *don't* return. Although this branch has ended
 		 * there may still be other subscriptions to deal with.
 		 */
-		rc = subs__process(db, branch, source_id, topic, qos, retain, stored, false);
+		rc = sub__search_found(matches, branch);
+		if(rc) return rc;
+	}
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static int sub__matches_process(struct mosquitto_db *db, struct sub__matches *matches, const char *source_id, const char *topic, int qos, int retain, struct mosquitto_msg_store *stored)
+{
+	int i;
+	int rc;
+	bool have_subscribers = false;
+
+	for(i=0; i<matches->count; i++){
+		rc = subs__process(db, matches->hiers[i], source_id, topic, qos, retain, stored);
 		if(rc == MOSQ_ERR_SUCCESS){
 			have_subscribers = true;
 		}else if(rc != MOSQ_ERR_NO_SUBSCRIBERS){
@@ -677,6 +744,95 @@ static int sub__search(struct mosquitto_db *db, struct mosquitto__subhier *subhi
 }
 
 
+/* FNV-1a */
+static unsigned int sub__cache_hash(const char *topic)
+{
+	unsigned int hash = 2166136261U;
+
+	while(*topic){
+		hash ^= (unsigned char)*topic++;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+
+static bool sub__cache_get(struct mosquitto_db *db, const char *topic, unsigned int hash, struct sub__matches *matches)
+{
+	struct mosquitto__sub_cache_entry *entry;
+	int i;
+
+	if(db->sub_cache){
+		entry = &db->sub_cache[hash & (SUB_CACHE_SIZE-1)];
+		if(entry->topic && entry->epoch == db->subs_epoch && entry->hash == hash && !strcmp(entry->topic, topic)){
+			/* Copied, delivering may publish a will that replaces the entry. */
+			for(i=0; i<entry->hier_count; i++){
+				if(sub__matches_add(matches, entry->hiers[i])){
+					matches->count = 0;
+					return false;
+				}
+			}
+			G_SUB_CACHE_HITS_INC();
+			return true;
+		}
+	}
+	G_SUB_CACHE_MISSES_INC();
+	return false;
+}
+
+
+static void sub__cache_put(struct mosquitto_db *db, const char *topic, unsigned int hash, struct sub__matches *matches)
+{
+	struct mosquitto__sub_cache_entry *entry;
+
+	if(!db->sub_cache){
+		db->sub_cache = mosquitto__calloc(SUB_CACHE_SIZE, sizeof(struct mosquitto__sub_cache_entry));
+		if(!db->sub_cache) return;
+	}
+	entry = &db->sub_cache[hash & (SUB_CACHE_SIZE-1)];
+	if(entry->seen_hash != hash){
+		entry->seen_hash = hash;
+		return;
+	}
+
+	mosquitto__free(entry->topic);
+	entry->topic = NULL;
+	mosquitto__free(entry->hiers);
+	entry->hiers = NULL;
+	entry->hier_count = 0;
+
+	if(matches->count){
+		entry->hiers = mosquitto__malloc(matches->count*sizeof(struct mosquitto__subhier *));
+		if(!entry->hiers) return;
+		memcpy(entry->hiers, matches->hiers, matches->count*sizeof(struct mosquitto__subhier *));
+	}
+	entry->topic = mosquitto__strdup(topic);
+	if(!entry->topic){
+		mosquitto__free(entry->hiers);
+		entry->hiers = NULL;
+		return;
+	}
+	entry->hier_count = matches->count;
+	entry->hash = hash;
+	entry->epoch = db->subs_epoch;
+}
+
+
+void sub__cache_free(struct mosquitto_db *db)
+{
+	int i;
+
+	if(!db->sub_cache) return;
+
+	for(i=0; i<SUB_CACHE_SIZE; i++){
+		mosquitto__free(db->sub_cache[i].topic);
+		mosquitto__free(db->sub_cache[i].hiers);
+	}
+	mosquitto__free(db->sub_cache);
+	db->sub_cache = NULL;
+}
+
+
 struct mosquitto__subhier *sub__add_hier_entry(struct mosquitto__subhier *parent, struct mosquitto__subhier **sibling, const char *topic, size_t len)
 {
 	struct mosquitto__subhier *child;
@@ -697,7 +853,8 @@ struct mosquitto__subhier *sub__add_hier_entry(struct mosquitto__subhier *parent
 		log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
 		return NULL;
 	}else{
-		strncpy(child->topic, topic, child->topic_len+1);
+		memcpy(child->topic, topic, child->topic_len);
+		child->topic[child->topic_len] = '\0';
 	}
 
 	HASH_ADD_KEYPTR(hh, *sibling, child->topic, child->topic_len, child);
@@ -710,49 +867,44 @@ int sub__add(struct mosquitto_db *db, struct mosquitto *context, const char *sub
 {
 	int rc = 0;
 	struct mosquitto__subhier *subhier;
-	struct sub__token *tokens = NULL, *t;
+	struct sub__token local[SUB_TOKENS_LOCAL];
+	struct sub__token *token_list = NULL, *tokens;
 	char *sharename = NULL;
 
 	assert(root);
 	assert(*root);
 	assert(sub);
 
-	if(sub__topic_tokenise(sub, &tokens)) return 1;
+	if(sub__topic_tokenise(sub, local, &token_list)) return 1;
 
-	if(!strcmp(tokens->topic, "$share")){
-		if(!tokens->next || !tokens->next->next){
-			sub__topic_tokens_free(tokens);
-			return MOSQ_ERR_PROTOCOL;
-		}
-		t = tokens->next;
-		mosquitto__free(tokens->topic);
-		mosquitto__free(tokens);
-		tokens = t;
-
-		sharename = tokens->topic;
+	db->subs_epoch++;
 
-		tokens->topic = mosquitto__strdup("");
-		if(!tokens->topic){
-			tokens->topic = sharename;
-			sub__topic_tokens_free(tokens);
-			return MOSQ_ERR_PROTOCOL;
-		}
-		tokens->topic_len = 0;
+	tokens = token_list;
+	rc = sub__topic_share(&tokens, &sharename);
+	if(rc){
+		sub__topic_tokens_free(token_list, local);
+		return rc;
 	}
 
 	HASH_FIND(hh, *root, tokens->topic, tokens->topic_len, subhier);
 	if(!subhier){
 		subhier = sub__add_hier_entry(NULL, root, tokens->topic, tokens->topic_len);
 		if(!subhier){
-			sub__topic_tokens_free(tokens);
+			mosquitto__free(sharename);
+			sub__topic_tokens_free(token_list, local);
 			log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
 			return MOSQ_ERR_NOMEM;
 		}
 
 	}
 	rc = sub__add_context(db, context, qos, identifier, options, subhier, tokens, sharename);
+#ifdef WITH_PERSISTENCE
+	if(rc == MOSQ_ERR_SUCCESS || rc == MOSQ_ERR_SUB_EXISTS){
+		persist__log_sub(db, context, sub, qos, identifier, options);
+	}
+#endif
 
-	sub__topic_tokens_free(tokens);
+	sub__topic_tokens_free(token_list, local);
 
 	return rc;
 }
@@ -761,42 +913,36 @@ int sub__remove(struct mosquitto_db *db, struct mosquitto *context, const char *
 {
 	int rc = 0;
 	struct mosquitto__subhier *subhier;
-	struct sub__token *tokens = NULL, *t;
+	struct sub__token local[SUB_TOKENS_LOCAL];
+	struct sub__token *token_list = NULL, *tokens;
 	char *sharename = NULL;
 
 	assert(root);
 	assert(sub);
 
-	if(sub__topic_tokenise(sub, &tokens)) return 1;
-
-	if(!strcmp(tokens->topic, "$share")){
-		if(!tokens->next || !tokens->next->next){
-			sub__topic_tokens_free(tokens);
-			return MOSQ_ERR_PROTOCOL;
-		}
-		t = tokens->next;
-		mosquitto__free(tokens->topic);
-		mosquitto__free(tokens);
-		tokens = t;
+	if(sub__topic_tokenise(sub, local, &token_list)) return 1;
 
-		sharename = tokens->topic;
+	db->subs_epoch++;
 
-		tokens->topic = mosquitto__strdup("");
-		if(!tokens->topic){
-			tokens->topic = sharename;
-			sub__topic_tokens_free(tokens);
-			return MOSQ_ERR_PROTOCOL;
-		}
-		tokens->topic_len = 0;
+	tokens = token_list;
+	rc = sub__topic_share(&tokens, &sharename);
+	if(rc){
+		sub__topic_tokens_free(token_list, local);
+		return rc;
 	}
 
 	HASH_FIND(hh, root, tokens->topic, tokens->topic_len, subhier);
 	if(subhier){
 		*reason = MQTT_RC_NO_SUBSCRIPTION_EXISTED;
 		rc = sub__remove_recurse(db, context, subhier, tokens, reason, sharename);
+#ifdef WITH_PERSISTENCE
+		if(rc == MOSQ_ERR_SUCCESS && *reason == MQTT_RC_SUCCESS){
+			persist__log_sub_delete(db, context, sub);
+		}
+#endif
 	}
 
-	sub__topic_tokens_free(tokens);
+	sub__topic_tokens_free(token_list, local);
 
 	return rc;
 }
@@ -805,12 +951,25 @@ int sub__messages_queue(struct mosquitto_db *db, const char *source_id, const ch
 {
 	int rc = 0;
 	struct mosquitto__subhier *subhier;
+	struct sub__token local[SUB_TOKENS_LOCAL];
 	struct sub__token *tokens = NULL;
+	struct sub__matches matches;
+	unsigned int hash = 0;
+	bool cached = false;
 
 	assert(db);
 	assert(topic);
 
-	if(sub__topic_tokenise(topic, &tokens)) return 1;
+	sub__matches_init(&matches);
+
+	hash = sub__cache_hash(topic);
+	cached = sub__cache_get(db, topic, hash, &matches);
+	if(!cached){
+		if(sub__topic_tokenise(topic, local, &tokens)){
+			sub__matches_free(&matches);
+			return 1;
+		}
+	}
 
 	/* Protect this message until we have sent it to all
 	clients - this is required because websockets client calls
@@ -818,17 +977,27 @@ int sub__messages_queue(struct mosquitto_db *db, const char *source_id, const ch
 	*/
 	db__msg_store_ref_inc(*stored);
 
-	HASH_FIND(hh, db->subs, tokens->topic, tokens->topic_len, subhier);
-	if(subhier){
-		if(retain){
-			/* We have a message that needs to be retained, so ensure that the subscription
-			 * tree for its topic exists.
-			 */
-			sub__add_context(db, NULL, 0, 0, 0, subhier, tokens, NULL);
+	if(retain){
+		rc = retain__store(db, topic, *stored);
+	}
+	if(rc){
+		if(!cached){
+			sub__topic_tokens_free(tokens, local);
+		}
+	}else if(cached){
+		rc = sub__matches_process(db, &matches, source_id, topic, qos, retain, *stored);
+	}else{
+		HASH_FIND(hh, db->subs, tokens->topic, tokens->topic_len, subhier);
+		if(subhier){
+			rc = sub__search(subhier, tokens, &matches);
+			if(rc == MOSQ_ERR_SUCCESS){
+				sub__cache_put(db, topic, hash, &matches);
+				rc = sub__matches_process(db, &matches, source_id, topic, qos, retain, *stored);
+			}
 		}
-		rc = sub__search(db, subhier, tokens, source_id, topic, qos, retain, *stored, true);
+		sub__topic_tokens_free(tokens, local);
 	}
-	sub__topic_tokens_free(tokens);
+	sub__matches_free(&matches);
 
 	/* Remove our reference and free if needed. */
 	db__msg_store_ref_dec(db, stored);
@@ -846,7 +1015,7 @@ static struct mosquitto__subhier *tmp_remove_subs(struct mosquitto__subhier *sub
 		return NULL;
 	}
 
-	if(sub->children || sub->subs || sub->retained){
+	if(sub->children || sub->subs){
 		return NULL;
 	}
 
@@ -857,7 +1026,6 @@ static struct mosquitto__subhier *tmp_remove_subs(struct mosquitto__subhier *sub
 
 	if(parent->subs == NULL
 			&& parent->children == NULL
-			&& parent->retained == NULL
 			&& parent->shared == NULL
 			&& parent->parent){
 
@@ -891,7 +1059,6 @@ static int sub__clean_session_shared(struct mosquitto_db *db, struct mosquitto *
 		}
 		if(context->shared_subs[i]->hier->subs == NULL
 				&& context->shared_subs[i]->hier->children == NULL
-				&& context->shared_subs[i]->hier->retained == NULL
 				&& context->shared_subs[i]->hier->shared == NULL
 				&& context->shared_subs[i]->hier->parent){
 
@@ -918,6 +1085,10 @@ int sub__clean_session(struct mosquitto_db *db, struct mosquitto *context)
 	struct mosquitto__subleaf *leaf;
 	struct mosquitto__subhier *hier;
 
+	if(context->sub_count || context->shared_sub_count){
+		db->subs_epoch++;
+	}
+
 	for(i=0; i<context->sub_count; i++){
 		if(context->subs[i] == NULL){
 			continue;
@@ -936,7 +1107,6 @@ int sub__clean_session(struct mosquitto_db *db, struct mosquitto *context)
 		}
 		if(context->subs[i]->subs == NULL
 				&& context->subs[i]->children == NULL
-				&& context->subs[i]->retained == NULL
 				&& context->subs[i]->shared == NULL
 				&& context->subs[i]->parent){
 
@@ -975,9 +1145,6 @@ void sub__tree_print(struct mosquitto__subhier *root, int level)
 			}
 			leaf = leaf->next;
 		}
-		if(branch->retained){
-			printf(" (r)");
-		}
 		printf("\n");
 	}
 
@@ -985,24 +1152,187 @@ void sub__tree_print(struct mosquitto__subhier *root, int level)
 	}
 }
 
-static int retain__process(struct mosquitto_db *db, struct mosquitto__subhier *branch, struct mosquitto *context, int sub_qos, uint32_t subscription_identifier, time_t now)
+struct mosquitto__retainhier *retain__add_hier_entry(struct mosquitto__retainhier *parent, struct mosquitto__retainhier **sibling, const char *topic, size_t len)
 {
-	int rc = 0;
-	int qos;
-	uint16_t mid;
-	mosquitto_property *properties = NULL;
-	struct mosquitto_msg_store *retained;
+	struct mosquitto__retainhier *child;
 
-	if(branch->retained->message_expiry_time > 0 && now >= branch->retained->message_expiry_time){
-		db__msg_store_ref_dec(db, &branch->retained);
-		branch->retained = NULL;
+	assert(sibling);
+
+	child = mosquitto__calloc(1, sizeof(struct mosquitto__retainhier));
+	if(!child){
+		log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+		return NULL;
+	}
+	child->parent = parent;
+	child->topic_len = len;
+	child->topic = mosquitto__malloc(len+1);
+	if(!child->topic){
+		child->topic_len = 0;
+		mosquitto__free(child);
+		log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+		return NULL;
+	}else{
+		memcpy(child->topic, topic, child->topic_len);
+		child->topic[child->topic_len] = '\0';
+	}
+
+	HASH_ADD_KEYPTR(hh, *sibling, child->topic, child->topic_len, child);
+
+	return child;
+}
+
+
+static void retain__clear(struct mosquitto_db *db, struct mosquitto__retainhier *retainhier)
+{
+#ifdef WITH_PERSISTENCE
+	persist__payload_unretain(db, retainhier->retained);
+#endif
+	retainhier->retained->is_retained = false;
+	db__msg_store_ref_dec(db, &retainhier->retained);
+	retainhier->retained = NULL;
 #ifdef WITH_SYS_TREE
-		db->retained_count--;
+	db->retained_count--;
 #endif
+}
+
+
+/* Remove retainhier, and the parents above it, if they no longer lead to a
+ * retained message. */
+static void retain__prune(struct mosquitto__retainhier *retainhier)
+{
+	struct mosquitto__retainhier *parent;
+
+	while(retainhier->parent && !retainhier->retained && !retainhier->children){
+		parent = retainhier->parent;
+		HASH_DELETE(hh, parent->children, retainhier);
+		mosquitto__free(retainhier->topic);
+		mosquitto__free(retainhier);
+		retainhier = parent;
+	}
+}
+
+
+/* Make stored the retained message of topic, or remove the retained message
+ * of topic if stored has no payload. */
+static int retain__store(struct mosquitto_db *db, const char *topic, struct mosquitto_msg_store *stored)
+{
+	struct mosquitto__retainhier *retainhier, *branch;
+	struct sub__token local[SUB_TOKENS_LOCAL];
+	struct sub__token *token_list = NULL, *tokens;
+
+	if(sub__topic_tokenise(topic, local, &token_list)) return 1;
+
+	HASH_FIND(hh, db->retains, token_list->topic, token_list->topic_len, retainhier);
+	if(!retainhier && stored->payloadlen){
+		/* Other roots than "" and "$SYS" are added when first used, as
+		 * sub__add() does for subscriptions. */
+		retainhier = retain__add_hier_entry(NULL, &db->retains, token_list->topic, token_list->topic_len);
+		if(!retainhier){
+			sub__topic_tokens_free(token_list, local);
+			return MOSQ_ERR_NOMEM;
+		}
+	}
+	for(tokens=token_list; retainhier && tokens; tokens=tokens->next){
+		HASH_FIND(hh, retainhier->children, tokens->topic, tokens->topic_len, branch);
+		if(!branch && stored->payloadlen){
+			branch = retain__add_hier_entry(retainhier, &retainhier->children, tokens->topic, tokens->topic_len);
+			if(!branch){
+				sub__topic_tokens_free(token_list, local);
+				return MOSQ_ERR_NOMEM;
+			}
+		}
+		retainhier = branch;
+	}
+	sub__topic_tokens_free(token_list, local);
+
+	if(!retainhier){
+		/* Nothing retained to remove. */
 		return MOSQ_ERR_SUCCESS;
 	}
 
-	retained = branch->retained;
+#ifdef WITH_PERSISTENCE
+	if(strncmp(topic, "$SYS", 4)){
+		/* Retained messages count as a persistence change, but only if
+		 * they aren't for $SYS. */
+		db->persistence_changes++;
+		persist__log_retain(db, stored);
+	}
+#endif
+	if(retainhier->retained){
+		retain__clear(db, retainhier);
+	}
+	if(stored->payloadlen){
+		retainhier->retained = stored;
+		stored->is_retained = true;
+		db__msg_store_ref_inc(stored);
+#ifdef WITH_SYS_TREE
+		db->retained_count++;
+#endif
+	}else{
+		retain__prune(retainhier);
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static void retain__source_clear(struct mosquitto_db *db, struct retain__source *source)
+{
+	if(source->stored){
+		acl__patterns_free(&source->context);
+		db__msg_store_ref_dec(db, &source->stored);
+	}
+	memset(&source->context, 0, sizeof(struct mosquitto));
+}
+
+
+static bool retain__source_is(struct mosquitto_msg_store *a, struct mosquitto_msg_store *b)
+{
+	if(a->source_listener != b->source_listener || strcmp(a->source_id, b->source_id)){
+		return false;
+	}
+	if(a->source_username && b->source_username){
+		return !strcmp(a->source_username, b->source_username);
+	}
+	return a->source_username == b->source_username;
+}
+
+
+static int retain__source_set(struct mosquitto_db *db, struct retain__source *source, struct mosquitto_msg_store *retained)
+{
+	int rc;
+
+	if(source->stored && retain__source_is(source->stored, retained)){
+		return MOSQ_ERR_SUCCESS;
+	}
+	retain__source_clear(db, source);
+
+	source->context.id = retained->source_id;
+	source->context.username = retained->source_username;
+	source->context.listener = retained->source_listener;
+
+	rc = acl__find_acls(db, &source->context);
+	if(rc){
+		acl__patterns_free(&source->context);
+		memset(&source->context, 0, sizeof(struct mosquitto));
+		return rc;
+	}
+	source->stored = retained;
+	db__msg_store_ref_inc(retained);
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static int retain__process(struct mosquitto_db *db, struct mosquitto *context, struct mosquitto_msg_store *retained, int sub_qos, uint32_t subscription_identifier, struct retain__source *source)
+{
+	int rc = 0;
+	int qos;
+	uint16_t mid;
+	mosquitto_property *properties = NULL;
+
+#ifdef WITH_PERSISTENCE
+	rc = persist__payload_load(db, retained);
+	if(rc) return rc;
+#endif
 
 	rc = mosquitto_acl_check(db, context, retained->topic, retained->payloadlen, UHPA_ACCESS(retained->payload, retained->payloadlen),
 			retained->qos, retained->retain, MOSQ_ACL_READ);
@@ -1014,17 +1344,10 @@ static int retain__process(struct mosquitto_db *db, struct mosquitto__subhier *b
 
 	/* Check for original source access */
 	if(db->config->check_retain_source && retained->origin != mosq_mo_broker && retained->source_id){
-		struct mosquitto retain_ctxt;
-		memset(&retain_ctxt, 0, sizeof(struct mosquitto));
-
-		retain_ctxt.id = retained->source_id;
-		retain_ctxt.username = retained->source_username;
-		retain_ctxt.listener = retained->source_listener;
-
-		rc = acl__find_acls(db, &retain_ctxt);
+		rc = retain__source_set(db, source, retained);
 		if(rc) return rc;
 
-		rc = mosquitto_acl_check(db, &retain_ctxt, retained->topic, retained->payloadlen, UHPA_ACCESS(retained->payload, retained->payloadlen),
+		rc = mosquitto_acl_check(db, &source->context, retained->topic, retained->payloadlen, UHPA_ACCESS(retained->payload, retained->payloadlen),
 				retained->qos, retained->retain, MOSQ_ACL_WRITE);
 		if(rc == MOSQ_ERR_ACL_DENIED){
 			return MOSQ_ERR_SUCCESS;
@@ -1050,89 +1373,230 @@ static int retain__process(struct mosquitto_db *db, struct mosquitto__subhier *b
 	return db__message_insert(db, context, mid, mosq_md_out, qos, true, retained, properties);
 }
 
-static int retain__search(struct mosquitto_db *db, struct mosquitto__subhier *subhier, struct sub__token *tokens, struct mosquitto *context, const char *sub, int sub_qos, uint32_t subscription_identifier, time_t now, int level)
+
+static int retain__found(struct mosquitto_db *db, struct mosquitto__retainhier *branch, struct mosquitto__retain_queue *queue, time_t now)
 {
-	struct mosquitto__subhier *branch, *branch_tmp;
+	struct mosquitto_msg_store **msgs;
+	int size;
+
+	if(branch->retained->message_expiry_time > 0 && now >= branch->retained->message_expiry_time){
+		retain__clear(db, branch);
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	if(queue->count == queue->size){
+		size = queue->size ? queue->size*2 : 16;
+		msgs = mosquitto__realloc(queue->msgs, size*sizeof(struct mosquitto_msg_store *));
+		if(!msgs) return MOSQ_ERR_NOMEM;
+		queue->msgs = msgs;
+		queue->size = size;
+	}
+	queue->msgs[queue->count] = branch->retained;
+	queue->count++;
+	db__msg_store_ref_inc(branch->retained);
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+/* Remove branch if an expired message has left it empty. Its parents are
+ * left to the callers, which may be iterating over their siblings. */
+static void retain__search_prune(struct mosquitto__retainhier *retainhier, struct mosquitto__retainhier *branch)
+{
+	if(!branch->retained && !branch->children){
+		HASH_DELETE(hh, retainhier->children, branch);
+		mosquitto__free(branch->topic);
+		mosquitto__free(branch);
+	}
+}
+
+
+static int retain__search(struct mosquitto_db *db, struct mosquitto__retainhier *retainhier, struct sub__token *tokens, struct mosquitto__retain_queue *queue, time_t now, int level)
+{
+	struct mosquitto__retainhier *branch, *branch_tmp;
 	int flag = 0;
 
-	if(!strcmp(tokens->topic, "#") && !tokens->next){
-		HASH_ITER(hh, subhier->children, branch, branch_tmp){
+	if(sub__token_is(tokens, "#") && !tokens->next){
+		HASH_ITER(hh, retainhier->children, branch, branch_tmp){
 			/* Set flag to indicate that we should check for retained messages
 			 * on "foo" when we are subscribing to e.g. "foo/#" and then exit
 			 * this function and return to an earlier retain__search().
 			 */
 			flag = -1;
 			if(branch->retained){
-				retain__process(db, branch, context, sub_qos, subscription_identifier, now);
+				retain__found(db, branch, queue, now);
 			}
 			if(branch->children){
-				retain__search(db, branch, tokens, context, sub, sub_qos, subscription_identifier, now, level+1);
+				retain__search(db, branch, tokens, queue, now, level+1);
 			}
+			retain__search_prune(retainhier, branch);
 		}
 	}else{
-		if(!strcmp(tokens->topic, "+")){
-			HASH_ITER(hh, subhier->children, branch, branch_tmp){
+		if(sub__token_is(tokens, "+")){
+			HASH_ITER(hh, retainhier->children, branch, branch_tmp){
 				if(tokens->next){
-					if(retain__search(db, branch, tokens->next, context, sub, sub_qos, subscription_identifier, now, level+1) == -1
-							|| (tokens->next && !strcmp(tokens->next->topic, "#") && level>0)){
+					if(retain__search(db, branch, tokens->next, queue, now, level+1) == -1
+							|| (tokens->next && sub__token_is(tokens->next, "#") && level>0)){
 
 						if(branch->retained){
-							retain__process(db, branch, context, sub_qos, subscription_identifier, now);
+							retain__found(db, branch, queue, now);
 						}
 					}
 				}else{
 					if(branch->retained){
-						retain__process(db, branch, context, sub_qos, subscription_identifier, now);
+						retain__found(db, branch, queue, now);
 					}
 				}
+				retain__search_prune(retainhier, branch);
 			}
 		}else{
-			HASH_FIND(hh, subhier->children, tokens->topic, tokens->topic_len, branch);
+			HASH_FIND(hh, retainhier->children, tokens->topic, tokens->topic_len, branch);
 			if(branch){
 				if(tokens->next){
-					if(retain__search(db, branch, tokens->next, context, sub, sub_qos, subscription_identifier, now, level+1) == -1
-							|| (tokens->next && !strcmp(tokens->next->topic, "#") && level>0)){
+					if(retain__search(db, branch, tokens->next, queue, now, level+1) == -1
+							|| (tokens->next && sub__token_is(tokens->next, "#") && level>0)){
 
 						if(branch->retained){
-							retain__process(db, branch, context, sub_qos, subscription_identifier, now);
+							retain__found(db, branch, queue, now);
 						}
 					}
 				}else{
 					if(branch->retained){
-						retain__process(db, branch, context, sub_qos, subscription_identifier, now);
+						retain__found(db, branch, queue, now);
 					}
 				}
+				retain__search_prune(retainhier, branch);
 			}
 		}
 	}
 	return flag;
 }
 
+
+static void retain__queue_free(struct mosquitto_db *db, struct mosquitto__retain_queue *queue)
+{
+	int i;
+
+	for(i=queue->pos; i<queue->count; i++){
+		db__msg_store_ref_dec(db, &queue->msgs[i]);
+	}
+	mosquitto__free(queue->msgs);
+	mosquitto__free(queue->sub);
+	mosquitto__free(queue);
+}
+
+
+/* Find the retained messages matching sub and queue them for context. With
+ * retained_delivery_batch set, only that many are sent now and the main loop
+ * sends the rest a batch at a time. */
 int sub__retain_queue(struct mosquitto_db *db, struct mosquitto *context, const char *sub, int sub_qos, uint32_t subscription_identifier)
 {
-	struct mosquitto__subhier *subhier;
-	struct sub__token *tokens = NULL, *tail;
-	time_t now;
+	struct mosquitto__retainhier *retainhier;
+	struct mosquitto__retain_queue *queue;
+	struct sub__token local[SUB_TOKENS_LOCAL];
+	struct sub__token *tokens = NULL;
 
 	assert(db);
 	assert(context);
 	assert(sub);
 
-	if(sub__topic_tokenise(sub, &tokens)) return 1;
+	if(sub__topic_tokenise(sub, local, &tokens)) return 1;
 
-	HASH_FIND(hh, db->subs, tokens->topic, tokens->topic_len, subhier);
+	/* Subscribing again sends them all again. */
+	sub__retain_queue_free(db, context, sub);
 
-	if(subhier){
-		now = time(NULL);
-		retain__search(db, subhier, tokens, context, sub, sub_qos, subscription_identifier, now, 0);
+	HASH_FIND(hh, db->retains, tokens->topic, tokens->topic_len, retainhier);
+	if(!retainhier){
+		sub__topic_tokens_free(tokens, local);
+		return MOSQ_ERR_SUCCESS;
 	}
-	while(tokens){
-		tail = tokens->next;
-		mosquitto__free(tokens->topic);
-		mosquitto__free(tokens);
-		tokens = tail;
+
+	queue = mosquitto__calloc(1, sizeof(struct mosquitto__retain_queue));
+	if(!queue){
+		sub__topic_tokens_free(tokens, local);
+		return MOSQ_ERR_NOMEM;
 	}
+	retain__search(db, retainhier, tokens, queue, time(NULL), 0);
+	sub__topic_tokens_free(tokens, local);
+
+	if(queue->count == 0){
+		retain__queue_free(db, queue);
+		return MOSQ_ERR_SUCCESS;
+	}
+	queue->sub = mosquitto__strdup(sub);
+	if(!queue->sub){
+		retain__queue_free(db, queue);
+		return MOSQ_ERR_NOMEM;
+	}
+	queue->qos = sub_qos;
+	queue->identifier = subscription_identifier;
+	DL_APPEND(context->retain_queue, queue);
+
+	sub__retain_queue_send(db, context, db->config->retained_delivery_batch);
 
 	return MOSQ_ERR_SUCCESS;
 }
 
+
+/* Send up to limit of the retained messages queued for context, or all of
+ * them if limit is 0. */
+void sub__retain_queue_send(struct mosquitto_db *db, struct mosquitto *context, int limit)
+{
+	struct mosquitto__retain_queue *queue;
+	struct mosquitto_msg_store *stored;
+	struct retain__source source;
+	time_t now;
+	int sent = 0;
+
+	memset(&source, 0, sizeof(struct retain__source));
+	now = time(NULL);
+
+	while(context->retain_queue && (limit == 0 || sent < limit)){
+		queue = context->retain_queue;
+		stored = queue->msgs[queue->pos];
+		queue->pos++;
+
+		/* Messages replaced, removed or expired since they were found are
+		 * skipped. */
+		if(stored->is_retained
+				&& (stored->message_expiry_time == 0 || now < stored->message_expiry_time)){
+
+			retain__process(db, context, stored, queue->qos, queue->identifier, &source);
+			sent++;
+		}
+		db__msg_store_ref_dec(db, &stored);
+
+		if(queue->pos == queue->count){
+			DL_DELETE(context->retain_queue, queue);
+			retain__queue_free(db, queue);
+		}
+	}
+	retain__source_clear(db, &source);
+}
+
+
+/* Whether context has retained messages waiting and has finished sending
+ * the last batch, including any that were queued behind the in-flight
+ * limit. */
+bool sub__retain_queue_ready(struct mosquitto *context)
+{
+	return context->retain_queue
+		&& !context->current_out_packet
+		&& !context->out_packet
+		&& !context->msgs_out.queued;
+}
+
+
+/* Drop the retained messages waiting for context that were found for sub, or
+ * all of them if sub is NULL. */
+void sub__retain_queue_free(struct mosquitto_db *db, struct mosquitto *context, const char *sub)
+{
+	struct mosquitto__retain_queue *queue, *queue_tmp;
+
+	DL_FOREACH_SAFE(context->retain_queue, queue, queue_tmp){
+		if(!sub || !strcmp(queue->sub, sub)){
+			DL_DELETE(context->retain_queue, queue);
+			retain__queue_free(db, queue);
+		}
+	}
+}
+
@@ -44,6 +44,10 @@ unsigned long g_msgs_dropped = 0;
 int g_clients_expired = 0;
 unsigned int g_socket_connections = 0;
 unsigned int g_connection_count = 0;
+unsigned long g_acl_cache_hits = 0;
+unsigned long g_acl_cache_misses = 0;
+unsigned long g_sub_cache_hits = 0;
+unsigned long g_sub_cache_misses = 0;
 
 void sys_tree__init(struct mosquitto_db *db)
 {
@@ -131,6 +135,89 @@ static void sys_tree__update_memory(struct mosquitto_db *db, char *buf)
 }
 #endif
 
+/* Slab pools register themselves the first time they are used, always in the
+ * same order, so the position in the list identifies the pool. */
+#define SYS_TREE_POOLS 8
+
+static void sys_tree__update_pools(struct mosquitto_db *db, char *buf)
+{
+	static unsigned long pool_items[SYS_TREE_POOLS] = {-1, -1, -1, -1, -1, -1, -1, -1};
+	static unsigned long pool_bytes[SYS_TREE_POOLS] = {-1, -1, -1, -1, -1, -1, -1, -1};
+	struct mosquitto__pool *pool;
+	char topic[100];
+	unsigned long value_ul;
+	int i;
+
+	for(pool=memory__pool_list(), i=0; pool && i<SYS_TREE_POOLS; pool=pool->next, i++){
+		if(pool_items[i] != pool->items){
+			pool_items[i] = pool->items;
+			snprintf(topic, sizeof(topic), "$SYS/broker/heap/pools/%s/items", pool->name);
+			snprintf(buf, BUFLEN, "%lu", pool_items[i]);
+			db__messages_easy_queue(db, NULL, topic, SYS_TREE_QOS, strlen(buf), buf, 1, 60, NULL);
+		}
+		value_ul = memory__pool_bytes(pool);
+		if(pool_bytes[i] != value_ul){
+			pool_bytes[i] = value_ul;
+			snprintf(topic, sizeof(topic), "$SYS/broker/heap/pools/%s/bytes", pool->name);
+			snprintf(buf, BUFLEN, "%lu", pool_bytes[i]);
+			db__messages_easy_queue(db, NULL, topic, SYS_TREE_QOS, strlen(buf), buf, 1, 60, NULL);
+		}
+	}
+}
+
+#ifdef WITH_PERSISTENCE
+static void sys_tree__update_persistence(struct mosquitto_db *db, char *buf)
+{
+	static const char *state = NULL;
+	static time_t last_save = -1;
+	static unsigned long saves = -1;
+	static unsigned long failures = -1;
+	static unsigned long last_duration = -1;
+	struct mosquitto__persist_stats *stats = &db->persist_stats;
+	const char *new_state;
+
+	if(!db->config->persistence){
+		return;
+	}
+
+	if(stats->saving){
+		new_state = "saving";
+	}else if(stats->last_failed){
+		new_state = "failed";
+	}else{
+		new_state = "idle";
+	}
+	if(state != new_state){
+		state = new_state;
+		db__messages_easy_queue(db, NULL, "$SYS/broker/persistence/state", SYS_TREE_QOS, strlen(state), state, 1, 60, NULL);
+	}
+
+	if(last_save != stats->last_save){
+		last_save = stats->last_save;
+		snprintf(buf, BUFLEN, "%ld", (long)last_save);
+		db__messages_easy_queue(db, NULL, "$SYS/broker/persistence/last_save", SYS_TREE_QOS, strlen(buf), buf, 1, 60, NULL);
+	}
+
+	if(last_duration != stats->last_duration){
+		last_duration = stats->last_duration;
+		snprintf(buf, BUFLEN, "%lu", last_duration);
+		db__messages_easy_queue(db, NULL, "$SYS/broker/persistence/last_duration", SYS_TREE_QOS, strlen(buf), buf, 1, 60, NULL);
+	}
+
+	if(saves != stats->saves){
+		saves = stats->saves;
+		snprintf(buf, BUFLEN, "%lu", saves);
+		db__messages_easy_queue(db, NULL, "$SYS/broker/persistence/saves", SYS_TREE_QOS, strlen(buf), buf, 1, 60, NULL);
+	}
+
+	if(failures != stats->failures){
+		failures = stats->failures;
+		snprintf(buf, BUFLEN, "%lu", failures);
+		db__messages_easy_queue(db, NULL, "$SYS/broker/persistence/failures", SYS_TREE_QOS, strlen(buf), buf, 1, 60, NULL);
+	}
+}
+#endif
+
 static void calc_load(struct mosquitto_db *db, char *buf, const char *topic, bool initial, double exponent, double interval, double *current)
 {
 	double new_value;
@@ -176,6 +263,10 @@ void sys_tree__update(struct mosquitto_db *db, int interval, time_t start_time)
 	static int subscription_count = -1;
 	static int shared_subscription_count = -1;
 	static int retained_count = -1;
+	static unsigned long acl_cache_hits = -1;
+	static unsigned long acl_cache_misses = -1;
+	static unsigned long sub_cache_hits = -1;
+	static unsigned long sub_cache_misses = -1;
 
 	static double msgs_received_load1 = 0;
 	static double msgs_received_load5 = 0;
@@ -323,6 +414,10 @@ void sys_tree__update(struct mosquitto_db *db, int interval, time_t start_time)
 #ifdef REAL_WITH_MEMORY_TRACKING
 		sys_tree__update_memory(db, buf);
 #endif
+		sys_tree__update_pools(db, buf);
+#ifdef WITH_PERSISTENCE
+		sys_tree__update_persistence(db, buf);
+#endif
 
 		if(msgs_received != g_msgs_received){
 			msgs_received = g_msgs_received;
@@ -378,6 +473,30 @@ void sys_tree__update(struct mosquitto_db *db, int interval, time_t start_time)
 			db__messages_easy_queue(db, NULL, "$SYS/broker/publish/bytes/sent", SYS_TREE_QOS, strlen(buf), buf, 1, 60, NULL);
 		}
 
+		if(acl_cache_hits != g_acl_cache_hits){
+			acl_cache_hits = g_acl_cache_hits;
+			snprintf(buf, BUFLEN, "%lu", acl_cache_hits);
+			db__messages_easy_queue(db, NULL, "$SYS/broker/acl/cache/hits", SYS_TREE_QOS, strlen(buf), buf, 1, 60, NULL);
+		}
+
+		if(acl_cache_misses != g_acl_cache_misses){
+			acl_cache_misses = g_acl_cache_misses;
+			snprintf(buf, BUFLEN, "%lu", acl_cache_misses);
+			db__messages_easy_queue(db, NULL, "$SYS/broker/acl/cache/misses", SYS_TREE_QOS, strlen(buf), buf, 1, 60, NULL);
+		}
+
+		if(sub_cache_hits != g_sub_cache_hits){
+			sub_cache_hits = g_sub_cache_hits;
+			snprintf(buf, BUFLEN, "%lu", sub_cache_hits);
+			db__messages_easy_queue(db, NULL, "$SYS/broker/subscriptions/cache/hits", SYS_TREE_QOS, strlen(buf), buf, 1, 60, NULL);
+		}
+
+		if(sub_cache_misses != g_sub_cache_misses){
+			sub_cache_misses = g_sub_cache_misses;
+			snprintf(buf, BUFLEN, "%lu", sub_cache_misses);
+			db__messages_easy_queue(db, NULL, "$SYS/broker/subscriptions/cache/misses", SYS_TREE_QOS, strlen(buf), buf, 1, 60, NULL);
+		}
+
 		last_update = mosquitto_time();
 	}
 }
@@ -30,6 +30,10 @@ extern unsigned long g_msgs_dropped;
 extern int g_clients_expired;
 extern unsigned int g_socket_connections;
 extern unsigned int g_connection_count;
+extern unsigned long g_acl_cache_hits;
+extern unsigned long g_acl_cache_misses;
+extern unsigned long g_sub_cache_hits;
+extern unsigned long g_sub_cache_misses;
 
 #define G_BYTES_RECEIVED_INC(A) (g_bytes_received+=(A))
 #define G_BYTES_SENT_INC(A) (g_bytes_sent+=(A))
@@ -43,6 +47,10 @@ extern unsigned int g_connection_count;
 #define G_CLIENTS_EXPIRED_INC() (g_clients_expired++)
 #define G_SOCKET_CONNECTIONS_INC() (g_socket_connections++)
 #define G_CONNECTION_COUNT_INC() (g_connection_count++)
+#define G_ACL_CACHE_HITS_INC() (g_acl_cache_hits++)
+#define G_ACL_CACHE_MISSES_INC() (g_acl_cache_misses++)
+#define G_SUB_CACHE_HITS_INC() (g_sub_cache_hits++)
+#define G_SUB_CACHE_MISSES_INC() (g_sub_cache_misses++)
 
 #else
 
@@ -58,6 +66,10 @@ extern unsigned int g_connection_count;
 #define G_CLIENTS_EXPIRED_INC()
 #define G_SOCKET_CONNECTIONS_INC()
 #define G_CONNECTION_COUNT_INC()
+#define G_ACL_CACHE_HITS_INC()
+#define G_ACL_CACHE_MISSES_INC()
+#define G_SUB_CACHE_HITS_INC()
+#define G_SUB_CACHE_MISSES_INC()
 
 #endif
 
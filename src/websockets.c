@@ -346,7 +346,7 @@ static int callback_mqtt(struct libwebsocket_context *context,
 				}
 
 				packet__cleanup(packet);
-				mosquitto__free(packet);
+				packet__free(packet);
 
 				mosq->next_msg_out = mosquitto_time() + mosq->keepalive;
 			}
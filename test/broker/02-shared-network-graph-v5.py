@@ -0,0 +1,140 @@
+#!/usr/bin/env python3
+
+# Test whether unsubscribing from a shared subscription removes its sub edge
+# from the $NETWORK graph.
+#
+# Client 1 subscribes to $share/one/graph-test/#. The sub edge of graph-test/1
+# is created when the first message is delivered to it. After client 1
+# unsubscribes, the next delta on $NETWORK/delta should delete that edge.
+
+from mosq_test_helper import *
+import json
+
+def write_config(filename, port):
+    with open(filename, 'w') as f:
+        f.write("port %d\n" % (port))
+        f.write("graph_interval 1\n")
+        f.write("graph_delta true\n")
+
+def recv_all(sock, length):
+    data = b""
+    while len(data) < length:
+        chunk = sock.recv(length - len(data))
+        if len(chunk) == 0:
+            raise ValueError
+        data += chunk
+    return data
+
+def recv_packet(sock):
+    header = recv_all(sock, 1)
+    length = 0
+    multiplier = 1
+    while True:
+        byte = recv_all(sock, 1)
+        header += byte
+        length += (byte[0] & 0x7F) * multiplier
+        multiplier *= 128
+        if byte[0] & 0x80 == 0:
+            break
+    return header + recv_all(sock, length)
+
+def recv_publish(sock):
+    packet = recv_packet(sock)
+    if packet[0] & 0xF0 != 0x30:
+        raise ValueError
+    (body, length) = mosq_test.remaining_length(packet)
+    pos = 2 + struct.unpack("!H", body[0:2])[0]
+    # QoS 0, so no mid, then the property length and properties
+    props_len = 0
+    multiplier = 1
+    while True:
+        byte = body[pos]
+        pos += 1
+        props_len += (byte & 0x7F) * multiplier
+        multiplier *= 128
+        if byte & 0x80 == 0:
+            break
+    return body[pos+props_len:]
+
+# Client 1 may still be reading the messages sent to it.
+def do_unsubscribe(sock):
+    sock.send(unsubscribe1_packet)
+    for i in range(100):
+        packet = recv_packet(sock)
+        if packet[0] & 0xF0 != 0x30:
+            if not mosq_test.packet_matches("unsuback1", packet, unsuback1_packet):
+                raise ValueError
+            return
+    raise ValueError
+
+# Publishes until a delta has an event for the sub edge of client 1, so the
+# topic doesn't expire from the graph in the meantime. A delta is only
+# published if the graph changed, so one may not come every second.
+def wait_for_sub_event(graph_sock, pub_sock, op):
+    graph_sock.settimeout(1.5)
+    for i in range(20):
+        pub_sock.send(publish_packet)
+        try:
+            payload = recv_publish(graph_sock)
+        except socket.timeout:
+            continue
+        events = json.loads(payload.decode('utf-8'))["events"]
+        for event in events:
+            if event["type"] == "sub" and event["op"] == op \
+                    and event["topic"] == "graph-test/1" and event["client"] == "client1":
+                return
+    raise ValueError
+
+rc = 1
+keepalive = 60
+mid = 1
+
+connect1_packet = mosq_test.gen_connect("client1", keepalive=keepalive, proto_ver=5)
+connect2_packet = mosq_test.gen_connect("client2", keepalive=keepalive, proto_ver=5)
+connect3_packet = mosq_test.gen_connect("graph", keepalive=keepalive, proto_ver=5)
+connack_packet = mosq_test.gen_connack(rc=0, proto_ver=5)
+
+subscribe1_packet = mosq_test.gen_subscribe(mid, "$share/one/graph-test/#", 0, proto_ver=5)
+suback1_packet = mosq_test.gen_suback(mid, 0, proto_ver=5)
+
+subscribe3_packet = mosq_test.gen_subscribe(mid, "$NETWORK/delta", 0, proto_ver=5)
+suback3_packet = mosq_test.gen_suback(mid, 0, proto_ver=5)
+
+publish_packet = mosq_test.gen_publish("graph-test/1", qos=0, payload="message", proto_ver=5)
+
+mid = 2
+unsubscribe1_packet = mosq_test.gen_unsubscribe(mid, "$share/one/graph-test/#", proto_ver=5)
+unsuback1_packet = mosq_test.gen_unsuback(mid, proto_ver=5)
+
+port = mosq_test.get_port()
+conf_file = os.path.basename(__file__).replace('.py', '.conf')
+write_config(conf_file, port)
+broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+try:
+    graph_sock = mosq_test.do_client_connect(connect3_packet, connack_packet, timeout=10, port=port)
+    mosq_test.do_send_receive(graph_sock, subscribe3_packet, suback3_packet, "suback3")
+
+    sock1 = mosq_test.do_client_connect(connect1_packet, connack_packet, timeout=10, port=port)
+    mosq_test.do_send_receive(sock1, subscribe1_packet, suback1_packet, "suback1")
+
+    pub_sock = mosq_test.do_client_connect(connect2_packet, connack_packet, timeout=10, port=port)
+
+    wait_for_sub_event(graph_sock, pub_sock, "add")
+    do_unsubscribe(sock1)
+    wait_for_sub_event(graph_sock, pub_sock, "delete")
+
+    rc = 0
+
+    sock1.close()
+    pub_sock.close()
+    graph_sock.close()
+finally:
+    os.remove(conf_file)
+    broker.terminate()
+    broker.wait()
+    (stdo, stde) = broker.communicate()
+    if rc:
+        print(stde.decode('utf-8'))
+
+exit(rc)
@@ -0,0 +1,103 @@
+#!/usr/bin/env python3
+
+# Publish messages either side of the size the broker stops copying payloads
+# into each outgoing packet at, to QoS 0 and QoS 1 subscribers using MQTT
+# v3.1.1 and v5, and check that each gets the complete message. One QoS 1
+# subscriber disconnects without acknowledging and must get the message again
+# with the dup flag set.
+
+from mosq_test_helper import *
+
+def recv_all(sock, length):
+    data = b""
+    while len(data) < length:
+        chunk = sock.recv(length - len(data))
+        if len(chunk) == 0:
+            break
+        data += chunk
+    return data
+
+def expect_publish(sock, name, publish_packet):
+    packet = recv_all(sock, len(publish_packet))
+    if not mosq_test.packet_matches(name, packet, publish_packet):
+        raise ValueError
+
+def do_test():
+    rc = 1
+    keepalive = 60
+    topic = "large/test"
+    sizes = [10, 1023, 1024, 50000, 300000]
+
+    subs = [
+        ("large-sub-0", 0, 4),
+        ("large-sub-1", 1, 4),
+        ("large-sub-2", 0, 5),
+        ("large-sub-3", 1, 5),
+    ]
+
+    port = mosq_test.get_port()
+    broker = mosq_test.start_broker(filename=os.path.basename(__file__), port=port)
+
+    try:
+        socks = []
+        for (client_id, qos, proto_ver) in subs:
+            connect_packet = mosq_test.gen_connect(client_id, keepalive=keepalive, proto_ver=proto_ver)
+            connack_packet = mosq_test.gen_connack(rc=0, proto_ver=proto_ver)
+            subscribe_packet = mosq_test.gen_subscribe(1, topic, qos, proto_ver=proto_ver)
+            suback_packet = mosq_test.gen_suback(1, qos, proto_ver=proto_ver)
+
+            sock = mosq_test.do_client_connect(connect_packet, connack_packet, timeout=10, port=port)
+            mosq_test.do_send_receive(sock, subscribe_packet, suback_packet, "suback")
+            socks.append(sock)
+
+        # Persistent QoS 1 subscriber that doesn't acknowledge the first time
+        resub_connect_packet = mosq_test.gen_connect("large-resub", keepalive=keepalive, clean_session=False)
+        resub_connack1_packet = mosq_test.gen_connack(rc=0)
+        resub_connack2_packet = mosq_test.gen_connack(rc=0, flags=1)
+        resub_subscribe_packet = mosq_test.gen_subscribe(1, topic, 1)
+        resub_suback_packet = mosq_test.gen_suback(1, 1)
+        resub = mosq_test.do_client_connect(resub_connect_packet, resub_connack1_packet, timeout=10, port=port)
+        mosq_test.do_send_receive(resub, resub_subscribe_packet, resub_suback_packet, "resub suback")
+
+        pub = mosq_test.do_client_connect(mosq_test.gen_connect("large-pub"), mosq_test.gen_connack(rc=0), timeout=10, port=port)
+
+        for i in range(len(sizes)):
+            payload = "".join(chr(ord("a") + (i + j) % 26) for j in range(sizes[i]))
+            mid = i + 1
+            publish_packet = mosq_test.gen_publish(topic, qos=1, mid=mid, payload=payload)
+            puback_packet = mosq_test.gen_puback(mid)
+            mosq_test.do_send_receive(pub, publish_packet, puback_packet, "puback%d" % (i))
+
+            for ((client_id, qos, proto_ver), sock) in zip(subs, socks):
+                expected = mosq_test.gen_publish(topic, qos=qos, mid=mid, payload=payload, proto_ver=proto_ver)
+                expect_publish(sock, "%s publish%d" % (client_id, i), expected)
+                if qos == 1:
+                    sock.send(mosq_test.gen_puback(mid, proto_ver=proto_ver))
+
+            expected = mosq_test.gen_publish(topic, qos=1, mid=mid, payload=payload)
+            expect_publish(resub, "resub publish%d" % (i), expected)
+            if i == len(sizes) - 2:
+                # Go away without acknowledging, and come back for it
+                resub.close()
+                resub = mosq_test.do_client_connect(resub_connect_packet, resub_connack2_packet, timeout=10, port=port)
+                expected = mosq_test.gen_publish(topic, qos=1, mid=mid, payload=payload, dup=True)
+                expect_publish(resub, "resub dup publish%d" % (i), expected)
+            resub.send(mosq_test.gen_puback(mid))
+
+        for sock in socks + [resub, pub]:
+            mosq_test.do_ping(sock)
+
+        rc = 0
+
+        for sock in socks + [resub, pub]:
+            sock.close()
+    finally:
+        broker.terminate()
+        broker.wait()
+        (stdo, stde) = broker.communicate()
+        if rc:
+            print(stde.decode('utf-8'))
+            exit(rc)
+
+do_test()
+exit(0)
@@ -0,0 +1,88 @@
+#!/usr/bin/env python3
+
+# Send many packets of different sizes back to back in one go, some of them
+# larger than the broker's read buffer, then the same packets a few bytes at a
+# time, and check that every one of them is handled.
+
+from mosq_test_helper import *
+
+def recv_all(sock, length):
+    data = b""
+    while len(data) < length:
+        chunk = sock.recv(length - len(data))
+        if len(chunk) == 0:
+            break
+        data += chunk
+    return data
+
+def expect_publishes(sock, publish_packets):
+    for i in range(len(publish_packets)):
+        packet = recv_all(sock, len(publish_packets[i]))
+        if not mosq_test.packet_matches("publish%d" % (i), packet, publish_packets[i]):
+            raise ValueError
+
+def do_test():
+    rc = 1
+    keepalive = 60
+
+    connect1_packet = mosq_test.gen_connect("pipe-sub", keepalive=keepalive)
+    connect2_packet = mosq_test.gen_connect("pipe-pub", keepalive=keepalive)
+    connack_packet = mosq_test.gen_connack(rc=0)
+
+    mid = 1
+    subscribe_packet = mosq_test.gen_subscribe(mid, "pipe/test", 0)
+    suback_packet = mosq_test.gen_suback(mid, 0)
+
+    pingreq_packet = mosq_test.gen_pingreq()
+    pingresp_packet = mosq_test.gen_pingresp()
+
+    publish_packets = []
+    for i in range(1000):
+        if i % 100 == 99:
+            payload = "x" * (20000 + i)
+        else:
+            payload = ("%d-" % (i)) * (i % 50 + 1)
+        publish_packets.append(mosq_test.gen_publish("pipe/test", qos=0, payload=payload))
+
+    port = mosq_test.get_port()
+    # Without -v, so that thousands of debug lines do not fill the stderr pipe
+    cmd = ['../../src/mosquitto', '-p', str(port)]
+    broker = mosq_test.start_broker(filename=os.path.basename(__file__), cmd=cmd, port=port)
+
+    try:
+        sock = mosq_test.do_client_connect(connect1_packet, connack_packet, timeout=10, port=port)
+        mosq_test.do_send_receive(sock, subscribe_packet, suback_packet, "suback")
+
+        # CONNECT, all of the PUBLISHes and a PINGREQ in one send
+        pub = socket.create_connection(("localhost", port))
+        pub.settimeout(10)
+        pub.sendall(connect2_packet + b"".join(publish_packets) + pingreq_packet)
+        if not mosq_test.expect_packet(pub, "connack", connack_packet):
+            raise ValueError
+        if not mosq_test.expect_packet(pub, "pingresp", pingresp_packet):
+            raise ValueError
+        expect_publishes(sock, publish_packets)
+
+        # The first hundred again, split at every seventh byte
+        data = b"".join(publish_packets[0:100]) + pingreq_packet
+        for i in range(0, len(data), 7):
+            pub.send(data[i:i+7])
+        if not mosq_test.expect_packet(pub, "pingresp", pingresp_packet):
+            raise ValueError
+        expect_publishes(sock, publish_packets[0:100])
+        mosq_test.do_ping(sock)
+
+        rc = 0
+
+        pub.close()
+        sock.close()
+    finally:
+        broker.terminate()
+        broker.wait()
+        (stdo, stde) = broker.communicate()
+        if rc:
+            print(stde.decode('utf-8'))
+            exit(rc)
+
+do_test()
+exit(0)
@@ -0,0 +1,74 @@
+#!/usr/bin/env python3
+
+# Publish many messages of different sizes to a subscriber that does not read
+# until they are all sent, so the broker has to queue them, and check that
+# they all arrive intact and in order.
+
+from mosq_test_helper import *
+
+def recv_all(sock, length):
+    data = b""
+    while len(data) < length:
+        chunk = sock.recv(length - len(data))
+        if len(chunk) == 0:
+            break
+        data += chunk
+    return data
+
+def do_test():
+    rc = 1
+    keepalive = 60
+    count = 5000
+
+    connect1_packet = mosq_test.gen_connect("slow-sub", keepalive=keepalive)
+    connect2_packet = mosq_test.gen_connect("slow-pub", keepalive=keepalive)
+    connack_packet = mosq_test.gen_connack(rc=0)
+
+    mid = 1
+    subscribe_packet = mosq_test.gen_subscribe(mid, "slow/test", 0)
+    suback_packet = mosq_test.gen_suback(mid, 0)
+
+    publish_packets = []
+    for i in range(count):
+        payload = ("%d-" % (i)) * (i % 300 + 1)
+        publish_packets.append(mosq_test.gen_publish("slow/test", qos=0, payload=payload))
+
+    port = mosq_test.get_port()
+    # Without -v, so that thousands of debug lines do not fill the stderr pipe
+    cmd = ['../../src/mosquitto', '-p', str(port)]
+    broker = mosq_test.start_broker(filename=os.path.basename(__file__), cmd=cmd, port=port)
+
+    try:
+        sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4096)
+        sock.settimeout(10)
+        sock.connect(("localhost", port))
+        sock.send(connect1_packet)
+        if not mosq_test.expect_packet(sock, "connack", connack_packet):
+            raise ValueError
+        mosq_test.do_send_receive(sock, subscribe_packet, suback_packet, "suback")
+
+        pub = mosq_test.do_client_connect(connect2_packet, connack_packet, port=port)
+        pub.sendall(b"".join(publish_packets))
+        mosq_test.do_ping(pub)
+
+        for i in range(count):
+            packet = recv_all(sock, len(publish_packets[i]))
+            if not mosq_test.packet_matches("publish%d" % (i), packet, publish_packets[i]):
+                raise ValueError
+        mosq_test.do_ping(sock)
+
+        rc = 0
+
+        pub.close()
+        sock.close()
+    finally:
+        broker.terminate()
+        broker.wait()
+        (stdo, stde) = broker.communicate()
+        if rc:
+            print(stde.decode('utf-8'))
+            exit(rc)
+
+do_test()
+exit(0)
@@ -0,0 +1,93 @@
+#!/usr/bin/env python3
+
+# Publish repeatedly to one topic while subscriptions that match it are added
+# and removed, and check that each message goes to exactly the clients that
+# are subscribed at the time it is published.
+
+from mosq_test_helper import *
+
+def do_test():
+    rc = 1
+    keepalive = 60
+
+    connect1_packet = mosq_test.gen_connect("sub-change-1", keepalive=keepalive)
+    connect2_packet = mosq_test.gen_connect("sub-change-2", keepalive=keepalive)
+    connect3_packet = mosq_test.gen_connect("sub-change-pub", keepalive=keepalive)
+    connack_packet = mosq_test.gen_connack(rc=0)
+
+    mid = 1
+    subscribe1_packet = mosq_test.gen_subscribe(mid, "change/test", 0)
+    suback1_packet = mosq_test.gen_suback(mid, 0)
+
+    mid = 2
+    subscribe2_packet = mosq_test.gen_subscribe(mid, "change/+", 0)
+    suback2_packet = mosq_test.gen_suback(mid, 0)
+
+    mid = 3
+    unsubscribe1_packet = mosq_test.gen_unsubscribe(mid, "change/test")
+    unsuback1_packet = mosq_test.gen_unsuback(mid)
+
+    mid = 4
+    subscribe3_packet = mosq_test.gen_subscribe(mid, "change/#", 0)
+    suback3_packet = mosq_test.gen_suback(mid, 0)
+
+    publish_packets = []
+    for i in range(8):
+        publish_packets.append(mosq_test.gen_publish("change/test", qos=0, payload="message%d" % (i)))
+
+    port = mosq_test.get_port()
+    broker = mosq_test.start_broker(filename=os.path.basename(__file__), port=port)
+
+    try:
+        sock1 = mosq_test.do_client_connect(connect1_packet, connack_packet, port=port)
+        mosq_test.do_send_receive(sock1, subscribe1_packet, suback1_packet, "suback1")
+        pub = mosq_test.do_client_connect(connect3_packet, connack_packet, port=port)
+
+        # The same topic several times in a row, only client 1 is subscribed
+        for i in range(3):
+            pub.send(publish_packets[i])
+            if not mosq_test.expect_packet(sock1, "publish%d" % (i), publish_packets[i]):
+                raise ValueError
+
+        # A second matching subscription
+        sock2 = mosq_test.do_client_connect(connect2_packet, connack_packet, port=port)
+        mosq_test.do_send_receive(sock2, subscribe2_packet, suback2_packet, "suback2")
+        for i in range(3, 5):
+            pub.send(publish_packets[i])
+            if not mosq_test.expect_packet(sock1, "publish%d" % (i), publish_packets[i]):
+                raise ValueError
+            if not mosq_test.expect_packet(sock2, "publish%d" % (i), publish_packets[i]):
+                raise ValueError
+
+        # Client 1 unsubscribes
+        mosq_test.do_send_receive(sock1, unsubscribe1_packet, unsuback1_packet, "unsuback1")
+        pub.send(publish_packets[5])
+        if not mosq_test.expect_packet(sock2, "publish5", publish_packets[5]):
+            raise ValueError
+        mosq_test.do_ping(sock1)
+
+        # Client 2 goes away with its clean session, client 1 subscribes again
+        sock2.close()
+        mosq_test.do_ping(pub)
+        pub.send(publish_packets[6])
+        mosq_test.do_ping(sock1)
+        mosq_test.do_send_receive(sock1, subscribe3_packet, suback3_packet, "suback3")
+        pub.send(publish_packets[7])
+        if not mosq_test.expect_packet(sock1, "publish7", publish_packets[7]):
+            raise ValueError
+        mosq_test.do_ping(sock1)
+
+        rc = 0
+
+        pub.close()
+        sock1.close()
+    finally:
+        broker.terminate()
+        broker.wait()
+        (stdo, stde) = broker.communicate()
+        if rc:
+            print(stde.decode('utf-8'))
+            exit(rc)
+
+do_test()
+exit(0)
@@ -0,0 +1,79 @@
+#!/usr/bin/env python3
+
+# Test whether retained messages not yet sent in batches with
+# retained_delivery_batch are kept when a persistent session disconnects, and
+# sent once it reconnects.
+
+from mosq_test_helper import *
+
+def write_config(filename, port):
+    with open(filename, 'w') as f:
+        f.write("port %d\n" % (port))
+        f.write("max_inflight_messages 2\n")
+        f.write("retained_delivery_batch 2\n")
+
+def do_publish(sock, mid, topic, payload):
+    publish_packet = mosq_test.gen_publish(topic, qos=1, mid=mid, payload=payload, retain=True)
+    puback_packet = mosq_test.gen_puback(mid)
+    mosq_test.do_send_receive(sock, publish_packet, puback_packet, "puback")
+
+def expect_publish(sock, mid, topic, payload, dup=False):
+    publish_packet = mosq_test.gen_publish(topic, qos=1, mid=mid, payload=payload, retain=True, dup=dup)
+    if not mosq_test.expect_packet(sock, "publish %d" % (mid), publish_packet):
+        raise ValueError
+
+port = mosq_test.get_port()
+conf_file = os.path.basename(__file__).replace('.py', '.conf')
+write_config(conf_file, port)
+
+rc = 1
+pub_connect_packet = mosq_test.gen_connect("retain-resume-pub", keepalive=60)
+sub_connect_packet = mosq_test.gen_connect("retain-resume-sub", keepalive=60, clean_session=False)
+connack_packet = mosq_test.gen_connack(rc=0)
+connack_resumed_packet = mosq_test.gen_connack(flags=1, rc=0)
+
+mid = 5
+subscribe_packet = mosq_test.gen_subscribe(mid, "resume/#", 1)
+suback_packet = mosq_test.gen_suback(mid, 1)
+
+broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+try:
+    pub_sock = mosq_test.do_client_connect(pub_connect_packet, connack_packet, port=port)
+    for i in range(1, 6):
+        do_publish(pub_sock, i, "resume/%d" % (i), "message %d" % (i))
+
+    sock = mosq_test.do_client_connect(sub_connect_packet, connack_packet, port=port)
+    mosq_test.do_send_receive(sock, subscribe_packet, suback_packet, "suback")
+
+    expect_publish(sock, 1, "resume/1", "message 1")
+    expect_publish(sock, 2, "resume/2", "message 2")
+    sock.close()
+
+    # The two in flight messages are sent again, then the rest of the batches.
+    sock = mosq_test.do_client_connect(sub_connect_packet, connack_resumed_packet, port=port)
+    expect_publish(sock, 1, "resume/1", "message 1", dup=True)
+    expect_publish(sock, 2, "resume/2", "message 2", dup=True)
+    sock.send(mosq_test.gen_puback(1))
+    sock.send(mosq_test.gen_puback(2))
+    expect_publish(sock, 3, "resume/3", "message 3")
+    expect_publish(sock, 4, "resume/4", "message 4")
+    sock.send(mosq_test.gen_puback(3))
+    sock.send(mosq_test.gen_puback(4))
+    expect_publish(sock, 5, "resume/5", "message 5")
+    sock.send(mosq_test.gen_puback(5))
+    mosq_test.do_ping(sock)
+
+    rc = 0
+
+    sock.close()
+    pub_sock.close()
+finally:
+    os.remove(conf_file)
+    broker.terminate()
+    broker.wait()
+    (stdo, stde) = broker.communicate()
+    if rc:
+        print(stde.decode('utf-8'))
+
+exit(rc)
@@ -0,0 +1,84 @@
+#!/usr/bin/env python3
+
+# Test whether retained messages are sent in batches with
+# retained_delivery_batch set. Only two messages can be in flight, so the third
+# batch waits for the subscriber to acknowledge messages. A retained message
+# replaced before its batch is sent is skipped, the subscriber gets the new
+# one through its subscription instead.
+
+from mosq_test_helper import *
+
+def write_config(filename, port):
+    with open(filename, 'w') as f:
+        f.write("port %d\n" % (port))
+        f.write("max_inflight_messages 2\n")
+        f.write("retained_delivery_batch 2\n")
+
+def do_publish(sock, mid, topic, payload):
+    publish_packet = mosq_test.gen_publish(topic, qos=1, mid=mid, payload=payload, retain=True)
+    puback_packet = mosq_test.gen_puback(mid)
+    mosq_test.do_send_receive(sock, publish_packet, puback_packet, "puback")
+
+def expect_publish(sock, mid, topic, payload, retain):
+    publish_packet = mosq_test.gen_publish(topic, qos=1, mid=mid, payload=payload, retain=retain)
+    if not mosq_test.expect_packet(sock, "publish %d" % (mid), publish_packet):
+        raise ValueError
+
+port = mosq_test.get_port()
+conf_file = os.path.basename(__file__).replace('.py', '.conf')
+write_config(conf_file, port)
+
+rc = 1
+pub_connect_packet = mosq_test.gen_connect("retain-batch-pub", keepalive=60)
+sub_connect_packet = mosq_test.gen_connect("retain-batch-sub", keepalive=60)
+connack_packet = mosq_test.gen_connack(rc=0)
+
+mid = 5
+subscribe_packet = mosq_test.gen_subscribe(mid, "batch/#", 1)
+suback_packet = mosq_test.gen_suback(mid, 1)
+
+broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+try:
+    pub_sock = mosq_test.do_client_connect(pub_connect_packet, connack_packet, port=port)
+    for i in range(1, 8):
+        do_publish(pub_sock, i, "batch/%d" % (i), "message %d" % (i))
+    do_publish(pub_sock, 8, "batch/3", "")
+
+    sock = mosq_test.do_client_connect(sub_connect_packet, connack_packet, port=port)
+    mosq_test.do_send_receive(sock, subscribe_packet, suback_packet, "suback")
+
+    expect_publish(sock, 1, "batch/1", "message 1", True)
+    expect_publish(sock, 2, "batch/2", "message 2", True)
+
+    # batch/4 and batch/5 are queued behind them by now, batch/6 and batch/7
+    # are not.
+    do_publish(pub_sock, 9, "batch/6", "message 6 replaced")
+
+    sock.send(mosq_test.gen_puback(1))
+    expect_publish(sock, 3, "batch/4", "message 4", True)
+    sock.send(mosq_test.gen_puback(2))
+    expect_publish(sock, 4, "batch/5", "message 5", True)
+    sock.send(mosq_test.gen_puback(3))
+    expect_publish(sock, 5, "batch/6", "message 6 replaced", False)
+    sock.send(mosq_test.gen_puback(4))
+    expect_publish(sock, 6, "batch/7", "message 7", True)
+    sock.send(mosq_test.gen_puback(5))
+    sock.send(mosq_test.gen_puback(6))
+
+    # Nothing else is sent, the old batch/6 was skipped.
+    mosq_test.do_ping(sock)
+
+    rc = 0
+
+    sock.close()
+    pub_sock.close()
+finally:
+    os.remove(conf_file)
+    broker.terminate()
+    broker.wait()
+    (stdo, stde) = broker.communicate()
+    if rc:
+        print(stde.decode('utf-8'))
+
+exit(rc)
@@ -0,0 +1,37 @@
+#!/usr/bin/env python3
+
+# Test whether a retained PUBLISH to a topic under a $ root other than $SYS,
+# which nothing has subscribed to yet, is retained.
+
+from mosq_test_helper import *
+
+rc = 1
+keepalive = 60
+mid = 16
+connect_packet = mosq_test.gen_connect("retain-dollar-test", keepalive=keepalive)
+connack_packet = mosq_test.gen_connack(rc=0)
+
+publish_packet = mosq_test.gen_publish("$retain/dollar/test", qos=0, payload="retained message", retain=True)
+subscribe_packet = mosq_test.gen_subscribe(mid, "$retain/#", 0)
+suback_packet = mosq_test.gen_suback(mid, 0)
+
+port = mosq_test.get_port()
+broker = mosq_test.start_broker(filename=os.path.basename(__file__), port=port)
+
+try:
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet, port=port)
+    sock.send(publish_packet)
+    mosq_test.do_send_receive(sock, subscribe_packet, suback_packet, "suback")
+
+    if mosq_test.expect_packet(sock, "publish", publish_packet):
+        rc = 0
+
+    sock.close()
+finally:
+    broker.terminate()
+    broker.wait()
+    (stdo, stde) = broker.communicate()
+    if rc:
+        print(stde.decode('utf-8'))
+
+exit(rc)
@@ -0,0 +1,102 @@
+#!/usr/bin/env python3
+
+# Check whether messages stop being delivered to a client that stays connected
+# when its access is revoked, after it has already received messages on the
+# topic.
+
+from mosq_test_helper import *
+import signal
+
+def write_config(filename, port, per_listener):
+    with open(filename, 'w') as f:
+        f.write("per_listener_settings %s\n" % (per_listener))
+        f.write("port %d\n" % (port))
+        f.write("acl_file %s\n" % (filename.replace('.conf', '.acl')))
+
+def write_acl(filename, en):
+    with open(filename, 'w') as f:
+        f.write('user username\n')
+        f.write('topic read topic/one\n')
+        if en:
+            f.write('topic read topic/two\n')
+        f.write('user helper\n')
+        f.write('topic write topic/#\n')
+
+def do_test(per_listener):
+    keepalive = 60
+    username = "username"
+
+    connect1_packet = mosq_test.gen_connect("acl-check", keepalive=keepalive, username=username)
+    connack1_packet = mosq_test.gen_connack(rc=0)
+
+    mid = 1
+    subscribe1_packet = mosq_test.gen_subscribe(mid=mid, topic="topic/one", qos=0)
+    suback1_packet = mosq_test.gen_suback(mid=mid, qos=0)
+
+    mid = 2
+    subscribe2_packet = mosq_test.gen_subscribe(mid=mid, topic="topic/two", qos=0)
+    suback2_packet = mosq_test.gen_suback(mid=mid, qos=0)
+
+    connect2_packet = mosq_test.gen_connect("helper", keepalive=keepalive, username="helper")
+    connack2_packet = mosq_test.gen_connack(rc=0)
+
+    publish1_packet = mosq_test.gen_publish(topic="topic/one", qos=0, payload="message1")
+    publish2_packet = mosq_test.gen_publish(topic="topic/two", qos=0, payload="message2")
+    publish3_packet = mosq_test.gen_publish(topic="topic/two", qos=0, payload="message3")
+    publish4_packet = mosq_test.gen_publish(topic="topic/one", qos=0, payload="message4")
+
+    port = mosq_test.get_port()
+
+    conf_file = os.path.basename(__file__).replace('.py', '.conf')
+    write_config(conf_file, port, per_listener)
+
+    acl_file = os.path.basename(__file__).replace('.py', '.acl')
+    write_acl(acl_file, True)
+
+    rc = 1
+    broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+    try:
+        sock = mosq_test.do_client_connect(connect1_packet, connack1_packet, port=port)
+        mosq_test.do_send_receive(sock, subscribe1_packet, suback1_packet, "suback1")
+        mosq_test.do_send_receive(sock, subscribe2_packet, suback2_packet, "suback2")
+
+        helper = mosq_test.do_client_connect(connect2_packet, connack2_packet, port=port)
+
+        # Both topics are readable, the decisions are remembered
+        helper.send(publish1_packet)
+        if not mosq_test.expect_packet(sock, "publish1", publish1_packet):
+            raise ValueError
+        helper.send(publish2_packet)
+        if not mosq_test.expect_packet(sock, "publish2", publish2_packet):
+            raise ValueError
+
+        # Reload ACLs with topic/two now disabled
+        write_acl(acl_file, False)
+        broker.send_signal(signal.SIGHUP)
+        time.sleep(1)
+
+        # The helper may still write to topic/two, but the client may not
+        # read it any more, only topic/one arrives
+        helper.send(publish3_packet)
+        helper.send(publish4_packet)
+        if not mosq_test.expect_packet(sock, "publish4", publish4_packet):
+            raise ValueError
+        mosq_test.do_ping(sock)
+
+        helper.close()
+        sock.close()
+        rc = 0
+
+    finally:
+        os.remove(conf_file)
+        os.remove(acl_file)
+        broker.terminate()
+        broker.wait()
+        (stdo, stde) = broker.communicate()
+        if rc:
+            print(stde.decode('utf-8'))
+            exit(rc)
+
+do_test("false")
+do_test("true")
@@ -0,0 +1,89 @@
+#!/usr/bin/env python3
+
+# Check that topic and pattern ACLs with + and # wildcards allow exactly the
+# topics they match, including the parent level of # and empty levels.
+
+from mosq_test_helper import *
+
+def write_config(filename, port, per_listener):
+    with open(filename, 'w') as f:
+        f.write("per_listener_settings %s\n" % (per_listener))
+        f.write("port %d\n" % (port))
+        f.write("acl_file %s\n" % (filename.replace('.conf', '.acl')))
+
+def write_acl(filename):
+    with open(filename, 'w') as f:
+        f.write('user username\n')
+        f.write('topic readwrite a/+/c\n')
+        f.write('topic readwrite b/#\n')
+        f.write('topic readwrite +/d/+/#\n')
+        f.write('topic read e/f\n')
+        f.write('topic write e/+\n')
+        f.write('pattern readwrite p/%c/+\n')
+
+def do_test(per_listener):
+    # Topic, whether the client may both write and read it
+    topics = [
+        ("a/b/c", True),
+        ("a//c", True),
+        ("a/b/c/d", False),
+        ("a/c", False),
+        ("b", True),
+        ("b/x/y", True),
+        ("bb/x", False),
+        ("x/d/y", True),
+        ("x/d/y/z", True),
+        ("x/d", False),
+        ("e/f", True),
+        ("e/g", False),
+        ("p/acl-check/q", True),
+        ("p/other/q", False),
+        ("p/acl-check", False),
+    ]
+
+    keepalive = 60
+    connect_packet = mosq_test.gen_connect("acl-check", keepalive=keepalive, username="username")
+    connack_packet = mosq_test.gen_connack(rc=0)
+
+    mid = 1
+    subscribe_packet = mosq_test.gen_subscribe(mid=mid, topic="#", qos=0)
+    suback_packet = mosq_test.gen_suback(mid=mid, qos=0)
+
+    port = mosq_test.get_port()
+
+    conf_file = os.path.basename(__file__).replace('.py', '.conf')
+    write_config(conf_file, port, per_listener)
+
+    acl_file = os.path.basename(__file__).replace('.py', '.acl')
+    write_acl(acl_file)
+
+    rc = 1
+    broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+    try:
+        sock = mosq_test.do_client_connect(connect_packet, connack_packet, port=port)
+        mosq_test.do_send_receive(sock, subscribe_packet, suback_packet, "suback")
+
+        for (topic, allowed) in topics:
+            publish_packet = mosq_test.gen_publish(topic=topic, qos=0, payload="message")
+            sock.send(publish_packet)
+            if allowed:
+                if not mosq_test.expect_packet(sock, topic, publish_packet):
+                    raise ValueError
+        mosq_test.do_ping(sock)
+
+        sock.close()
+        rc = 0
+
+    finally:
+        os.remove(conf_file)
+        os.remove(acl_file)
+        broker.terminate()
+        broker.wait()
+        (stdo, stde) = broker.communicate()
+        if rc:
+            print(stde.decode('utf-8'))
+            exit(rc)
+
+do_test("false")
+do_test("true")
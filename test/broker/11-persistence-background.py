@@ -0,0 +1,110 @@
+#!/usr/bin/env python3
+
+# Test whether an autosave with autosave_background writes a usable database
+# from a child process, and whether its completion is reported on
+# $SYS/broker/persistence/saves. The broker is killed once the save is
+# reported, so the retained message can only come back from the database the
+# child wrote.
+
+from mosq_test_helper import *
+import signal
+
+def write_config(filename, port):
+    with open(filename, 'w') as f:
+        f.write("port %d\n" % (port))
+        f.write("persistence true\n")
+        f.write("persistence_file mosquitto-%d.db\n" % (port))
+        f.write("autosave_interval 1\n")
+        f.write("autosave_background true\n")
+        f.write("sys_interval 1\n")
+
+def read_publish(sock):
+    header = sock.recv(1)
+    if len(header) == 0:
+        raise ValueError
+    length = 0
+    mult = 1
+    while True:
+        byte = sock.recv(1)[0]
+        length += (byte & 127) * mult
+        mult *= 128
+        if byte & 128 == 0:
+            break
+    body = b""
+    while len(body) < length:
+        body += sock.recv(length - len(body))
+    if header[0] & 0xF0 != 0x30:
+        return (None, None)
+    topic_len = struct.unpack("!H", body[0:2])[0]
+    return (body[2:2+topic_len].decode('utf-8'), body[2+topic_len:])
+
+def wait_for_save(sock):
+    # The saves count is published as 0 before the first save completes
+    start = time.time()
+    while time.time() < start + 10:
+        (topic, payload) = read_publish(sock)
+        if topic == "$SYS/broker/persistence/saves" and payload != b"0":
+            return
+    raise ValueError
+
+def remove_db(port):
+    for f in ['mosquitto-%d.db' % (port), 'mosquitto-%d.db.new' % (port)]:
+        if os.path.exists(f):
+            os.unlink(f)
+
+port = mosq_test.get_port()
+conf_file = os.path.basename(__file__).replace('.py', '.conf')
+write_config(conf_file, port)
+
+rc = 1
+keepalive = 60
+connect_packet = mosq_test.gen_connect("persistence-bg-test", keepalive=keepalive)
+connack_packet = mosq_test.gen_connack(rc=0)
+
+mid = 1
+subscribe_sys_packet = mosq_test.gen_subscribe(mid, "$SYS/broker/persistence/saves", 0)
+suback_sys_packet = mosq_test.gen_suback(mid, 0)
+
+mid = 2
+subscribe_packet = mosq_test.gen_subscribe(mid, "background/retained", 0)
+suback_packet = mosq_test.gen_suback(mid, 0)
+
+mid = 3
+publish_packet = mosq_test.gen_publish("background/retained", qos=1, mid=mid, payload="retained message", retain=True)
+puback_packet = mosq_test.gen_puback(mid)
+publish_packet_r = mosq_test.gen_publish("background/retained", qos=0, payload="retained message", retain=True)
+
+remove_db(port)
+
+broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+try:
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet, timeout=20, port=port)
+    mosq_test.do_send_receive(sock, publish_packet, puback_packet, "puback")
+    mosq_test.do_send_receive(sock, subscribe_sys_packet, suback_sys_packet, "suback sys")
+    wait_for_save(sock)
+    sock.close()
+
+    broker.send_signal(signal.SIGKILL)
+    broker.wait()
+    broker.communicate()
+    broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet, timeout=20, port=port)
+    mosq_test.do_send_receive(sock, subscribe_packet, suback_packet, "suback")
+    if not mosq_test.expect_packet(sock, "retained", publish_packet_r):
+        raise ValueError
+    sock.close()
+
+    rc = 0
+finally:
+    os.remove(conf_file)
+    broker.terminate()
+    broker.wait()
+    (stdo, stde) = broker.communicate()
+    if rc:
+        print(stde.decode('utf-8'))
+    remove_db(port)
+
+
+exit(rc)
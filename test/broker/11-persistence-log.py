@@ -0,0 +1,125 @@
+#!/usr/bin/env python3
+
+# Test whether changes made since the last save of the persistence database
+# survive the broker being killed, when persistence_log is enabled. A durable
+# client has two queued messages and a retained message is set. The broker is
+# killed before it can save, restarted, and the client acknowledges the first
+# message. After a second kill and restart only the second message must be
+# delivered again, and the retained message must still be there.
+
+from mosq_test_helper import *
+import signal
+
+def write_config(filename, port):
+    with open(filename, 'w') as f:
+        f.write("port %d\n" % (port))
+        f.write("persistence true\n")
+        f.write("persistence_log true\n")
+        f.write("persistence_file mosquitto-%d.db\n" % (port))
+        f.write("autosave_interval 3600\n")
+
+def kill_broker(broker):
+    broker.send_signal(signal.SIGKILL)
+    broker.wait()
+    return broker.communicate()
+
+def remove_db(port):
+    for f in ['mosquitto-%d.db' % (port), 'mosquitto-%d.db.log' % (port)]:
+        if os.path.exists(f):
+            os.unlink(f)
+
+port = mosq_test.get_port()
+conf_file = os.path.basename(__file__).replace('.py', '.conf')
+write_config(conf_file, port)
+
+rc = 1
+keepalive = 60
+connect_packet = mosq_test.gen_connect("persistence-log-test", keepalive=keepalive, clean_session=False)
+connack_packet = mosq_test.gen_connack(rc=0)
+connack_packet2 = mosq_test.gen_connack(rc=0, flags=1)  # session present
+
+pub_connect_packet = mosq_test.gen_connect("persistence-log-pub", keepalive=keepalive)
+sub_connect_packet = mosq_test.gen_connect("persistence-log-sub", keepalive=keepalive)
+
+mid = 1
+subscribe_packet = mosq_test.gen_subscribe(mid, "log/queued", 1)
+suback_packet = mosq_test.gen_suback(mid, 1)
+
+mid = 2
+subscribe_retain_packet = mosq_test.gen_subscribe(mid, "log/retained", 0)
+suback_retain_packet = mosq_test.gen_suback(mid, 0)
+
+mid = 10
+publish_retain_packet = mosq_test.gen_publish("log/retained", qos=1, mid=mid, payload="retained message", retain=True)
+puback_retain_packet = mosq_test.gen_puback(mid)
+publish_retain_packet_r = mosq_test.gen_publish("log/retained", qos=0, payload="retained message", retain=True)
+
+mid = 11
+publish1_packet = mosq_test.gen_publish("log/queued", qos=1, mid=mid, payload="message1")
+puback1_packet = mosq_test.gen_puback(mid)
+mid = 12
+publish2_packet = mosq_test.gen_publish("log/queued", qos=1, mid=mid, payload="message2")
+puback2_packet = mosq_test.gen_puback(mid)
+
+publish1_packet_r = mosq_test.gen_publish("log/queued", qos=1, mid=1, payload="message1")
+publish2_packet_r = mosq_test.gen_publish("log/queued", qos=1, mid=2, payload="message2")
+publish2_packet_dup = mosq_test.gen_publish("log/queued", qos=1, mid=2, payload="message2", dup=True)
+puback1_packet_r = mosq_test.gen_puback(1)
+
+remove_db(port)
+
+broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+try:
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet, timeout=20, port=port)
+    mosq_test.do_send_receive(sock, subscribe_packet, suback_packet, "suback")
+    sock.close()
+
+    pub = mosq_test.do_client_connect(pub_connect_packet, connack_packet, timeout=20, port=port)
+    mosq_test.do_send_receive(pub, publish_retain_packet, puback_retain_packet, "puback retain")
+    mosq_test.do_send_receive(pub, publish1_packet, puback1_packet, "puback1")
+    mosq_test.do_send_receive(pub, publish2_packet, puback2_packet, "puback2")
+    pub.close()
+
+    # The log is flushed once per main loop iteration
+    time.sleep(0.5)
+    kill_broker(broker)
+    broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet2, timeout=20, port=port)
+    if not mosq_test.expect_packet(sock, "publish1", publish1_packet_r):
+        raise ValueError
+    if not mosq_test.expect_packet(sock, "publish2", publish2_packet_r):
+        raise ValueError
+    sock.send(puback1_packet_r)
+    mosq_test.do_ping(sock)
+    sock.close()
+
+    time.sleep(0.5)
+    kill_broker(broker)
+    broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet2, timeout=20, port=port)
+    if not mosq_test.expect_packet(sock, "publish2 dup", publish2_packet_dup):
+        raise ValueError
+    mosq_test.do_ping(sock)
+    sock.close()
+
+    sub = mosq_test.do_client_connect(sub_connect_packet, connack_packet, timeout=20, port=port)
+    mosq_test.do_send_receive(sub, subscribe_retain_packet, suback_retain_packet, "suback retain")
+    if not mosq_test.expect_packet(sub, "retained", publish_retain_packet_r):
+        raise ValueError
+    sub.close()
+
+    rc = 0
+finally:
+    os.remove(conf_file)
+    broker.terminate()
+    broker.wait()
+    (stdo, stde) = broker.communicate()
+    if rc:
+        print(stde.decode('utf-8'))
+    remove_db(port)
+
+
+exit(rc)
@@ -0,0 +1,108 @@
+#!/usr/bin/env python3
+
+# Test whether large retained payloads restored with retained_cache_size set
+# are delivered intact. The cache only has room for one payload at a time, so
+# each subscription reads its payload back from the database. A save forced
+# with SIGUSR1 part way through moves the payloads to the new file.
+
+from mosq_test_helper import *
+import signal
+
+def write_config(filename, port):
+    with open(filename, 'w') as f:
+        f.write("port %d\n" % (port))
+        f.write("persistence true\n")
+        f.write("persistence_file mosquitto-%d.db\n" % (port))
+        f.write("retained_cache_size 4000\n")
+
+def remove_db(port):
+    for f in ['mosquitto-%d.db' % (port), 'mosquitto-%d.db.new' % (port)]:
+        if os.path.exists(f):
+            os.unlink(f)
+
+def payload(i, size):
+    return (("%d" % (i)) * size)[0:size]
+
+def expect_retained(sock, expected):
+    packet = b""
+    while len(packet) < len(expected):
+        data = sock.recv(len(expected) - len(packet))
+        if len(data) == 0:
+            break
+        packet += data
+    if not mosq_test.packet_matches("retained", packet, expected):
+        raise ValueError
+
+def check_retained(port, topics):
+    connect_packet = mosq_test.gen_connect("retained-cache-sub", keepalive=60)
+    connack_packet = mosq_test.gen_connack(rc=0)
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet, timeout=20, port=port)
+    mid = 1
+    for (topic, message) in topics:
+        subscribe_packet = mosq_test.gen_subscribe(mid, topic, 0)
+        suback_packet = mosq_test.gen_suback(mid, 0)
+        publish_packet = mosq_test.gen_publish(topic, qos=0, payload=message, retain=True)
+        mosq_test.do_send_receive(sock, subscribe_packet, suback_packet, "suback")
+        expect_retained(sock, publish_packet)
+        mid += 1
+    sock.close()
+
+def publish_retained(port, topics):
+    connect_packet = mosq_test.gen_connect("retained-cache-pub", keepalive=60)
+    connack_packet = mosq_test.gen_connack(rc=0)
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet, timeout=20, port=port)
+    mid = 1
+    for (topic, message) in topics:
+        publish_packet = mosq_test.gen_publish(topic, qos=1, mid=mid, payload=message, retain=True)
+        puback_packet = mosq_test.gen_puback(mid)
+        mosq_test.do_send_receive(sock, publish_packet, puback_packet, "puback")
+        mid += 1
+    sock.close()
+
+def restart(broker, port):
+    broker.terminate()
+    broker.wait()
+    broker.communicate()
+    return mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+port = mosq_test.get_port()
+conf_file = os.path.basename(__file__).replace('.py', '.conf')
+write_config(conf_file, port)
+
+rc = 1
+topics = [("cache/small", "small")]
+for i in range(1, 6):
+    topics.append(("cache/%d" % (i), payload(i, 3000)))
+
+remove_db(port)
+
+broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+try:
+    publish_retained(port, topics)
+    broker = restart(broker, port)
+
+    check_retained(port, topics)
+    check_retained(port, topics)
+
+    topics[2] = ("cache/2", payload(7, 2000))
+    publish_retained(port, [topics[2]])
+    broker.send_signal(signal.SIGUSR1)
+    time.sleep(0.5)
+    check_retained(port, topics)
+
+    broker = restart(broker, port)
+    check_retained(port, topics)
+
+    rc = 0
+finally:
+    os.remove(conf_file)
+    broker.terminate()
+    broker.wait()
+    (stdo, stde) = broker.communicate()
+    if rc:
+        print(stde.decode('utf-8'))
+    remove_db(port)
+
+
+exit(rc)
@@ -27,11 +27,16 @@ tests = [
     (1, './01-connect-uname-pwd-no-flag.py'),
     (2, './01-connect-zero-length-id.py'),
 
+    (1, './02-shared-network-graph-v5.py'),
     (1, './02-shared-qos0-v5.py'),
     (1, './02-subhier-crash.py'),
+    (1, './02-subpub-large-payload-fanout.py'),
     (1, './02-subpub-qos0-long-topic.py'),
+    (1, './02-subpub-qos0-pipelined.py'),
     (1, './02-subpub-qos0-retain-as-publish.py'),
     (1, './02-subpub-qos0-send-retain.py'),
+    (1, './02-subpub-qos0-slow-subscriber.py'),
+    (1, './02-subpub-qos0-subscription-change.py'),
     (1, './02-subpub-qos0-subscription-id.py'),
     (1, './02-subpub-qos0-topic-alias-unknown.py'),
     (1, './02-subpub-qos0-topic-alias.py'),
@@ -89,6 +94,9 @@ tests = [
 
     (1, './04-retain-check-source-persist.py'),
     (1, './04-retain-check-source.py'),
+    (1, './04-retain-delivery-batch.py'),
+    (1, './04-retain-delivery-batch-resume.py'),
+    (1, './04-retain-dollar-topic.py'),
     (1, './04-retain-qos0-clear.py'),
     (1, './04-retain-qos0-fresh.py'),
     (1, './04-retain-qos0-repeated.py'),
@@ -143,8 +151,10 @@ tests = [
     (3, './08-tls-psk-bridge.py'),
 
     (1, './09-acl-access-variants.py'),
+    (1, './09-acl-change-connected.py'),
     (1, './09-acl-change.py'),
     (1, './09-acl-empty-file.py'),
+    (1, './09-acl-wildcards.py'),
     (1, './09-auth-bad-method.py'),
     (1, './09-extended-auth-change-username.py'),
     (1, './09-extended-auth-multistep-reauth.py'),
@@ -170,6 +180,9 @@ tests = [
     (1, './11-persistent-subscription.py'),
     (1, './11-persistent-subscription-v5.py'),
     (1, './11-persistent-subscription-no-local.py'),
+    (1, './11-persistence-background.py'),
+    (1, './11-persistence-log.py'),
+    (1, './11-persistence-retained-cache.py'),
     (1, './11-pub-props.py'),
     (1, './11-subscription-id.py'),
 
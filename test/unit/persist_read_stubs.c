@@ -28,6 +28,10 @@ struct mosquitto *context__init(struct mosquitto_db *db, mosq_sock_t sock)
 	return m;
 }
 
+void context__add_to_disused(struct mosquitto_db *db, struct mosquitto *context)
+{
+}
+
 int db__message_store(struct mosquitto_db *db, const struct mosquitto *source, uint16_t source_mid, char *topic, int qos, uint32_t payloadlen, mosquitto__payload_uhpa *payload, int retain, struct mosquitto_msg_store **stored, uint32_t message_expiry_interval, mosquitto_property *properties, dbid_t store_id, enum mosquitto_msg_origin origin)
 {
     struct mosquitto_msg_store *temp = NULL;
@@ -125,6 +129,16 @@ int send__pingreq(struct mosquitto *mosq)
 	return MOSQ_ERR_SUCCESS;
 }
 
+int persist__backup(struct mosquitto_db *db, bool shutdown)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+int persist__log_open(struct mosquitto_db *db, bool truncate)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
 int sub__add(struct mosquitto_db *db, struct mosquitto *context, const char *sub, int qos, uint32_t identifier, int options, struct mosquitto__subhier **root)
 {
 	last_sub = strdup(sub);
@@ -142,9 +156,29 @@ int sub__messages_queue(struct mosquitto_db *db, const char *source_id, const ch
 	return MOSQ_ERR_SUCCESS;
 }
 
+int sub__remove(struct mosquitto_db *db, struct mosquitto *context, const char *sub, struct mosquitto__subhier *root, uint8_t *reason)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+struct mosquitto_client_msg *db__client_msg_new(void)
+{
+	return mosquitto__calloc(1, sizeof(struct mosquitto_client_msg));
+}
+
+void db__client_msg_free(struct mosquitto_client_msg *msg)
+{
+	mosquitto__free(msg);
+}
 
 void db__msg_store_ref_inc(struct mosquitto_msg_store *store)
 {
 	store->ref_count++;
 }
 
+void db__msg_store_ref_dec(struct mosquitto_db *db, struct mosquitto_msg_store **store)
+{
+	(*store)->ref_count--;
+}
+